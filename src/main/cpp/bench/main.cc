@@ -0,0 +1,196 @@
+// Compare query speed and dTLB misses across model memory policies.
+//
+// usage: bench model.bin sentences.txt [passes]
+//
+// Loads the model once per policy, scores every line of sentences.txt once to
+// warm up, then times the given number of passes.  TLB misses are counted with
+// perf_event_open on Linux (vm.perf_event_paranoid <= 2); elsewhere only time
+// is reported.  Use a model much larger than the last level cache; tag models
+// fit in L2 and show no difference.
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <chrono>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef _MSC_VER
+#define FIMPORT __declspec(dllimport)
+#else
+#define FIMPORT __attribute__((visibility("default")))
+#endif
+
+extern "C" {
+
+FIMPORT void *
+kenlm_init_file(const char *path, int flags, size_t ex_msg_size, char *ex_msg);
+
+FIMPORT void
+kenlm_clean(void *pHandle);
+
+FIMPORT float
+kenlm_query(void *pHandle, const char *pTag);
+
+FIMPORT int
+kenlm_image_allocation(void *pHandle);
+
+}
+
+namespace {
+
+struct Policy {
+    const char *name;
+    int flags;
+};
+
+// See KENLM_LOAD_* and KENLM_ALLOC_* in clb/clb.cc.
+const Policy kPolicies[] = {
+    {"mmap", 0},
+    {"malloc", 2},
+    {"aligned", 2 | 16},
+    {"thp", 2 | 32},
+    {"hugetlb", 2 | 64}
+};
+
+const char *kAllocationNames[] = {"malloc", "aligned", "thp", "hugetlb"};
+
+class TlbCounter {
+  public:
+    TlbCounter() : fd_(-1) {
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~TlbCounter() {
+#ifdef __linux__
+        if (fd_ != -1) close(fd_);
+#endif
+    }
+
+    bool Available() const { return fd_ != -1; }
+
+    void Start() {
+#ifdef __linux__
+        if (fd_ == -1) return;
+        ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    uint64_t Stop() {
+        uint64_t count = 0;
+#ifdef __linux__
+        if (fd_ == -1) return 0;
+        ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd_, &count, sizeof(count)) != sizeof(count)) count = 0;
+#endif
+        return count;
+    }
+
+  private:
+    int fd_;
+};
+
+float
+ScoreAll(void *pHandle, const std::vector<std::string> &lines) {
+    float sum = 0.0;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        sum += kenlm_query(pHandle, lines[i].c_str());
+    }
+    return sum;
+}
+
+} // namespace
+
+int
+main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " model.bin sentences.txt [passes]" << std::endl;
+        return 1;
+    }
+    int passes = argc > 3 ? atoi(argv[3]) : 3;
+
+    std::vector<std::string> lines;
+    {
+        FILE *f = fopen(argv[2], "r");
+        if (!f) {
+            std::cerr << "cannot open " << argv[2] << std::endl;
+            return 1;
+        }
+        char line[65536];
+        while (fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (*line) lines.push_back(line);
+        }
+        fclose(f);
+    }
+    if (lines.empty()) {
+        std::cerr << "no sentences in " << argv[2] << std::endl;
+        return 1;
+    }
+
+    TlbCounter tlb;
+    if (!tlb.Available()) {
+        std::cerr << "dTLB counter unavailable; reporting time only." << std::endl;
+    }
+
+    std::cout << "policy\tgot\tload_ms\tns/sentence\tdTLB_misses/sentence\tchecksum" << std::endl;
+    for (size_t p = 0; p < sizeof(kPolicies) / sizeof(Policy); ++p) {
+        char ex_msg[2048];
+        ex_msg[0] = '\0';
+        std::chrono::steady_clock::time_point load_start = std::chrono::steady_clock::now();
+        void *pHandle = kenlm_init_file(argv[1], kPolicies[p].flags, sizeof(ex_msg), ex_msg);
+        double load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - load_start).count();
+        if (!pHandle) {
+            std::cerr << kPolicies[p].name << ": " << ex_msg << std::endl;
+            continue;
+        }
+
+        float checksum = ScoreAll(pHandle, lines);
+
+        tlb.Start();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int pass = 0; pass < passes; ++pass) {
+            checksum += ScoreAll(pHandle, lines);
+        }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        uint64_t misses = tlb.Stop();
+
+        double queries = static_cast<double>(lines.size()) * passes;
+        int got = kenlm_image_allocation(pHandle);
+        std::cout << kPolicies[p].name << '\t'
+            << (kPolicies[p].flags & 2 ? kAllocationNames[got] : "mmap") << '\t'
+            << load_ms << '\t'
+            << ns / queries << '\t';
+        if (tlb.Available()) {
+            std::cout << misses / queries;
+        } else {
+            std::cout << '-';
+        }
+        std::cout << '\t' << checksum << std::endl;
+
+        kenlm_clean(pHandle);
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+// Build a binary model from an ARPA file.
+//
+// usage: build_binary [-t type] [-m] [-v version] [-p multiplier] [-q prob_bits]
+//                     [-b backoff_bits] [-f fingerprint_bits] [-j threads]
+//                     model.arpa model.bin
+//
+// type is probing (the default), quant, trie, quanttrie, fp32 or fp16; -m
+// uses the minimal perfect hash vocabulary.  -v 1 lays the probing types'
+// tables out in blocks probed with SIMD; the default is 0.  Tables are filled on every core
+// unless -j says otherwise; the file is the same whatever the thread count.
+
+#include <iostream>
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#define FIMPORT __declspec(dllimport)
+#else
+#define FIMPORT __attribute__((visibility("default")))
+#endif
+
+extern "C" {
+
+FIMPORT int
+kenlm_build_binary(const char *arpa_path, const char *binary_path, int model_type, float probing_multiplier, int prob_bits, int backoff_bits, int fingerprint_bits, int threads, size_t ex_msg_size, char *ex_msg);
+
+}
+
+namespace {
+
+struct Type {
+    const char *name;
+    int model_type;
+};
+
+// See lm::ngram::ModelType.
+const Type kTypes[] = {
+    {"probing", 0},
+    {"quant", 6},
+    {"trie", 7},
+    {"quanttrie", 8},
+    {"fp32", 9},
+    {"fp16", 10}
+};
+
+const int kMphTypeAdd = 16;
+
+// See kenlm_build_binary.
+const int kVersionTypeAdd = 256;
+
+void
+Usage(const char *name) {
+    std::cerr << "usage: " << name << " [-t probing|quant|trie|quanttrie|fp32|fp16] [-m] [-v version] [-p multiplier] [-q prob_bits] [-b backoff_bits] [-f fingerprint_bits] [-j threads] model.arpa model.bin" << std::endl;
+}
+
+} // namespace
+
+int
+main(int argc, char *argv[]) {
+    int model_type = 0;
+    bool mph = false;
+    float multiplier = -1.0;
+    int prob_bits = -1, backoff_bits = -1, fingerprint_bits = -1, threads = 0, version = 0;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1]; ++arg) {
+        char option = argv[arg][1];
+        if (option == 'm') {
+            mph = true;
+            continue;
+        }
+        if (arg + 1 == argc || argv[arg][2]) {
+            Usage(argv[0]);
+            return 1;
+        }
+        const char *value = argv[++arg];
+        switch (option) {
+            case 't': {
+                size_t t = 0;
+                while (t < sizeof(kTypes) / sizeof(Type) && strcmp(kTypes[t].name, value)) ++t;
+                if (t == sizeof(kTypes) / sizeof(Type)) {
+                    std::cerr << "unknown type " << value << std::endl;
+                    Usage(argv[0]);
+                    return 1;
+                }
+                model_type = kTypes[t].model_type;
+                break;
+            }
+            case 'v': version = atoi(value); break;
+            case 'p': multiplier = static_cast<float>(atof(value)); break;
+            case 'q': prob_bits = atoi(value); break;
+            case 'b': backoff_bits = atoi(value); break;
+            case 'f': fingerprint_bits = atoi(value); break;
+            case 'j': threads = atoi(value); break;
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - arg != 2) {
+        Usage(argv[0]);
+        return 1;
+    }
+    if (mph) {
+        model_type += kMphTypeAdd;
+    }
+    model_type += version * kVersionTypeAdd;
+
+    char ex_msg[2048];
+    ex_msg[0] = '\0';
+    if (kenlm_build_binary(argv[arg], argv[arg + 1], model_type, multiplier, prob_bits, backoff_bits, fingerprint_bits, threads, sizeof(ex_msg), ex_msg)) {
+        std::cerr << ex_msg << std::endl;
+        return 1;
+    }
+    return 0;
+}
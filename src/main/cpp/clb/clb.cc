@@ -1,9 +1,797 @@
+#include "lm/builder.hh"
 #include "lm/model.hh"
 #include "lm/vocab.hh" // just for _misc
 
+#include "util/checksum.hh"
+#include "util/file.hh"
+#include "util/murmur_hash.hh"
+#include "util/parallel.hh"
+#include "util/result_cache.hh"
+#include "util/split_tokens.hh"
 #include "util/string_piece.hh"
+#include "util/thread_pool.hh"
+#include "util/versioned_slot.hh"
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+void CopyExceptionMessage(const std::exception &ex, size_t ex_msg_size, char *ex_msg) {
+    if (!ex_msg || !ex_msg_size) {
+        return;
+    }
+    const char *what = ex.what();
+    if (what) {
+        size_t len = std::min(strlen(what), (size_t)(ex_msg_size - 1));
+        memcpy(ex_msg, what, len);
+        ex_msg[len] = '\0';
+    }
+}
+
+// Flags for kenlm_init_file and kenlm_init_ex, combined with |.  0 maps the
+// file and lets pages fault in on demand, so startup does not depend on the
+// model size.
+enum {
+    KENLM_LOAD_POPULATE = 1,          // MAP_POPULATE: fault the whole file in during init
+    KENLM_LOAD_READ = 2,              // read into private memory instead of mapping
+    KENLM_LOAD_ADVISE_RANDOM = 4,     // MADV_RANDOM: no read-ahead on faults
+    KENLM_LOAD_ADVISE_WILLNEED = 8,   // MADV_WILLNEED: start reading in the background
+    KENLM_LOAD_WARM = 128,            // touch every page on all cores before returning (see kenlm_warm)
+    KENLM_LOAD_VERIFY = 256,          // checksum and check every table on all cores; fail if corrupt
+    KENLM_LOAD_PREFETCH_ORDERS = 512, // prefetch every order of a word at once (probing models far bigger than cache)
+    KENLM_LOAD_FILTER = 1024,         // Bloom filter in front of each probing table so misses skip the walk
+    KENLM_LOAD_LIMIT_PROBES = 2048,   // read every probing table on all cores to bound lookups (implied by VERIFY)
+    KENLM_LOAD_NO_TRANSITIONS = 4096, // never compile a small model into a transition table (see kTransitionBytes)
+    KENLM_LOAD_TRANSITION_CACHE = 8192, // remember transitions of bigger models as they are scored (see kTransitionCacheBytes)
+
+    // How kenlm_query* split sentences into words.  0 splits at every space,
+    // so two spaces in a row or one at either end make an empty word, <unk>.
+    KENLM_SPLIT_SKIP_EMPTY = 16384,   // runs of delimiters split once and ones at either end do not split
+    KENLM_SPLIT_WHITESPACE = 32768,   // tab, newline, vertical tab, form feed and carriage return split too
+
+    // Memory for a private copy (kenlm_init_ex, or KENLM_LOAD_READ).  Each
+    // falls back to the previous one; kenlm_image_allocation says what won.
+    KENLM_ALLOC_ALIGNED = 16,         // page aligned, every table on its own cache line
+    KENLM_ALLOC_TRANSPARENT_HUGE = 32, // also madvise(MADV_HUGEPAGE)
+    KENLM_ALLOC_HUGETLB = 64          // MAP_HUGETLB from vm.nr_hugepages
+};
+
+// Bytes of the state buffers of kenlm_score_word*, the same for every model
+// (see kenlm_state_size).
+enum {
+    KENLM_STATE_SIZE = 64
+};
+
+static_assert(sizeof(lm::ngram::State) <= KENLM_STATE_SIZE, "lm::ngram::State outgrew KENLM_STATE_SIZE: raise it, which changes the C API");
+
+// Bits per n-gram of the filters KENLM_LOAD_FILTER builds.
+const unsigned int kFilterBits = 10;
+
+// Models whose every state and word fit in a table this big are scored
+// through it (see lm/transition_table.hh): a tag model of a few dozen words
+// takes a few hundred kilobytes.
+const size_t kTransitionBytes = 4 << 20;
+
+// Memory KENLM_LOAD_TRANSITION_CACHE shares between every thread querying a
+// handle (see lm/transition_cache.hh): a quarter for about 170 thousand
+// states, the rest for about 2.5 million transitions.
+const size_t kTransitionCacheBytes = 64 << 20;
+
+// Defaults for every handle: ARPA text is parsed and built on all cores, and
+// small models are compiled into a transition table.
+lm::ngram::Config
+BaseConfig() {
+    lm::ngram::Config config;
+    config.arpa_threads = std::max(1u, std::thread::hardware_concurrency());
+    config.transition_bytes = kTransitionBytes;
+    return config;
+}
+
+lm::ngram::Config
+ConfigFromFlags(int flags) {
+    lm::ngram::Config config(BaseConfig());
+    if (flags & KENLM_LOAD_READ) {
+        config.load_method = util::READ;
+    } else if (flags & KENLM_LOAD_POPULATE) {
+        config.load_method = util::POPULATE_OR_LAZY;
+    } else {
+        config.load_method = util::LAZY;
+    }
+    config.map_advice = util::ADVISE_NORMAL;
+    if (flags & KENLM_LOAD_ADVISE_RANDOM) {
+        config.map_advice |= util::ADVISE_RANDOM;
+    }
+    if (flags & KENLM_LOAD_ADVISE_WILLNEED) {
+        config.map_advice |= util::ADVISE_WILLNEED;
+    }
+    if (flags & KENLM_ALLOC_HUGETLB) {
+        config.image_allocation = util::ALLOCATE_HUGETLB;
+    } else if (flags & KENLM_ALLOC_TRANSPARENT_HUGE) {
+        config.image_allocation = util::ALLOCATE_TRANSPARENT_HUGE;
+    } else if (flags & KENLM_ALLOC_ALIGNED) {
+        config.image_allocation = util::ALLOCATE_ALIGNED;
+    }
+    if (flags & KENLM_LOAD_WARM) {
+        config.warm_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (flags & KENLM_LOAD_VERIFY) {
+        config.verify_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (flags & KENLM_LOAD_PREFETCH_ORDERS) {
+        config.prefetch_orders = true;
+    }
+    if (flags & KENLM_LOAD_FILTER) {
+        config.filter_bits = kFilterBits;
+    }
+    if (flags & KENLM_LOAD_LIMIT_PROBES) {
+        config.probe_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (flags & KENLM_LOAD_NO_TRANSITIONS) {
+        config.transition_bytes = 0;
+    }
+    if (flags & KENLM_LOAD_TRANSITION_CACHE) {
+        config.transition_cache_bytes = kTransitionCacheBytes;
+    }
+    config.messages = &std::cerr;
+    return config;
+}
+
+util::Delimiters
+DelimitersFromFlags(int flags) {
+    const bool skip_empty = (flags & KENLM_SPLIT_SKIP_EMPTY) != 0;
+    if (flags & KENLM_SPLIT_WHITESPACE) {
+        return util::Delimiters::Whitespace(skip_empty);
+    }
+    return util::Delimiters(" ", skip_empty);
+}
+
+// Steps through the model's transition table a word at a time.
+template <class Model> class TransitionWalk {
+  public:
+    explicit TransitionWalk(const Model &model)
+        : model_(model), table_(model.Transitions()), state_(table_.BeginSentence()), total_(0.0) {}
+
+    void operator()(StringPiece word) {
+        const lm::ngram::TransitionTable::Cell &cell = table_.Transition(state_, model_.GetVocabulary().Index(word));
+        total_ += cell.prob;
+        state_ = cell.next;
+    }
+
+    // The total with </s>.
+    float End() const {
+        return total_ + table_.Transition(state_, model_.GetVocabulary().EndSentence()).prob;
+    }
+
+  private:
+    const Model &model_;
+    const lm::ngram::TransitionTable &table_;
+    uint32_t state_;
+    float total_;
+};
+
+// Scores with FullScore a word at a time.
+template <class Model> class FullScoreWalk {
+  public:
+    explicit FullScoreWalk(const Model &model)
+        : model_(model), state_(model.BeginSentenceState()), total_(0.0) {} // : model.NullContextState(); if !sentence_context
+
+    void operator()(StringPiece word) {
+        // Reads at most the whole vocabulary table, even a corrupt one.
+        lm::WordIndex vocab = model_.GetVocabulary().Index(word);
+        typename Model::State out;
+        total_ += model_.FullScore(state_, vocab, out).prob;
+        state_ = out;
+    }
+
+    // The total with </s>.
+    float End() const {
+        typename Model::State out;
+        return total_ + model_.FullScore(state_, model_.GetVocabulary().EndSentence(), out).prob;
+    }
+
+  private:
+    const Model &model_;
+    typename Model::State state_;
+    float total_;
+};
+
+// Appends the ids of words to ids.
+template <class Vocabulary> class CollectIds {
+  public:
+    CollectIds(const Vocabulary &vocab, std::vector<lm::WordIndex> &ids) : vocab_(vocab), ids_(ids) {}
+
+    void operator()(StringPiece word) {
+        ids_.push_back(vocab_.Index(word));
+    }
+
+  private:
+    const Vocabulary &vocab_;
+    std::vector<lm::WordIndex> &ids_;
+};
+
+// QueryModel through the model's transition table: the same words, the same
+// probabilities added in the same order.
+template <class Model> float
+QueryTransitions(const Model &model, const util::Delimiters &delimiters, StringPiece piece) {
+    TransitionWalk<Model> walk(model);
+    util::SplitTokens(piece, delimiters, walk);
+    return walk.End();
+}
+
+// QueryModel through the model's transition cache: the words are looked up
+// first, then scored as FullScore would, in the same order.
+template <class Model> float
+QueryCache(const Model &model, const util::Delimiters &delimiters, StringPiece piece) {
+    std::vector<lm::WordIndex> ids;
+    CollectIds<typename Model::Vocabulary> collect(model.GetVocabulary(), ids);
+    util::SplitTokens(piece, delimiters, collect);
+    return model.Cache().ScoreSentence(model, ids.data(), ids.size());
+}
+
+// lm/ngram_query.hh
+
+template <class Model> float
+QueryModel(const Model &model, const util::Delimiters &delimiters, StringPiece piece) {
+    if (!model.Transitions().Empty()) {
+        return QueryTransitions(model, delimiters, piece);
+    }
+    try {
+        if (!model.Cache().Empty()) {
+            return QueryCache(model, delimiters, piece);
+        }
+        FullScoreWalk<Model> walk(model);
+        util::SplitTokens(piece, delimiters, walk);
+        return walk.End();
+    } catch (...) {
+        return 0.0;
+    }
+}
+
+// Same as QueryModel for a sentence already mapped to the model's word ids.
+// An id outside the vocabulary fails the sentence.
+template <class Model> float
+QueryModelIds(const Model &model, const lm::WordIndex *ids, size_t length) {
+    float total = 0.0;
+    try {
+        typename Model::State out;
+        typename Model::State state = model.BeginSentenceState();
+        const lm::WordIndex bound = model.GetVocabulary().Bound();
+        if (!model.Transitions().Empty()) {
+            for (size_t i = 0; i < length; ++i) {
+                if (ids[i] >= bound) {
+                    return 0.0;
+                }
+            }
+            return model.Transitions().ScoreSentence(ids, length, model.GetVocabulary().EndSentence());
+        }
+        if (!model.Cache().Empty()) {
+            for (size_t i = 0; i < length; ++i) {
+                if (ids[i] >= bound) {
+                    return 0.0;
+                }
+            }
+            return model.Cache().ScoreSentence(model, ids, length);
+        }
+        for (size_t i = 0; i < length; ++i) {
+            if (ids[i] >= bound) {
+                return 0.0;
+            }
+            lm::FullScoreReturn ret = model.FullScore(state, ids[i], out);
+            total += ret.prob;
+            state = out;
+        }
+        lm::FullScoreReturn ret = model.FullScore(state, model.GetVocabulary().EndSentence(), out);
+        total += ret.prob;
+    } catch (...) {
+        total = 0.0;
+    }
+    return total;
+}
+
+// Write state to a KENLM_STATE_SIZE buffer with every byte past the words in
+// use zero, so callers may compare and hash states as bytes.
+void
+WriteState(const lm::ngram::State &state, void *to) {
+    memset(to, 0, KENLM_STATE_SIZE);
+    lm::ngram::State *out = reinterpret_cast<lm::ngram::State *>(to);
+    std::copy(state.words, state.words + state.length, out->words);
+    std::copy(state.backoff, state.backoff + state.length, out->backoff);
+    out->length = state.length;
+}
+
+// Score ids[0, n) one after another from in, leaving the state after the
+// last in out and writing each word's probability, n-gram length and
+// whether it is <unk> to those of probs, ngram_lengths and oovs that are
+// not NULL.  Fails before scoring anything if in is longer than model's
+// states or holds an id that is not the model's, or if an id in ids is not.
+template <class Model> bool
+ScoreWords(const Model &model, const lm::ngram::State &in, const lm::WordIndex *ids, size_t n, lm::ngram::State &out, float *probs, unsigned char *ngram_lengths, unsigned char *oovs) {
+    const lm::WordIndex bound = model.GetVocabulary().Bound();
+    if (in.length >= model.Order()) {
+        return false;
+    }
+    for (unsigned char i = 0; i < in.length; ++i) {
+        if (in.words[i] >= bound) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (ids[i] >= bound) {
+            return false;
+        }
+    }
+    // FullScore writes to the buffer from does not point to.
+    lm::ngram::State buffers[2];
+    const lm::ngram::State *from = &in;
+    for (size_t i = 0; i < n; ++i) {
+        lm::ngram::State &to = buffers[i & 1];
+        lm::FullScoreReturn ret = model.FullScore(*from, ids[i], to);
+        if (probs) {
+            probs[i] = ret.prob;
+        }
+        if (ngram_lengths) {
+            ngram_lengths[i] = ret.ngram_length;
+        }
+        if (oovs) {
+            oovs[i] = (ids[i] == lm::kUNK);
+        }
+        from = &to;
+    }
+    out = *from;
+    return true;
+}
+
+// Most sentences in one pool item of a batch call: as many as the model
+// keeps in flight several times over (see BatchBlockSize).
+const size_t kBatchBlock = 64;
+
+// kenlm_build_binary's model_type holds the search version in multiples of
+// this, above every lm::ngram::ModelType.
+const int kBuildVersionAdd = 256;
+
+// Models with fewer bytes of tables mostly stay in cache, where interleaving
+// sentences costs more in bookkeeping than it saves in waiting on memory.
+const uint64_t kInterleaveBytes = 32ULL << 20;
+
+template <class Model> bool
+Interleave(const Model &model) {
+    uint64_t bytes = 0;
+    for (std::vector<lm::ngram::ImageSection>::const_iterator i = model.Sections().begin(); i != model.Sections().end(); ++i) {
+        bytes += i->size;
+    }
+    return bytes >= kInterleaveBytes;
+}
+
+// QueryModelIds for sentences[0, n) into out, with the lookups of several
+// sentences interleaved (see GenericModel::ScoreSentences) if interleave.
+template <class Model> void
+QueryModelIdsBatch(const Model &model, bool interleave, const lm::WordIndex *const *sentences, const size_t *lengths, size_t n, float *out) {
+    if (!interleave) {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = sentences[i] || !lengths[i] ? QueryModelIds(model, sentences[i], lengths[i]) : 0.0;
+        }
+        return;
+    }
+    const lm::WordIndex bound = model.GetVocabulary().Bound();
+    // Sentences that fail are scored empty, then zeroed.
+    std::vector<size_t> checked(n);
+    std::vector<bool> failed(n);
+    for (size_t i = 0; i < n; ++i) {
+        // An id outside the vocabulary fails the sentence.
+        size_t w = 0;
+        while (sentences[i] && w < lengths[i] && sentences[i][w] < bound) {
+            ++w;
+        }
+        failed[i] = (w < lengths[i]);
+        checked[i] = failed[i] ? 0 : lengths[i];
+    }
+    model.ScoreSentences(sentences, checked.data(), n, out);
+    for (size_t i = 0; i < n; ++i) {
+        if (failed[i]) {
+            out[i] = 0.0;
+        }
+    }
+}
+
+// What a handle points to: a model of whichever type the binary holds.  The
+// per-word work stays in the typed QueryModel, so a query costs one virtual
+// call per sentence.
+class LoadedModel {
+  public:
+    LoadedModel() : version_(NextVersion()) {}
+
+    virtual ~LoadedModel() {}
+
+    // Different for every model loaded by the process, so a result cache
+    // never answers for one model with another's results.
+    uint64_t Version() const { return version_; }
+
+    // How Query and AppendIds split sentences.  Set before the handle is
+    // handed out.
+    const util::Delimiters &Delimiters() const { return delimiters_; }
+
+    void SetDelimiters(const util::Delimiters &delimiters) { delimiters_ = delimiters; }
+
+    virtual float Query(StringPiece sentence) const = 0;
+
+    virtual float QueryIds(const lm::WordIndex *ids, size_t length) const = 0;
+
+    virtual void QueryIdsBatch(const lm::WordIndex *const *sentences, const size_t *lengths, size_t n, float *out) const = 0;
+
+    // Whether QueryIdsBatch interleaves sentences (see Interleave).
+    virtual bool Interleaves() const = 0;
+
+    virtual lm::WordIndex Index(StringPiece word) const = 0;
+
+    // Append the ids of the words of sentence, split as Query splits it.
+    virtual void AppendIds(StringPiece sentence, std::vector<lm::WordIndex> &ids) const = 0;
+
+    virtual util::AllocatePolicy ImageAllocation() const = 0;
+
+    virtual uint64_t ImageChecksum() const = 0;
+
+    virtual void WarmUp(unsigned int threads, std::vector<double> &seconds) const = 0;
+
+    // False if the model was loaded without a transition cache.
+    virtual bool CacheStats(lm::ngram::TransitionCache::Stats &stats) const = 0;
+
+    virtual const lm::ngram::State &BeginSentenceState() const = 0;
+
+    virtual const lm::ngram::State &NullContextState() const = 0;
+
+    virtual lm::WordIndex EndSentence() const = 0;
+
+    virtual bool ScoreWords(const lm::ngram::State &in, const lm::WordIndex *ids, size_t n, lm::ngram::State &out, float *probs, unsigned char *ngram_lengths, unsigned char *oovs) const = 0;
+
+  private:
+    static uint64_t NextVersion() {
+        static std::atomic<uint64_t> next(1);
+        return next.fetch_add(1);
+    }
+
+    const uint64_t version_;
+
+    util::Delimiters delimiters_;
+};
+
+template <class Model> class TypedModel : public LoadedModel {
+  public:
+    TypedModel(size_t size, void *data, const lm::ngram::Config &config) : model_(size, data, config), interleave_(Interleave(model_)) {}
+
+    TypedModel(const char *file, const lm::ngram::Config &config) : model_(file, config), interleave_(Interleave(model_)) {}
+
+    float Query(StringPiece sentence) const { return QueryModel(model_, Delimiters(), sentence); }
+
+    float QueryIds(const lm::WordIndex *ids, size_t length) const { return QueryModelIds(model_, ids, length); }
+
+    void QueryIdsBatch(const lm::WordIndex *const *sentences, const size_t *lengths, size_t n, float *out) const { QueryModelIdsBatch(model_, interleave_, sentences, lengths, n, out); }
+
+    bool Interleaves() const { return interleave_; }
+
+    lm::WordIndex Index(StringPiece word) const { return model_.GetVocabulary().Index(word); }
+
+    void AppendIds(StringPiece sentence, std::vector<lm::WordIndex> &ids) const {
+        CollectIds<typename Model::Vocabulary> collect(model_.GetVocabulary(), ids);
+        util::SplitTokens(sentence, Delimiters(), collect);
+    }
+
+    util::AllocatePolicy ImageAllocation() const { return model_.ImageAllocation(); }
+
+    uint64_t ImageChecksum() const { return model_.ImageChecksum(); }
+
+    void WarmUp(unsigned int threads, std::vector<double> &seconds) const { model_.WarmUp(threads, seconds); }
+
+    bool CacheStats(lm::ngram::TransitionCache::Stats &stats) const {
+        if (model_.Cache().Empty()) {
+            return false;
+        }
+        stats = model_.Cache().GetStats();
+        return true;
+    }
+
+    const lm::ngram::State &BeginSentenceState() const { return model_.BeginSentenceState(); }
+
+    const lm::ngram::State &NullContextState() const { return model_.NullContextState(); }
+
+    lm::WordIndex EndSentence() const { return model_.GetVocabulary().EndSentence(); }
+
+    bool ScoreWords(const lm::ngram::State &in, const lm::WordIndex *ids, size_t n, lm::ngram::State &out, float *probs, unsigned char *ngram_lengths, unsigned char *oovs) const {
+        return ::ScoreWords(model_, in, ids, n, out, probs, ngram_lengths, oovs);
+    }
+
+  private:
+    Model model_;
+
+    bool interleave_;
+};
+
+// Constructs a TypedModel from an in-memory image.
+class ImageSource {
+  public:
+    ImageSource(size_t size, void *data) : size_(size), data_(data) {}
+
+    template <class Model> LoadedModel *New(const lm::ngram::Config &config) const {
+        return new TypedModel<Model>(size_, data_, config);
+    }
+
+  private:
+    size_t size_;
+    void *data_;
+};
+
+// Constructs a TypedModel from a binary file.
+class FileSource {
+  public:
+    explicit FileSource(const char *path) : path_(path) {}
+
+    template <class Model> LoadedModel *New(const lm::ngram::Config &config) const {
+        return new TypedModel<Model>(path_, config);
+    }
+
+  private:
+    const char *path_;
+};
+
+// Construct the class for the model type and search version in the binary
+// header.  Anything else goes to ProbingModel, or to the class for the type
+// with version 0, which explains what is wrong with it.
+template <class Source> LoadedModel *
+NewModel(lm::ngram::ModelType type, unsigned int search_version, const Source &source, const lm::ngram::Config &config) {
+    if (search_version == lm::ngram::detail::BlockedLayout::kVersion) {
+        switch (type) {
+            case lm::ngram::PROBING:
+                return source.template New<lm::ngram::BlockedProbingModel>(config);
+            case lm::ngram::QUANT_PROBING:
+                return source.template New<lm::ngram::BlockedQuantProbingModel>(config);
+            case lm::ngram::FINGERPRINT32_PROBING:
+                return source.template New<lm::ngram::BlockedFingerprint32ProbingModel>(config);
+            case lm::ngram::FINGERPRINT16_PROBING:
+                return source.template New<lm::ngram::BlockedFingerprint16ProbingModel>(config);
+            case lm::ngram::MPH_PROBING:
+                return source.template New<lm::ngram::MphBlockedProbingModel>(config);
+            case lm::ngram::MPH_QUANT_PROBING:
+                return source.template New<lm::ngram::MphBlockedQuantProbingModel>(config);
+            case lm::ngram::MPH_FINGERPRINT32_PROBING:
+                return source.template New<lm::ngram::MphBlockedFingerprint32ProbingModel>(config);
+            case lm::ngram::MPH_FINGERPRINT16_PROBING:
+                return source.template New<lm::ngram::MphBlockedFingerprint16ProbingModel>(config);
+            default:
+                break;
+        }
+    }
+    switch (type) {
+        case lm::ngram::QUANT_PROBING:
+            return source.template New<lm::ngram::QuantProbingModel>(config);
+        case lm::ngram::PACKED_TRIE:
+            return source.template New<lm::ngram::TrieModel>(config);
+        case lm::ngram::QUANT_PACKED_TRIE:
+            return source.template New<lm::ngram::QuantTrieModel>(config);
+        case lm::ngram::FINGERPRINT32_PROBING:
+            return source.template New<lm::ngram::Fingerprint32ProbingModel>(config);
+        case lm::ngram::FINGERPRINT16_PROBING:
+            return source.template New<lm::ngram::Fingerprint16ProbingModel>(config);
+        case lm::ngram::MPH_PROBING:
+            return source.template New<lm::ngram::MphProbingModel>(config);
+        case lm::ngram::MPH_QUANT_PROBING:
+            return source.template New<lm::ngram::MphQuantProbingModel>(config);
+        case lm::ngram::MPH_PACKED_TRIE:
+            return source.template New<lm::ngram::MphTrieModel>(config);
+        case lm::ngram::MPH_QUANT_PACKED_TRIE:
+            return source.template New<lm::ngram::MphQuantTrieModel>(config);
+        case lm::ngram::MPH_FINGERPRINT32_PROBING:
+            return source.template New<lm::ngram::MphFingerprint32ProbingModel>(config);
+        case lm::ngram::MPH_FINGERPRINT16_PROBING:
+            return source.template New<lm::ngram::MphFingerprint16ProbingModel>(config);
+        default:
+            return source.template New<lm::ngram::ProbingModel>(config);
+    }
+}
+
+LoadedModel *
+NewModel(size_t size, void *data, const lm::ngram::Config &config) {
+    lm::ngram::ModelType type = lm::ngram::PROBING;
+    unsigned int search_version = 0;
+    if (data) {
+        lm::ngram::RecognizeBinary(size, data, type, search_version);
+    } else if (config.data_method == lm::ngram::Config::SHARE_DATA && config.shared_segment) {
+        lm::ngram::RecognizeSegment(config.shared_segment, type, search_version);
+    }
+    return NewModel(type, search_version, ImageSource(size, data), config);
+}
+
+LoadedModel *
+NewModel(const char *path, const lm::ngram::Config &config) {
+    lm::ngram::ModelType type = lm::ngram::PROBING;
+    unsigned int search_version = 0;
+    lm::ngram::RecognizeBinary(path, type, search_version);
+    return NewModel(type, search_version, FileSource(path), config);
+}
+
+LoadedModel *
+LoadModel(size_t size, void *data, const lm::ngram::Config &config, const util::Delimiters &delimiters, size_t ex_msg_size, char *ex_msg) {
+    LoadedModel *pModel = NULL;
+    try {
+        pModel = NewModel(size, data, config);
+        pModel->SetDelimiters(delimiters);
+    } catch (const std::exception &ex) {
+        CopyExceptionMessage(ex, ex_msg_size, ex_msg);
+    }
+    return pModel;
+}
+
+LoadedModel *
+LoadModel(const char *path, const lm::ngram::Config &config, const util::Delimiters &delimiters, size_t ex_msg_size, char *ex_msg) {
+    LoadedModel *pModel = NULL;
+    try {
+        pModel = NewModel(path, config);
+        pModel->SetDelimiters(delimiters);
+    } catch (const std::exception &ex) {
+        CopyExceptionMessage(ex, ex_msg_size, ex_msg);
+    }
+    return pModel;
+}
+
+typedef util::VersionedSlot<LoadedModel> ModelSlot;
+
+// model.Query(sentence) through cache, which holds results of any number of
+// models: the key is a hash of the bytes' hash and the model's version,
+// checked against the length.  (Seeding with the version instead would let
+// a sentence for one model collide with a sentence one byte off for the
+// next: MurmurHash64A xors the seed into the first word.)  A hit neither
+// splits nor looks up a word.
+float
+CachedQuery(util::ResultCache &cache, const LoadedModel &model, const char *sentence) {
+    size_t length = strlen(sentence);
+    uint64_t keyed[2] = {util::MurmurHash64A(sentence, length), model.Version()};
+    uint64_t key = util::MurmurHash64A(keyed, sizeof(keyed));
+    uint32_t check = static_cast<uint32_t>(length);
+    float total;
+    if (!cache.Find(key, check, total)) {
+        total = model.Query(StringPiece(sentence, length));
+        cache.Insert(key, check, total);
+    }
+    return total;
+}
+
+class ReplaySentence {
+  public:
+    ReplaySentence(const LoadedModel &model, const std::vector<StringPiece> &sentences)
+        : model_(model), sentences_(sentences) {}
+
+    void operator()(size_t i) const {
+        model_.Query(sentences_[i]);
+    }
+
+  private:
+    const LoadedModel &model_;
+    const std::vector<StringPiece> &sentences_;
+};
+
+// Scores block i (block sentences, at most kBatchBlock) of a batch of n
+// into out.
+class ScoreSentence {
+  public:
+    ScoreSentence(const LoadedModel &model, size_t block, const char *const *sentences, const size_t *lengths, size_t n, float *out)
+        : model_(model), block_(block), sentences_(sentences), lengths_(lengths), n_(n), out_(out) {}
+
+    void operator()(size_t block) const {
+        const size_t begin = block * block_;
+        const size_t end = std::min(begin + block_, n_);
+        std::vector<lm::WordIndex> ids;
+        size_t starts[kBatchBlock + 1];
+        size_t index[kBatchBlock];
+        size_t count = 0;
+        for (size_t i = begin; i < end; ++i) {
+            const char *sentence = sentences_[i];
+            if (!sentence) {
+                out_[i] = 0.0;
+                continue;
+            }
+            starts[count] = ids.size();
+            model_.AppendIds(StringPiece(sentence, lengths_ ? lengths_[i] : strlen(sentence)), ids);
+            index[count++] = i;
+        }
+        starts[count] = ids.size();
+
+        const lm::WordIndex *words[kBatchBlock];
+        size_t lengths[kBatchBlock];
+        float scores[kBatchBlock];
+        for (size_t c = 0; c < count; ++c) {
+            words[c] = ids.data() + starts[c];
+            lengths[c] = starts[c + 1] - starts[c];
+        }
+        model_.QueryIdsBatch(words, lengths, count, scores);
+        for (size_t c = 0; c < count; ++c) {
+            out_[index[c]] = scores[c];
+        }
+    }
+
+  private:
+    const LoadedModel &model_;
+    size_t block_;
+    const char *const *sentences_;
+    const size_t *lengths_;
+    size_t n_;
+    float *out_;
+};
+
+// Looks token i of a batch up into out[i].
+class IndexToken {
+  public:
+    IndexToken(const LoadedModel &model, const char *const *tokens, const size_t *lengths, uint32_t *out)
+        : model_(model), tokens_(tokens), lengths_(lengths), out_(out) {}
+
+    void operator()(size_t i) const {
+        const char *token = tokens_[i];
+        out_[i] = token ? model_.Index(StringPiece(token, lengths_ ? lengths_[i] : strlen(token))) : lm::kUNK;
+    }
+
+  private:
+    const LoadedModel &model_;
+    const char *const *tokens_;
+    const size_t *lengths_;
+    uint32_t *out_;
+};
+
+// Scores the word ids of block i (block sentences) of a batch of n into
+// out.
+class ScoreIds {
+  public:
+    ScoreIds(const LoadedModel &model, size_t block, const uint32_t *const *sentences, const size_t *lengths, size_t n, float *out)
+        : model_(model), block_(block), sentences_(sentences), lengths_(lengths), n_(n), out_(out) {}
+
+    void operator()(size_t block) const {
+        const size_t begin = block * block_;
+        model_.QueryIdsBatch(sentences_ + begin, lengths_ + begin, std::min(block_, n_ - begin), out_ + begin);
+    }
+
+  private:
+    const LoadedModel &model_;
+    size_t block_;
+    const uint32_t *const *sentences_;
+    const size_t *lengths_;
+    size_t n_;
+    float *out_;
+};
+
+// One pool for every batch call in the process, with a worker per core
+// besides the caller.  Never freed: joining threads while the library is
+// unloaded can deadlock.
+util::ThreadPool &
+BatchPool() {
+    static util::ThreadPool *pool = new util::ThreadPool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return *pool;
+}
+
+unsigned int
+BatchThreads(int threads) {
+    return threads > 0 ? threads : BatchPool().Workers() + 1;
+}
+
+// Sentences per pool item for a batch of n on threads threads.  A model that
+// interleaves gets at least kScoreLanes per item to keep in flight, and
+// otherwise enough items for every thread, up to kBatchBlock.  One that does
+// not gains nothing from blocks and scores a sentence per item, so stealing
+// spreads even a short batch over every thread.
+size_t
+BatchBlockSize(const LoadedModel &model, size_t n, unsigned int threads) {
+    if (!model.Interleaves()) {
+        return 1;
+    }
+    const size_t per_thread = (n + threads - 1) / threads;
+    return std::max<size_t>(lm::ngram::ProbingModel::kScoreLanes, std::min(kBatchBlock, per_thread));
+}
+
+size_t
+BatchBlocks(size_t n, size_t block) {
+    return (n + block - 1) / block;
+}
+
+} // namespace
 
 extern "C" {
 
@@ -30,26 +818,150 @@ kenlm_misc() {
     while (pos != StringPiece::npos);
 }
 
+// Copy a binary model from memory.  data may also hold ARPA text, which is
+// parsed and built into a probing model on all cores.
 FEXPORT void *
 kenlm_init(size_t size, void *data, size_t ex_msg_size, char *ex_msg) {
-    lm::ngram::ProbingModel *pModel = NULL;
+    return LoadModel(size, data, BaseConfig(), util::Delimiters(), ex_msg_size, ex_msg);
+}
+
+// Same as kenlm_init, with control over the copy through KENLM_ALLOC_* flags.
+FEXPORT void *
+kenlm_init_ex(size_t size, void *data, int flags, size_t ex_msg_size, char *ex_msg) {
+    return LoadModel(size, data, ConfigFromFlags(flags), DelimitersFromFlags(flags), ex_msg_size, ex_msg);
+}
+
+// Which memory the model's private copy ended up in: 0 malloc (also for
+// mapped, borrowed and shared models), 1 aligned, 2 transparent huge pages,
+// 3 hugetlb.  -1 for a NULL handle.
+FEXPORT int
+kenlm_image_allocation(void *pHandle) {
+    if (!pHandle) {
+        return -1;
+    }
+    return reinterpret_cast<LoadedModel *>(pHandle)->ImageAllocation();
+}
+
+// Same as kenlm_init but without copying: the model reads data in place.
+// data must be 8-byte aligned and must outlive the handle (until kenlm_clean).
+FEXPORT void *
+kenlm_init_borrowed(size_t size, void *data, size_t ex_msg_size, char *ex_msg) {
+    lm::ngram::Config config(BaseConfig());
+    config.data_method = lm::ngram::Config::BORROW_DATA;
+    return LoadModel(size, data, config, util::Delimiters(), ex_msg_size, ex_msg);
+}
+
+// Share one copy of the model between processes through the POSIX shared
+// memory segment name (e.g. "/tag.lm.v3").  The first caller publishes data;
+// later callers, possibly in other processes, attach read-only and may pass
+// size = 0 and data = NULL.  The segment stays until kenlm_unlink_shared.
+FEXPORT void *
+kenlm_init_shared(const char *name, size_t size, void *data, size_t ex_msg_size, char *ex_msg) {
+    lm::ngram::Config config(BaseConfig());
+    config.data_method = lm::ngram::Config::SHARE_DATA;
+    config.shared_segment = name;
+    return LoadModel(size, data, config, util::Delimiters(), ex_msg_size, ex_msg);
+}
+
+// Returns 1 if the segment existed.  Processes that attached keep their
+// mapping; new processes will publish again.
+FEXPORT int
+kenlm_unlink_shared(const char *name) {
     try {
-        pModel = new lm::ngram::ProbingModel(size, data);
-    } catch (const std::exception &ex) {
-        if (ex_msg) {
-            const char *what = ex.what();
-            if (what) {
-                size_t len = std::min(strlen(what), (size_t)(ex_msg_size - 1));
-                memcpy(ex_msg, what, len + 1);
-            }
-        }
+        return util::UnlinkSegment(name) ? 1 : 0;
+    } catch (...) {
+        return 0;
     }
-    return pModel;
+}
+
+// Load a binary model straight from path.  See KENLM_LOAD_* for flags.
+// An ARPA file is parsed and built into a probing model on all cores.
+FEXPORT void *
+kenlm_init_file(const char *path, int flags, size_t ex_msg_size, char *ex_msg) {
+    return LoadModel(path, ConfigFromFlags(flags), DelimitersFromFlags(flags), ex_msg_size, ex_msg);
+}
+
+// Same as kenlm_init_file, but the binary built from an ARPA file is kept in
+// the directory cache_dir, named by the checksum of the text, and the next
+// load of the same text maps it instead of building again.  Binary files load
+// as usual.  If the cache cannot be written the model still loads.
+FEXPORT void *
+kenlm_init_file_cached(const char *path, int flags, const char *cache_dir, size_t ex_msg_size, char *ex_msg) {
+    lm::ngram::Config config(ConfigFromFlags(flags));
+    config.arpa_cache = cache_dir;
+    return LoadModel(path, config, DelimitersFromFlags(flags), ex_msg_size, ex_msg);
+}
+
+// Same as kenlm_init_ex with kenlm_init_file_cached's cache for ARPA text.
+FEXPORT void *
+kenlm_init_cached(size_t size, void *data, int flags, const char *cache_dir, size_t ex_msg_size, char *ex_msg) {
+    lm::ngram::Config config(ConfigFromFlags(flags));
+    config.arpa_cache = cache_dir;
+    return LoadModel(size, data, config, DelimitersFromFlags(flags), ex_msg_size, ex_msg);
+}
+
+// Same as kenlm_init_file with KENLM_LOAD_VERIFY, and the file must also have
+// checksum expected_checksum (from kenlm_checksum when it was published), or
+// the load fails.
+FEXPORT void *
+kenlm_init_file_verified(const char *path, int flags, uint64_t expected_checksum, size_t ex_msg_size, char *ex_msg) {
+    lm::ngram::Config config(ConfigFromFlags(flags | KENLM_LOAD_VERIFY));
+    config.expected_checksum = expected_checksum;
+    return LoadModel(path, config, DelimitersFromFlags(flags), ex_msg_size, ex_msg);
+}
+
+// Checksum of a whole binary model file in memory, as checked by
+// kenlm_init_file_verified.
+FEXPORT uint64_t
+kenlm_checksum(const void *data, size_t size) {
+    try {
+        return util::Checksum(data, size, std::max(1u, std::thread::hardware_concurrency()));
+    } catch (...) {
+        return 0;
+    }
+}
+
+// Checksum of the file the model was loaded from, or 0 if it was loaded
+// without KENLM_LOAD_VERIFY.
+FEXPORT uint64_t
+kenlm_image_checksum(void *pHandle) {
+    if (!pHandle) {
+        return 0;
+    }
+    return reinterpret_cast<LoadedModel *>(pHandle)->ImageChecksum();
+}
+
+// Counters of the transition cache of a model loaded with
+// KENLM_LOAD_TRANSITION_CACHE, summed over every thread since the load, to
+// those of the pointers that are not NULL.  Returns 0, or -1 if there is no
+// cache (including for models small enough for a transition table).
+FEXPORT int
+kenlm_transition_cache_stats(void *pHandle, uint64_t *hits, uint64_t *misses, uint64_t *evictions, uint64_t *states) {
+    if (!pHandle) {
+        return -1;
+    }
+    lm::ngram::TransitionCache::Stats stats;
+    if (!reinterpret_cast<LoadedModel *>(pHandle)->CacheStats(stats)) {
+        return -1;
+    }
+    if (hits) {
+        *hits = stats.hits;
+    }
+    if (misses) {
+        *misses = stats.misses;
+    }
+    if (evictions) {
+        *evictions = stats.evictions;
+    }
+    if (states) {
+        *states = stats.states;
+    }
+    return 0;
 }
 
 FEXPORT void
 kenlm_clean(void *pHandle) {
-    lm::ngram::ProbingModel *pModel = reinterpret_cast<lm::ngram::ProbingModel *>(pHandle);
+    LoadedModel *pModel = reinterpret_cast<LoadedModel *>(pHandle);
     try {
         std::cout << "cleaning a model" << std::endl;
         delete pModel;
@@ -57,41 +969,409 @@ kenlm_clean(void *pHandle) {
     }
 }
 
-// lm/ngram_query.hh
-
 FEXPORT float
 kenlm_query(void *pHandle, const char *pTag) {
-    float total = 0.0;
     if (!pHandle) {
-        return total;
+        return 0.0;
+    }
+    return reinterpret_cast<LoadedModel *>(pHandle)->Query(pTag);
+}
+
+// Score n sentences in one call: out[i] = kenlm_query(pHandle, sentences[i]).
+// lengths[i] is the length of sentences[i], which then need not be NUL
+// terminated; NULL lengths means every sentence is.  The sentences are spread
+// over threads threads (<= 0 for every core) of a pool kept for the life of
+// the process; threads that run out steal from the others, so uneven lengths
+// balance out.  On models too big to stay in cache (kInterleaveBytes), each
+// thread works on several sentences at once, prefetching the table lookups
+// of one while it does those of the others, with the same scores.  Returns
+// 0, or -1 for a NULL handle or on failure.
+FEXPORT int
+kenlm_query_batch(void *pHandle, const char **sentences, const size_t *lengths, size_t n, float *out, int threads) {
+    if (!pHandle || (n && (!sentences || !out))) {
+        return -1;
     }
     try {
-        lm::ngram::ProbingModel *pModel = reinterpret_cast<lm::ngram::ProbingModel *>(pHandle);
-        StringPiece piece(pTag);
+        const LoadedModel &model = *reinterpret_cast<LoadedModel *>(pHandle);
+        const unsigned int use_threads = BatchThreads(threads);
+        const size_t block = BatchBlockSize(model, n, use_threads);
+        BatchPool().ParallelFor(BatchBlocks(n, block), use_threads, ScoreSentence(model, block, sentences, lengths, n, out));
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
 
-        lm::ngram::ProbingModel::State out;
-        lm::ngram::ProbingModel::State state = pModel->BeginSentenceState(); // : model.NullContextState(); if !sentence_context
+// Word ids are those of one model: look tokens up once per model with
+// kenlm_vocab_index*, then score the ids with kenlm_query_ids* as often as
+// needed.  Words the model does not know get 0, <unk>.  Scoring ids gives
+// the same results as kenlm_query on the tokens joined by single spaces.
 
-        StringPiece::size_type prev_pos = 0;
-        StringPiece::size_type pos;
-        do {
-            pos = piece.find_first_of(' ', prev_pos);
-            StringPiece word(piece.substr(prev_pos, pos - prev_pos));
-            prev_pos = pos + 1;
+// The id of the word of length length (need not be NUL terminated).  0 for
+// unknown words and a NULL handle.
+FEXPORT uint32_t
+kenlm_vocab_index(void *pHandle, const char *word, size_t length) {
+    if (!pHandle || !word) {
+        return lm::kUNK;
+    }
+    return reinterpret_cast<LoadedModel *>(pHandle)->Index(StringPiece(word, length));
+}
 
-            lm::WordIndex vocab = pModel->GetVocabulary().Index(word); // can hang !!!
-            lm::FullScoreReturn ret = pModel->FullScore(state, vocab, out);
-            total += ret.prob;
-            state = out;
+// out[i] = kenlm_vocab_index(pHandle, tokens[i], lengths[i]) for n tokens on
+// threads threads as kenlm_query_batch.  NULL lengths means every token is
+// NUL terminated.  Returns 0, or -1 for a NULL handle or on failure.
+FEXPORT int
+kenlm_vocab_index_batch(void *pHandle, const char **tokens, const size_t *lengths, size_t n, uint32_t *out, int threads) {
+    if (!pHandle || (n && (!tokens || !out))) {
+        return -1;
+    }
+    try {
+        const LoadedModel &model = *reinterpret_cast<LoadedModel *>(pHandle);
+        BatchPool().ParallelFor(n, BatchThreads(threads), IndexToken(model, tokens, lengths, out));
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+// Score the sentence of length word ids from kenlm_vocab_index*, with <s>
+// and </s> around it as kenlm_query does.  0.0 if an id is not the model's.
+FEXPORT float
+kenlm_query_ids(void *pHandle, const uint32_t *ids, size_t length) {
+    if (!pHandle || (length && !ids)) {
+        return 0.0;
+    }
+    return reinterpret_cast<LoadedModel *>(pHandle)->QueryIds(ids, length);
+}
+
+// out[i] = kenlm_query_ids(pHandle, sentences[i], lengths[i]) for n sentences
+// on threads threads as kenlm_query_batch.  Returns 0, or -1 for a NULL
+// handle or on failure.
+FEXPORT int
+kenlm_query_ids_batch(void *pHandle, const uint32_t **sentences, const size_t *lengths, size_t n, float *out, int threads) {
+    if (!pHandle || (n && (!sentences || !lengths || !out))) {
+        return -1;
+    }
+    try {
+        const LoadedModel &model = *reinterpret_cast<LoadedModel *>(pHandle);
+        const unsigned int use_threads = BatchThreads(threads);
+        const size_t block = BatchBlockSize(model, n, use_threads);
+        BatchPool().ParallelFor(BatchBlocks(n, block), use_threads, ScoreIds(model, block, sentences, lengths, n, out));
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+// Scoring a word at a time, for callers that extend many prefixes and would
+// otherwise score each again from the start.  A state is the context the
+// next word is scored in; it lives in a caller's buffer of kenlm_state_size()
+// bytes, aligned to 4, and only means something to the model that wrote it.
+// States are written with every unused byte zero, so two states are the same
+// context exactly when their bytes are equal.  Scoring from
+// kenlm_begin_state each word of a sentence and then kenlm_end_sentence_id
+// adds up to kenlm_query_ids.
+
+// What kenlm_score_word found for a word.
+struct kenlm_word_detail {
+    float prob;             // log10 probability
+    uint32_t ngram_length;  // length of the n-gram matched, the word included
+    uint32_t oov;           // 1 if the word is <unk>, else 0
+};
+
+// Bytes of a state buffer: KENLM_STATE_SIZE.
+FEXPORT size_t
+kenlm_state_size() {
+    return KENLM_STATE_SIZE;
+}
+
+// Write the state after <s>, where kenlm_query starts, to out_state.
+// Returns 0, or -1 for a NULL handle.
+FEXPORT int
+kenlm_begin_state(void *pHandle, void *out_state) {
+    if (!pHandle || !out_state) {
+        return -1;
+    }
+    WriteState(reinterpret_cast<LoadedModel *>(pHandle)->BeginSentenceState(), out_state);
+    return 0;
+}
+
+// Write the empty context, for text that does not start a sentence, to
+// out_state.  Returns 0, or -1 for a NULL handle.
+FEXPORT int
+kenlm_null_state(void *pHandle, void *out_state) {
+    if (!pHandle || !out_state) {
+        return -1;
+    }
+    WriteState(reinterpret_cast<LoadedModel *>(pHandle)->NullContextState(), out_state);
+    return 0;
+}
+
+// The id of </s>, to end a sentence with; 0 for a NULL handle.
+FEXPORT uint32_t
+kenlm_end_sentence_id(void *pHandle) {
+    return pHandle ? reinterpret_cast<LoadedModel *>(pHandle)->EndSentence() : lm::kUNK;
+}
+
+// Score word_id (from kenlm_vocab_index*) after in_state, writing the state
+// after it to out_state (which may be in_state) and what was found to
+// detail unless it is NULL.  Returns 0, or -1 for a NULL handle or state, an
+// id that is not the model's, or an in_state longer than the model's order
+// allows or with an id that is not the model's.  Nothing else about in_state
+// is checked: a state another model wrote that passes scores as garbage.
+FEXPORT int
+kenlm_score_word(void *pHandle, const void *in_state, uint32_t word_id, void *out_state, kenlm_word_detail *detail) {
+    if (!pHandle || !in_state || !out_state) {
+        return -1;
+    }
+    float prob;
+    unsigned char ngram_length, oov;
+    lm::ngram::State out;
+    try {
+        if (!reinterpret_cast<LoadedModel *>(pHandle)->ScoreWords(*reinterpret_cast<const lm::ngram::State *>(in_state), &word_id, 1, out, &prob, &ngram_length, &oov)) {
+            return -1;
         }
-        while (pos != StringPiece::npos);
+    } catch (...) {
+        return -1;
+    }
+    WriteState(out, out_state);
+    if (detail) {
+        detail->prob = prob;
+        detail->ngram_length = ngram_length;
+        detail->oov = oov;
+    }
+    return 0;
+}
 
-        lm::FullScoreReturn ret = pModel->FullScore(state, pModel->GetVocabulary().EndSentence(), out);
-        total += ret.prob;
+// kenlm_score_word for n words one after another: word i's probability,
+// n-gram length and <unk> flag go to probs[i], ngram_lengths[i] and oovs[i]
+// (each array may be NULL) and the state after the last word to out_state.
+// Nothing is allocated.  Returns 0, or -1 as kenlm_score_word without
+// scoring any word.
+FEXPORT int
+kenlm_score_words(void *pHandle, const void *in_state, const uint32_t *ids, size_t n, void *out_state, float *probs, unsigned char *ngram_lengths, unsigned char *oovs) {
+    if (!pHandle || !in_state || !out_state || (n && !ids)) {
+        return -1;
+    }
+    lm::ngram::State out;
+    try {
+        if (!reinterpret_cast<LoadedModel *>(pHandle)->ScoreWords(*reinterpret_cast<const lm::ngram::State *>(in_state), ids, n, out, probs, ngram_lengths, oovs)) {
+            return -1;
+        }
     } catch (...) {
-        total = 0.0;
+        return -1;
+    }
+    WriteState(out, out_state);
+    return 0;
+}
+
+// Touch every page of the model on threads threads so the first queries do
+// not hit cold memory.  Writes the milliseconds spent on each section to
+// section_ms (up to max_sections): the vocabulary, then 1-grams, 2-grams...
+// Returns the number of sections, or -1 on failure.
+FEXPORT int
+kenlm_warm(void *pHandle, int threads, double *section_ms, size_t max_sections) {
+    if (!pHandle) {
+        return -1;
+    }
+    try {
+        LoadedModel *pModel = reinterpret_cast<LoadedModel *>(pHandle);
+        std::vector<double> seconds;
+        pModel->WarmUp(std::max(threads, 1), seconds);
+        for (size_t i = 0; section_ms && i < std::min(max_sections, seconds.size()); ++i) {
+            section_ms[i] = seconds[i] * 1000.0;
+        }
+        return static_cast<int>(seconds.size());
+    } catch (...) {
+        return -1;
+    }
+}
+
+// Warm the paths real traffic takes by scoring every sample_every-th line of
+// a query log (newline separated sentences, log_size bytes) on threads
+// threads.  Scores are discarded.  Returns the number of sentences replayed,
+// or -1 on failure.
+FEXPORT long
+kenlm_warm_queries(void *pHandle, const char *log, size_t log_size, size_t sample_every, int threads) {
+    if (!pHandle || !log) {
+        return -1;
+    }
+    try {
+        std::vector<StringPiece> sentences;
+        StringPiece rest(log, log_size);
+        for (size_t line = 0; !rest.empty(); ++line) {
+            StringPiece::size_type end = rest.find('\n');
+            StringPiece sentence(rest.substr(0, end));
+            if (end == StringPiece::npos) {
+                rest.clear();
+            } else {
+                rest.remove_prefix(end + 1);
+            }
+            if (line % std::max<size_t>(sample_every, 1) == 0 && !sentence.empty()) {
+                sentences.push_back(sentence);
+            }
+        }
+        const LoadedModel &model = *reinterpret_cast<LoadedModel *>(pHandle);
+        util::ParallelFor(sentences.size(), std::max(threads, 1), ReplaySentence(model, sentences));
+        return static_cast<long>(sentences.size());
+    } catch (...) {
+        return -1;
+    }
+}
+
+// Model slots allow replacing a model under live traffic.  Queries through a
+// slot take no locks and finish on the model they started with; a replaced
+// model is freed once no query can still be using it.
+
+FEXPORT void *
+kenlm_slot_new() {
+    try {
+        return new ModelSlot();
+    } catch (...) {
+        return NULL;
+    }
+}
+
+// Make pHandle (from kenlm_init*, or NULL) the slot's model.  The slot takes
+// ownership: do not kenlm_clean it.  Blocks until queries on the previous
+// model have finished, then frees it.  Returns the new version (>= 1), or 0
+// on failure.  Concurrent publishes are serialized.
+FEXPORT uint64_t
+kenlm_slot_publish(void *pSlot, void *pHandle) {
+    if (!pSlot) {
+        return 0;
+    }
+    try {
+        return reinterpret_cast<ModelSlot *>(pSlot)->Publish(reinterpret_cast<LoadedModel *>(pHandle));
+    } catch (...) {
+        return 0;
+    }
+}
+
+// Version of the current model; 0 if nothing was published.
+FEXPORT uint64_t
+kenlm_slot_version(void *pSlot) {
+    return pSlot ? reinterpret_cast<ModelSlot *>(pSlot)->Version() : 0;
+}
+
+FEXPORT float
+kenlm_slot_query(void *pSlot, const char *pTag) {
+    if (!pSlot) {
+        return 0.0;
+    }
+    ModelSlot::Reader reader(*reinterpret_cast<ModelSlot *>(pSlot));
+    const LoadedModel *pModel = reader.Get();
+    return pModel ? pModel->Query(pTag) : 0.0;
+}
+
+// Frees the slot and its model.  No query may be running on it.
+FEXPORT void
+kenlm_slot_free(void *pSlot) {
+    try {
+        delete reinterpret_cast<ModelSlot *>(pSlot);
+    } catch (...) {
+    }
+}
+
+// Result caches remember the totals of whole sentences, for callers whose
+// sentences repeat.  One cache may serve any number of handles and slots
+// from any number of threads: results are kept apart by model, so a publish
+// to a slot never gets the previous model's results.  A full cache forgets
+// the results least recently found (CLOCK).  Sentences are told apart by a
+// 64-bit hash and their length, so two with the same hash share a result.
+
+// A cache for about entries sentences of 16 bytes each, or NULL on failure.
+FEXPORT void *
+kenlm_result_cache_new(size_t entries) {
+    try {
+        return new util::ResultCache(entries);
+    } catch (...) {
+        return NULL;
+    }
+}
+
+// kenlm_query(pHandle, pTag), answered from pCache when it can be.
+FEXPORT float
+kenlm_cached_query(void *pCache, void *pHandle, const char *pTag) {
+    if (!pCache || !pHandle) {
+        return 0.0;
+    }
+    return CachedQuery(*reinterpret_cast<util::ResultCache *>(pCache), *reinterpret_cast<LoadedModel *>(pHandle), pTag);
+}
+
+// kenlm_slot_query(pSlot, pTag), answered from pCache when it can be.
+FEXPORT float
+kenlm_slot_cached_query(void *pCache, void *pSlot, const char *pTag) {
+    if (!pCache || !pSlot) {
+        return 0.0;
+    }
+    ModelSlot::Reader reader(*reinterpret_cast<ModelSlot *>(pSlot));
+    const LoadedModel *pModel = reader.Get();
+    return pModel ? CachedQuery(*reinterpret_cast<util::ResultCache *>(pCache), *pModel, pTag) : 0.0;
+}
+
+// Counters since kenlm_result_cache_new, over every thread, and how many
+// sentences the cache holds, to those of the pointers that are not NULL.
+// Returns 0, or -1 for a NULL cache.
+FEXPORT int
+kenlm_result_cache_stats(void *pCache, uint64_t *hits, uint64_t *misses, uint64_t *evictions, uint64_t *entries) {
+    if (!pCache) {
+        return -1;
+    }
+    util::ResultCache::Stats stats = reinterpret_cast<util::ResultCache *>(pCache)->GetStats();
+    if (hits) {
+        *hits = stats.hits;
+    }
+    if (misses) {
+        *misses = stats.misses;
+    }
+    if (evictions) {
+        *evictions = stats.evictions;
+    }
+    if (entries) {
+        *entries = stats.entries;
+    }
+    return 0;
+}
+
+// Frees the cache.  No query may be running on it.
+FEXPORT void
+kenlm_result_cache_free(void *pCache) {
+    delete reinterpret_cast<util::ResultCache *>(pCache);
+}
+
+// Build the binary model binary_path from the ARPA file arpa_path, as
+// build_binary does.  model_type is a lm::ngram::ModelType: 0 probing,
+// 6 quantized probing, 7 trie, 8 quantized trie, 9 and 10 probing with 32 and
+// 16 bit fingerprints, each plus 16 for the minimal perfect hash vocabulary.
+// Add kBuildVersionAdd times the search version for another layout of the
+// probing tables: 1 is the blocked layout, probed with SIMD.
+// Negative probing_multiplier, prob_bits, backoff_bits or fingerprint_bits
+// keep the default.  threads <= 0 uses every core; the file is the same
+// either way.  Returns 0, or -1 with the reason in ex_msg.
+FEXPORT int
+kenlm_build_binary(const char *arpa_path, const char *binary_path, int model_type, float probing_multiplier, int prob_bits, int backoff_bits, int fingerprint_bits, int threads, size_t ex_msg_size, char *ex_msg) {
+    try {
+        lm::ngram::Config config;
+        if (probing_multiplier >= 0.0) {
+            config.probing_multiplier = probing_multiplier;
+        }
+        if (prob_bits >= 0) {
+            config.prob_bits = prob_bits;
+        }
+        if (backoff_bits >= 0) {
+            config.backoff_bits = backoff_bits;
+        }
+        if (fingerprint_bits >= 0) {
+            config.vocab_fingerprint_bits = fingerprint_bits;
+        }
+        unsigned int use_threads = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        lm::ngram::BuildBinaryFile(arpa_path, binary_path, static_cast<lm::ngram::ModelType>(model_type % kBuildVersionAdd), model_type / kBuildVersionAdd, config, use_threads);
+        return 0;
+    } catch (const std::exception &ex) {
+        CopyExceptionMessage(ex, ex_msg_size, ex_msg);
+        return -1;
     }
-    return total;
 }
 
 }
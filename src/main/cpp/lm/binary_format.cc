@@ -0,0 +1,104 @@
+#include "lm/binary_format.hh"
+
+#include "lm/lm_exception.hh"
+#include "util/exception.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+namespace lm {
+namespace ngram {
+namespace detail {
+
+namespace {
+
+const char kMagicBeforeVersion[] = "mmap lm http://kheafield.com/code format version";
+// This must be shorter than kMagicBytes and indicates an incomplete binary file (i.e. build failed).
+const char kMagicIncomplete[] = "mmap lm http://kheafield.com/code incomplete\n";
+const long int kMagicVersion = 5;
+
+// Old binary files built on 32-bit machines have this header.
+// TODO: eliminate with next binary release.
+struct OldSanity {
+  char magic[sizeof(kMagicBytes)];
+  float zero_f, one_f, minus_half_f;
+  WordIndex one_word_index, max_word_index;
+  uint64_t one_uint64;
+
+  void SetToReference() {
+    std::memset(this, 0, sizeof(OldSanity));
+    std::memcpy(magic, kMagicBytes, sizeof(magic));
+    zero_f = 0.0; one_f = 1.0; minus_half_f = -0.5;
+    one_word_index = 1;
+    max_word_index = std::numeric_limits<WordIndex>::max();
+    one_uint64 = 1;
+  }
+};
+
+} // namespace
+
+void Sanity::SetToReference() {
+  std::memset(this, 0, sizeof(Sanity));
+  std::memcpy(magic, kMagicBytes, sizeof(kMagicBytes));
+  zero_f = 0.0; one_f = 1.0; minus_half_f = -0.5;
+  one_word_index = 1;
+  max_word_index = std::numeric_limits<WordIndex>::max();
+  padding_to_8 = 0;
+  one_uint64 = 1;
+}
+
+std::size_t TotalHeaderSize(unsigned char order) {
+  return ALIGN8(sizeof(Sanity) + sizeof(FixedWidthParameters) + sizeof(uint64_t) * order);
+}
+
+bool IsBinaryFormat(std::size_t file_size, const void *data) {
+  if (file_size == static_cast<std::size_t>(-1) || (file_size <= sizeof(Sanity))) return false;
+  Sanity reference_header = Sanity();
+  reference_header.SetToReference();
+  if (!std::memcmp(data, &reference_header, sizeof(Sanity))) return true;
+  if (!std::memcmp(data, kMagicIncomplete, strlen(kMagicIncomplete))) {
+    UTIL_THROW(FormatLoadException, "This binary file did not finish building");
+  }
+  if (!std::memcmp(data, kMagicBeforeVersion, strlen(kMagicBeforeVersion))) {
+    char *end_ptr;
+    const char *begin_version = static_cast<const char*>(data) + strlen(kMagicBeforeVersion);
+    long int version = std::strtol(begin_version, &end_ptr, 10);
+    if ((end_ptr != begin_version) && version != kMagicVersion) {
+      UTIL_THROW(FormatLoadException, "Binary file has version " << version << " but this implementation expects version " << kMagicVersion << " so you'll have to use the ARPA to rebuild your binary");
+    }
+    OldSanity old_sanity = OldSanity();
+    old_sanity.SetToReference();
+    UTIL_THROW_IF(!std::memcmp(data, &old_sanity, sizeof(OldSanity)), FormatLoadException, "Looks like this is an old 32-bit format.  The old 32-bit format has been removed so that 64-bit and 32-bit files are exchangeable.");
+    UTIL_THROW(FormatLoadException, "File looks like it should be loaded with mmap, but the test values don't match.  Try rebuilding the binary format LM using the same code revision, compiler, and architecture");
+  }
+  return false;
+}
+
+void WriteHeader(const FixedWidthParameters &fixed, const std::vector<uint64_t> &counts, bool complete, void *to) {
+  uint8_t *out = static_cast<uint8_t*>(to);
+  std::memset(out, 0, TotalHeaderSize(counts.size()));
+  Sanity sanity;
+  sanity.SetToReference();
+  if (!complete) {
+    std::memset(sanity.magic, 0, sizeof(sanity.magic));
+    std::memcpy(sanity.magic, kMagicIncomplete, strlen(kMagicIncomplete));
+  }
+  std::memcpy(out, &sanity, sizeof(Sanity));
+  // Copy field by field so the struct's padding stays zero.
+  FixedWidthParameters zeroed;
+  std::memset(&zeroed, 0, sizeof(FixedWidthParameters));
+  zeroed.order = fixed.order;
+  zeroed.probing_multiplier = fixed.probing_multiplier;
+  zeroed.model_type = fixed.model_type;
+  zeroed.has_vocabulary = fixed.has_vocabulary;
+  zeroed.search_version = fixed.search_version;
+  std::memcpy(out + sizeof(Sanity), &zeroed, sizeof(FixedWidthParameters));
+  if (!counts.empty()) {
+    std::memcpy(out + sizeof(Sanity) + sizeof(FixedWidthParameters), &counts[0], sizeof(uint64_t) * counts.size());
+  }
+}
+
+} // namespace detail
+} // namespace ngram
+} // namespace lm
@@ -0,0 +1,68 @@
+#ifndef LM_BINARY_FORMAT_H
+#define LM_BINARY_FORMAT_H
+
+#include "lm/config.hh"
+#include "lm/search_hashed.hh"
+#include "lm/word_index.hh"
+
+#include <cstddef>
+#include <vector>
+
+#include <stdint.h>
+
+/* The header of a binary file: Sanity, FixedWidthParameters, then the n-gram
+ * counts, padded to 8 bytes.  The vocabulary, the search tables and the
+ * vocabulary strings follow.
+ */
+
+namespace lm {
+namespace ngram {
+namespace detail {
+
+const char kMagicBytes[] = "mmap lm http://kheafield.com/code format version 5\n\0";
+
+// Test values aligned to 8 bytes.
+struct Sanity {
+  char magic[ALIGN8(sizeof(kMagicBytes))];
+  float zero_f, one_f, minus_half_f;
+  WordIndex one_word_index, max_word_index, padding_to_8;
+  uint64_t one_uint64;
+
+  void SetToReference();
+};
+
+struct FixedWidthParameters {
+  unsigned char order;
+  float probing_multiplier;
+  // What type of model is this?
+  ModelType model_type;
+  // Does the end of the file have the actual strings in the vocabulary?
+  bool has_vocabulary;
+  unsigned int search_version;
+};
+
+// Parameters stored in the header of a binary file.
+struct Parameters {
+  FixedWidthParameters fixed;
+  std::vector<uint64_t> counts;
+};
+
+std::size_t TotalHeaderSize(unsigned char order);
+
+// Throws FormatLoadException for binary files from another version of the
+// format or one that did not finish building.  Returns false for anything
+// else that is not a binary file, such as ARPA.
+bool IsBinaryFormat(std::size_t file_size, const void *data);
+
+/* Write the TotalHeaderSize(counts.size()) bytes of header to to.  Padding is
+ * zeroed so the same model always makes the same bytes.  With complete
+ * false, the magic says the file is incomplete, and IsBinaryFormat refuses
+ * it: write that first, then the real header once everything else is out.
+ */
+void WriteHeader(const FixedWidthParameters &fixed, const std::vector<uint64_t> &counts, bool complete, void *to);
+
+} // namespace detail
+} // namespace ngram
+} // namespace lm
+
+#endif // LM_BINARY_FORMAT_H
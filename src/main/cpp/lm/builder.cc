@@ -0,0 +1,596 @@
+#include "lm/builder.hh"
+
+#include "lm/binary_format.hh"
+#include "lm/lm_exception.hh"
+#include "lm/quantize.hh"
+#include "lm/read_arpa.hh"
+#include "lm/search_hashed.hh"
+#include "lm/search_trie.hh"
+#include "lm/value.hh"
+#include "lm/vocab.hh"
+#include "util/checksum.hh"
+#include "util/file.hh"
+#include "util/parallel.hh"
+#include "util/scoped.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace lm {
+namespace ngram {
+
+namespace {
+
+// N-grams per work item when hashing an order in parallel.
+const std::size_t kBuildChunk = 1 << 16;
+
+/* One order of the model being built: the ARPA file's n-grams, then any
+ * blanks.  Unigrams are indexed by word id.  key is how HashedSearch finds
+ * the n-gram; suffix and prefix are the keys of the n-gram without its first
+ * and without its last word.  A unigram's key is its word.
+ */
+struct Order {
+  unsigned int n;
+  std::vector<WordIndex> words;
+  std::vector<ProbBackoff> weights;
+  std::vector<uint64_t> keys, suffix, prefix;
+  // N-grams from blank on are blanks.
+  std::size_t blank;
+
+  std::size_t Size() const { return weights.size(); }
+  const WordIndex *Words(std::size_t i) const { return &words[i * n]; }
+};
+
+uint64_t NGramKey(const WordIndex *words, unsigned int n) {
+  uint64_t ret = words[n - 1];
+  for (unsigned int i = n - 1; i-- > 0; ) {
+    ret = detail::CombineWordHash(ret, words[i]);
+  }
+  return ret;
+}
+
+class HashChunk {
+  public:
+    explicit HashChunk(Order &order) : order_(order) {}
+
+    void operator()(std::size_t chunk) const {
+      std::size_t end = std::min(order_.Size(), (chunk + 1) * kBuildChunk);
+      const unsigned int n = order_.n;
+      for (std::size_t i = chunk * kBuildChunk; i < end; ++i) {
+        const WordIndex *words = order_.Words(i);
+        order_.keys[i] = NGramKey(words, n);
+        order_.suffix[i] = NGramKey(words + 1, n - 1);
+        order_.prefix[i] = NGramKey(words, n - 1);
+      }
+    }
+
+  private:
+    Order &order_;
+};
+
+void HashOrder(Order &order, unsigned int threads) {
+  order.keys.resize(order.Size());
+  order.suffix.resize(order.Size());
+  order.prefix.resize(order.Size());
+  util::ParallelFor((order.Size() + kBuildChunk - 1) / kBuildChunk, threads, HashChunk(order));
+}
+
+// Finds n-grams of an order by key.
+class KeyIndex {
+  public:
+    explicit KeyIndex(const std::vector<uint64_t> &keys) {
+      sorted_.reserve(keys.size());
+      for (std::size_t i = 0; i < keys.size(); ++i) {
+        sorted_.push_back(std::make_pair(keys[i], i));
+      }
+      std::sort(sorted_.begin(), sorted_.end());
+    }
+
+    bool Find(uint64_t key, std::size_t &index) const {
+      std::vector<std::pair<uint64_t, std::size_t> >::const_iterator i = std::lower_bound(sorted_.begin(), sorted_.end(), std::make_pair(key, static_cast<std::size_t>(0)));
+      if (i == sorted_.end() || i->first != key) return false;
+      index = i->second;
+      return true;
+    }
+
+  private:
+    std::vector<std::pair<uint64_t, std::size_t> > sorted_;
+};
+
+// Add the missing suffixes of each order to the order below as blanks, from
+// the top down so that blanks get their own missing suffixes.  Hashes every
+// order on the way.
+void AddBlanks(std::vector<Order> &orders, unsigned int threads) {
+  orders[0].blank = orders[0].Size();
+  for (std::size_t i = orders.size(); i >= 2; --i) {
+    Order &upper = orders[i - 1];
+    HashOrder(upper, threads);
+    Order &lower = orders[i - 2];
+    if (i == 2) break;
+    lower.blank = lower.Size();
+    // The lower order is hashed once its blanks are in, so hash what the
+    // suffixes are compared against here.
+    std::vector<uint64_t> have;
+    have.reserve(lower.Size());
+    for (std::size_t j = 0; j < lower.Size(); ++j) {
+      have.push_back(NGramKey(lower.Words(j), lower.n));
+    }
+    std::sort(have.begin(), have.end());
+    std::vector<std::pair<uint64_t, std::size_t> > missing;
+    for (std::size_t j = 0; j < upper.Size(); ++j) {
+      if (!std::binary_search(have.begin(), have.end(), upper.suffix[j])) {
+        missing.push_back(std::make_pair(upper.suffix[j], j));
+      }
+    }
+    std::sort(missing.begin(), missing.end());
+    ProbBackoff unset;
+    unset.prob = 0.0;
+    unset.backoff = 0.0;
+    for (std::size_t j = 0; j < missing.size(); ++j) {
+      if (j && missing[j].first == missing[j - 1].first) continue;
+      const WordIndex *words = upper.Words(missing[j].second) + 1;
+      lower.words.insert(lower.words.end(), words, words + lower.n);
+      lower.weights.push_back(unset);
+    }
+  }
+}
+
+// A blank's probability is what the model would say without it: that of its
+// suffix plus the backoff of its context.  Goes up so suffixes are done first.
+void WeighBlanks(std::vector<Order> &orders) {
+  for (std::size_t i = 1; i + 1 < orders.size(); ++i) {
+    Order &order = orders[i];
+    if (order.blank == order.Size()) continue;
+    const Order &lower = orders[i - 1];
+    KeyIndex index(lower.keys);
+    for (std::size_t j = order.blank; j < order.Size(); ++j) {
+      std::size_t suffix, context;
+      if (lower.n == 1) {
+        suffix = order.Words(j)[1];
+      } else {
+        UTIL_THROW_IF(!index.Find(order.suffix[j], suffix), FormatLoadException, "Lost the suffix of a blank " << order.n << "-gram");
+      }
+      float prob = lower.weights[suffix].prob;
+      if (lower.n == 1) {
+        prob += lower.weights[order.Words(j)[0]].backoff;
+      } else if (index.Find(order.prefix[j], context)) {
+        prob += lower.weights[context].backoff;
+      }
+      order.weights[j].prob = prob;
+    }
+  }
+}
+
+/* The sign bit of the probability says that nothing extends the n-gram to the
+ * left (it is no suffix of the next order); HashedSearch stops there.  A zero
+ * backoff is -0.0 if nothing extends the n-gram to the right (it is no prefix
+ * of the next order) so that the state can drop it.  The longest order does
+ * not extend either way.
+ */
+class MarkOrder {
+  public:
+    explicit MarkOrder(std::vector<Order> &orders) : orders_(orders) {}
+
+    void operator()(std::size_t i) const {
+      Order &order = orders_[i];
+      if (i + 1 == orders_.size()) {
+        for (std::vector<ProbBackoff>::iterator w = order.weights.begin(); w != order.weights.end(); ++w) {
+          w->prob = -std::fabs(w->prob);
+        }
+        return;
+      }
+      const Order &upper = orders_[i + 1];
+      std::vector<uint64_t> suffixes(upper.suffix), prefixes(upper.prefix);
+      std::sort(suffixes.begin(), suffixes.end());
+      std::sort(prefixes.begin(), prefixes.end());
+      for (std::size_t j = 0; j < order.Size(); ++j) {
+        uint64_t key = (order.n == 1) ? static_cast<uint64_t>(j) : order.keys[j];
+        ProbBackoff &weights = order.weights[j];
+        bool independent = !std::binary_search(suffixes.begin(), suffixes.end(), key);
+        weights.prob = independent ? -std::fabs(weights.prob) : std::fabs(weights.prob);
+        if (weights.backoff == 0.0) {
+          weights.backoff = std::binary_search(prefixes.begin(), prefixes.end(), key) ? 0.0 : -0.0;
+        }
+      }
+    }
+
+  private:
+    std::vector<Order> &orders_;
+};
+
+// Turn the ARPA file into orders, unigrams indexed by word.
+void MakeOrders(ArpaModel &arpa, std::vector<Order> &orders) {
+  orders.resize(arpa.counts.size());
+  for (std::size_t i = 0; i < orders.size(); ++i) {
+    orders[i].n = i + 1;
+    orders[i].blank = 0;
+  }
+  Order &unigrams = orders[0];
+  unigrams.weights.resize(arpa.counts[0]);
+  unigrams.words.resize(arpa.counts[0]);
+  for (std::size_t i = 0; i < arpa.orders[0].words.size(); ++i) {
+    unigrams.weights[arpa.orders[0].words[i]] = arpa.orders[0].weights[i];
+  }
+  for (WordIndex i = 0; i < unigrams.words.size(); ++i) unigrams.words[i] = i;
+  for (std::size_t i = 1; i < orders.size(); ++i) {
+    orders[i].words.swap(arpa.orders[i].words);
+    orders[i].weights.swap(arpa.orders[i].weights);
+  }
+}
+
+// Train the values on every order.  Middle order probabilities go in the way
+// ProbingProxy returns them, with the sign bit set.
+template <class Quant> void Train(const std::vector<Order> &orders, Quant &quant, const Config &config) {
+  if (!Quant::kStored) return;
+  for (std::size_t i = 1; i + 1 < orders.size(); ++i) {
+    std::vector<float> prob, backoff;
+    prob.reserve(orders[i].Size());
+    backoff.reserve(orders[i].Size());
+    for (std::vector<ProbBackoff>::const_iterator w = orders[i].weights.begin(); w != orders[i].weights.end(); ++w) {
+      prob.push_back(-std::fabs(w->prob));
+      backoff.push_back(w->backoff);
+    }
+    quant.Train(i + 1, prob, backoff);
+  }
+  std::vector<float> prob;
+  prob.reserve(orders.back().Size());
+  for (std::vector<ProbBackoff>::const_iterator w = orders.back().weights.begin(); w != orders.back().weights.end(); ++w) {
+    prob.push_back(w->prob);
+  }
+  quant.TrainProb(orders.size(), prob);
+  quant.FinishedLoading(config);
+}
+
+// Fills one probing table: the middle order i, or longest if i is the last.
+template <class Value, class Layout> class FillHashedTable {
+  public:
+    typedef detail::HashedSearch<Value, Layout> Search;
+
+    FillHashedTable(const std::vector<Order> &orders, Search &search, unsigned int threads)
+      : orders_(orders), search_(search), threads_(threads) {}
+
+    void operator()(std::size_t table) const {
+      std::size_t i = table + 1;
+      const Order &order = orders_[i];
+      const typename Value::Codebooks &codebooks = search_.GetCodebooks();
+      typename Value::KeyEqual equal;
+      if (i + 1 < orders_.size()) {
+        std::vector<typename Value::ProbingEntry> entries(order.Size());
+        for (std::size_t j = 0; j < order.Size(); ++j) {
+          entries[j].key = util::StoredKey(equal, order.keys[j]);
+          entries[j].value = codebooks.EncodeMiddle(i - 1, order.weights[j].prob, order.weights[j].backoff);
+        }
+        search_.GetMiddle(i - 1).InsertAll(order.keys.empty() ? NULL : &order.keys[0], entries.empty() ? NULL : &entries[0], order.Size(), threads_);
+      } else {
+        std::vector<typename Value::LongestEntry> entries(order.Size());
+        for (std::size_t j = 0; j < order.Size(); ++j) {
+          entries[j].key = util::StoredKey(equal, order.keys[j]);
+          entries[j].value = codebooks.EncodeLongest(order.weights[j].prob);
+        }
+        search_.GetLongest().InsertAll(order.keys.empty() ? NULL : &order.keys[0], entries.empty() ? NULL : &entries[0], order.Size(), threads_);
+      }
+    }
+
+  private:
+    const std::vector<Order> &orders_;
+    Search &search_;
+    unsigned int threads_;
+};
+
+// Split threads between the tables, each of which splits its share between
+// ranges of buckets.
+unsigned int ThreadsPerTable(unsigned int threads, std::size_t tables) {
+  return std::max<unsigned int>(1, (threads + tables - 1) / tables);
+}
+
+template <class Value, class Layout> void FillSearch(std::vector<Order> &orders, const Config &config, unsigned int threads, detail::HashedSearch<Value, Layout> &search) {
+  Train(orders, search.GetCodebooks(), config);
+  std::copy(orders[0].weights.begin(), orders[0].weights.end(), search.UnigramRaw());
+  std::size_t tables = orders.size() - 1;
+  util::ParallelFor(tables, threads, FillHashedTable<Value, Layout>(orders, search, ThreadsPerTable(threads, tables)));
+}
+
+// Compares n-grams by their reversed words, the order of the trie.
+class ReversedLess {
+  public:
+    explicit ReversedLess(const Order &order) : order_(order) {}
+
+    bool operator()(std::size_t left, std::size_t right) const {
+      const WordIndex *l = order_.Words(left), *r = order_.Words(right);
+      for (unsigned int i = order_.n; i-- > 0; ) {
+        if (l[i] != r[i]) return l[i] < r[i];
+      }
+      return false;
+    }
+
+  private:
+    const Order &order_;
+};
+
+// Sorts each order but unigrams, which are already by word, into trie order.
+class SortReversed {
+  public:
+    SortReversed(const std::vector<Order> &orders, std::vector<std::vector<std::size_t> > &sorted)
+      : orders_(orders), sorted_(sorted) {}
+
+    void operator()(std::size_t i) const {
+      std::vector<std::size_t> &sorted = sorted_[i];
+      sorted.resize(orders_[i].Size());
+      for (std::size_t j = 0; j < sorted.size(); ++j) sorted[j] = j;
+      if (i) std::sort(sorted.begin(), sorted.end(), ReversedLess(orders_[i]));
+    }
+
+  private:
+    const std::vector<Order> &orders_;
+    std::vector<std::vector<std::size_t> > &sorted_;
+};
+
+// Is the context of the (n + 1)-gram upper, which is upper without its first
+// word, before the n-gram words in the trie's order?
+bool ContextBefore(const WordIndex *upper, const WordIndex *words, unsigned int n) {
+  for (unsigned int i = n; i-- > 0; ) {
+    if (upper[i + 1] != words[i]) return upper[i + 1] < words[i];
+  }
+  return false;
+}
+
+// Writes one order of the trie, given each order in trie order.
+template <class Quant> class FillTrieOrder {
+  public:
+    typedef trie::TrieSearch<Quant> Search;
+
+    FillTrieOrder(const std::vector<Order> &orders, const std::vector<std::vector<std::size_t> > &sorted, Search &search)
+      : orders_(orders), sorted_(sorted), search_(search) {}
+
+    void operator()(std::size_t i) const {
+      const Order &order = orders_[i];
+      const Quant &quant = search_.GetQuant();
+      if (i + 1 == orders_.size()) {
+        trie::BitPackedLongest &longest = search_.GetLongest();
+        for (std::size_t j = 0; j < order.Size(); ++j) {
+          std::size_t at = sorted_[i][j];
+          quant.WriteLongest(longest.Write(j, order.Words(at)[0]), order.weights[at].prob);
+        }
+        return;
+      }
+      // Children of each n-gram start at the first (n + 1)-gram whose context
+      // is not before it.
+      const Order &upper = orders_[i + 1];
+      const std::vector<std::size_t> &upper_sorted = sorted_[i + 1];
+      std::size_t next = 0;
+      if (i == 0) {
+        trie::UnigramValue *unigrams = search_.GetUnigram().Raw();
+        // One more for the end of the last range.
+        for (std::size_t j = 0; j <= order.Size(); ++j) {
+          WordIndex word = static_cast<WordIndex>(j);
+          while (next < upper.Size() && upper.Words(upper_sorted[next])[1] < word) ++next;
+          unigrams[j].next = next;
+          if (j < order.Size()) unigrams[j].weights = order.weights[j];
+        }
+        unigrams[order.Size() + 1].next = next;
+        return;
+      }
+      trie::BitPackedMiddle &middle = search_.GetMiddle(i - 1);
+      for (std::size_t j = 0; j < order.Size(); ++j) {
+        std::size_t at = sorted_[i][j];
+        const WordIndex *words = order.Words(at);
+        while (next < upper.Size() && ContextBefore(upper.Words(upper_sorted[next]), words, order.n)) ++next;
+        quant.WriteMiddle(i - 1, middle.Write(j, words[0], next), order.weights[at].prob, order.weights[at].backoff);
+      }
+      middle.FinishedLoading(upper.Size());
+    }
+
+  private:
+    const std::vector<Order> &orders_;
+    const std::vector<std::vector<std::size_t> > &sorted_;
+    Search &search_;
+};
+
+template <class Quant> void FillSearch(std::vector<Order> &orders, const Config &config, unsigned int threads, trie::TrieSearch<Quant> &search) {
+  Train(orders, search.GetQuant(), config);
+  std::vector<std::vector<std::size_t> > sorted(orders.size());
+  util::ParallelFor(orders.size(), threads, SortReversed(orders, sorted));
+  util::ParallelFor(orders.size(), threads, FillTrieOrder<Quant>(orders, sorted, search));
+}
+
+template <class Search, class VocabularyT> void BuildImage(const ArpaModel &arpa, std::vector<Order> &orders, ModelType type, const Config &config, unsigned int threads, util::scoped_memory &out) {
+  std::vector<uint64_t> counts;
+  for (std::vector<Order>::const_iterator i = orders.begin(); i != orders.end(); ++i) {
+    counts.push_back(i->Size());
+  }
+  std::size_t header_size = detail::TotalHeaderSize(counts.size());
+  std::size_t vocab_size = util::CheckOverflow(VocabularyT::Size(counts[0], config));
+  std::size_t search_size = util::CheckOverflow(Search::Size(counts, config));
+  std::size_t strings_size = 0;
+  for (std::vector<StringPiece>::const_iterator i = arpa.vocab.begin(); i != arpa.vocab.end(); ++i) {
+    strings_size += i->size() + 1;
+  }
+  std::size_t total = header_size + vocab_size + search_size + strings_size;
+  out.reset(util::CallocOrThrow(total), total, util::scoped_memory::MALLOC_ALLOCATED);
+  uint8_t *base = static_cast<uint8_t*>(out.get());
+
+  detail::FixedWidthParameters fixed;
+  fixed.order = static_cast<unsigned char>(counts.size());
+  fixed.probing_multiplier = config.probing_multiplier;
+  fixed.model_type = type;
+  fixed.has_vocabulary = true;
+  fixed.search_version = Search::kVersion;
+  detail::WriteHeader(fixed, counts, true, base);
+
+  std::vector<ProbingVocabularyEntry> words;
+  words.reserve(arpa.vocab.size());
+  for (WordIndex i = 1; i < arpa.vocab.size(); ++i) {
+    words.push_back(ProbingVocabularyEntry::Make(detail::HashForVocab(arpa.vocab[i]), i));
+  }
+  VocabularyT::Build(base + header_size, vocab_size, counts[0], config, words);
+
+  Search search;
+  std::vector<uint64_t> table_sizes;
+  Search::TableSizes(counts, config, table_sizes);
+  std::vector<uint8_t*> tables;
+  uint8_t *table = base + header_size + vocab_size;
+  for (std::vector<uint64_t>::const_iterator i = table_sizes.begin(); i != table_sizes.end(); ++i) {
+    tables.push_back(table);
+    table += *i;
+  }
+  search.SetupTables(&tables[0], counts, config);
+  FillSearch(orders, config, threads, search);
+
+  char *strings = reinterpret_cast<char*>(table);
+  for (std::vector<StringPiece>::const_iterator i = arpa.vocab.begin(); i != arpa.vocab.end(); ++i) {
+    std::memcpy(strings, i->data(), i->size());
+    strings += i->size() + 1;
+  }
+}
+
+// Write image to fd with the incomplete magic, then the real header.
+void WriteImage(const util::scoped_memory &image, int fd) {
+  detail::FixedWidthParameters fixed;
+  std::memcpy(&fixed, image.begin() + sizeof(detail::Sanity), sizeof(detail::FixedWidthParameters));
+  std::vector<uint64_t> counts(fixed.order);
+  std::memcpy(&counts[0], image.begin() + sizeof(detail::Sanity) + sizeof(detail::FixedWidthParameters), sizeof(uint64_t) * fixed.order);
+  std::size_t header_size = detail::TotalHeaderSize(fixed.order);
+  std::vector<uint8_t> incomplete(header_size);
+  detail::WriteHeader(fixed, counts, false, &incomplete[0]);
+  util::WriteOrThrow(fd, &incomplete[0], header_size);
+  util::WriteOrThrow(fd, image.begin() + header_size, image.size() - header_size);
+  util::SeekOrThrow(fd, 0);
+  util::WriteOrThrow(fd, image.get(), header_size);
+}
+
+// The probing tables in the layout of search_version.
+template <class Value, class VocabularyT> void BuildHashedImage(const ArpaModel &arpa, std::vector<Order> &orders, ModelType type, unsigned int search_version, const Config &config, unsigned int threads, util::scoped_memory &out) {
+  if (search_version == detail::BlockedLayout::kVersion) {
+    BuildImage<detail::HashedSearch<Value, detail::BlockedLayout>, VocabularyT>(arpa, orders, type, config, threads, out);
+  } else {
+    BuildImage<detail::HashedSearch<Value, detail::PackedLayout>, VocabularyT>(arpa, orders, type, config, threads, out);
+  }
+}
+
+} // namespace
+
+void BuildBinary(const StringPiece &text, ModelType type, unsigned int search_version, const Config &config, unsigned int threads, util::scoped_memory &out) {
+  UTIL_THROW_IF(config.probing_multiplier <= 1.0, ConfigException, "The probing multiplier must be greater than 1.0.");
+  ModelType search_type = static_cast<ModelType>(type & ~kMphVocabularyTypeAdd);
+  bool trie = (search_type == PACKED_TRIE || search_type == QUANT_PACKED_TRIE);
+  UTIL_THROW_IF(search_version > (trie ? trie::TrieSearch<DontQuantize>::kVersion : detail::BlockedLayout::kVersion), ConfigException, "There is no search version " << search_version << " of model type " << static_cast<unsigned int>(type));
+  // Before sizing, which trusts the bits.
+  if (search_type == QUANT_PROBING || search_type == QUANT_PACKED_TRIE) {
+    SeparatelyQuantize::CheckBits(config.prob_bits, config.backoff_bits);
+  }
+  threads = std::max(threads, 1U);
+  ArpaModel arpa;
+  ReadArpa(text, threads, arpa);
+  std::vector<Order> orders;
+  MakeOrders(arpa, orders);
+  AddBlanks(orders, threads);
+  WeighBlanks(orders);
+  util::ParallelFor(orders.size(), threads, MarkOrder(orders));
+
+  switch (type) {
+    case PROBING:
+      BuildHashedImage<BackoffValue, ProbingVocabulary>(arpa, orders, type, search_version, config, threads, out);
+      break;
+    case QUANT_PROBING:
+      BuildHashedImage<QuantizedValue, ProbingVocabulary>(arpa, orders, type, search_version, config, threads, out);
+      break;
+    case PACKED_TRIE:
+      BuildImage<trie::TrieSearch<DontQuantize>, ProbingVocabulary>(arpa, orders, type, config, threads, out);
+      break;
+    case QUANT_PACKED_TRIE:
+      BuildImage<trie::TrieSearch<SeparatelyQuantize>, ProbingVocabulary>(arpa, orders, type, config, threads, out);
+      break;
+    case FINGERPRINT32_PROBING:
+      BuildHashedImage<FingerprintValue<uint32_t>, ProbingVocabulary>(arpa, orders, type, search_version, config, threads, out);
+      break;
+    case FINGERPRINT16_PROBING:
+      BuildHashedImage<FingerprintValue<uint16_t>, ProbingVocabulary>(arpa, orders, type, search_version, config, threads, out);
+      break;
+    case MPH_PROBING:
+      BuildHashedImage<BackoffValue, MphVocabulary>(arpa, orders, type, search_version, config, threads, out);
+      break;
+    case MPH_QUANT_PROBING:
+      BuildHashedImage<QuantizedValue, MphVocabulary>(arpa, orders, type, search_version, config, threads, out);
+      break;
+    case MPH_PACKED_TRIE:
+      BuildImage<trie::TrieSearch<DontQuantize>, MphVocabulary>(arpa, orders, type, config, threads, out);
+      break;
+    case MPH_QUANT_PACKED_TRIE:
+      BuildImage<trie::TrieSearch<SeparatelyQuantize>, MphVocabulary>(arpa, orders, type, config, threads, out);
+      break;
+    case MPH_FINGERPRINT32_PROBING:
+      BuildHashedImage<FingerprintValue<uint32_t>, MphVocabulary>(arpa, orders, type, search_version, config, threads, out);
+      break;
+    case MPH_FINGERPRINT16_PROBING:
+      BuildHashedImage<FingerprintValue<uint16_t>, MphVocabulary>(arpa, orders, type, search_version, config, threads, out);
+      break;
+    default:
+      UTIL_THROW(ConfigException, "There is no model type " << static_cast<unsigned int>(type));
+  }
+}
+
+void BuildBinaryFile(const char *arpa_file, const char *binary_file, ModelType type, unsigned int search_version, const Config &config, unsigned int threads) {
+  util::scoped_memory image;
+  try {
+    util::scoped_fd arpa(util::OpenReadOrThrow(arpa_file));
+    std::size_t arpa_size = util::CheckOverflow(util::SizeOrThrow(arpa.get()));
+    util::scoped_memory text;
+    if (arpa_size) util::MapRead(util::LAZY, arpa.get(), 0, arpa_size, text);
+    BuildBinary(StringPiece(text.begin(), text.size()), type, search_version, config, threads, image);
+  } catch (util::Exception &e) {
+    e << " File: " << arpa_file;
+    throw;
+  }
+  WriteBinaryFile(image, binary_file);
+}
+
+void WriteBinaryFile(const util::scoped_memory &image, const char *binary_file) {
+  try {
+    util::scoped_fd out(util::CreateOrThrow(binary_file));
+    WriteImage(image, out.get());
+  } catch (util::Exception &e) {
+    e << " File: " << binary_file;
+    throw;
+  }
+}
+
+std::string BinaryCachePath(const char *directory, const StringPiece &arpa, ModelType type, unsigned int search_version, const Config &config, unsigned int threads) {
+  char name[128];
+  // The multiplier's bits, since any change to it changes the tables.
+  uint32_t multiplier;
+  std::memcpy(&multiplier, &config.probing_multiplier, sizeof(multiplier));
+  std::sprintf(name, "%016llx-%u-%u-%08x-%u-%u-%u.bin",
+      static_cast<unsigned long long>(util::Checksum(arpa.data(), arpa.size(), threads)),
+      static_cast<unsigned int>(type), search_version, static_cast<unsigned int>(multiplier),
+      static_cast<unsigned int>(config.prob_bits), static_cast<unsigned int>(config.backoff_bits), static_cast<unsigned int>(config.vocab_fingerprint_bits));
+  std::string ret(directory);
+  if (!ret.empty() && ret[ret.size() - 1] != '/') ret += '/';
+  return ret + name;
+}
+
+void WriteBinaryCache(const util::scoped_memory &image, const std::string &path) {
+  std::string temp(path + ".tmp");
+  try {
+    util::scoped_fd out(util::MakeTempOrThrow(temp));
+    WriteImage(image, out.get());
+  } catch (util::Exception &e) {
+    std::remove(temp.c_str());
+    e << " File: " << temp;
+    throw;
+  }
+  try {
+    util::RenameOrThrow(temp.c_str(), path.c_str());
+  } catch (...) {
+    std::remove(temp.c_str());
+    throw;
+  }
+}
+
+} // namespace ngram
+} // namespace lm
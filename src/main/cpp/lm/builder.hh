@@ -0,0 +1,58 @@
+#ifndef LM_BUILDER_H
+#define LM_BUILDER_H
+
+#include "lm/config.hh"
+#include "lm/search_hashed.hh"
+#include "util/mmap.hh"
+#include "util/string_piece.hh"
+
+#include <string>
+
+namespace lm {
+namespace ngram {
+
+/* Build the binary image of a model of type type from the text of an ARPA
+ * file, as a model's (size, data) constructor takes it.  search_version
+ * picks the layout of probing tables (see detail::PackedLayout and
+ * detail::BlockedLayout); tries only have version 0.  config supplies the
+ * probing_multiplier and, for the types that use them, prob_bits,
+ * backoff_bits and vocab_fingerprint_bits.
+ *
+ * Orders are filled in parallel on up to threads threads, and each probing
+ * table is split into ranges of buckets filled in parallel too.  The image is
+ * the same whatever the number of threads.
+ *
+ * N-grams whose suffix is missing from the ARPA file (as SRILM's pruning
+ * leaves them) would be unreachable, so the suffix is added as a blank: its
+ * probability is the backed-off one and its backoff 0.  The header counts
+ * include blanks.
+ *
+ * Throws FormatLoadException for bad ARPA text and ConfigException for a bad
+ * type, version or config.
+ */
+void BuildBinary(const StringPiece &arpa, ModelType type, unsigned int search_version, const Config &config, unsigned int threads, util::scoped_memory &out);
+
+/* Same, from the file arpa_file to the file binary_file.  Until the build
+ * finishes, binary_file says it is incomplete and models refuse to load it.
+ */
+void BuildBinaryFile(const char *arpa_file, const char *binary_file, ModelType type, unsigned int search_version, const Config &config, unsigned int threads);
+
+// Write an image from BuildBinary to binary_file, incomplete until the end.
+void WriteBinaryFile(const util::scoped_memory &image, const char *binary_file);
+
+/* Name of the cached binary of the ARPA text arpa in directory: the
+ * util::Checksum of the text (taken on threads threads) and every build
+ * parameter, so a changed file or config misses the cache.
+ */
+std::string BinaryCachePath(const char *directory, const StringPiece &arpa, ModelType type, unsigned int search_version, const Config &config, unsigned int threads);
+
+/* Write image to the cache file path through a temporary file renamed into
+ * place.  Processes loading path see nothing or the whole file, even while
+ * others write it, and models already mapping an older copy keep it.
+ */
+void WriteBinaryCache(const util::scoped_memory &image, const std::string &path);
+
+} // namespace ngram
+} // namespace lm
+
+#endif // LM_BUILDER_H
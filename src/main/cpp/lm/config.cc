@@ -6,7 +6,26 @@ namespace lm {
 namespace ngram {
 
 Config::Config() :
-  probing_multiplier(1.5) {}
+  probing_multiplier(1.5),
+  prob_bits(8),
+  backoff_bits(8),
+  vocab_fingerprint_bits(64),
+  data_method(COPY_DATA),
+  shared_segment(NULL),
+  load_method(util::LAZY),
+  map_advice(util::ADVISE_NORMAL),
+  image_allocation(util::ALLOCATE_MALLOC),
+  warm_threads(0),
+  verify_threads(0),
+  probe_threads(0),
+  expected_checksum(0),
+  arpa_threads(1),
+  arpa_cache(NULL),
+  prefetch_orders(false),
+  filter_bits(0),
+  transition_bytes(0),
+  transition_cache_bytes(0),
+  messages(NULL) {}
 
 } // namespace ngram
 } // namespace lm
@@ -1,6 +1,10 @@
 #ifndef LM_CONFIG_H
 #define LM_CONFIG_H
 
+#include "util/mmap.hh"
+
+#include <iosfwd>
+
 #include <stdint.h>
 
 // This is a macro instead of an inline function so constants can be assigned using it.
@@ -19,6 +23,126 @@ struct Config {
   // TrieModel which has lower memory consumption.
   float probing_multiplier;
 
+  // Bits per quantized probability and backoff code when building a
+  // QuantProbingModel or QuantTrieModel (see lm/quantize.hh).  Loading reads
+  // them from the file.
+  uint8_t prob_bits, backoff_bits;
+
+  // Bits of word hash kept per word when building a model with MphVocabulary
+  // (see lm/vocab.hh), 8 to 64.  At 64, unknown words are rejected exactly
+  // as ProbingVocabulary does; each bit less saves memory and doubles the
+  // chance of taking an unknown word for a known one.  Loading reads it from
+  // the file.
+  uint8_t vocab_fingerprint_bits;
+
+  // How the (size, data) model constructor treats the caller's image.
+  typedef enum {
+    // Copy the image into memory owned by the model.  The caller may free its
+    // bytes as soon as the constructor returns.
+    COPY_DATA,
+    // Use the caller's bytes in place.  The bytes must be 8-byte aligned and
+    // must stay alive and unmodified until the model is destroyed.
+    BORROW_DATA,
+    // Publish the image as the POSIX shared memory segment shared_segment, or
+    // attach to it read-only if another process already published it (data
+    // may then be NULL).  Every process then maps the same physical pages.
+    // The segment outlives the processes until it is unlinked.
+    SHARE_DATA
+  } DataMethod;
+
+  DataMethod data_method;
+
+  // Segment name for SHARE_DATA, e.g. "/tag.lm.v3".  Include a version in the
+  // name: an attacher cannot tell an old model from a new one of equal size.
+  const char *shared_segment;
+
+  // Loading from a file with the (file) model constructor.  See util/mmap.hh
+  // for details.  Mapped models share the page cache with every other
+  // process mapping the same file.
+  util::LoadMethod load_method;
+
+  // util::MapAdvice flags applied to a mapped model.
+  unsigned int map_advice;
+
+  // Memory for the private copy made by COPY_DATA or load_method READ.
+  // Anything but ALLOCATE_MALLOC also starts every table on its own cache
+  // line.  If the system refuses huge pages, the model falls back and says so
+  // on messages; the model's ImageAllocation() reports what it got.
+  util::AllocatePolicy image_allocation;
+
+  // If non-zero, touch every page of the vocabulary and every table on this
+  // many threads before the constructor returns, so the first queries do not
+  // fault.  Time per section goes to messages.
+  unsigned int warm_threads;
+
+  // If non-zero, distrust the image: checksum it, then walk the vocabulary
+  // and every table on this many threads before any lookup, throwing
+  // FormatLoadException at the first inconsistency.  A corrupt table would
+  // otherwise return garbage scores.  Implies probe_threads.
+  unsigned int verify_threads;
+
+  // Probing models: if non-zero, read the vocabulary and every table on this
+  // many threads at load to find how far any entry sits from its ideal
+  // bucket, and stop every lookup there (see
+  // util::ProbingHashTable::LimitProbes).  Lookups of missing words and
+  // n-grams also stop early in runs built in order of ideal bucket, as
+  // build_binary builds them.  Otherwise a lookup reads up to the next empty
+  // bucket and, in a table with none, no further than the whole table.
+  // Faults in every page of the tables, like warm_threads.
+  unsigned int probe_threads;
+
+  // If non-zero, the util::Checksum of the whole binary file.  Loading fails
+  // unless the image matches.  Implies checksumming even if verify_threads is
+  // zero.
+  uint64_t expected_checksum;
+
+  // Loading ARPA text instead of a binary: threads to parse it and fill the
+  // tables on.  The model does not depend on the number.
+  unsigned int arpa_threads;
+
+  // Loading ARPA text: if set, a directory of binaries built from ARPA files
+  // (see lm/builder.hh BinaryCachePath).  A model whose text and parameters
+  // match a cached binary loads it as if it had been given the binary;
+  // otherwise the model builds one and writes it there for next time.
+  const char *arpa_cache;
+
+  // Probing models: before the first lookup for a word, prefetch the entry
+  // of every order its context could reach, so that for tables far bigger
+  // than the cache the misses overlap instead of following each other.
+  // Entries past the order where the lookup stops are loaded for nothing,
+  // and models that fit in cache lose a few percent to the extra hashing.
+  // Trie models ignore it: each order's search starts where the one below
+  // ended.
+  bool prefetch_orders;
+
+  // Probing models: if non-zero, bits per n-gram of a Bloom filter built at
+  // load in front of each order but unigrams (see HashedSearch::BuildFilters).
+  // A lookup the filter rules out costs one line of it instead of a walk to
+  // an empty bucket, but one it lets through reads both.  Worth it when most
+  // lookups miss and the filters stay in cache where the tables would not.
+  // 10 bits rule out 99% of misses for 1.25 bytes per n-gram of private
+  // memory.  Trie models ignore it.
+  unsigned int filter_bits;
+
+  // If non-zero, number every state reachable from the begin-sentence and
+  // null-context states at load and score every word in each in advance,
+  // as long as that table takes at most this many bytes: 8 per state and
+  // word (see lm/transition_table.hh).  Sentence scoring through
+  // GenericModel::ScoreSentences then costs one lookup per word.  Only
+  // models with a few dozen to a few hundred words fit; for the others,
+  // giving up costs up to this many bytes / 8 FullScore calls at load.
+  std::size_t transition_bytes;
+
+  // If non-zero and the model is too big for transition_bytes, remember
+  // transitions as GenericModel::ScoreSentences scores them, in about this
+  // many bytes shared by every thread (see lm/transition_cache.hh).  Pays
+  // off when the same contexts come back, as in repetitive traffic; each
+  // word not remembered costs a lock and a lookup on top of FullScore.
+  std::size_t transition_cache_bytes;
+
+  // Where to report warnings such as allocation fallback.  NULL is quiet.
+  std::ostream *messages;
+
   // Set defaults.
   Config();
 };
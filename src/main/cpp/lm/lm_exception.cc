@@ -5,6 +5,9 @@
 
 namespace lm {
 
+ConfigException::ConfigException() throw() {}
+ConfigException::~ConfigException() throw() {}
+
 LoadException::LoadException() throw() {}
 LoadException::~LoadException() throw() {}
 
@@ -11,6 +11,12 @@
 
 namespace lm {
 
+class ConfigException : public util::Exception {
+  public:
+    ConfigException() throw();
+    ~ConfigException() throw();
+};
+
 class LoadException : public util::Exception {
    public:
       virtual ~LoadException() throw();
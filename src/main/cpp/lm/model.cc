@@ -1,14 +1,24 @@
 #include "lm/model.hh"
 
+#include "lm/binary_format.hh"
+#include "lm/builder.hh"
 #include "lm/max_order.hh"
 #include "lm/lm_exception.hh"
+#include "util/checksum.hh"
 #include "util/exception.hh"
+#include "util/file.hh"
+#include "util/parallel.hh"
+#include "util/scoped.hh"
+#include "util/string_stream.hh"
 
 #include <algorithm>
+#include <chrono>
 #include <functional>
 #include <numeric>
+#include <cerrno>
 #include <cmath>
 #include <limits>
+#include <ostream>
 
 namespace lm {
 namespace ngram {
@@ -37,7 +47,7 @@ inline bool HasExtension(const float &backoff) {
 
 namespace detail {
 
-template <class Search, class VocabularyT> const ModelType GenericModel<Search, VocabularyT>::kModelType = Search::kModelType;
+template <class Search, class VocabularyT> const ModelType GenericModel<Search, VocabularyT>::kModelType = static_cast<ModelType>(Search::kModelType + VocabularyT::kModelTypeAdd);
 
 template <class Search, class VocabularyT>
 uint64_t GenericModel<Search, VocabularyT>::Size(const std::vector<uint64_t> &counts, const Config &config) {
@@ -49,10 +59,47 @@ void GenericModel<Search, VocabularyT>::SetupMemory(void *base, const std::vecto
   size_t goal_size = ::util::CheckOverflow(Size(counts, config));
   uint8_t *start = static_cast<uint8_t*>(base);
   size_t allocated = VocabularyT::Size(counts[0], config);
-  vocab_.SetupMemory(start, allocated); // , counts[0], config
+  uint8_t *vocab = start;
   start += allocated;
-  start = search_.SetupMemory(start, counts, config);
+  std::vector<uint64_t> table_sizes;
+  Search::TableSizes(counts, config, table_sizes);
+  std::vector<uint8_t*> tables;
+  for (std::vector<uint64_t>::const_iterator i = table_sizes.begin(); i != table_sizes.end(); ++i) {
+    tables.push_back(start);
+    start += *i;
+  }
   if (static_cast<std::size_t>(start - static_cast<uint8_t*>(base)) != goal_size) UTIL_THROW(FormatLoadException, "The data structures took " << (start - static_cast<uint8_t*>(base)) << " but Size says they should take " << goal_size);
+  SetupSections(vocab, allocated, &*tables.begin(), table_sizes, counts, config);
+}
+
+template <class Search, class VocabularyT>
+void GenericModel<Search, VocabularyT>::SetupSections(uint8_t *vocab, std::size_t vocab_size, uint8_t *const *tables, const std::vector<uint64_t> &table_sizes, const std::vector<uint64_t> &counts, const Config &config) {
+  search_.SetupTables(tables, counts, config);
+  if (config.verify_threads) {
+    // Before the vocabulary looks up <s> and </s>.
+    VocabularyT::CheckConsistency(vocab, vocab_size, counts[0], config.verify_threads);
+    search_.CheckConsistency(counts, config.verify_threads);
+  }
+  unsigned int probe_threads = config.verify_threads ? config.verify_threads : config.probe_threads;
+  if (probe_threads) search_.LimitProbes(probe_threads);
+  search_.BuildFilters(counts, config.filter_bits);
+  vocab_.SetupMemory(vocab, vocab_size); // , counts[0], config
+  if (probe_threads) vocab_.LimitProbes(probe_threads);
+
+  sections_.clear();
+  ImageSection section;
+  section.name = "vocabulary";
+  section.begin = vocab;
+  section.size = vocab_size;
+  sections_.push_back(section);
+  std::vector<std::string> names;
+  Search::TableNames(counts.size(), names);
+  for (std::size_t i = 0; i < table_sizes.size(); ++i) {
+    section.name = names[i];
+    section.begin = tables[i];
+    section.size = table_sizes[i];
+    sections_.push_back(section);
+  }
 }
 
 namespace {
@@ -66,75 +113,30 @@ void CheckCounts(const std::vector<uint64_t> &counts) {
   }
 }
 
-const char *kModelNames[1] = {
-    "probing hash tables"
-};
-
-const char kMagicBeforeVersion[] = "mmap lm http://kheafield.com/code format version";
-const char kMagicBytes[] = "mmap lm http://kheafield.com/code format version 5\n\0";
-// This must be shorter than kMagicBytes and indicates an incomplete binary file (i.e. build failed).
-const char kMagicIncomplete[] = "mmap lm http://kheafield.com/code incomplete\n";
-const long int kMagicVersion = 5;
-
-// Old binary files built on 32-bit machines have this header.
-// TODO: eliminate with next binary release.
-struct OldSanity {
-  char magic[sizeof(kMagicBytes)];
-  float zero_f, one_f, minus_half_f;
-  WordIndex one_word_index, max_word_index;
-  uint64_t one_uint64;
-
-  void SetToReference() {
-    std::memset(this, 0, sizeof(OldSanity));
-    std::memcpy(magic, kMagicBytes, sizeof(magic));
-    zero_f = 0.0; one_f = 1.0; minus_half_f = -0.5;
-    one_word_index = 1;
-    max_word_index = std::numeric_limits<WordIndex>::max();
-    one_uint64 = 1;
-  }
-};
-
-
-// Test values aligned to 8 bytes.
-struct Sanity {
-  char magic[ALIGN8(sizeof(kMagicBytes))];
-  float zero_f, one_f, minus_half_f;
-  WordIndex one_word_index, max_word_index, padding_to_8;
-  uint64_t one_uint64;
-
-  void SetToReference() {
-    std::memset(this, 0, sizeof(Sanity));
-    std::memcpy(magic, kMagicBytes, sizeof(kMagicBytes));
-    zero_f = 0.0; one_f = 1.0; minus_half_f = -0.5;
-    one_word_index = 1;
-    max_word_index = std::numeric_limits<WordIndex>::max();
-    padding_to_8 = 0;
-    one_uint64 = 1;
-  }
+const char *kModelNames[11] = {
+    "probing hash tables",
+    "probing hash tables with rest costs",
+    "trie",
+    "trie with quantization",
+    "trie with array-compressed pointers",
+    "trie with quantization and array-compressed pointers",
+    "probing hash tables with quantization",
+    "bit-packed trie",
+    "bit-packed trie with quantization",
+    "probing hash tables with 32-bit fingerprints",
+    "probing hash tables with 16-bit fingerprints"
 };
 
-struct FixedWidthParameters {
-  unsigned char order;
-  float probing_multiplier;
-  // What type of model is this?
-  ModelType model_type;
-  // Does the end of the file have the actual strings in the vocabulary?
-  bool has_vocabulary;
-  unsigned int search_version;
-};
-
-// Parameters stored in the header of a binary file.
-struct Parameters {
-  FixedWidthParameters fixed;
-  std::vector<uint64_t> counts;
-};
+std::string ModelName(unsigned int model_type) {
+  const unsigned int kNames = sizeof(kModelNames) / sizeof(const char *);
+  if (model_type < kNames) return kModelNames[model_type];
+  if (model_type >= kMphVocabularyTypeAdd && model_type - kMphVocabularyTypeAdd < kNames)
+    return std::string(kModelNames[model_type - kMphVocabularyTypeAdd]) + " with a perfect hash vocabulary";
+  return std::string();
+}
 
 } // namespace
 
-std::size_t TotalHeaderSize(unsigned char order) {
-  return ALIGN8(sizeof(Sanity) + sizeof(FixedWidthParameters) + sizeof(uint64_t) * order);
-}
-
 void CheckHeader(Parameters &out) {
   if (out.fixed.probing_multiplier < 1.0)
     UTIL_THROW(FormatLoadException, "Binary format claims to have a probing multiplier of ... which is < 1.0."); // << out.fixed.probing_multiplier 
@@ -145,58 +147,158 @@ namespace util {
   const size_t kBadSize = (size_t)-1;
 }
 
-bool IsBinaryFormat(size_t file_size, void *data) {
-  if (file_size == util::kBadSize || (file_size <= sizeof(Sanity))) return false;
-  Sanity reference_header = Sanity();
-  reference_header.SetToReference();
-  if (!std::memcmp(data, &reference_header, sizeof(Sanity))) return true;
-  if (!std::memcmp(data, kMagicIncomplete, strlen(kMagicIncomplete))) {
-    UTIL_THROW(FormatLoadException, "This binary file did not finish building");
-  }
-  if (!std::memcmp(data, kMagicBeforeVersion, strlen(kMagicBeforeVersion))) {
-    char *end_ptr;
-    const char *begin_version = static_cast<const char*>(data) + strlen(kMagicBeforeVersion);
-    long int version = std::strtol(begin_version, &end_ptr, 10);
-    if ((end_ptr != begin_version) && version != kMagicVersion) {
-      UTIL_THROW(FormatLoadException, "Binary file has version " << version << " but this implementation expects version " << kMagicVersion << " so you'll have to use the ARPA to rebuild your binary");
-    }
-    OldSanity old_sanity = OldSanity();
-    old_sanity.SetToReference();
-    UTIL_THROW_IF(!std::memcmp(data, &old_sanity, sizeof(OldSanity)), FormatLoadException, "Looks like this is an old 32-bit format.  The old 32-bit format has been removed so that 64-bit and 32-bit files are exchangeable.");
-    UTIL_THROW(FormatLoadException, "File looks like it should be loaded with mmap, but the test values don't match.  Try rebuilding the binary format LM using the same code revision, compiler, and architecture");
-  }
-  return false;
+// Every table entry starts with a 64-bit key and every section is a multiple
+// of 8 bytes, so an 8-byte aligned image keeps every key naturally aligned.
+const std::size_t kImageAlignment = 8;
+
+const std::size_t kCacheLine = 64;
+
+std::size_t CacheAlign(std::size_t offset) {
+  return ((offset + kCacheLine - 1) / kCacheLine) * kCacheLine;
 }
 
 const std::size_t kInvalidSize = static_cast<std::size_t>(-1);
 
 void MatchCheck(ModelType model_type, unsigned int search_version, const Parameters &params) {
   if (params.fixed.model_type != model_type) {
-    if (static_cast<unsigned int>(params.fixed.model_type) >= (sizeof(kModelNames) / sizeof(const char *)))
+    if (ModelName(params.fixed.model_type).empty())
       UTIL_THROW(FormatLoadException, "The binary file claims to be model type " << static_cast<unsigned int>(params.fixed.model_type) << " but this is not implemented for in this inference code.");
-    UTIL_THROW(FormatLoadException, "The binary file was built for " << kModelNames[params.fixed.model_type] << " but the inference code is trying to load " << kModelNames[model_type]);
+    UTIL_THROW(FormatLoadException, "The binary file was built for " << ModelName(params.fixed.model_type) << " but the inference code is trying to load " << ModelName(model_type));
   }
-  UTIL_THROW_IF(search_version != params.fixed.search_version, FormatLoadException, "The binary file has " << kModelNames[params.fixed.model_type] << " version " << params.fixed.search_version << " but this code expects " << kModelNames[params.fixed.model_type] << " version " << search_version);
+  UTIL_THROW_IF(search_version != params.fixed.search_version, FormatLoadException, "The binary file has " << ModelName(params.fixed.model_type) << " version " << params.fixed.search_version << " but this code expects " << ModelName(params.fixed.model_type) << " version " << search_version);
 }
 
 
 template <class Search, class VocabularyT>
 GenericModel<Search, VocabularyT>::GenericModel(size_t file_size, void *data, const Config &init_config)
-:
-    readen_content((uint8_t *)std::malloc(file_size))
-{
-  std::memcpy(readen_content, data, file_size);
+  : allocation_(::util::ALLOCATE_MALLOC), prefetch_orders_(init_config.prefetch_orders), checksum_(0) {
+  if (data && !IsBinaryFormat(file_size, data)) {
+    LoadArpa(StringPiece(static_cast<const char*>(data), file_size), init_config);
+    return;
+  }
+  LoadMemory(file_size, data, init_config);
+}
+
+template <class Search, class VocabularyT>
+void GenericModel<Search, VocabularyT>::LoadMemory(size_t file_size, void *data, const Config &init_config) {
+  if (init_config.data_method == Config::BORROW_DATA) {
+    UTIL_THROW_IF(reinterpret_cast<uintptr_t>(data) % kImageAlignment, FormatLoadException, "Borrowed model data must be " << kImageAlignment << "-byte aligned but starts at offset " << (reinterpret_cast<uintptr_t>(data) % kImageAlignment) << " from an aligned address.  Copy it instead.");
+    memory_.reset(data, file_size, ::util::scoped_memory::NONE_ALLOCATED);
+  } else if (init_config.data_method == Config::SHARE_DATA) {
+    UTIL_THROW_IF(!init_config.shared_segment, FormatLoadException, "Sharing the model requires a segment name.");
+    UTIL_THROW_IF(data && !IsBinaryFormat(file_size, data), FormatLoadException, "Not a binary format of a file");
+    bool created = ::util::PublishOrAttachSegment(init_config.shared_segment, data, file_size, sizeof(Sanity), memory_);
+    try {
+      LoadImage(init_config);
+    } catch (...) {
+      // Do not leave a broken image for the next process to find.
+      if (created) ::util::UnlinkSegment(init_config.shared_segment);
+      throw;
+    }
+    return;
+  } else if (init_config.image_allocation != ::util::ALLOCATE_MALLOC) {
+    CopyImage(file_size, data, init_config);
+    return;
+  } else {
+    memory_.reset(::util::MallocOrThrow(file_size), file_size, ::util::scoped_memory::MALLOC_ALLOCATED);
+    std::memcpy(memory_.get(), data, file_size);
+  }
+  LoadImage(init_config);
+}
+
+template <class Search, class VocabularyT>
+GenericModel<Search, VocabularyT>::GenericModel(const char *file, const Config &init_config)
+  : allocation_(::util::ALLOCATE_MALLOC), prefetch_orders_(init_config.prefetch_orders), checksum_(0) {
+  try {
+    ::util::scoped_fd fd(::util::OpenReadOrThrow(file));
+    std::size_t file_size = ::util::CheckOverflow(::util::SizeOrThrow(fd.get()));
+    Sanity header;
+    if (::util::ReadOrEOF(fd.get(), &header, sizeof(Sanity)) < sizeof(Sanity) || !IsBinaryFormat(file_size, &header)) {
+      ::util::scoped_memory text;
+      if (file_size) ::util::MapRead(::util::LAZY, fd.get(), 0, file_size, text);
+      LoadArpa(StringPiece(text.begin(), text.size()), init_config);
+      return;
+    }
+  } catch (::util::Exception &e) {
+    e << " File: " << file;
+    throw;
+  }
+  LoadFile(file, init_config);
+}
+
+template <class Search, class VocabularyT>
+void GenericModel<Search, VocabularyT>::LoadFile(const char *file, const Config &init_config) {
+  try {
+    ::util::scoped_fd fd(::util::OpenReadOrThrow(file));
+    std::size_t file_size = ::util::CheckOverflow(::util::SizeOrThrow(fd.get()));
+    UTIL_THROW_IF(file_size <= sizeof(Sanity), FormatLoadException, "File is too small to be a binary model");
+    if (init_config.load_method == ::util::READ && init_config.image_allocation != ::util::ALLOCATE_MALLOC) {
+      // Copy out of a temporary mapping into the requested memory.
+      ::util::scoped_memory mapped;
+      ::util::MapRead(::util::LAZY, fd.get(), 0, file_size, mapped);
+      CopyImage(file_size, mapped.get(), init_config);
+      return;
+    }
+    ::util::MapRead(init_config.load_method, fd.get(), 0, file_size, memory_);
+    ::util::AdviseMapping(memory_, init_config.map_advice);
+    LoadImage(init_config);
+  } catch (::util::Exception &e) {
+    e << " File: " << file;
+    throw;
+  }
+}
+
+template <class Search, class VocabularyT>
+void GenericModel<Search, VocabularyT>::LoadArpa(const StringPiece &text, const Config &init_config) {
+  unsigned int threads = std::max(init_config.arpa_threads, 1u);
+  std::string cache;
+  if (init_config.arpa_cache) {
+    cache = BinaryCachePath(init_config.arpa_cache, text, kModelType, kVersion, init_config, threads);
+    try {
+      LoadFile(cache.c_str(), init_config);
+      return;
+    } catch (const ::util::Exception &e) {
+      const ::util::ErrnoException *missing = dynamic_cast<const ::util::ErrnoException*>(&e);
+      if (init_config.messages && !(missing && missing->Error() == ENOENT)) {
+        *init_config.messages << "Rebuilding the cached binary: " << e.what() << std::endl;
+      }
+    }
+  }
+  // Copies go through LoadMemory; otherwise the model owns what was built.
+  bool copy = init_config.data_method == Config::SHARE_DATA || init_config.image_allocation != ::util::ALLOCATE_MALLOC;
+  ::util::scoped_memory built;
+  ::util::scoped_memory &image = copy ? built : memory_;
+  BuildBinary(text, kModelType, kVersion, init_config, threads, image);
+  if (!cache.empty()) {
+    try {
+      WriteBinaryCache(image, cache);
+    } catch (const ::util::Exception &e) {
+      if (init_config.messages) *init_config.messages << "Could not cache the binary: " << e.what() << std::endl;
+    }
+  }
+  if (copy) {
+    Config copy_config(init_config);
+    if (copy_config.data_method == Config::BORROW_DATA) copy_config.data_method = Config::COPY_DATA;
+    LoadMemory(image.size(), image.get(), copy_config);
+  } else {
+    LoadImage(init_config);
+  }
+}
+
+template <class Search, class VocabularyT>
+std::size_t GenericModel<Search, VocabularyT>::ReadHeader(std::size_t file_size, const void *image_void, std::vector<uint64_t> &counts, Config &config) {
+  const uint8_t *image = static_cast<const uint8_t*>(image_void);
 
-  bool isBinaryFormat = IsBinaryFormat(file_size, readen_content);
+  bool isBinaryFormat = IsBinaryFormat(file_size, const_cast<uint8_t*>(image));
   UTIL_THROW_IF(!isBinaryFormat, FormatLoadException, "Not a binary format of a file");
 
   Parameters parameters;
 
-  memcpy(&parameters.fixed, readen_content + sizeof(Sanity), sizeof(FixedWidthParameters));
+  memcpy(&parameters.fixed, image + sizeof(Sanity), sizeof(FixedWidthParameters));
 
   CheckHeader(parameters);
   if (parameters.fixed.order) {
-    memcpy(&*parameters.counts.begin(), readen_content + sizeof(Sanity) + sizeof(FixedWidthParameters), sizeof(uint64_t) * parameters.fixed.order);
+    memcpy(&*parameters.counts.begin(), image + sizeof(Sanity) + sizeof(FixedWidthParameters), sizeof(uint64_t) * parameters.fixed.order);
   }
 
   MatchCheck(kModelType, kVersion, parameters);
@@ -205,19 +307,87 @@ GenericModel<Search, VocabularyT>::GenericModel(size_t file_size, void *data, co
 
   CheckCounts(parameters.counts);
 
-  Config new_config(init_config);
-  new_config.probing_multiplier = parameters.fixed.probing_multiplier;
+  config.probing_multiplier = parameters.fixed.probing_multiplier;
 
   UTIL_THROW_IF(!parameters.fixed.has_vocabulary, FormatLoadException, "The decoder requested all the vocabulary strings, but this binary does not have them.  You may need to rebuild the binary with an updated version of build_binary.");
 
-  std::size_t size = Size(parameters.counts, new_config);
+  UTIL_THROW_IF(file_size != util::kBadSize && file_size < header_size, FormatLoadException, "Binary file has size " << file_size << " but the header ends at " << header_size);
+  VocabularyT::UpdateConfigFromBinary(image + header_size, file_size - header_size, config);
+  std::size_t search_offset = header_size + VocabularyT::Size(parameters.counts[0], config);
+  UTIL_THROW_IF(file_size != util::kBadSize && file_size < search_offset, FormatLoadException, "Binary file has size " << file_size << " but the vocabulary ends at " << search_offset);
+  Search::UpdateConfigFromBinary(image + search_offset, file_size - search_offset, config);
+
+  std::size_t size = Size(parameters.counts, config);
   // The header is smaller than a page, so we have to map the whole header as well.
   uint64_t total_map = static_cast<uint64_t>(header_size) + static_cast<uint64_t>(size);
 
   UTIL_THROW_IF(file_size != util::kBadSize && file_size < total_map, FormatLoadException, "Binary file has size " << file_size << " but the headers say it should be at least " << total_map);
-  SetupMemory(readen_content + header_size, parameters.counts, new_config);
-  // isBinaryFormat
+  counts.swap(parameters.counts);
+  return header_size;
+}
+
+template <class Search, class VocabularyT>
+void GenericModel<Search, VocabularyT>::LoadImage(const Config &init_config) {
+  uint8_t *image = static_cast<uint8_t*>(memory_.get());
+  ChecksumImage(memory_.size(), image, init_config);
+  std::vector<uint64_t> counts;
+  Config new_config(init_config);
+  std::size_t header_size = ReadHeader(memory_.size(), image, counts, new_config);
+  SetupMemory(image + header_size, counts, new_config);
+  InitStates(new_config);
+}
+
+template <class Search, class VocabularyT>
+void GenericModel<Search, VocabularyT>::ChecksumImage(std::size_t file_size, const void *data, const Config &config) {
+  if (!config.verify_threads && !config.expected_checksum) return;
+  checksum_ = ::util::Checksum(data, file_size, std::max(config.verify_threads, 1u));
+  UTIL_THROW_IF(config.expected_checksum && checksum_ != config.expected_checksum, FormatLoadException, "The model has checksum " << checksum_ << " but " << config.expected_checksum << " was expected.  The file is corrupt or is a different model.");
+}
+
+template <class Search, class VocabularyT>
+void GenericModel<Search, VocabularyT>::CopyImage(std::size_t file_size, const void *data, const Config &init_config) {
+  ChecksumImage(file_size, data, init_config);
+  std::vector<uint64_t> counts;
+  Config new_config(init_config);
+  std::size_t header_size = ReadHeader(file_size, data, counts, new_config);
+
+  // Same order as the file: header, vocabulary, then the search tables, but
+  // each on a fresh cache line.  The vocabulary strings at the end are unused.
+  std::size_t vocab_size = VocabularyT::Size(counts[0], new_config);
+  std::vector<uint64_t> table_sizes;
+  Search::TableSizes(counts, new_config, table_sizes);
+  std::size_t vocab_offset = CacheAlign(header_size);
+  std::vector<std::size_t> table_offsets;
+  std::size_t end = vocab_offset + vocab_size;
+  for (std::vector<uint64_t>::const_iterator i = table_sizes.begin(); i != table_sizes.end(); ++i) {
+    table_offsets.push_back(CacheAlign(end));
+    end = table_offsets.back() + ::util::CheckOverflow(*i);
+  }
+
+  allocation_ = ::util::AllocateImage(end, init_config.image_allocation, memory_);
+  if (allocation_ != init_config.image_allocation && init_config.messages) {
+    *init_config.messages << "Asked for " << ::util::AllocatePolicyName(init_config.image_allocation) << " to hold the model but got " << ::util::AllocatePolicyName(allocation_) << "." << std::endl;
+  }
+
+  uint8_t *base = static_cast<uint8_t*>(memory_.get());
+  const uint8_t *from = static_cast<const uint8_t*>(data);
+  std::memcpy(base, from, header_size);
+  from += header_size;
+  std::memcpy(base + vocab_offset, from, vocab_size);
+  from += vocab_size;
+  std::vector<uint8_t*> tables;
+  for (std::size_t i = 0; i < table_sizes.size(); ++i) {
+    tables.push_back(base + table_offsets[i]);
+    std::memcpy(tables.back(), from, table_sizes[i]);
+    from += table_sizes[i];
+  }
+
+  SetupSections(base + vocab_offset, vocab_size, &*tables.begin(), table_sizes, counts, new_config);
+  InitStates(new_config);
+}
 
+template <class Search, class VocabularyT>
+void GenericModel<Search, VocabularyT>::InitStates(const Config &config) {
   // g++ prints warnings unless these are fully initialized.
   State begin_sentence = State();
   begin_sentence.length = 1;
@@ -229,15 +399,51 @@ GenericModel<Search, VocabularyT>::GenericModel(size_t file_size, void *data, co
   State null_context = State();
   null_context.length = 0;
   P::Init(begin_sentence, null_context, vocab_, search_.Order());
+
+  if (config.warm_threads) {
+    std::vector<double> seconds;
+    WarmUp(config.warm_threads, seconds);
+    if (config.messages) {
+      for (std::size_t i = 0; i < sections_.size(); ++i) {
+        *config.messages << "Warmed " << sections_[i].name << " (" << sections_[i].size << " bytes) in " << seconds[i] << " s" << std::endl;
+      }
+    }
+  }
+  if (config.transition_bytes) transitions_.Compile(*this, config.transition_bytes);
+  if (config.transition_cache_bytes && transitions_.Empty()) cache_.Reset(config.transition_cache_bytes, begin_sentence);
 }
 
+namespace {
+// Each thread takes this much of a section at a time.
+const std::size_t kWarmChunk = 1 << 22;
+
+class WarmChunk {
+  public:
+    WarmChunk(const ImageSection &section) : section_(section) {}
+
+    void operator()(std::size_t chunk) const {
+      std::size_t begin = chunk * kWarmChunk;
+      ::util::TouchPages(section_.begin + begin, std::min(kWarmChunk, section_.size - begin));
+    }
+
+  private:
+    const ImageSection &section_;
+};
+} // namespace
+
 template <class Search, class VocabularyT>
-GenericModel<Search, VocabularyT>::~GenericModel() {
-  if (readen_content) {
-      std::free(readen_content);
+void GenericModel<Search, VocabularyT>::WarmUp(unsigned int threads, std::vector<double> &seconds) const {
+  seconds.clear();
+  for (std::vector<ImageSection>::const_iterator i = sections_.begin(); i != sections_.end(); ++i) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ::util::ParallelFor((i->size + kWarmChunk - 1) / kWarmChunk, threads, WarmChunk(*i));
+    seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
   }
 }
 
+template <class Search, class VocabularyT>
+GenericModel<Search, VocabularyT>::~GenericModel() {}
+
 template <class Search, class VocabularyT>
 FullScoreReturn GenericModel<Search, VocabularyT>::FullScore(const State &in_state, const WordIndex new_word, State &out_state) const {
   FullScoreReturn ret = ScoreExceptBackoff(in_state.words, in_state.words + in_state.length, new_word, out_state);
@@ -270,6 +476,7 @@ FullScoreReturn GenericModel<Search, VocabularyT>::ScoreExceptBackoff(
     const WordIndex new_word,
     State &out_state) const {
   assert(new_word < vocab_.Bound());
+  if (prefetch_orders_) search_.PrefetchContext(new_word, context_rbegin, context_rend);
   FullScoreReturn ret;
   // ret.ngram_length contains the last known non-blank ngram length.
   ret.ngram_length = 1;
@@ -318,9 +525,220 @@ void GenericModel<Search, VocabularyT>::ResumeScore(const WordIndex *hist_iter,
   }
 }
 
+/* ScoreExceptBackoff and ResumeScore cut into steps at each lookup, with the
+ * locals they would keep on the stack.  The arithmetic is theirs, in the same
+ * order, so the scores are bit for bit the same.
+ */
+template <class Search, class VocabularyT>
+struct GenericModel<Search, VocabularyT>::Lane {
+  enum Step { UNIGRAM, MIDDLE, LONGEST };
+  Step step;
+
+  std::size_t sentence;
+  // Words not scored yet.  The word at end is </s>.
+  const WordIndex *next, *end;
+  WordIndex word;
+  float total;
+
+  State in, out;
+  FullScoreReturn ret;
+  typename Search::Node node;
+  // The next order.  Its context word is in.words[order_minus_2].
+  unsigned char order_minus_2;
+};
+
+template <class Search, class VocabularyT>
+void GenericModel<Search, VocabularyT>::ScoreSentences(const WordIndex *const *sentences, const std::size_t *lengths, std::size_t count, float *out) const {
+  if (!transitions_.Empty()) {
+    for (std::size_t i = 0; i < count; ++i) {
+      out[i] = transitions_.ScoreSentence(sentences[i], lengths[i], vocab_.EndSentence());
+    }
+    return;
+  }
+  if (!cache_.Empty()) {
+    for (std::size_t i = 0; i < count; ++i) {
+      out[i] = cache_.ScoreSentence(*this, sentences[i], lengths[i]);
+    }
+    return;
+  }
+  Lane lanes[kScoreLanes];
+  std::size_t started = 0, busy = 0;
+  for (; busy < kScoreLanes && started < count; ++busy, ++started) {
+    StartSentence(lanes[busy], started, sentences[started], lengths[started]);
+  }
+  while (busy) {
+    for (std::size_t l = 0; l < busy; ) {
+      if (Advance(lanes[l])) {
+        ++l;
+        continue;
+      }
+      out[lanes[l].sentence] = lanes[l].total;
+      if (started < count) {
+        StartSentence(lanes[l], started, sentences[started], lengths[started]);
+        ++started;
+        ++l;
+      } else {
+        // Keep the busy lanes in front.  The one moved here has not had its
+        // turn in this pass.
+        lanes[l] = lanes[--busy];
+      }
+    }
+  }
+}
+
+template <class Search, class VocabularyT>
+void GenericModel<Search, VocabularyT>::StartSentence(Lane &lane, std::size_t sentence, const WordIndex *words, std::size_t length) const {
+  lane.sentence = sentence;
+  lane.next = words;
+  lane.end = words + length;
+  lane.total = 0.0;
+  lane.in = P::BeginSentenceState();
+  StartWord(lane);
+}
+
+template <class Search, class VocabularyT>
+void GenericModel<Search, VocabularyT>::StartWord(Lane &lane) const {
+  lane.word = (lane.next == lane.end) ? vocab_.EndSentence() : *lane.next;
+  assert(lane.word < vocab_.Bound());
+  search_.PrefetchUnigram(lane.word);
+  lane.step = Lane::UNIGRAM;
+}
+
+template <class Search, class VocabularyT>
+bool GenericModel<Search, VocabularyT>::Advance(Lane &lane) const {
+  FullScoreReturn &ret = lane.ret;
+  switch (lane.step) {
+    case Lane::UNIGRAM: {
+      ret.ngram_length = 1;
+      typename Search::UnigramPointer uni(search_.LookupUnigram(lane.word, lane.node, ret.independent_left, ret.extend_left));
+      lane.out.backoff[0] = uni.Backoff();
+      ret.prob = uni.Prob();
+      ret.rest = uni.Rest();
+      lane.out.length = HasExtension(lane.out.backoff[0]) ? 1 : 0;
+      lane.out.words[0] = lane.word;
+      lane.order_minus_2 = 0;
+      return ContinueWord(lane);
+    }
+    case Lane::MIDDLE: {
+      typename Search::MiddlePointer pointer(search_.LookupMiddle(lane.order_minus_2, lane.in.words[lane.order_minus_2], lane.node, ret.independent_left, ret.extend_left));
+      if (!pointer.Found()) return FinishWord(lane);
+      float &backoff = lane.out.backoff[lane.order_minus_2 + 1];
+      backoff = pointer.Backoff();
+      ret.prob = pointer.Prob();
+      ret.rest = pointer.Rest();
+      ret.ngram_length = lane.order_minus_2 + 2;
+      if (HasExtension(backoff)) {
+        lane.out.length = ret.ngram_length;
+      }
+      ++lane.order_minus_2;
+      return ContinueWord(lane);
+    }
+    case Lane::LONGEST: {
+      typename Search::LongestPointer longest(search_.LookupLongest(lane.in.words[lane.order_minus_2], lane.node));
+      if (longest.Found()) {
+        ret.prob = longest.Prob();
+        ret.rest = ret.prob;
+        ret.ngram_length = P::Order();
+      }
+      return FinishWord(lane);
+    }
+  }
+  return FinishWord(lane);
+}
+
+template <class Search, class VocabularyT>
+bool GenericModel<Search, VocabularyT>::ContinueWord(Lane &lane) const {
+  if (lane.order_minus_2 == lane.in.length) return FinishWord(lane);
+  if (lane.ret.independent_left) return FinishWord(lane);
+  if (lane.order_minus_2 == P::Order() - 2) {
+    lane.ret.independent_left = true;
+    search_.PrefetchLongest(lane.in.words[lane.order_minus_2], lane.node);
+    lane.step = Lane::LONGEST;
+  } else {
+    search_.PrefetchMiddle(lane.order_minus_2, lane.in.words[lane.order_minus_2], lane.node);
+    lane.step = Lane::MIDDLE;
+  }
+  return true;
+}
+
+template <class Search, class VocabularyT>
+bool GenericModel<Search, VocabularyT>::FinishWord(Lane &lane) const {
+  CopyRemainingHistory(lane.in.words, lane.out);
+  for (const float *i = lane.in.backoff + lane.ret.ngram_length - 1; i < lane.in.backoff + lane.in.length; ++i) {
+    lane.ret.prob += *i;
+  }
+  lane.total += lane.ret.prob;
+  if (lane.next == lane.end) return false;
+  ++lane.next;
+  lane.in = lane.out;
+  StartWord(lane);
+  return true;
+}
+
 template class GenericModel<HashedSearch<BackoffValue>, ProbingVocabulary>;
+template class GenericModel<HashedSearch<QuantizedValue>, ProbingVocabulary>;
+template class GenericModel<trie::TrieSearch<DontQuantize>, ProbingVocabulary>;
+template class GenericModel<trie::TrieSearch<SeparatelyQuantize>, ProbingVocabulary>;
+template class GenericModel<HashedSearch<FingerprintValue<uint32_t> >, ProbingVocabulary>;
+template class GenericModel<HashedSearch<FingerprintValue<uint16_t> >, ProbingVocabulary>;
+template class GenericModel<HashedSearch<BackoffValue>, MphVocabulary>;
+template class GenericModel<HashedSearch<QuantizedValue>, MphVocabulary>;
+template class GenericModel<trie::TrieSearch<DontQuantize>, MphVocabulary>;
+template class GenericModel<trie::TrieSearch<SeparatelyQuantize>, MphVocabulary>;
+template class GenericModel<HashedSearch<FingerprintValue<uint32_t> >, MphVocabulary>;
+template class GenericModel<HashedSearch<FingerprintValue<uint16_t> >, MphVocabulary>;
+template class GenericModel<HashedSearch<BackoffValue, BlockedLayout>, ProbingVocabulary>;
+template class GenericModel<HashedSearch<QuantizedValue, BlockedLayout>, ProbingVocabulary>;
+template class GenericModel<HashedSearch<FingerprintValue<uint32_t>, BlockedLayout>, ProbingVocabulary>;
+template class GenericModel<HashedSearch<FingerprintValue<uint16_t>, BlockedLayout>, ProbingVocabulary>;
+template class GenericModel<HashedSearch<BackoffValue, BlockedLayout>, MphVocabulary>;
+template class GenericModel<HashedSearch<QuantizedValue, BlockedLayout>, MphVocabulary>;
+template class GenericModel<HashedSearch<FingerprintValue<uint32_t>, BlockedLayout>, MphVocabulary>;
+template class GenericModel<HashedSearch<FingerprintValue<uint16_t>, BlockedLayout>, MphVocabulary>;
 
 } // namespace detail
 
+bool RecognizeBinary(std::size_t size, const void *data, ModelType &recognized) {
+  unsigned int search_version;
+  return RecognizeBinary(size, data, recognized, search_version);
+}
+
+bool RecognizeBinary(std::size_t size, const void *data, ModelType &recognized, unsigned int &search_version) {
+  if (!detail::IsBinaryFormat(size, const_cast<void*>(data)) || size < sizeof(detail::Sanity) + sizeof(detail::FixedWidthParameters)) return false;
+  detail::FixedWidthParameters fixed;
+  std::memcpy(&fixed, static_cast<const uint8_t*>(data) + sizeof(detail::Sanity), sizeof(detail::FixedWidthParameters));
+  recognized = fixed.model_type;
+  search_version = fixed.search_version;
+  return true;
+}
+
+bool RecognizeBinary(const char *file, ModelType &recognized) {
+  unsigned int search_version;
+  return RecognizeBinary(file, recognized, search_version);
+}
+
+bool RecognizeBinary(const char *file, ModelType &recognized, unsigned int &search_version) {
+  try {
+    ::util::scoped_fd fd(::util::OpenReadOrThrow(file));
+    uint8_t header[sizeof(detail::Sanity) + sizeof(detail::FixedWidthParameters)];
+    std::size_t got = ::util::ReadOrEOF(fd.get(), header, sizeof(header));
+    return RecognizeBinary(got, header, recognized, search_version);
+  } catch (::util::Exception &e) {
+    e << " File: " << file;
+    throw;
+  }
+}
+
+bool RecognizeSegment(const char *name, ModelType &recognized) {
+  unsigned int search_version;
+  return RecognizeSegment(name, recognized, search_version);
+}
+
+bool RecognizeSegment(const char *name, ModelType &recognized, unsigned int &search_version) {
+  ::util::scoped_memory segment;
+  ::util::PublishOrAttachSegment(name, NULL, 0, sizeof(detail::Sanity), segment);
+  return RecognizeBinary(segment.size(), segment.get(), recognized, search_version);
+}
+
 } // namespace ngram
 } // namespace lm
@@ -2,15 +2,45 @@
 #define LM_MODEL_H
 
 #include "lm/config.hh"
+#include "lm/quantize.hh"
 #include "lm/search_hashed.hh"
+#include "lm/search_trie.hh"
 #include "lm/state.hh"
+#include "lm/transition_cache.hh"
+#include "lm/transition_table.hh"
 #include "lm/value.hh"
 #include "lm/vocab.hh"
+#include "util/mmap.hh"
 
 #include <algorithm>
+#include <string>
 #include <vector>
 
 namespace lm {
+namespace ngram {
+
+// A named piece of a loaded model: the vocabulary or the table of one order.
+struct ImageSection {
+  std::string name;
+  const uint8_t *begin;
+  std::size_t size;
+};
+
+/* Is this a binary model, and of which type?  Returns false for anything
+ * else (such as ARPA).  Throws FormatLoadException for binary files from an
+ * incompatible version.  Use it to pick the class to load with, together
+ * with search_version (the class's kVersion) where a type has several.
+ */
+bool RecognizeBinary(std::size_t size, const void *data, ModelType &recognized);
+bool RecognizeBinary(std::size_t size, const void *data, ModelType &recognized, unsigned int &search_version);
+bool RecognizeBinary(const char *file, ModelType &recognized);
+bool RecognizeBinary(const char *file, ModelType &recognized, unsigned int &search_version);
+// The shared memory segment name (see Config::SHARE_DATA), once published.
+bool RecognizeSegment(const char *name, ModelType &recognized);
+bool RecognizeSegment(const char *name, ModelType &recognized, unsigned int &search_version);
+
+} // namespace ngram
+
 namespace base {
 
 // Common model interface that depends on knowing the specific classes.
@@ -86,10 +116,23 @@ class GenericModel : public base::ModelFacade<GenericModel<Search, VocabularyT>,
      */
     static uint64_t Size(const std::vector<uint64_t> &counts, const Config &config = Config());
 
-    /* Load the model from a file. Binary files must have the format expected by this class
-     * or you'll get an exception.
+    /* Load the model from an in-memory image of a binary file.  Binary files
+     * must have the format expected by this class or you'll get an exception.
+     * The image is copied unless config.data_method says to borrow it (the
+     * tables point straight into data) or to share it between processes.
+     *
+     * Anything that is not a binary file is taken for ARPA text and built
+     * into a model of this type on config.arpa_threads threads, or loaded
+     * from config.arpa_cache.  A built model owns its image, so borrowing
+     * only applies to binaries.
      */
     explicit GenericModel(size_t file_size, void *data, const Config &config = Config());
+
+    /* Load the model from a binary file on disk.  By default the file is
+     * mapped read-only and paged in on demand; see config.load_method and
+     * config.map_advice.  ARPA files are handled as by the constructor above.
+     */
+    explicit GenericModel(const char *file, const Config &config = Config());
     ~GenericModel();
 
     /* Score p(new_word | in_state) and incorporate new_word into out_state.
@@ -98,20 +141,122 @@ class GenericModel : public base::ModelFacade<GenericModel<Search, VocabularyT>,
      */
     FullScoreReturn FullScore(const State &in_state, const WordIndex new_word, State &out_state) const;
 
+    /* Score count sentences of word ids, each from BeginSentenceState() and
+     * ending with </s>: out[i] is the sum of FullScore(...).prob over the
+     * lengths[i] words at sentences[i] and </s>, added in the same order, so
+     * it is exactly what scoring word by word gives.  Every id must be below
+     * GetVocabulary().Bound().
+     *
+     * One sentence waits on each lookup before it can work out the next, so
+     * kScoreLanes sentences are kept in flight instead.  A sentence prefetches
+     * its next lookup and yields to the others; when its turn comes back the
+     * memory is there and the lookup is resolved.  This pays off for tables
+     * much bigger than the cache.  With Transitions() each word is one
+     * lookup in it instead.
+     */
+    void ScoreSentences(const WordIndex *const *sentences, const std::size_t *lengths, std::size_t count, float *out) const;
+
+    static const std::size_t kScoreLanes = 8;
+
+    // How the private copy of the image was allocated, after any fallback.
+    // ALLOCATE_MALLOC also covers images that were mapped, borrowed or shared.
+    util::AllocatePolicy ImageAllocation() const { return allocation_; }
+
+    // The vocabulary, then the table of each order from unigrams up.
+    const std::vector<ImageSection> &Sections() const { return sections_; }
+
+    /* Touch every page of every section, splitting each section across
+     * threads.  Sets seconds[i] to the time taken for Sections()[i].
+     */
+    void WarmUp(unsigned int threads, std::vector<double> &seconds) const;
+
+    // util::Checksum of the binary file, or 0 if loaded without
+    // verify_threads or expected_checksum.
+    uint64_t ImageChecksum() const { return checksum_; }
+
+    // Every state and word scored in advance if the model is small enough
+    // for Config::transition_bytes, else empty.
+    const TransitionTable &Transitions() const { return transitions_; }
+
+    // Transitions remembered as they are scored, for
+    // Config::transition_cache_bytes, else empty.
+    const TransitionCache &Cache() const { return cache_; }
+
   private:
     FullScoreReturn ScoreExceptBackoff(const WordIndex *const context_rbegin, const WordIndex *const context_rend, const WordIndex new_word, State &out_state) const;
 
     // Score bigrams and above.  Do not include backoff.
     void ResumeScore(const WordIndex *context_rbegin, const WordIndex *const context_rend, unsigned char starting_order_minus_2, typename Search::Node &node, float *backoff_out, unsigned char &next_use, FullScoreReturn &ret) const;
 
+    // A sentence in flight in ScoreSentences.
+    struct Lane;
+
+    void StartSentence(Lane &lane, std::size_t sentence, const WordIndex *words, std::size_t length) const;
+
+    // Prefetch what the next word's unigram lookup needs.
+    void StartWord(Lane &lane) const;
+
+    // Do the lookup the lane prefetched, and the bookkeeping after it, up to
+    // prefetching the next one.  Returns false once the sentence is scored.
+    bool Advance(Lane &lane) const;
+
+    // ResumeScore's stopping rules: finish the word or prefetch the next order.
+    bool ContinueWord(Lane &lane) const;
+
+    // FullScore's backoff for the finished word; then move on to the next.
+    bool FinishWord(Lane &lane) const;
+
     // Appears after Size in the cc file.
     void SetupMemory(void *start, const std::vector<uint64_t> &counts, const Config &config);
 
+    // Check the header of an image.  Fills in counts and the parameters
+    // stored in the file, and returns the header size.
+    static std::size_t ReadHeader(std::size_t file_size, const void *image, std::vector<uint64_t> &counts, Config &config);
+
+    // The (size, data) and (file) constructors for binary images.
+    void LoadMemory(size_t file_size, void *data, const Config &config);
+    void LoadFile(const char *file, const Config &config);
+
+    // Build the image from ARPA text, or load it from config.arpa_cache.
+    void LoadArpa(const StringPiece &text, const Config &config);
+
+    // Check the header of memory_ and point the vocabulary and search at it.
+    void LoadImage(const Config &config);
+
+    // Copy an image into memory_ under config.image_allocation, starting
+    // every table on a cache line, and point the vocabulary and search at it.
+    void CopyImage(std::size_t file_size, const void *data, const Config &config);
+
+    // Checksum the binary file if config asks for it.
+    void ChecksumImage(std::size_t file_size, const void *data, const Config &config);
+
+    // Point vocab_ and search_ at their memory and remember the sections.
+    // Verifies them first if config.verify_threads is set.
+    void SetupSections(uint8_t *vocab, std::size_t vocab_size, uint8_t *const *tables, const std::vector<uint64_t> &table_sizes, const std::vector<uint64_t> &counts, const Config &config);
+
+    // Called once the vocabulary and search are set up.  Also warms the
+    // image and compiles Transitions() if config asks.
+    void InitStates(const Config &config);
+
     VocabularyT vocab_;
 
     Search search_;
 
-    uint8_t *readen_content;
+    // The whole binary image, header included.
+    util::scoped_memory memory_;
+
+    util::AllocatePolicy allocation_;
+
+    // See Config::prefetch_orders.
+    bool prefetch_orders_;
+
+    std::vector<ImageSection> sections_;
+
+    uint64_t checksum_;
+
+    TransitionTable transitions_;
+
+    TransitionCache cache_;
 };
 
 } // namespace detail
@@ -123,6 +268,306 @@ public:
         detail::GenericModel<detail::HashedSearch<BackoffValue>, ProbingVocabulary>(file_size, data, config)
     {
     }
+
+    explicit ProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<BackoffValue>, ProbingVocabulary>(file, config)
+    {
+    }
+};
+
+// Same tables, with probabilities and backoffs quantized (see lm/quantize.hh).
+class QuantProbingModel : public detail::GenericModel<detail::HashedSearch<QuantizedValue>, ProbingVocabulary> {
+public:
+    QuantProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<QuantizedValue>, ProbingVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit QuantProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<QuantizedValue>, ProbingVocabulary>(file, config)
+    {
+    }
+};
+
+// Sorted bit-packed trie (see lm/search_trie.hh): much smaller, slower lookups.
+class TrieModel : public detail::GenericModel<trie::TrieSearch<DontQuantize>, ProbingVocabulary> {
+public:
+    TrieModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<trie::TrieSearch<DontQuantize>, ProbingVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit TrieModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<trie::TrieSearch<DontQuantize>, ProbingVocabulary>(file, config)
+    {
+    }
+};
+
+// The trie with quantized probabilities and backoffs, smaller still.
+class QuantTrieModel : public detail::GenericModel<trie::TrieSearch<SeparatelyQuantize>, ProbingVocabulary> {
+public:
+    QuantTrieModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<trie::TrieSearch<SeparatelyQuantize>, ProbingVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit QuantTrieModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<trie::TrieSearch<SeparatelyQuantize>, ProbingVocabulary>(file, config)
+    {
+    }
+};
+
+// Probing tables keyed by fingerprints (see lm/value.hh): smaller entries,
+// rare false positives.
+class Fingerprint32ProbingModel : public detail::GenericModel<detail::HashedSearch<FingerprintValue<uint32_t> >, ProbingVocabulary> {
+public:
+    Fingerprint32ProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint32_t> >, ProbingVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit Fingerprint32ProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint32_t> >, ProbingVocabulary>(file, config)
+    {
+    }
+};
+
+class Fingerprint16ProbingModel : public detail::GenericModel<detail::HashedSearch<FingerprintValue<uint16_t> >, ProbingVocabulary> {
+public:
+    Fingerprint16ProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint16_t> >, ProbingVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit Fingerprint16ProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint16_t> >, ProbingVocabulary>(file, config)
+    {
+    }
+};
+
+// The models above with the perfect hash vocabulary (see lm/vocab.hh).
+// Same lookups, smaller vocabulary.
+class MphProbingModel : public detail::GenericModel<detail::HashedSearch<BackoffValue>, MphVocabulary> {
+public:
+    MphProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<BackoffValue>, MphVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit MphProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<BackoffValue>, MphVocabulary>(file, config)
+    {
+    }
+};
+
+class MphQuantProbingModel : public detail::GenericModel<detail::HashedSearch<QuantizedValue>, MphVocabulary> {
+public:
+    MphQuantProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<QuantizedValue>, MphVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit MphQuantProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<QuantizedValue>, MphVocabulary>(file, config)
+    {
+    }
+};
+
+class MphTrieModel : public detail::GenericModel<trie::TrieSearch<DontQuantize>, MphVocabulary> {
+public:
+    MphTrieModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<trie::TrieSearch<DontQuantize>, MphVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit MphTrieModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<trie::TrieSearch<DontQuantize>, MphVocabulary>(file, config)
+    {
+    }
+};
+
+class MphQuantTrieModel : public detail::GenericModel<trie::TrieSearch<SeparatelyQuantize>, MphVocabulary> {
+public:
+    MphQuantTrieModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<trie::TrieSearch<SeparatelyQuantize>, MphVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit MphQuantTrieModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<trie::TrieSearch<SeparatelyQuantize>, MphVocabulary>(file, config)
+    {
+    }
+};
+
+class MphFingerprint32ProbingModel : public detail::GenericModel<detail::HashedSearch<FingerprintValue<uint32_t> >, MphVocabulary> {
+public:
+    MphFingerprint32ProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint32_t> >, MphVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit MphFingerprint32ProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint32_t> >, MphVocabulary>(file, config)
+    {
+    }
+};
+
+class MphFingerprint16ProbingModel : public detail::GenericModel<detail::HashedSearch<FingerprintValue<uint16_t> >, MphVocabulary> {
+public:
+    MphFingerprint16ProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint16_t> >, MphVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit MphFingerprint16ProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint16_t> >, MphVocabulary>(file, config)
+    {
+    }
+};
+
+// The probing models above with the blocked layout (see detail::BlockedLayout),
+// search version 1: the same tables, probed several buckets at a time.
+class BlockedProbingModel : public detail::GenericModel<detail::HashedSearch<BackoffValue, detail::BlockedLayout>, ProbingVocabulary> {
+public:
+    BlockedProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<BackoffValue, detail::BlockedLayout>, ProbingVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit BlockedProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<BackoffValue, detail::BlockedLayout>, ProbingVocabulary>(file, config)
+    {
+    }
+};
+
+class BlockedQuantProbingModel : public detail::GenericModel<detail::HashedSearch<QuantizedValue, detail::BlockedLayout>, ProbingVocabulary> {
+public:
+    BlockedQuantProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<QuantizedValue, detail::BlockedLayout>, ProbingVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit BlockedQuantProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<QuantizedValue, detail::BlockedLayout>, ProbingVocabulary>(file, config)
+    {
+    }
+};
+
+class BlockedFingerprint32ProbingModel : public detail::GenericModel<detail::HashedSearch<FingerprintValue<uint32_t>, detail::BlockedLayout>, ProbingVocabulary> {
+public:
+    BlockedFingerprint32ProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint32_t>, detail::BlockedLayout>, ProbingVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit BlockedFingerprint32ProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint32_t>, detail::BlockedLayout>, ProbingVocabulary>(file, config)
+    {
+    }
+};
+
+class BlockedFingerprint16ProbingModel : public detail::GenericModel<detail::HashedSearch<FingerprintValue<uint16_t>, detail::BlockedLayout>, ProbingVocabulary> {
+public:
+    BlockedFingerprint16ProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint16_t>, detail::BlockedLayout>, ProbingVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit BlockedFingerprint16ProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint16_t>, detail::BlockedLayout>, ProbingVocabulary>(file, config)
+    {
+    }
+};
+
+class MphBlockedProbingModel : public detail::GenericModel<detail::HashedSearch<BackoffValue, detail::BlockedLayout>, MphVocabulary> {
+public:
+    MphBlockedProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<BackoffValue, detail::BlockedLayout>, MphVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit MphBlockedProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<BackoffValue, detail::BlockedLayout>, MphVocabulary>(file, config)
+    {
+    }
+};
+
+class MphBlockedQuantProbingModel : public detail::GenericModel<detail::HashedSearch<QuantizedValue, detail::BlockedLayout>, MphVocabulary> {
+public:
+    MphBlockedQuantProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<QuantizedValue, detail::BlockedLayout>, MphVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit MphBlockedQuantProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<QuantizedValue, detail::BlockedLayout>, MphVocabulary>(file, config)
+    {
+    }
+};
+
+class MphBlockedFingerprint32ProbingModel : public detail::GenericModel<detail::HashedSearch<FingerprintValue<uint32_t>, detail::BlockedLayout>, MphVocabulary> {
+public:
+    MphBlockedFingerprint32ProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint32_t>, detail::BlockedLayout>, MphVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit MphBlockedFingerprint32ProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint32_t>, detail::BlockedLayout>, MphVocabulary>(file, config)
+    {
+    }
+};
+
+class MphBlockedFingerprint16ProbingModel : public detail::GenericModel<detail::HashedSearch<FingerprintValue<uint16_t>, detail::BlockedLayout>, MphVocabulary> {
+public:
+    MphBlockedFingerprint16ProbingModel(size_t file_size, void *data, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint16_t>, detail::BlockedLayout>, MphVocabulary>(file_size, data, config)
+    {
+    }
+
+    explicit MphBlockedFingerprint16ProbingModel(const char *file, const Config &config = Config())
+    :
+        detail::GenericModel<detail::HashedSearch<FingerprintValue<uint16_t>, detail::BlockedLayout>, MphVocabulary>(file, config)
+    {
+    }
 };
 
 } // namespace ngram
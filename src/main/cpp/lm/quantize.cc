@@ -0,0 +1,110 @@
+#include "lm/quantize.hh"
+
+#include "lm/lm_exception.hh"
+
+#include <algorithm>
+#include <numeric>
+
+namespace lm {
+namespace ngram {
+
+namespace {
+
+const uint8_t kSeparatelyQuantizeVersion = 1;
+
+// Sort values and split them into bins equal in count, each represented by its
+// mean.  With fewer values than bins, empty bins repeat a neighbor so the
+// centers stay sorted and finite.
+void MakeBins(std::vector<float> &values, float *centers, uint32_t bins) {
+  std::sort(values.begin(), values.end());
+  std::vector<float>::const_iterator start = values.begin(), finish;
+  bool seen = false;
+  for (uint32_t i = 0; i < bins; ++i, start = finish) {
+    finish = values.begin() + ((values.size() * static_cast<uint64_t>(i + 1)) / bins);
+    if (finish == start) {
+      centers[i] = i ? centers[i - 1] : 0.0;
+    } else {
+      centers[i] = std::accumulate(start, finish, 0.0) / static_cast<float>(finish - start);
+      if (!seen) std::fill(centers, centers + i, centers[i]);
+      seen = true;
+    }
+  }
+}
+
+} // namespace
+
+void SeparatelyQuantize::CheckBits(uint8_t prob_bits, uint8_t backoff_bits) {
+  UTIL_THROW_IF(prob_bits < 1 || prob_bits > 16, ConfigException, "Quantization needs 1 to 16 probability bits, not " << static_cast<unsigned int>(prob_bits));
+  UTIL_THROW_IF(backoff_bits < 2 || backoff_bits > 16, ConfigException, "Quantization needs 2 to 16 backoff bits, not " << static_cast<unsigned int>(backoff_bits));
+  UTIL_THROW_IF(prob_bits + backoff_bits > 31, ConfigException, "Quantized probability and backoff share 31 bits, but " << static_cast<unsigned int>(prob_bits) << " + " << static_cast<unsigned int>(backoff_bits) << " were requested");
+}
+
+void SeparatelyQuantize::UpdateConfigFromBinary(const uint8_t *start, std::size_t available, Config &config) {
+  UTIL_THROW_IF(available < kHeaderSize, FormatLoadException, "The file ends before the quantization header");
+  UTIL_THROW_IF(start[0] != kSeparatelyQuantizeVersion, FormatLoadException, "This file has quantization version " << static_cast<unsigned int>(start[0]) << " but the code expects version " << static_cast<unsigned int>(kSeparatelyQuantizeVersion));
+  try {
+    CheckBits(start[1], start[2]);
+  } catch (const ConfigException &e) {
+    UTIL_THROW(FormatLoadException, "Bad quantization header: " << e.what());
+  }
+  config.prob_bits = start[1];
+  config.backoff_bits = start[2];
+}
+
+void SeparatelyQuantize::SetupMemory(void *base, unsigned char order, const Config &config) {
+  CheckBits(config.prob_bits, config.backoff_bits);
+  start_ = static_cast<uint8_t*>(base);
+  order_ = order;
+  prob_bits_ = config.prob_bits;
+  backoff_bits_ = config.backoff_bits;
+  prob_mask_ = (1U << prob_bits_) - 1;
+  backoff_mask_ = (1U << backoff_bits_) - 1;
+  float *centers = reinterpret_cast<float*>(start_ + kHeaderSize);
+  for (unsigned char i = 0; i + 2 < order; ++i) {
+    tables_[i][0] = Bins(prob_bits_, centers);
+    centers += 1U << prob_bits_;
+    tables_[i][1] = Bins(backoff_bits_, centers);
+    centers += 1U << backoff_bits_;
+  }
+  longest_ = Bins(prob_bits_, centers);
+}
+
+void SeparatelyQuantize::Train(unsigned char order, std::vector<float> &prob, std::vector<float> &backoff) {
+  MakeBins(prob, tables_[order - 2][0].Populate(), 1U << prob_bits_);
+  float *centers = tables_[order - 2][1].Populate();
+  centers[kNoExtensionQuant] = -0.0;
+  centers[kExtensionQuant] = 0.0;
+  // Zeros have their own codes.
+  backoff.erase(std::remove(backoff.begin(), backoff.end(), 0.0f), backoff.end());
+  MakeBins(backoff, centers + 2, (1U << backoff_bits_) - 2);
+}
+
+void SeparatelyQuantize::TrainProb(unsigned char order, std::vector<float> &prob) {
+  MakeBins(prob, (order == order_ ? longest_ : tables_[order - 2][0]).Populate(), 1U << prob_bits_);
+}
+
+void SeparatelyQuantize::FinishedLoading(const Config &config) {
+  std::fill(start_, start_ + kHeaderSize, 0);
+  start_[0] = kSeparatelyQuantizeVersion;
+  start_[1] = config.prob_bits;
+  start_[2] = config.backoff_bits;
+}
+
+void SeparatelyQuantize::CheckConsistency() const {
+  for (unsigned char i = 0; i + 2 < order_; ++i) {
+    for (const float *c = tables_[i][0].begin(); c != tables_[i][0].end(); ++c) {
+      UTIL_THROW_IF(!std::isfinite(*c) || *c > 0.0, FormatLoadException, "Bad probability center in order " << (i + 2));
+    }
+    const float *c = tables_[i][1].begin();
+    UTIL_THROW_IF(!(c[kNoExtensionQuant] == 0.0 && std::signbit(c[kNoExtensionQuant]) && c[kExtensionQuant] == 0.0 && !std::signbit(c[kExtensionQuant])), FormatLoadException, "The reserved backoff centers of order " << (i + 2) << " are not -0.0 and 0.0");
+    for (; c != tables_[i][1].end(); ++c) {
+      UTIL_THROW_IF(!std::isfinite(*c), FormatLoadException, "Bad backoff center in order " << (i + 2));
+    }
+  }
+  for (const float *c = longest_.begin(); c != longest_.end(); ++c) {
+    UTIL_THROW_IF(!std::isfinite(*c) || *c > 0.0, FormatLoadException, "Bad probability center in order " << static_cast<unsigned int>(order_));
+  }
+}
+
+} // namespace ngram
+} // namespace lm
@@ -0,0 +1,319 @@
+#ifndef LM_QUANTIZE_H
+#define LM_QUANTIZE_H
+
+#include "lm/config.hh"
+#include "lm/max_order.hh"
+#include "lm/search_hashed.hh"
+#include "lm/value.hh"
+#include "util/bit_packing.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <stdint.h>
+
+namespace lm {
+namespace ngram {
+
+/* Values of the bit-packed trie (see lm/search_trie.hh) stored as they are:
+ * a probability without its sign bit, since it is never positive, and for
+ * middle orders a backoff after it.
+ */
+class DontQuantize {
+  public:
+    static const bool kStored = false;
+    static const ModelType kTrieModelType = PACKED_TRIE;
+
+    static uint64_t Size(unsigned char /*order*/, const Config &/*config*/) { return 0; }
+
+    static void UpdateConfigFromBinary(const uint8_t * /*start*/, std::size_t /*available*/, Config &/*config*/) {}
+
+    static uint8_t MiddleBits(const Config &/*config*/) { return 63; }
+    static uint8_t LongestBits(const Config &/*config*/) { return 31; }
+
+    void SetupMemory(void * /*start*/, unsigned char /*order*/, const Config &/*config*/) {}
+
+    // Building: nothing to train.
+    void Train(unsigned char /*order*/, std::vector<float> &/*prob*/, std::vector<float> &/*backoff*/) {}
+    void TrainProb(unsigned char /*order*/, std::vector<float> &/*prob*/) {}
+    void FinishedLoading(const Config &/*config*/) {}
+
+    void CheckConsistency() const {}
+
+    float MiddleProb(unsigned char /*order_minus_2*/, const util::BitAddress &address) const {
+      return util::ReadNonPositiveFloat31(address.base, address.offset);
+    }
+
+    float MiddleBackoff(unsigned char /*order_minus_2*/, const util::BitAddress &address) const {
+      return util::ReadFloat32(address.base, address.offset + 31);
+    }
+
+    float LongestProb(const util::BitAddress &address) const {
+      return util::ReadNonPositiveFloat31(address.base, address.offset);
+    }
+
+    void WriteMiddle(unsigned char /*order_minus_2*/, const util::BitAddress &address, float prob, float backoff) const {
+      util::WriteNonPositiveFloat31(address.base, address.offset, prob);
+      util::WriteFloat32(address.base, address.offset + 31, backoff);
+    }
+
+    void WriteLongest(const util::BitAddress &address, float prob) const {
+      util::WriteNonPositiveFloat31(address.base, address.offset, prob);
+    }
+
+    bool ValidMiddle(unsigned char order_minus_2, const util::BitAddress &address) const {
+      return std::isfinite(MiddleProb(order_minus_2, address)) && std::isfinite(MiddleBackoff(order_minus_2, address));
+    }
+
+    bool ValidLongest(const util::BitAddress &address) const {
+      return std::isfinite(LongestProb(address));
+    }
+};
+
+/* Binned probabilities and backoffs, as in upstream KenLM's quantized trie.
+ * Every order above unigrams has its own codebook of 2^prob_bits probability
+ * centers and 2^backoff_bits backoff centers.  Training sorts the values and
+ * splits them into bins holding equal numbers of values; each bin decodes to
+ * its mean.  Backoff codes 0 and 1 are reserved for -0.0 and 0.0 so the
+ * extension information in the sign of a zero backoff survives.
+ *
+ * Image: an 8 byte header (version, prob_bits, backoff_bits), then for each
+ * middle order its probability centers and backoff centers, then the longest
+ * order's probability centers, all as floats.
+ *
+ * QuantizedValue packs the codes into probing entries; the bit-packed trie
+ * reads them from its records through MiddleProb and friends.
+ */
+class SeparatelyQuantize {
+  public:
+    static const bool kStored = true;
+    static const ModelType kTrieModelType = QUANT_PACKED_TRIE;
+
+    static const uint32_t kNoExtensionQuant = 0;
+    static const uint32_t kExtensionQuant = 1;
+
+    class Bins {
+      public:
+        Bins() : begin_(NULL), end_(NULL) {}
+
+        Bins(uint8_t bits, float *begin) : begin_(begin), end_(begin + (1U << bits)) {}
+
+        float *Populate() { return begin_; }
+
+        const float *begin() const { return begin_; }
+        const float *end() const { return end_; }
+
+        uint32_t EncodeProb(float value) const {
+          return Nearest(begin_, end_, value);
+        }
+
+        uint32_t EncodeBackoff(float value) const {
+          if (value == 0.0) {
+            return std::signbit(value) ? kNoExtensionQuant : kExtensionQuant;
+          }
+          return 2 + Nearest(begin_ + 2, end_, value);
+        }
+
+        float Decode(uint32_t code) const { return begin_[code]; }
+
+      private:
+        // Index of the center closest to value in sorted [begin, end).
+        static uint32_t Nearest(const float *begin, const float *end, float value) {
+          const float *above = std::lower_bound(begin, end, value);
+          if (above == begin) return 0;
+          if (above == end) return end - begin - 1;
+          return above - begin - (value - *(above - 1) < *above - value);
+        }
+
+        float *begin_, *end_;
+    };
+
+    // Throws ConfigException unless the bits fit the entry formats.
+    static void CheckBits(uint8_t prob_bits, uint8_t backoff_bits);
+
+    static uint64_t Size(unsigned char order, const Config &config) {
+      uint64_t longest_table = (1ULL << config.prob_bits) * sizeof(float);
+      uint64_t middle_table = (1ULL << config.backoff_bits) * sizeof(float) + longest_table;
+      return ALIGN8(kHeaderSize + (order > 2 ? order - 2 : 0) * middle_table + longest_table);
+    }
+
+    // Read the bits the image was built with into config.
+    static void UpdateConfigFromBinary(const uint8_t *start, std::size_t available, Config &config);
+
+    SeparatelyQuantize() : prob_bits_(0), backoff_bits_(0), prob_mask_(0), backoff_mask_(0) {}
+
+    void SetupMemory(void *start, unsigned char order, const Config &config);
+
+    // Building: set up memory, train every order, then FinishedLoading.
+    // Middle order probabilities are trained with the sign bit set, as
+    // ProbingProxy returns them.  The vectors are sorted in place.
+    void Train(unsigned char order, std::vector<float> &prob, std::vector<float> &backoff);
+    void TrainProb(unsigned char order, std::vector<float> &prob);
+    void FinishedLoading(const Config &config);
+
+    // Checks the codebooks for values that cannot come from training.
+    void CheckConsistency() const;
+
+    const Bins *GetTables(unsigned char order_minus_2) const { return tables_[order_minus_2]; }
+    const Bins &LongestTable() const { return longest_; }
+
+    // Bits each bit-packed trie record spends on values.
+    static uint8_t MiddleBits(const Config &config) { return config.prob_bits + config.backoff_bits; }
+    static uint8_t LongestBits(const Config &config) { return config.prob_bits; }
+
+    // A trie record holds the probability code, then the backoff code.
+    float MiddleProb(unsigned char order_minus_2, const util::BitAddress &address) const {
+      return tables_[order_minus_2][0].Decode(util::ReadInt25(address.base, address.offset, prob_bits_, prob_mask_));
+    }
+
+    float MiddleBackoff(unsigned char order_minus_2, const util::BitAddress &address) const {
+      return tables_[order_minus_2][1].Decode(util::ReadInt25(address.base, address.offset + prob_bits_, backoff_bits_, backoff_mask_));
+    }
+
+    float LongestProb(const util::BitAddress &address) const {
+      return longest_.Decode(util::ReadInt25(address.base, address.offset, prob_bits_, prob_mask_));
+    }
+
+    void WriteMiddle(unsigned char order_minus_2, const util::BitAddress &address, float prob, float backoff) const {
+      uint64_t code = tables_[order_minus_2][0].EncodeProb(-std::fabs(prob)) | (static_cast<uint64_t>(tables_[order_minus_2][1].EncodeBackoff(backoff)) << prob_bits_);
+      util::WriteInt57(address.base, address.offset, prob_bits_ + backoff_bits_, code);
+    }
+
+    void WriteLongest(const util::BitAddress &address, float prob) const {
+      util::WriteInt57(address.base, address.offset, prob_bits_, longest_.EncodeProb(prob));
+    }
+
+    // Every code decodes to a center, and CheckConsistency checks those.
+    bool ValidMiddle(unsigned char /*order_minus_2*/, const util::BitAddress &/*address*/) const { return true; }
+    bool ValidLongest(const util::BitAddress &/*address*/) const { return true; }
+
+    uint8_t ProbBits() const { return prob_bits_; }
+    uint32_t ProbMask() const { return prob_mask_; }
+    uint32_t BackoffMask() const { return backoff_mask_; }
+
+  private:
+    static const std::size_t kHeaderSize = 8;
+
+    Bins tables_[KENLM_MAX_ORDER - 1][2];
+
+    Bins longest_;
+
+    uint8_t *start_;
+    unsigned char order_;
+
+    uint8_t prob_bits_, backoff_bits_;
+    uint32_t prob_mask_, backoff_mask_;
+};
+
+/* Probing hash tables holding quantized values.  Unigrams keep full
+ * precision.  A middle entry packs the probability code in the low
+ * prob_bits, the backoff code above it, and the independent left flag (the
+ * sign bit of BackoffValue's probability) in the top bit, so it needs
+ * prob_bits + backoff_bits <= 31.  A longest entry holds only a probability
+ * code.  Entries shrink from 16 to 12 and from 12 to 10 bytes.
+ */
+struct QuantizedValue {
+  typedef ProbBackoff Weights;
+  static const ModelType kProbingModelType = QUANT_PROBING;
+
+  typedef BackoffValue::ProbingProxy ProbingProxy;
+
+  static const uint32_t kIndependentLeft = 0x80000000;
+
+#pragma pack(push)
+#pragma pack(4)
+  struct ProbingEntry {
+    typedef uint64_t Key;
+    typedef uint32_t Value;
+    uint64_t key;
+    uint32_t value;
+    uint64_t GetKey() const { return key; }
+  };
+#pragma pack(2)
+  struct LongestEntry {
+    typedef uint64_t Key;
+    typedef uint16_t Value;
+    uint64_t key;
+    uint16_t value;
+    uint64_t GetKey() const { return key; }
+  };
+#pragma pack(pop)
+
+  typedef util::IdentityHash KeyHash;
+  typedef std::equal_to<uint64_t> KeyEqual;
+
+  class MiddlePointer {
+    public:
+      MiddlePointer(const SeparatelyQuantize &quant, unsigned char order_minus_2, uint32_t code)
+        : quant_(&quant), bins_(quant.GetTables(order_minus_2)), code_(code) {}
+
+      MiddlePointer() : quant_(NULL) {}
+
+      bool Found() const { return quant_ != NULL; }
+
+      float Prob() const { return bins_[0].Decode(code_ & quant_->ProbMask()); }
+
+      float Backoff() const { return bins_[1].Decode((code_ >> quant_->ProbBits()) & quant_->BackoffMask()); }
+
+      float Rest() const { return Prob(); }
+
+      bool IndependentLeft() const { return code_ & kIndependentLeft; }
+
+    private:
+      const SeparatelyQuantize *quant_;
+      const SeparatelyQuantize::Bins *bins_;
+      uint32_t code_;
+  };
+
+  class LongestPointer {
+    public:
+      LongestPointer(const SeparatelyQuantize::Bins &bins, uint16_t code) : bins_(&bins), code_(code) {}
+
+      LongestPointer() : bins_(NULL) {}
+
+      bool Found() const { return bins_ != NULL; }
+
+      float Prob() const { return bins_->Decode(code_); }
+
+    private:
+      const SeparatelyQuantize::Bins *bins_;
+      uint16_t code_;
+  };
+
+  class Codebooks : public SeparatelyQuantize {
+    public:
+      template <class Entry> MiddlePointer Middle(unsigned char order_minus_2, const Entry &entry) const {
+        return MiddlePointer(*this, order_minus_2, entry.value);
+      }
+
+      template <class Entry> LongestPointer Longest(const Entry &entry) const {
+        return LongestPointer(LongestTable(), entry.value);
+      }
+
+      // Stored the way BackoffValue stores it: the sign bit of prob is the
+      // independent left flag.
+      uint32_t EncodeMiddle(unsigned char order_minus_2, float prob, float backoff) const {
+        const Bins *bins = GetTables(order_minus_2);
+        uint32_t ret = bins[0].EncodeProb(-std::fabs(prob)) | (bins[1].EncodeBackoff(backoff) << ProbBits());
+        return std::signbit(prob) ? (ret | kIndependentLeft) : ret;
+      }
+
+      uint16_t EncodeLongest(float prob) const {
+        return static_cast<uint16_t>(LongestTable().EncodeProb(prob));
+      }
+
+      bool Valid(const ProbingEntry &entry) const {
+        return !(entry.value & ~(kIndependentLeft | ProbMask() | (BackoffMask() << ProbBits())));
+      }
+
+      bool Valid(const LongestEntry &entry) const {
+        return !(entry.value & ~ProbMask());
+      }
+  };
+};
+
+} // namespace ngram
+} // namespace lm
+
+#endif // LM_QUANTIZE_H
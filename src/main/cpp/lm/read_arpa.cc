@@ -0,0 +1,382 @@
+#include "lm/read_arpa.hh"
+
+#include "lm/config.hh"
+#include "lm/lm_exception.hh"
+#include "lm/max_order.hh"
+#include "lm/vocab.hh"
+#include "util/mmap.hh"
+#include "util/parallel.hh"
+#include "util/scoped.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+
+namespace lm {
+namespace ngram {
+
+namespace {
+
+const StringPiece kUnknownWord("<unk>");
+
+// Lines of the text, numbered from 1 for messages.
+class LineReader {
+  public:
+    explicit LineReader(const StringPiece &text) : rest_(text), line_number_(0) {}
+
+    // Returns false at the end of the text.  Strips a trailing \r.
+    bool Next(StringPiece &line) {
+      if (rest_.empty()) return false;
+      StringPiece::size_type end = rest_.find('\n');
+      line = rest_.substr(0, end);
+      if (end == StringPiece::npos) {
+        rest_.clear();
+      } else {
+        rest_.remove_prefix(end + 1);
+      }
+      if (!line.empty() && line[line.size() - 1] == '\r') line.remove_suffix(1);
+      ++line_number_;
+      return true;
+    }
+
+    // Next line that is not blank.
+    StringPiece NextContent() {
+      StringPiece line;
+      do {
+        UTIL_THROW_IF(!Next(line), FormatLoadException, "The ARPA file ends early after line " << line_number_);
+      } while (line.empty());
+      return line;
+    }
+
+    uint64_t LineNumber() const { return line_number_; }
+
+    // What has not been read yet.
+    const StringPiece &Rest() const { return rest_; }
+
+    // Skip the first bytes of Rest(), which hold lines lines.
+    void Skip(std::size_t bytes, uint64_t lines) {
+      rest_.remove_prefix(bytes);
+      line_number_ += lines;
+    }
+
+  private:
+    StringPiece rest_;
+    uint64_t line_number_;
+};
+
+bool IsSpace(char c) {
+  return c == ' ' || c == '\t';
+}
+
+// Split line on spaces and tabs into at most max tokens.  Returns how many
+// there were, max + 1 if there were too many.
+std::size_t Tokenize(StringPiece line, StringPiece *out, std::size_t max) {
+  std::size_t found = 0;
+  while (true) {
+    std::size_t start = 0;
+    while (start < line.size() && IsSpace(line[start])) ++start;
+    if (start == line.size()) return found;
+    if (found == max) return max + 1;
+    std::size_t end = start;
+    while (end < line.size() && !IsSpace(line[end])) ++end;
+    out[found++] = line.substr(start, end - start);
+    line.remove_prefix(end);
+  }
+}
+
+float ReadFloat(const StringPiece &token, uint64_t line_number) {
+  char buffer[64];
+  UTIL_THROW_IF(token.size() >= sizeof(buffer), FormatLoadException, "Expected a number but got " << token << " on line " << line_number);
+  std::memcpy(buffer, token.data(), token.size());
+  buffer[token.size()] = 0;
+  char *end;
+  float ret = std::strtof(buffer, &end);
+  UTIL_THROW_IF(end != buffer + token.size() || std::isnan(ret), FormatLoadException, "Expected a number but got " << token << " on line " << line_number);
+  return ret;
+}
+
+void ReadWeights(const StringPiece &prob, const StringPiece *backoff, uint64_t line_number, ProbBackoff &out) {
+  out.prob = ReadFloat(prob, line_number);
+  UTIL_THROW_IF(out.prob > 0.0, FormatLoadException, "Positive log probability " << prob << " on line " << line_number);
+  if (std::isinf(out.prob)) out.prob = kArpaImpossibleProb;
+  out.backoff = backoff ? ReadFloat(*backoff, line_number) : 0.0;
+  UTIL_THROW_IF(std::isinf(out.backoff), FormatLoadException, "Infinite backoff " << *backoff << " on line " << line_number);
+}
+
+void ReadCounts(LineReader &lines, std::vector<uint64_t> &counts) {
+  StringPiece line;
+  do {
+    UTIL_THROW_IF(!lines.Next(line), FormatLoadException, "No \\data\\ in the ARPA file");
+  } while (line != "\\data\\");
+  while (lines.Next(line) && !line.empty()) {
+    UTIL_THROW_IF(!line.starts_with("ngram "), FormatLoadException, "Expected ngram n=count on line " << lines.LineNumber() << " but got " << line);
+    StringPiece::size_type equals = line.find('=');
+    UTIL_THROW_IF(equals == StringPiece::npos, FormatLoadException, "Expected ngram n=count on line " << lines.LineNumber() << " but got " << line);
+    std::string order(line.data() + 6, equals - 6), count(line.data() + equals + 1, line.size() - equals - 1);
+    char *end;
+    unsigned long n = std::strtoul(order.c_str(), &end, 10);
+    UTIL_THROW_IF(*end || n != counts.size() + 1, FormatLoadException, "Expected the count of " << (counts.size() + 1) << "-grams on line " << lines.LineNumber() << " but got " << line);
+    counts.push_back(std::strtoull(count.c_str(), &end, 10));
+    UTIL_THROW_IF(*end || count.empty(), FormatLoadException, "Bad count on line " << lines.LineNumber() << ": " << line);
+  }
+  UTIL_THROW_IF(counts.empty(), FormatLoadException, "The ARPA header has no counts");
+  UTIL_THROW_IF(counts.size() > KENLM_MAX_ORDER, FormatLoadException, "This model has order " << counts.size() << " but KenLM was compiled to support up to " << KENLM_MAX_ORDER << ".  " << KENLM_ORDER_MESSAGE);
+  UTIL_THROW_IF(counts.size() < 2, FormatLoadException, "Binary models need at least bigrams, but the ARPA file is a unigram model");
+  UTIL_THROW_IF(counts[0] >= std::numeric_limits<WordIndex>::max(), FormatLoadException, "There are " << counts[0] << " unigrams, too many for 32-bit word ids");
+}
+
+void ReadSectionHeader(LineReader &lines, unsigned int n) {
+  StringPiece line(lines.NextContent());
+  char expected[16];
+  std::sprintf(expected, "\\%u-grams:", n);
+  UTIL_THROW_IF(line != expected, FormatLoadException, "Expected " << expected << " on line " << lines.LineNumber() << " but got " << line);
+}
+
+// Sections smaller than this are not worth splitting between threads.
+const std::size_t kMinPieceBytes = 1 << 20;
+
+// Where the lines of the section starting at rest end: at the next line
+// starting with a backslash, which no n-gram line does.
+std::size_t SectionEnd(const StringPiece &rest) {
+  const char *begin = rest.data(), *end = begin + rest.size();
+  for (const char *i = begin; i != end; ++i) {
+    i = static_cast<const char*>(std::memchr(i, '\\', end - i));
+    if (!i) break;
+    if (i == begin || i[-1] == '\n') return i - begin;
+  }
+  return rest.size();
+}
+
+// A run of whole lines of a section, parsed by one thread.
+struct Piece {
+  StringPiece text;
+  // Lines and non-blank lines (entries) in text.
+  uint64_t lines, entries;
+  // Line number of the first line and entries in earlier pieces.
+  uint64_t first_line, offset;
+};
+
+// Calls the callback with each non-blank line of piece and its number.
+template <class Callback> void ForEachEntry(const Piece &piece, Callback &callback) {
+  const char *i = piece.text.data(), *end = i + piece.text.size();
+  uint64_t line_number = piece.first_line;
+  for (; i != end; ++line_number) {
+    const char *newline = static_cast<const char*>(std::memchr(i, '\n', end - i));
+    const char *line_end = newline ? newline : end;
+    StringPiece line(i, line_end - i);
+    if (!line.empty() && line[line.size() - 1] == '\r') line.remove_suffix(1);
+    if (!line.empty()) callback(line, line_number);
+    i = newline ? newline + 1 : end;
+  }
+}
+
+class CountEntry {
+  public:
+    CountEntry() : entries(0) {}
+    void operator()(const StringPiece &, uint64_t) { ++entries; }
+    uint64_t entries;
+};
+
+class CountPiece {
+  public:
+    explicit CountPiece(std::vector<Piece> &pieces) : pieces_(pieces) {}
+
+    void operator()(std::size_t i) const {
+      Piece &piece = pieces_[i];
+      CountEntry count;
+      ForEachEntry(piece, count);
+      piece.entries = count.entries;
+      piece.lines = std::count(piece.text.data(), piece.text.data() + piece.text.size(), '\n');
+      if (!piece.text.empty() && piece.text[piece.text.size() - 1] != '\n') ++piece.lines;
+    }
+
+  private:
+    std::vector<Piece> &pieces_;
+};
+
+/* Split the section at the start of lines.Rest() into pieces at line
+ * boundaries and count each piece's entries in parallel.  Checks the total
+ * against count and moves lines past the section.
+ */
+void SplitSection(LineReader &lines, unsigned int n, uint64_t count, unsigned int threads, std::vector<Piece> &pieces) {
+  StringPiece body(lines.Rest().data(), SectionEnd(lines.Rest()));
+  std::size_t parts = std::max<std::size_t>(1, std::min<std::size_t>(static_cast<std::size_t>(threads) * 4, body.size() / kMinPieceBytes));
+  pieces.clear();
+  std::size_t begin = 0;
+  for (std::size_t p = 1; p <= parts; ++p) {
+    std::size_t end = (p == parts) ? body.size() : std::max(begin, body.size() / parts * p);
+    if (end != body.size()) {
+      const char *newline = static_cast<const char*>(std::memchr(body.data() + end, '\n', body.size() - end));
+      end = newline ? newline + 1 - body.data() : body.size();
+    }
+    Piece piece;
+    piece.text = StringPiece(body.data() + begin, end - begin);
+    pieces.push_back(piece);
+    begin = end;
+  }
+  util::ParallelFor(pieces.size(), threads, CountPiece(pieces));
+  uint64_t line = lines.LineNumber() + 1, entries = 0;
+  for (std::vector<Piece>::iterator i = pieces.begin(); i != pieces.end(); ++i) {
+    i->first_line = line;
+    i->offset = entries;
+    line += i->lines;
+    entries += i->entries;
+  }
+  UTIL_THROW_IF(entries != count, FormatLoadException, "The header says there are " << count << " " << n << "-grams but the section starting after line " << lines.LineNumber() << " has " << entries);
+  lines.Skip(body.size(), line - lines.LineNumber() - 1);
+}
+
+class ParseUnigram {
+  public:
+    ParseUnigram(StringPiece *words, ProbBackoff *weights) : words_(words), weights_(weights) {}
+
+    void operator()(const StringPiece &line, uint64_t line_number) {
+      StringPiece tokens[3];
+      std::size_t found = Tokenize(line, tokens, 3);
+      UTIL_THROW_IF(found < 2 || found > 3, FormatLoadException, "Expected probability, word and maybe backoff on line " << line_number);
+      ReadWeights(tokens[0], found == 3 ? &tokens[2] : NULL, line_number, *weights_++);
+      *words_++ = tokens[1];
+    }
+
+  private:
+    StringPiece *words_;
+    ProbBackoff *weights_;
+};
+
+class ParseNGram {
+  public:
+    ParseNGram(unsigned int n, const ProbingVocabulary &vocab, WordIndex *words, ProbBackoff *weights)
+      : n_(n), vocab_(vocab), words_(words), weights_(weights) {}
+
+    void operator()(const StringPiece &line, uint64_t line_number) {
+      StringPiece tokens[KENLM_MAX_ORDER + 2];
+      std::size_t found = Tokenize(line, tokens, n_ + 2);
+      UTIL_THROW_IF(found < n_ + 1 || found > n_ + 2, FormatLoadException, "Expected probability, " << n_ << " words and maybe backoff on line " << line_number);
+      ReadWeights(tokens[0], found == n_ + 2 ? &tokens[n_ + 1] : NULL, line_number, *weights_++);
+      for (unsigned int w = 0; w < n_; ++w, ++words_) {
+        *words_ = vocab_.Index(tokens[w + 1]);
+        UTIL_THROW_IF(!*words_ && tokens[w + 1] != kUnknownWord, FormatLoadException, "The word " << tokens[w + 1] << " on line " << line_number << " is not a unigram");
+      }
+    }
+
+  private:
+    unsigned int n_;
+    const ProbingVocabulary &vocab_;
+    WordIndex *words_;
+    ProbBackoff *weights_;
+};
+
+// Parses piece i of the section for order n.  Unigrams leave their words in
+// unigram_words for numbering; higher orders look them up in vocab.
+class ParsePiece {
+  public:
+    ParsePiece(const std::vector<Piece> &pieces, unsigned int n, const ProbingVocabulary *vocab, std::vector<StringPiece> &unigram_words, ArpaOrder &out)
+      : pieces_(pieces), n_(n), vocab_(vocab), unigram_words_(unigram_words), out_(out) {}
+
+    void operator()(std::size_t i) const {
+      const Piece &piece = pieces_[i];
+      if (n_ == 1) {
+        ParseUnigram parse(unigram_words_.data() + piece.offset, out_.weights.data() + piece.offset);
+        ForEachEntry(piece, parse);
+      } else {
+        ParseNGram parse(n_, *vocab_, out_.words.data() + piece.offset * n_, out_.weights.data() + piece.offset);
+        ForEachEntry(piece, parse);
+      }
+    }
+
+  private:
+    const std::vector<Piece> &pieces_;
+    unsigned int n_;
+    const ProbingVocabulary *vocab_;
+    std::vector<StringPiece> &unigram_words_;
+    ArpaOrder &out_;
+};
+
+void ReadSection(LineReader &lines, unsigned int n, uint64_t count, const ProbingVocabulary *vocab, unsigned int threads, std::vector<StringPiece> &unigram_words, ArpaOrder &out) {
+  ReadSectionHeader(lines, n);
+  std::vector<Piece> pieces;
+  SplitSection(lines, n, count, threads, pieces);
+  if (n == 1) unigram_words.resize(count);
+  out.words.resize(n == 1 ? 0 : count * n);
+  out.weights.resize(count);
+  util::ParallelFor(pieces.size(), threads, ParsePiece(pieces, n, vocab, unigram_words, out));
+}
+
+// Number the unigrams in file order after <unk>, which is always 0.
+void NumberUnigrams(const std::vector<StringPiece> &words, ArpaModel &out) {
+  ArpaOrder &order = out.orders[0];
+  order.words.resize(words.size());
+  out.vocab.reserve(words.size() + 1);
+  out.vocab.push_back(StringPiece());
+  bool saw_unk = false;
+  for (std::size_t i = 0; i < words.size(); ++i) {
+    if (words[i] == kUnknownWord) {
+      UTIL_THROW_IF(saw_unk, FormatLoadException, "There are two <unk> unigrams");
+      saw_unk = true;
+      order.words[i] = 0;
+      out.vocab[0] = words[i];
+    } else {
+      order.words[i] = static_cast<WordIndex>(out.vocab.size());
+      out.vocab.push_back(words[i]);
+    }
+  }
+  if (!saw_unk) {
+    out.vocab[0] = kUnknownWord;
+    order.words.push_back(0);
+    ProbBackoff weights;
+    weights.prob = kArpaImpossibleProb;
+    weights.backoff = 0.0;
+    order.weights.push_back(weights);
+    ++out.counts[0];
+  }
+}
+
+} // namespace
+
+void ReadArpa(const StringPiece &text, unsigned int threads, ArpaModel &out) {
+  threads = std::max(threads, 1U);
+  LineReader lines(text);
+  out.vocab.clear();
+  out.counts.clear();
+  ReadCounts(lines, out.counts);
+  out.orders.clear();
+  out.orders.resize(out.counts.size());
+  {
+    std::vector<StringPiece> unigram_words;
+    ReadSection(lines, 1, out.counts[0], NULL, threads, unigram_words, out.orders[0]);
+    NumberUnigrams(unigram_words, out);
+  }
+
+  // Look words up the way the model will.
+  std::vector<ProbingVocabularyEntry> words;
+  words.reserve(out.vocab.size());
+  for (WordIndex i = 1; i < out.vocab.size(); ++i) {
+    words.push_back(ProbingVocabularyEntry::Make(detail::HashForVocab(out.vocab[i]), i));
+  }
+  Config config;
+  std::size_t vocab_size = ProbingVocabulary::Size(out.counts[0], config);
+  util::scoped_memory vocab_memory(util::MallocOrThrow(vocab_size), vocab_size, util::scoped_memory::MALLOC_ALLOCATED);
+  std::memset(vocab_memory.get(), 0, vocab_size);
+  try {
+    ProbingVocabulary::Build(vocab_memory.get(), vocab_size, out.counts[0], config, words);
+  } catch (util::Exception &e) {
+    e << " among the unigrams.  Is a word listed twice?";
+    throw;
+  }
+  ProbingVocabulary vocab;
+  vocab.SetupMemory(vocab_memory.get(), vocab_size);
+
+  for (unsigned int n = 2; n <= out.counts.size(); ++n) {
+    std::vector<StringPiece> unused;
+    ReadSection(lines, n, out.counts[n - 1], &vocab, threads, unused, out.orders[n - 1]);
+  }
+  StringPiece line(lines.NextContent());
+  UTIL_THROW_IF(line != "\\end\\", FormatLoadException, "Expected \\end\\ on line " << lines.LineNumber() << " but got " << line << ".  Are there more n-grams than the header says?");
+}
+
+} // namespace ngram
+} // namespace lm
@@ -0,0 +1,50 @@
+#ifndef LM_READ_ARPA_H
+#define LM_READ_ARPA_H
+
+#include "lm/search_hashed.hh"
+#include "lm/word_index.hh"
+#include "util/string_piece.hh"
+
+#include <vector>
+
+#include <stdint.h>
+
+namespace lm {
+namespace ngram {
+
+// The n-grams of one order in file order: words holds n word ids per entry.
+struct ArpaOrder {
+  std::vector<WordIndex> words;
+  std::vector<ProbBackoff> weights;
+};
+
+/* An ARPA file, with words pointing into its text.  Word ids follow the
+ * order of the unigrams, except that <unk> is always 0.  A file without <unk>
+ * gets one with probability kArpaImpossibleProb, counted in counts[0].
+ * N-grams without a backoff get 0.
+ */
+struct ArpaModel {
+  // vocab[id] is the word.
+  std::vector<StringPiece> vocab;
+  std::vector<uint64_t> counts;
+  // orders[n - 1] holds the n-grams.
+  std::vector<ArpaOrder> orders;
+};
+
+// Probability of a missing <unk>, and of n-grams the file gives -inf, which
+// binary models do not store.
+const float kArpaImpossibleProb = -100.0;
+
+/* Parse ARPA text.  The header's counts must match the n-grams that follow,
+ * and every word in an n-gram must be a unigram.  Throws FormatLoadException
+ * naming the line.
+ *
+ * Each section is cut into runs of lines that are parsed on up to threads
+ * threads straight into out; the result does not depend on threads.
+ */
+void ReadArpa(const StringPiece &text, unsigned int threads, ArpaModel &out);
+
+} // namespace ngram
+} // namespace lm
+
+#endif // LM_READ_ARPA_H
@@ -1,28 +1,142 @@
 #include "lm/search_hashed.hh"
 
+#include "lm/lm_exception.hh"
+#include "lm/quantize.hh"
 #include "lm/value.hh"
+#include "util/parallel.hh"
 
 namespace lm {
 namespace ngram {
 namespace detail {
 
-template <class Value> uint8_t *HashedSearch<Value>::SetupMemory(uint8_t *start, const std::vector<uint64_t> &counts, const Config &config) {
-  unigram_ = Unigram(start, counts[0]);
-  start += Unigram::Size(counts[0]);
-  std::size_t allocated;
+template <class Value, class Layout> uint8_t *HashedSearch<Value, Layout>::SetupMemory(uint8_t *start, const std::vector<uint64_t> &counts, const Config &config) {
+  std::vector<uint64_t> sizes;
+  TableSizes(counts, config, sizes);
+  std::vector<uint8_t*> tables;
+  for (std::vector<uint64_t>::const_iterator i = sizes.begin(); i != sizes.end(); ++i) {
+    tables.push_back(start);
+    start += *i;
+  }
+  SetupTables(&*tables.begin(), counts, config);
+  return start;
+}
+
+template <class Value, class Layout> void HashedSearch<Value, Layout>::SetupTables(uint8_t *const *tables, const std::vector<uint64_t> &counts, const Config &config) {
+  if (Codebooks::kStored) codebooks_.SetupMemory(*tables++, counts.size(), config);
+  unigram_ = Unigram(*tables++, counts[0]);
   middle_.clear();
   for (unsigned int n = 2; n < counts.size(); ++n) {
-    allocated = Middle::Size(counts[n - 1], config.probing_multiplier);
-    middle_.push_back(Middle(start, allocated));
-    start += allocated;
+    middle_.push_back(Middle(*tables++, Middle::Size(counts[n - 1], config.probing_multiplier)));
   }
-  allocated = Longest::Size(counts.back(), config.probing_multiplier);
-  longest_ = Longest(start, allocated);
-  start += allocated;
-  return start;
+  longest_ = Longest(*tables, Longest::Size(counts.back(), config.probing_multiplier));
+}
+
+namespace {
+
+// Each value type knows what its entries may hold.
+template <class Codebooks> class CheckEntry {
+  public:
+    explicit CheckEntry(const Codebooks &codebooks) : codebooks_(codebooks) {}
+
+    template <class Entry> void operator()(const Entry &entry) const {
+      UTIL_THROW_IF(!codebooks_.Valid(entry), FormatLoadException, "Bad value for key " << entry.key);
+    }
+
+  private:
+    const Codebooks &codebooks_;
+};
+
+void CheckCount(std::size_t found, uint64_t count) {
+  UTIL_THROW_IF(found != count, FormatLoadException, "Found " << found << " entries but the header says " << count);
+}
+
+} // namespace
+
+template <class Value, class Layout> void HashedSearch<Value, Layout>::CheckConsistency(const std::vector<uint64_t> &counts, unsigned int threads) const {
+  try {
+    codebooks_.CheckConsistency();
+  } catch (util::Exception &e) {
+    e << " in quantization";
+    throw;
+  }
+  unsigned int n = 1;
+  try {
+    for (WordIndex i = 0; i < counts[0]; ++i) {
+      UTIL_THROW_IF(!ValidWeights(unigram_.Lookup(i)), FormatLoadException, "Bad weights for word " << i);
+    }
+    CheckEntry<Codebooks> check(codebooks_);
+    for (n = 2; n < counts.size(); ++n) {
+      CheckCount(middle_[n - 2].CheckConsistency(threads, check), counts[n - 1]);
+    }
+    CheckCount(longest_.CheckConsistency(threads, check), counts.back());
+  } catch (util::Exception &e) {
+    e << " in " << n << "-grams";
+    throw;
+  }
+}
+
+template <class Value, class Layout> void HashedSearch<Value, Layout>::LimitProbes(unsigned int threads) {
+  for (typename std::vector<Middle>::iterator i = middle_.begin(); i != middle_.end(); ++i) {
+    i->LimitProbes(threads);
+  }
+  longest_.LimitProbes(threads);
+}
+
+namespace {
+
+class InsertKey {
+  public:
+    explicit InsertKey(util::BloomFilter &filter) : filter_(filter) {}
+
+    void operator()(uint64_t key) { filter_.Insert(key); }
+
+  private:
+    util::BloomFilter &filter_;
+};
+
+// Fills filter i from middle order i, or from longest for the last.
+template <class Middle, class Longest> class FillFilter {
+  public:
+    FillFilter(const std::vector<Middle> &middle, const Longest &longest, std::vector<util::BloomFilter> &filters)
+      : middle_(middle), longest_(longest), filters_(filters) {}
+
+    void operator()(std::size_t i) const {
+      InsertKey insert(filters_[i]);
+      if (i < middle_.size()) {
+        middle_[i].ForEachKey(insert);
+      } else {
+        longest_.ForEachKey(insert);
+      }
+    }
+
+  private:
+    const std::vector<Middle> &middle_;
+    const Longest &longest_;
+    std::vector<util::BloomFilter> &filters_;
+};
+
+} // namespace
+
+template <class Value, class Layout> void HashedSearch<Value, Layout>::BuildFilters(const std::vector<uint64_t> &counts, unsigned int bits_per_key) {
+  std::vector<util::BloomFilter> filters;
+  if (bits_per_key) {
+    filters.reserve(counts.size() - 1);
+    for (std::size_t n = 1; n < counts.size(); ++n) {
+      filters.push_back(util::BloomFilter(counts[n], bits_per_key));
+    }
+    util::ParallelFor(filters.size(), filters.size(), FillFilter<Middle, Longest>(middle_, longest_, filters));
+  }
+  filters_.swap(filters);
 }
 
 template class HashedSearch<BackoffValue>;
+template class HashedSearch<QuantizedValue>;
+template class HashedSearch<FingerprintValue<uint32_t> >;
+template class HashedSearch<FingerprintValue<uint16_t> >;
+template class HashedSearch<BackoffValue, BlockedLayout>;
+template class HashedSearch<QuantizedValue, BlockedLayout>;
+template class HashedSearch<FingerprintValue<uint32_t>, BlockedLayout>;
+template class HashedSearch<FingerprintValue<uint16_t>, BlockedLayout>;
 
 } // namespace detail
 } // namespace ngram
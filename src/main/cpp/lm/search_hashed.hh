@@ -5,10 +5,15 @@
 #include "lm/return.hh"
 #include "lm/word_index.hh"
 
+#include "util/blocked_probing_hash_table.hh"
+#include "util/bloom_filter.hh"
+#include "util/prefetch.hh"
 #include "util/probing_hash_table.hh"
+#include "util/string_stream.hh"
 
 #include <algorithm>
 #include <iostream>
+#include <string>
 #include <vector>
 
 namespace lm {
@@ -26,8 +31,15 @@ struct ProbBackoff {
 namespace ngram {
 
 /* Not the best numbering system, but it grew this way for historical reasons
- * and I want to preserve existing binary files. */
-typedef enum {PROBING=0} ModelType;
+ * and I want to preserve existing binary files.  1 to 5 are upstream KenLM's
+ * rest cost and trie types, kept free so their files are recognized.  Our
+ * tries keep the probing vocabulary instead of upstream's sorted one, so
+ * they get their own numbers.  Models with the perfect hash vocabulary add
+ * kMphVocabularyTypeAdd (lm/vocab.hh) to the number of their search. */
+typedef enum {PROBING=0, QUANT_PROBING=6, PACKED_TRIE=7, QUANT_PACKED_TRIE=8,
+  FINGERPRINT32_PROBING=9, FINGERPRINT16_PROBING=10,
+  MPH_PROBING=16, MPH_QUANT_PROBING=22, MPH_PACKED_TRIE=23, MPH_QUANT_PACKED_TRIE=24,
+  MPH_FINGERPRINT32_PROBING=25, MPH_FINGERPRINT16_PROBING=26} ModelType;
 
 class BinaryFormat;
 namespace detail {
@@ -69,33 +81,118 @@ class LongestPointer {
     const float *to_;
 };
 
-template <class Value> class HashedSearch {
+/* How HashedSearch lays out its middle and longest tables, written to the
+ * binary header as the search version.  PackedLayout puts whole entries back
+ * to back and probes them one at a time.
+ */
+struct PackedLayout {
+  static const unsigned int kVersion = 0;
+
+  template <class Entry, class Hash, class Equal> struct Table {
+    typedef util::ProbingHashTable<Entry, Hash, Equal> T;
+  };
+};
+
+// Keys apart from values, probed a block of buckets per SIMD compare (see
+// util::BlockedProbingHashTable).  Same entries in the same buckets.
+struct BlockedLayout {
+  static const unsigned int kVersion = 1;
+
+  template <class Entry, class Hash, class Equal> struct Table {
+    typedef util::BlockedProbingHashTable<Entry, Hash, Equal> T;
+  };
+};
+
+template <class Value, class Layout = PackedLayout> class HashedSearch {
   public:
     typedef uint64_t Node;
 
     typedef typename Value::ProbingProxy UnigramPointer;
-    typedef typename Value::ProbingProxy MiddlePointer;
-    typedef ::lm::ngram::detail::LongestPointer LongestPointer;
+    typedef typename Value::MiddlePointer MiddlePointer;
+    typedef typename Value::LongestPointer LongestPointer;
 
     static const ModelType kModelType = Value::kProbingModelType;
-    static const unsigned int kVersion = 0;
+    static const unsigned int kVersion = Layout::kVersion;
 
     static uint64_t Size(const std::vector<uint64_t> &counts, const Config &config) {
-      uint64_t ret = Unigram::Size(counts[0]);
+      uint64_t ret = Codebooks::Size(counts.size(), config) + Unigram::Size(counts[0]);
       for (unsigned char n = 1; n < counts.size() - 1; ++n) {
         ret += Middle::Size(counts[n], config.probing_multiplier);
       }
       return ret + Longest::Size(counts.back(), config.probing_multiplier);
     }
 
+    // Sizes of the tables SetupMemory lays out back to back: codebooks if
+    // the values are quantized, unigrams, each middle order, then longest.
+    static void TableSizes(const std::vector<uint64_t> &counts, const Config &config, std::vector<uint64_t> &out) {
+      out.clear();
+      if (Codebooks::kStored) out.push_back(Codebooks::Size(counts.size(), config));
+      out.push_back(Unigram::Size(counts[0]));
+      for (unsigned char n = 1; n < counts.size() - 1; ++n) {
+        out.push_back(Middle::Size(counts[n], config.probing_multiplier));
+      }
+      out.push_back(Longest::Size(counts.back(), config.probing_multiplier));
+    }
+
+    // What to call each table in TableSizes order.
+    static void TableNames(unsigned char order, std::vector<std::string> &out) {
+      out.clear();
+      if (Codebooks::kStored) out.push_back("quantization");
+      for (unsigned int n = 1; n <= order; ++n) {
+        util::StringStream name;
+        name << n << "-grams";
+        out.push_back(name.str());
+      }
+    }
+
+    // Some of the config lives at the start of the search image (start, with
+    // available bytes readable).  Read it before calling Size.
+    static void UpdateConfigFromBinary(const uint8_t *start, std::size_t available, Config &config) {
+      Codebooks::UpdateConfigFromBinary(start, available, config);
+    }
+
     uint8_t *SetupMemory(uint8_t *start, const std::vector<uint64_t> &counts, const Config &config);
 
+    // Like SetupMemory, but table i (in TableSizes order) starts at tables[i]
+    // instead of right after table i - 1.
+    void SetupTables(uint8_t *const *tables, const std::vector<uint64_t> &counts, const Config &config);
+
+    // Check every table and value on threads threads.  Throws
+    // FormatLoadException naming the table.
+    void CheckConsistency(const std::vector<uint64_t> &counts, unsigned int threads) const;
+
+    // Bound lookups in every table by what it holds, reading them on threads
+    // threads.
+    void LimitProbes(unsigned int threads);
+
+    /* Put a util::BloomFilter of bits_per_key bits per entry in front of each
+     * middle order and longest, filled from the tables one per thread.  Then a
+     * lookup the filter rules out reads one line of it instead of walking the
+     * table to an empty bucket.  Filters hold stored keys, so they rule out
+     * little for 16-bit fingerprints.  0 removes them.
+     */
+    void BuildFilters(const std::vector<uint64_t> &counts, unsigned int bits_per_key);
+
     unsigned char Order() const {
       return middle_.size() + 2;
     }
 
     typename Value::Weights &UnknownUnigram() { return unigram_.Unknown(); }
 
+  private:
+    typedef typename Value::Codebooks Codebooks;
+    class Unigram;
+
+  public:
+    typedef typename Layout::template Table<typename Value::ProbingEntry, typename Value::KeyHash, typename Value::KeyEqual>::T Middle;
+    typedef typename Layout::template Table<typename Value::LongestEntry, typename Value::KeyHash, typename Value::KeyEqual>::T Longest;
+
+    // For building.  Unigram weights are indexed by word.
+    Codebooks &GetCodebooks() { return codebooks_; }
+    typename Value::Weights *UnigramRaw() { return unigram_.Raw(); }
+    Middle &GetMiddle(unsigned char order_minus_2) { return middle_[order_minus_2]; }
+    Longest &GetLongest() { return longest_; }
+
     UnigramPointer LookupUnigram(WordIndex word, Node &next, bool &independent_left, uint64_t &extend_left) const {
       extend_left = static_cast<uint64_t>(word);
       next = extend_left;
@@ -107,12 +204,12 @@ template <class Value> class HashedSearch {
     MiddlePointer LookupMiddle(unsigned char order_minus_2, WordIndex word, Node &node, bool &independent_left, uint64_t &extend_pointer) const {
       node = CombineWordHash(node, word);
       typename Middle::ConstIterator found;
-      if (!middle_[order_minus_2].Find(node, found)) {
+      if (!MayContain(middle_[order_minus_2], order_minus_2, node) || !middle_[order_minus_2].Find(node, found)) {
         independent_left = true;
         return MiddlePointer();
       }
       extend_pointer = node;
-      MiddlePointer ret(found->value);
+      MiddlePointer ret(codebooks_.Middle(order_minus_2, *found));
       independent_left = ret.IndependentLeft();
       return ret;
     }
@@ -120,11 +217,64 @@ template <class Value> class HashedSearch {
     LongestPointer LookupLongest(WordIndex word, const Node &node) const {
       // Sign bit is always on because longest n-grams do not extend left.
       typename Longest::ConstIterator found;
-      if (!longest_.Find(CombineWordHash(node, word), found)) return LongestPointer();
-      return LongestPointer(found->value.prob);
+      Node key = CombineWordHash(node, word);
+      if (!MayContain(longest_, middle_.size(), key) || !longest_.Find(key, found)) return LongestPointer();
+      return codebooks_.Longest(*found);
+    }
+
+    // Start loading what the lookup with the same arguments reads first, for
+    // callers with other work to do in the meantime.
+    void PrefetchUnigram(WordIndex word) const {
+      util::Prefetch(&unigram_.Lookup(word));
+    }
+
+    void PrefetchMiddle(unsigned char order_minus_2, WordIndex word, const Node &node) const {
+      Node key = CombineWordHash(node, word);
+      PrefetchFilter(order_minus_2, key);
+      middle_[order_minus_2].Prefetch(key);
+    }
+
+    void PrefetchLongest(WordIndex word, const Node &node) const {
+      Node key = CombineWordHash(node, word);
+      PrefetchFilter(middle_.size(), key);
+      longest_.Prefetch(key);
+    }
+
+    /* Start loading the bucket of every order the lookups of word after
+     * context would probe, all at once: the keys only depend on the words, so
+     * none of the loads waits for another.
+     */
+    void PrefetchContext(WordIndex word, const WordIndex *context_rbegin, const WordIndex *context_rend) const {
+      Node node = static_cast<Node>(word);
+      unsigned char order_minus_2 = 0;
+      for (const WordIndex *i = context_rbegin; i != context_rend; ++i, ++order_minus_2) {
+        node = CombineWordHash(node, *i);
+        PrefetchFilter(order_minus_2, node);
+        if (order_minus_2 == middle_.size()) {
+          longest_.Prefetch(node);
+          return;
+        }
+        middle_[order_minus_2].Prefetch(node);
+      }
     }
 
   private:
+    /* Filter i is in front of middle order i, or of longest for the last.
+     * The table's bucket is loaded while the filter is tested, so that a hit
+     * waits on one miss rather than two.
+     */
+    template <class Table> bool MayContain(const Table &table, std::size_t filter, Node key) const {
+      if (filters_.empty()) return true;
+      table.Prefetch(key);
+      return filters_[filter].MayContain(util::StoredKey(typename Value::KeyEqual(), key));
+    }
+
+    void PrefetchFilter(std::size_t filter, Node key) const {
+      if (!filters_.empty()) filters_[filter].Prefetch(util::StoredKey(typename Value::KeyEqual(), key));
+    }
+
+    Codebooks codebooks_;
+
     class Unigram {
       public:
         Unigram() {}
@@ -161,11 +311,11 @@ template <class Value> class HashedSearch {
 
     Unigram unigram_;
 
-    typedef util::ProbingHashTable<typename Value::ProbingEntry, util::IdentityHash> Middle;
     std::vector<Middle> middle_;
 
-    typedef util::ProbingHashTable<ProbEntry, util::IdentityHash> Longest;
     Longest longest_;
+
+    std::vector<util::BloomFilter> filters_;
 };
 
 } // namespace detail
@@ -0,0 +1,184 @@
+#include "lm/search_trie.hh"
+
+#include "lm/lm_exception.hh"
+#include "util/parallel.hh"
+#include "util/string_stream.hh"
+
+#include <algorithm>
+#include <numeric>
+
+namespace lm {
+namespace ngram {
+namespace trie {
+
+template <class Quant> uint64_t TrieSearch<Quant>::Size(const std::vector<uint64_t> &counts, const Config &config) {
+  std::vector<uint64_t> sizes;
+  TableSizes(counts, config, sizes);
+  return std::accumulate(sizes.begin(), sizes.end(), static_cast<uint64_t>(0));
+}
+
+template <class Quant> void TrieSearch<Quant>::TableSizes(const std::vector<uint64_t> &counts, const Config &config, std::vector<uint64_t> &out) {
+  out.clear();
+  if (Quant::kStored) out.push_back(Quant::Size(counts.size(), config));
+  out.push_back(Unigram::Size(counts[0]));
+  for (unsigned char n = 1; n < counts.size() - 1; ++n) {
+    out.push_back(BitPackedMiddle::Size(Quant::MiddleBits(config), counts[n], counts[0], counts[n + 1]));
+  }
+  out.push_back(BitPackedLongest::Size(Quant::LongestBits(config), counts.back(), counts[0]));
+}
+
+template <class Quant> void TrieSearch<Quant>::TableNames(unsigned char order, std::vector<std::string> &out) {
+  out.clear();
+  if (Quant::kStored) out.push_back("quantization");
+  for (unsigned int n = 1; n <= order; ++n) {
+    util::StringStream name;
+    name << n << "-grams";
+    out.push_back(name.str());
+  }
+}
+
+template <class Quant> void TrieSearch<Quant>::SetupTables(uint8_t *const *tables, const std::vector<uint64_t> &counts, const Config &config) {
+  UTIL_THROW_IF(counts.size() < 2, FormatLoadException, "The trie needs order 2 or more, not " << counts.size());
+  if (Quant::kStored) quant_.SetupMemory(*tables++, counts.size(), config);
+  unigram_ = Unigram(*tables++);
+  middle_.clear();
+  for (unsigned int n = 2; n < counts.size(); ++n) {
+    middle_.push_back(BitPackedMiddle(*tables++, Quant::MiddleBits(config), counts[n - 1], counts[0], counts[n]));
+  }
+  longest_ = BitPackedLongest(*tables, Quant::LongestBits(config), counts.back(), counts[0]);
+}
+
+namespace {
+
+// Parents per work item when checking an order in parallel.
+const uint64_t kCheckChunk = 1 << 16;
+
+class UnigramParent {
+  public:
+    explicit UnigramParent(const UnigramValue *unigrams) : unigrams_(unigrams) {}
+
+    uint64_t Next(uint64_t index) const { return unigrams_[index].next; }
+
+  private:
+    const UnigramValue *unigrams_;
+};
+
+class MiddleParent {
+  public:
+    explicit MiddleParent(const BitPackedMiddle &middle) : middle_(middle) {}
+
+    uint64_t Next(uint64_t index) const { return middle_.Next(index); }
+
+  private:
+    const BitPackedMiddle &middle_;
+};
+
+template <class Quant> class MiddleChild {
+  public:
+    MiddleChild(const BitPackedMiddle &middle, const Quant &quant, unsigned char order_minus_2)
+      : middle_(middle), quant_(quant), order_minus_2_(order_minus_2) {}
+
+    const BitPacked &Table() const { return middle_; }
+
+    bool Valid(uint64_t index) const { return quant_.ValidMiddle(order_minus_2_, middle_.Value(index)); }
+
+  private:
+    const BitPackedMiddle &middle_;
+    const Quant &quant_;
+    unsigned char order_minus_2_;
+};
+
+template <class Quant> class LongestChild {
+  public:
+    LongestChild(const BitPackedLongest &longest, const Quant &quant)
+      : longest_(longest), quant_(quant) {}
+
+    const BitPacked &Table() const { return longest_; }
+
+    bool Valid(uint64_t index) const { return quant_.ValidLongest(longest_.Value(index)); }
+
+  private:
+    const BitPackedLongest &longest_;
+    const Quant &quant_;
+};
+
+/* Check the children of a chunk of parents: each range starts where the last
+ * one ended and stays inside the child table, and words strictly ascend
+ * within a range, which the interpolation search relies on.
+ */
+template <class Parent, class Child> class CheckChildren {
+  public:
+    CheckChildren(const Parent &parent, uint64_t parents, const Child &child, WordIndex max_word)
+      : parent_(parent), parents_(parents), child_(child), max_word_(max_word) {}
+
+    void operator()(std::size_t chunk) const {
+      const BitPacked &table = child_.Table();
+      uint64_t p = chunk * kCheckChunk;
+      uint64_t end = std::min(p + kCheckChunk, parents_);
+      uint64_t c = parent_.Next(p);
+      for (; p < end; ++p) {
+        uint64_t child_end = parent_.Next(p + 1);
+        UTIL_THROW_IF(child_end < c || child_end > table.Entries(), FormatLoadException, "Children of entry " << p << " end at " << child_end << ", outside " << c << " to " << table.Entries());
+        for (uint64_t first = c; c < child_end; ++c) {
+          WordIndex word = table.Word(c);
+          UTIL_THROW_IF(word > max_word_, FormatLoadException, "Word " << word << " at entry " << c << " is not in the vocabulary");
+          UTIL_THROW_IF(c != first && word <= table.Word(c - 1), FormatLoadException, "Words out of order at entry " << c);
+          UTIL_THROW_IF(!child_.Valid(c), FormatLoadException, "Bad value at entry " << c);
+        }
+      }
+    }
+
+  private:
+    const Parent &parent_;
+    uint64_t parents_;
+    const Child &child_;
+    WordIndex max_word_;
+};
+
+template <class Parent, class Child> void CheckOrder(const Parent &parent, uint64_t parents, const Child &child, WordIndex max_word, unsigned int threads) {
+  UTIL_THROW_IF(parent.Next(0) != 0, FormatLoadException, "The first children start at " << parent.Next(0));
+  uint64_t end = parent.Next(parents);
+  UTIL_THROW_IF(end != child.Table().Entries(), FormatLoadException, "Found " << end << " entries but the header says " << child.Table().Entries());
+  util::ParallelFor((parents + kCheckChunk - 1) / kCheckChunk, threads, CheckChildren<Parent, Child>(parent, parents, child, max_word));
+}
+
+} // namespace
+
+template <class Quant> void TrieSearch<Quant>::CheckConsistency(const std::vector<uint64_t> &counts, unsigned int threads) const {
+  try {
+    quant_.CheckConsistency();
+  } catch (util::Exception &e) {
+    e << " in quantization";
+    throw;
+  }
+  unsigned int n = 1;
+  try {
+    const UnigramValue *unigrams = unigram_.Raw();
+    for (WordIndex i = 0; i < counts[0]; ++i) {
+      UTIL_THROW_IF(!ValidWeights(unigrams[i].weights), FormatLoadException, "Bad weights for word " << i);
+    }
+    WordIndex max_word = static_cast<WordIndex>(counts[0]);
+    n = 2;
+    // Unigrams have a spare entry in case <unk> was not counted.
+    UnigramParent unigram_parent(unigrams);
+    if (middle_.empty()) {
+      CheckOrder(unigram_parent, counts[0] + 1, LongestChild<Quant>(longest_, quant_), max_word, threads);
+      return;
+    }
+    CheckOrder(unigram_parent, counts[0] + 1, MiddleChild<Quant>(middle_[0], quant_, 0), max_word, threads);
+    for (n = 3; n < counts.size(); ++n) {
+      CheckOrder(MiddleParent(middle_[n - 3]), counts[n - 2], MiddleChild<Quant>(middle_[n - 2], quant_, n - 2), max_word, threads);
+    }
+    CheckOrder(MiddleParent(middle_.back()), counts[n - 2], LongestChild<Quant>(longest_, quant_), max_word, threads);
+  } catch (util::Exception &e) {
+    e << " in " << n << "-grams";
+    throw;
+  }
+}
+
+template class TrieSearch<DontQuantize>;
+template class TrieSearch<SeparatelyQuantize>;
+
+} // namespace trie
+} // namespace ngram
+} // namespace lm
@@ -0,0 +1,126 @@
+#ifndef LM_SEARCH_TRIE_H
+#define LM_SEARCH_TRIE_H
+
+#include "lm/config.hh"
+#include "lm/quantize.hh"
+#include "lm/return.hh"
+#include "lm/trie.hh"
+#include "lm/value.hh"
+#include "lm/word_index.hh"
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace lm {
+namespace ngram {
+namespace trie {
+
+/* Sorted, bit-packed trie (see lm/trie.hh).  Every n-gram costs its word
+ * id, value and child pointer in as few bits as the counts allow instead of a
+ * 64-bit hash key in a sparse table, so the tables are a fraction of the size
+ * of probing ones.  In exchange, each order costs an interpolation search
+ * instead of a hash probe.  Quant is DontQuantize or SeparatelyQuantize.
+ *
+ * To build, SetupTables on zeroed memory, train the quantizer if it is
+ * stored, then write unigrams, every middle order and the longest order in
+ * trie order: sorted by reversed n-gram.  Then FinishedLoading each middle
+ * order and the quantizer.
+ */
+template <class Quant> class TrieSearch {
+  public:
+    typedef NodeRange Node;
+
+    typedef BackoffValue::ProbingProxy UnigramPointer;
+    typedef trie::MiddlePointer<Quant> MiddlePointer;
+    typedef trie::LongestPointer<Quant> LongestPointer;
+
+    static const ModelType kModelType = Quant::kTrieModelType;
+    static const unsigned int kVersion = 0;
+
+    static uint64_t Size(const std::vector<uint64_t> &counts, const Config &config);
+
+    // Sizes of the tables SetupTables lays out: the quantizer if it is
+    // stored, unigrams, each middle order, then longest.
+    static void TableSizes(const std::vector<uint64_t> &counts, const Config &config, std::vector<uint64_t> &out);
+
+    // What to call each table in TableSizes order.
+    static void TableNames(unsigned char order, std::vector<std::string> &out);
+
+    // Read the quantizer's parameters from the start of the search image.
+    static void UpdateConfigFromBinary(const uint8_t *start, std::size_t available, Config &config) {
+      Quant::UpdateConfigFromBinary(start, available, config);
+    }
+
+    // Table i (in TableSizes order) starts at tables[i].
+    void SetupTables(uint8_t *const *tables, const std::vector<uint64_t> &counts, const Config &config);
+
+    // Check the quantizer, every child range and every word and value on
+    // threads threads.  Throws FormatLoadException naming the table.
+    void CheckConsistency(const std::vector<uint64_t> &counts, unsigned int threads) const;
+
+    // Each order's search is bounded by its parent's range; no filters and
+    // nothing to limit.
+    void BuildFilters(const std::vector<uint64_t> &, unsigned int) {}
+    void LimitProbes(unsigned int) {}
+
+    unsigned char Order() const {
+      return middle_.size() + 2;
+    }
+
+    UnigramPointer LookupUnigram(WordIndex word, Node &next, bool &independent_left, uint64_t &extend_left) const {
+      extend_left = static_cast<uint64_t>(word);
+      UnigramPointer ret(unigram_.Lookup(word, next));
+      // Nothing extends it to the left.
+      independent_left = (next.begin == next.end);
+      return ret;
+    }
+
+    MiddlePointer LookupMiddle(unsigned char order_minus_2, WordIndex word, Node &node, bool &independent_left, uint64_t &extend_left) const {
+      util::BitAddress address(middle_[order_minus_2].Find(word, node, extend_left));
+      independent_left = (address.base == NULL) || (node.begin == node.end);
+      return MiddlePointer(quant_, order_minus_2, address);
+    }
+
+    LongestPointer LookupLongest(WordIndex word, const Node &node) const {
+      return LongestPointer(quant_, longest_.Find(word, node));
+    }
+
+    // Start loading the first record the lookup with the same arguments
+    // reads.  The rest of the search depends on what that record holds.
+    void PrefetchUnigram(WordIndex word) const {
+      util::Prefetch(unigram_.Raw() + word);
+    }
+
+    void PrefetchMiddle(unsigned char order_minus_2, WordIndex word, const Node &node) const {
+      middle_[order_minus_2].Prefetch(word, node);
+    }
+
+    void PrefetchLongest(WordIndex word, const Node &node) const {
+      longest_.Prefetch(word, node);
+    }
+
+    void PrefetchContext(WordIndex, const WordIndex *, const WordIndex *) const {}
+
+    // For building.
+    Quant &GetQuant() { return quant_; }
+    Unigram &GetUnigram() { return unigram_; }
+    BitPackedMiddle &GetMiddle(unsigned char order_minus_2) { return middle_[order_minus_2]; }
+    BitPackedLongest &GetLongest() { return longest_; }
+
+  private:
+    Quant quant_;
+
+    Unigram unigram_;
+
+    std::vector<BitPackedMiddle> middle_;
+
+    BitPackedLongest longest_;
+};
+
+} // namespace trie
+} // namespace ngram
+} // namespace lm
+
+#endif // LM_SEARCH_TRIE_H
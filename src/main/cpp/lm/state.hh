@@ -1,6 +1,11 @@
 #ifndef LM_STATE_H
 #define LM_STATE_H
 
+#include "lm/max_order.hh"
+#include "lm/word_index.hh"
+
+#include <cstring>
+
 namespace lm {
 namespace ngram {
 
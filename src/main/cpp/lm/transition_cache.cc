@@ -0,0 +1,77 @@
+#include "lm/transition_cache.hh"
+
+#include "util/murmur_hash.hh"
+
+#include <algorithm>
+
+namespace lm {
+namespace ngram {
+
+void TransitionCache::Reset(std::size_t max_bytes, const State &begin) {
+  std::vector<StateSlot>().swap(slots_);
+  interned_.Reset(0);
+  transitions_.Reset(0);
+  next_state_.store(0);
+  // Each state takes two intern entries, as they are evicted separately.
+  std::size_t state_bytes = sizeof(StateSlot) + 2 * sizeof(util::ClockCache<uint32_t>::Entry);
+  std::size_t slots = std::min<std::size_t>(max_bytes / 4 / state_bytes, static_cast<std::size_t>(kBusy));
+  std::size_t transitions = util::ClockCache<Transition>::EntriesIn(max_bytes - max_bytes / 4);
+  if (slots < 2 || !transitions) return;
+
+  std::vector<StateSlot>(slots).swap(slots_);
+  for (std::size_t i = 0; i < slots; ++i) {
+    slots_[i].owner.store(kNoState, std::memory_order_relaxed);
+  }
+  interned_.Reset(2 * slots);
+  transitions_.Reset(transitions);
+
+  uint32_t number;
+  Intern(begin, number);
+}
+
+uint64_t TransitionCache::HashState(const State &state) {
+  uint64_t hash = util::MurmurHash64A(state.words, state.length * sizeof(WordIndex), state.length);
+  return hash == util::ClockCache<uint32_t>::kEmptyKey ? hash - 1 : hash;
+}
+
+bool TransitionCache::StateOf(uint32_t number, State &out) const {
+  const StateSlot &slot = slots_[SlotOf(number)];
+  if (slot.owner.load(std::memory_order_acquire) != number) return false;
+  out = slot.state;
+  // Pairs with the release fence in Intern: if the copy saw a newer state's
+  // bytes, this sees kBusy or the newer number.
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot.owner.load(std::memory_order_relaxed) == number;
+}
+
+bool TransitionCache::Intern(const State &state, uint32_t &number) const {
+  const uint64_t hash = HashState(state);
+  if (interned_.Find(hash, number, Holds(*this, state))) return true;
+  if (next_state_.load(std::memory_order_relaxed) >= kBusy) return false;
+  const uint64_t fresh = next_state_.fetch_add(1, std::memory_order_relaxed);
+  if (fresh >= kBusy) return false;
+  StateSlot &slot = slots_[SlotOf(static_cast<uint32_t>(fresh))];
+  // Another thread still writing the slot (it would take a lap of the ring
+  // meanwhile) keeps it; this state goes unnumbered.
+  uint32_t owner = slot.owner.load(std::memory_order_relaxed);
+  if (owner == kBusy || !slot.owner.compare_exchange_strong(owner, kBusy, std::memory_order_relaxed)) return false;
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.state = state;
+  number = static_cast<uint32_t>(fresh);
+  slot.owner.store(number, std::memory_order_release);
+  interned_.Insert(hash, number);
+  return true;
+}
+
+TransitionCache::Stats TransitionCache::GetStats() const {
+  util::ClockCache<Transition>::Stats transitions = transitions_.GetStats();
+  Stats ret;
+  ret.hits = transitions.hits;
+  ret.misses = transitions.misses;
+  ret.evictions = transitions.evictions;
+  ret.states = std::min<uint64_t>(next_state_.load(), static_cast<uint64_t>(kBusy));
+  return ret;
+}
+
+} // namespace ngram
+} // namespace lm
@@ -0,0 +1,184 @@
+#ifndef LM_TRANSITION_CACHE_H
+#define LM_TRANSITION_CACHE_H
+
+#include "lm/return.hh"
+#include "lm/state.hh"
+#include "lm/word_index.hh"
+#include "util/clock_cache.hh"
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#include <stdint.h>
+
+namespace lm {
+namespace ngram {
+
+/* TransitionTable built lazily, for models too big to compile ahead of time:
+ * states are numbered as sentences reach them and (state, word) ->
+ * (probability, next state) is remembered as it is scored.  Repetitive
+ * traffic then scores most words with one lookup instead of FullScore.
+ *
+ * Safe to share between threads.  Transitions live in a util::ClockCache.
+ * States live in a ring: each newly numbered state takes the slot of the
+ * oldest, so traffic that drifts keeps being learnt.  Numbers are never
+ * reused, so transitions stay right after their states are gone; a sentence
+ * that has to score on from a state no longer held rebuilds it with
+ * FullScore from the last one it knew.  Past 2^32 - 2 states nothing new is
+ * numbered, and sentences that reach a new state score on with FullScore
+ * until they come back to a known one.  A quarter of the bytes go to states
+ * and the rest to transitions.
+ */
+class TransitionCache {
+  public:
+    struct Stats {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t evictions;
+      // States numbered so far, held or not.
+      uint64_t states;
+    };
+
+    TransitionCache() : next_state_(0) {}
+
+    // Forget everything and take about max_bytes, or nothing for 0.
+    // begin is numbered 0.  Not thread safe.
+    void Reset(std::size_t max_bytes, const State &begin);
+
+    bool Empty() const { return slots_.empty(); }
+
+    // The transition from state number from on word, if remembered.
+    bool Find(uint32_t from, WordIndex word, float &prob, uint32_t &next) const {
+      Transition transition;
+      if (!transitions_.Find(Key(from, word), transition)) return false;
+      prob = transition.prob;
+      next = transition.next;
+      return true;
+    }
+
+    // Remember a transition, evicting another from its set if need be.
+    void Insert(uint32_t from, WordIndex word, float prob, uint32_t next) const {
+      Transition transition;
+      transition.prob = prob;
+      transition.next = next;
+      transitions_.Insert(Key(from, word), transition);
+    }
+
+    // The number of state, numbering it if it is new and can be.
+    bool Intern(const State &state, uint32_t &number) const;
+
+    // Copy the state numbered number to out, unless its slot has gone to a
+    // newer state.
+    bool StateOf(uint32_t number, State &out) const;
+
+    /* Sum of FullScore's prob over the length words at words and then </s>,
+     * from BeginSentenceState() (which Reset must have been given), added in
+     * that order, so exactly what scoring word by word gives.  Every word
+     * must be below the vocabulary's Bound().
+     */
+    template <class Model> float ScoreSentence(const Model &model, const WordIndex *words, std::size_t length) const;
+
+    Stats GetStats() const;
+
+  private:
+    static const uint32_t kNoState = static_cast<uint32_t>(-1);
+    // A slot's owner while its state is being written.  Numbers are below.
+    static const uint32_t kBusy = kNoState - 1;
+
+    struct Transition {
+      float prob;
+      uint32_t next;
+    };
+
+    // owner is the number of the state held, kNoState before the first, or
+    // kBusy while one is written.  Readers copy the state and then check
+    // owner did not change (a seqlock), so writers never wait on them.
+    struct StateSlot {
+      std::atomic<uint32_t> owner;
+      State state;
+    };
+
+    // Whether a number from the intern table still holds state.
+    class Holds {
+      public:
+        Holds(const TransitionCache &cache, const State &state) : cache_(cache), state_(state) {}
+
+        bool operator()(uint32_t number) const {
+          State stored;
+          return cache_.StateOf(number, stored) && stored == state_;
+        }
+
+      private:
+        const TransitionCache &cache_;
+        const State &state_;
+    };
+
+    // Never the table's empty key: from is below kNoState.
+    static uint64_t Key(uint32_t from, WordIndex word) {
+      return (static_cast<uint64_t>(from) << 32) | word;
+    }
+
+    static uint64_t HashState(const State &state);
+
+    // Number 0, the begin state, keeps slot 0; the rest go round the others.
+    std::size_t SlotOf(uint32_t number) const {
+      return number ? 1 + (number - 1) % (slots_.size() - 1) : 0;
+    }
+
+    mutable std::vector<StateSlot> slots_;
+
+    // From HashState to number; Holds tells a stale number from a live one.
+    mutable util::ClockCache<uint32_t> interned_;
+
+    mutable util::ClockCache<Transition> transitions_;
+
+    mutable std::atomic<uint64_t> next_state_;
+};
+
+template <class Model> float TransitionCache::ScoreSentence(const Model &model, const WordIndex *words, std::size_t length) const {
+  const WordIndex end_sentence = model.GetVocabulary().EndSentence();
+  float total = 0.0;
+  // The state's number, or kNoState while scoring on from one not numbered.
+  // A hit never reads the state.  buffers[current] holds the last state
+  // known, the one before word known, and a miss brings it up to date.
+  uint32_t number = 0;
+  State buffers[2];
+  std::size_t current = 0, known = 0;
+  buffers[0] = model.BeginSentenceState();
+  for (std::size_t i = 0; i <= length; ++i) {
+    const WordIndex word = (i < length) ? words[i] : end_sentence;
+    float prob;
+    uint32_t next;
+    if (number != kNoState) {
+      if (Find(number, word, prob, next)) {
+        total += prob;
+        number = next;
+        continue;
+      }
+      if (known != i && !StateOf(number, buffers[current])) {
+        // Its slot went to a newer state: rebuild it from the last known.
+        for (; known < i; ++known, current ^= 1) {
+          model.FullScore(buffers[current], words[known], buffers[current ^ 1]);
+        }
+      }
+    }
+    State &out = buffers[current ^ 1];
+    prob = model.FullScore(buffers[current], word, out).prob;
+    total += prob;
+    current ^= 1;
+    known = i + 1;
+    if (Intern(out, next)) {
+      if (number != kNoState) Insert(number, word, prob, next);
+      number = next;
+    } else {
+      number = kNoState;
+    }
+  }
+  return total;
+}
+
+} // namespace ngram
+} // namespace lm
+
+#endif // LM_TRANSITION_CACHE_H
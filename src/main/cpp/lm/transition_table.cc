@@ -0,0 +1,19 @@
+#include "lm/transition_table.hh"
+
+namespace lm {
+namespace ngram {
+
+float TransitionTable::ScoreSentence(const WordIndex *words, std::size_t length, WordIndex end_sentence) const {
+  float total = 0.0;
+  uint32_t state = BeginSentence();
+  for (std::size_t i = 0; i < length; ++i) {
+    const Cell &cell = Transition(state, words[i]);
+    total += cell.prob;
+    state = cell.next;
+  }
+  total += Transition(state, end_sentence).prob;
+  return total;
+}
+
+} // namespace ngram
+} // namespace lm
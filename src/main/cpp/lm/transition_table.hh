@@ -0,0 +1,105 @@
+#ifndef LM_TRANSITION_TABLE_H
+#define LM_TRANSITION_TABLE_H
+
+#include "lm/return.hh"
+#include "lm/word_index.hh"
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+namespace lm {
+namespace ngram {
+
+/* Every state a model can reach from BeginSentenceState() or
+ * NullContextState(), numbered, with what FullScore gives for each of them
+ * and each word: the probability and the number of the state it leads to.
+ * For a model of a few dozen words, such as a tag model, there are only a
+ * few thousand states, and a word costs one array access instead of hashing
+ * and probing every order.  Probabilities are FullScore's own, so a sentence
+ * summed in the same order scores exactly the same.
+ */
+class TransitionTable {
+  public:
+    struct Cell {
+      float prob;
+      uint32_t next;
+    };
+
+    TransitionTable() : words_(0) {}
+
+    /* Number the states of model and fill the table, unless it would take
+     * more than max_bytes.  Each state found costs a FullScore per word, so
+     * giving up on a big model costs about max_bytes / sizeof(Cell) of them.
+     * Returns whether the table was filled; if not, it is left empty.
+     */
+    template <class Model> bool Compile(const Model &model, std::size_t max_bytes);
+
+    bool Empty() const { return cells_.empty(); }
+
+    // The numbers of BeginSentenceState() and NullContextState().
+    uint32_t BeginSentence() const { return 0; }
+    uint32_t NullContext() const { return 1; }
+
+    // word must be below the vocabulary's Bound().
+    const Cell &Transition(uint32_t state, WordIndex word) const {
+      return cells_[static_cast<std::size_t>(state) * words_ + word];
+    }
+
+    /* Sum of prob over the length words at words and then end_sentence, from
+     * BeginSentence(), added in that order.  Every word must be below the
+     * vocabulary's Bound().
+     */
+    float ScoreSentence(const WordIndex *words, std::size_t length, WordIndex end_sentence) const;
+
+    std::size_t States() const { return words_ ? cells_.size() / words_ : 0; }
+
+    std::size_t MemoryUsage() const { return cells_.size() * sizeof(Cell); }
+
+  private:
+    std::vector<Cell> cells_;
+
+    // Cells per state: the vocabulary's Bound().
+    std::size_t words_;
+};
+
+template <class Model> bool TransitionTable::Compile(const Model &model, std::size_t max_bytes) {
+  typedef typename Model::State State;
+  std::vector<Cell>().swap(cells_);
+  words_ = 0;
+  const std::size_t words = model.GetVocabulary().Bound();
+  if (!words) return false;
+  const std::size_t max_states = std::min<std::size_t>(max_bytes / (sizeof(Cell) * words), static_cast<uint32_t>(-1));
+  // States compare by their words, which also determine their backoffs.
+  std::map<State, uint32_t> numbers;
+  std::vector<State> states;
+  states.push_back(model.BeginSentenceState());
+  states.push_back(model.NullContextState());
+  numbers.insert(std::make_pair(states[0], 0));
+  numbers.insert(std::make_pair(states[1], 1));
+  std::vector<Cell> cells;
+  State out;
+  for (std::size_t s = 0; s < states.size(); ++s) {
+    if (states.size() > max_states) return false;
+    for (WordIndex word = 0; word < words; ++word) {
+      Cell cell;
+      cell.prob = model.FullScore(states[s], word, out).prob;
+      std::pair<typename std::map<State, uint32_t>::iterator, bool> found = numbers.insert(std::make_pair(out, static_cast<uint32_t>(states.size())));
+      if (found.second) states.push_back(out);
+      cell.next = found.first->second;
+      cells.push_back(cell);
+    }
+  }
+  cells_.swap(cells);
+  words_ = words;
+  return true;
+}
+
+} // namespace ngram
+} // namespace lm
+
+#endif // LM_TRANSITION_TABLE_H
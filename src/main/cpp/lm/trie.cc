@@ -0,0 +1,110 @@
+#include "lm/trie.hh"
+
+#include "lm/config.hh"
+#include "lm/lm_exception.hh"
+#include "util/sorted_uniform.hh"
+
+#include <cassert>
+
+namespace lm {
+namespace ngram {
+namespace trie {
+namespace {
+
+class WordAccessor {
+  public:
+    explicit WordAccessor(const BitPacked &table) : table_(table) {}
+
+    uint64_t operator()(uint64_t index) const { return table_.Word(index); }
+
+  private:
+    const BitPacked &table_;
+};
+
+} // namespace
+
+uint64_t BitPacked::BaseSize(uint64_t records, uint64_t max_vocab, uint8_t remaining_bits) {
+  uint8_t total_bits = util::RequiredBits(max_vocab) + remaining_bits;
+  // Extra entry for next pointer at the end.
+  // +7 then / 8 to round up bits and convert to bytes
+  // +sizeof(uint64_t) so that ReadInt57 etc don't go segfault.
+  return ALIGN8((records * total_bits + 7) / 8 + sizeof(uint64_t));
+}
+
+void BitPacked::BaseInit(void *base, uint64_t entries, uint64_t max_vocab, uint8_t remaining_bits) {
+  util::BitPackingSanity();
+  word_bits_ = util::RequiredBits(max_vocab);
+  word_mask_ = (1ULL << word_bits_) - 1ULL;
+  UTIL_THROW_IF(word_bits_ > 57, util::Exception, "Sorry, word indices more than " << (1ULL << 57) << " are not implemented.  Edit util/bit_packing.hh and fix the bit packing functions.");
+  total_bits_ = word_bits_ + remaining_bits;
+  max_vocab_ = max_vocab;
+
+  base_ = static_cast<uint8_t*>(base);
+  entries_ = entries;
+}
+
+bool BitPacked::FindWord(WordIndex word, const NodeRange &range, uint64_t &at) const {
+  // Every word is below max_vocab_ + 1, so the search starts with the bounds
+  // of all possible words.
+  return util::BoundedSortedUniformFind(WordAccessor(*this), range.begin - 1, 0, range.end, max_vocab_ + 1, word, at);
+}
+
+uint64_t BitPackedMiddle::Size(uint8_t value_bits, uint64_t entries, uint64_t max_vocab, uint64_t max_next) {
+  return BaseSize(entries + 1, max_vocab, value_bits + util::RequiredBits(max_next));
+}
+
+BitPackedMiddle::BitPackedMiddle(void *base, uint8_t value_bits, uint64_t entries, uint64_t max_vocab, uint64_t max_next) {
+  next_bits_ = util::RequiredBits(max_next);
+  next_mask_ = (1ULL << next_bits_) - 1;
+  UTIL_THROW_IF(next_bits_ > 57, util::Exception, "Sorry, this does not support more than " << (1ULL << 57) << " n-grams of a particular order.  Edit util/bit_packing.hh and fix the bit packing functions.");
+  BaseInit(base, entries, max_vocab, value_bits + next_bits_);
+  next_offset_ = word_bits_ + value_bits;
+}
+
+util::BitAddress BitPackedMiddle::Find(WordIndex word, NodeRange &range, uint64_t &pointer) const {
+  uint64_t at;
+  if (!FindWord(word, range, at)) return util::BitAddress(NULL, 0);
+  pointer = at;
+  range.begin = Next(at);
+  range.end = Next(at + 1);
+  return Value(at);
+}
+
+util::BitAddress BitPackedMiddle::Write(uint64_t index, WordIndex word, uint64_t next) {
+  assert(word <= max_vocab_);
+  assert(index < entries_);
+  uint64_t at = index * total_bits_;
+  util::WriteInt57(base_, at, word_bits_, word);
+  util::WriteInt57(base_, at + next_offset_, next_bits_, next);
+  return util::BitAddress(base_, at + word_bits_);
+}
+
+void BitPackedMiddle::FinishedLoading(uint64_t next_end) {
+  util::WriteInt57(base_, entries_ * total_bits_ + next_offset_, next_bits_, next_end);
+}
+
+uint64_t BitPackedLongest::Size(uint8_t value_bits, uint64_t entries, uint64_t max_vocab) {
+  return BaseSize(entries, max_vocab, value_bits);
+}
+
+BitPackedLongest::BitPackedLongest(void *base, uint8_t value_bits, uint64_t entries, uint64_t max_vocab) {
+  BaseInit(base, entries, max_vocab, value_bits);
+}
+
+util::BitAddress BitPackedLongest::Find(WordIndex word, const NodeRange &range) const {
+  uint64_t at;
+  if (!FindWord(word, range, at)) return util::BitAddress(NULL, 0);
+  return Value(at);
+}
+
+util::BitAddress BitPackedLongest::Write(uint64_t index, WordIndex word) {
+  assert(word <= max_vocab_);
+  assert(index < entries_);
+  uint64_t at = index * total_bits_;
+  util::WriteInt57(base_, at, word_bits_, word);
+  return util::BitAddress(base_, at + word_bits_);
+}
+
+} // namespace trie
+} // namespace ngram
+} // namespace lm
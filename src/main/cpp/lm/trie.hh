@@ -0,0 +1,188 @@
+#ifndef LM_TRIE_H
+#define LM_TRIE_H
+
+#include "lm/search_hashed.hh"
+#include "lm/word_index.hh"
+#include "util/bit_packing.hh"
+#include "util/prefetch.hh"
+
+#include <cstddef>
+
+#include <stdint.h>
+
+namespace lm {
+namespace ngram {
+namespace trie {
+
+/* The trie is keyed on reversed n-grams: the children of the node for
+ * w_k ... w_n are the words w_{k-1} that extend it to the left.  Each order is
+ * one array, sorted first by parent and then by word, so a node's children
+ * are the contiguous range [begin, end) of the next order's array.
+ */
+struct NodeRange {
+  uint64_t begin, end;
+};
+
+// Unigrams are indexed directly by word.
+struct UnigramValue {
+  ProbBackoff weights;
+  uint64_t next;
+};
+
+class Unigram {
+  public:
+    Unigram() : unigram_(NULL) {}
+
+    explicit Unigram(void *start) : unigram_(static_cast<UnigramValue*>(start)) {}
+
+    static uint64_t Size(uint64_t count) {
+      // +1 in case <unk> is not counted, +1 for the end of the last range.
+      return (count + 2) * sizeof(UnigramValue);
+    }
+
+    const ProbBackoff &Lookup(WordIndex index, NodeRange &next) const {
+      next.begin = unigram_[index].next;
+      next.end = unigram_[index + 1].next;
+      return unigram_[index].weights;
+    }
+
+    // For building and checking.
+    UnigramValue *Raw() { return unigram_; }
+    const UnigramValue *Raw() const { return unigram_; }
+
+  private:
+    UnigramValue *unigram_;
+};
+
+/* Records of a fixed number of bits packed back to back: the word, then the
+ * value bits the quantizer asked for, then (in middle orders) the index of
+ * the first child.  Word ids are at most max_vocab.
+ */
+class BitPacked {
+  public:
+    BitPacked() : base_(NULL) {}
+
+    uint64_t Entries() const { return entries_; }
+
+    WordIndex Word(uint64_t index) const {
+      return static_cast<WordIndex>(util::ReadInt57(base_, index * total_bits_, word_bits_, word_mask_));
+    }
+
+    util::BitAddress Value(uint64_t index) const {
+      return util::BitAddress(base_, index * total_bits_ + word_bits_);
+    }
+
+    // Start loading the record FindWord probes first for word in range.
+    void Prefetch(WordIndex word, const NodeRange &range) const {
+      if (range.end <= range.begin) return;
+      uint64_t width = range.end - range.begin;
+      uint64_t offset = static_cast<uint64_t>(static_cast<double>(word) / static_cast<double>(max_vocab_ + 1) * static_cast<double>(width));
+      if (offset >= width) offset = width - 1;
+      util::Prefetch(base_ + (((range.begin + offset) * total_bits_) >> 3));
+    }
+
+  protected:
+    static uint64_t BaseSize(uint64_t records, uint64_t max_vocab, uint8_t remaining_bits);
+
+    void BaseInit(void *base, uint64_t entries, uint64_t max_vocab, uint8_t remaining_bits);
+
+    // Find word among the records in range, which are sorted by word.
+    bool FindWord(WordIndex word, const NodeRange &range, uint64_t &at) const;
+
+    uint8_t word_bits_;
+    uint8_t total_bits_;
+    uint64_t word_mask_;
+    uint64_t max_vocab_;
+
+    uint8_t *base_;
+    uint64_t entries_;
+};
+
+class BitPackedMiddle : public BitPacked {
+  public:
+    // max_next is the number of entries in the next order.
+    static uint64_t Size(uint8_t value_bits, uint64_t entries, uint64_t max_vocab, uint64_t max_next);
+
+    BitPackedMiddle() {}
+
+    BitPackedMiddle(void *base, uint8_t value_bits, uint64_t entries, uint64_t max_vocab, uint64_t max_next);
+
+    /* Find word among the children in range.  On success, range becomes the
+     * children of what was found, pointer its index, and the return value the
+     * address of its value.  Returns a NULL base otherwise.
+     */
+    util::BitAddress Find(WordIndex word, NodeRange &range, uint64_t &pointer) const;
+
+    // Index of the first child of record index.  Next(Entries()) is the end.
+    uint64_t Next(uint64_t index) const {
+      return util::ReadInt57(base_, index * total_bits_ + next_offset_, next_bits_, next_mask_);
+    }
+
+    /* Building: on zeroed memory, write every record in order, then
+     * FinishedLoading with the next order's entry count.  Returns the address
+     * for the quantizer to write the value to.
+     */
+    util::BitAddress Write(uint64_t index, WordIndex word, uint64_t next);
+
+    void FinishedLoading(uint64_t next_end);
+
+  private:
+    uint8_t next_offset_;
+    uint8_t next_bits_;
+    uint64_t next_mask_;
+};
+
+class BitPackedLongest : public BitPacked {
+  public:
+    static uint64_t Size(uint8_t value_bits, uint64_t entries, uint64_t max_vocab);
+
+    BitPackedLongest() {}
+
+    BitPackedLongest(void *base, uint8_t value_bits, uint64_t entries, uint64_t max_vocab);
+
+    util::BitAddress Find(WordIndex word, const NodeRange &range) const;
+
+    util::BitAddress Write(uint64_t index, WordIndex word);
+};
+
+template <class Quant> class MiddlePointer {
+  public:
+    MiddlePointer(const Quant &quant, unsigned char order_minus_2, util::BitAddress address)
+      : quant_(&quant), order_minus_2_(order_minus_2), address_(address) {}
+
+    MiddlePointer() : quant_(NULL), order_minus_2_(0), address_(NULL, 0) {}
+
+    bool Found() const { return address_.base != NULL; }
+
+    float Prob() const { return quant_->MiddleProb(order_minus_2_, address_); }
+
+    float Backoff() const { return quant_->MiddleBackoff(order_minus_2_, address_); }
+
+    float Rest() const { return Prob(); }
+
+  private:
+    const Quant *quant_;
+    unsigned char order_minus_2_;
+    util::BitAddress address_;
+};
+
+template <class Quant> class LongestPointer {
+  public:
+    LongestPointer(const Quant &quant, util::BitAddress address) : quant_(&quant), address_(address) {}
+
+    LongestPointer() : quant_(NULL), address_(NULL, 0) {}
+
+    bool Found() const { return address_.base != NULL; }
+
+    float Prob() const { return quant_->LongestProb(address_); }
+
+  private:
+    const Quant *quant_;
+    util::BitAddress address_;
+};
+
+} // namespace trie
+} // namespace ngram
+} // namespace lm
+
+#endif // LM_TRIE_H
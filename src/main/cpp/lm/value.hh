@@ -2,16 +2,14 @@
 #define LM_VALUE_H
 
 #include "lm/config.hh"
+#include "lm/search_hashed.hh"
+#include "util/bit_packing.hh"
 
-#include <stdint.h>
-
-namespace util {
-
-typedef union { float f; uint32_t i; } FloatEnc;
+#include <cmath>
+#include <functional>
+#include <vector>
 
-const uint32_t kSignBit = 0x80000000;
-
-} // namespace util
+#include <stdint.h>
 
 namespace lm {
 namespace ngram {
@@ -44,6 +42,10 @@ template <class Weights> class GenericProbingProxy {
     const Weights *to_;
 };
 
+inline bool ValidWeights(const ProbBackoff &weights) {
+  return std::isfinite(weights.prob) && std::isfinite(weights.backoff);
+}
+
 struct BackoffValue {
   typedef ProbBackoff Weights;
   static const ModelType kProbingModelType = PROBING;
@@ -62,6 +64,104 @@ struct BackoffValue {
     ProbBackoff value;
     uint64_t GetKey() const { return key; }
   };
+
+  typedef ProbingProxy MiddlePointer;
+
+  typedef detail::ProbEntry LongestEntry;
+  typedef detail::LongestPointer LongestPointer;
+
+  typedef util::IdentityHash KeyHash;
+  typedef std::equal_to<uint64_t> KeyEqual;
+
+  // Values are stored as they are, so there is nothing to keep or decode.
+  // Any entry with a ProbBackoff or Prob value will do.
+  class Codebooks {
+    public:
+      static const bool kStored = false;
+
+      static uint64_t Size(unsigned char /*order*/, const Config &/*config*/) { return 0; }
+
+      static void UpdateConfigFromBinary(const uint8_t * /*start*/, std::size_t /*available*/, Config &/*config*/) {}
+
+      void SetupMemory(void * /*start*/, unsigned char /*order*/, const Config &/*config*/) {}
+
+      void CheckConsistency() const {}
+
+      // Building: nothing to train, and values are stored as they come.
+      void Train(unsigned char /*order*/, std::vector<float> &/*prob*/, std::vector<float> &/*backoff*/) {}
+      void TrainProb(unsigned char /*order*/, std::vector<float> &/*prob*/) {}
+      void FinishedLoading(const Config &/*config*/) {}
+
+      ProbBackoff EncodeMiddle(unsigned char /*order_minus_2*/, float prob, float backoff) const {
+        ProbBackoff ret;
+        ret.prob = prob;
+        ret.backoff = backoff;
+        return ret;
+      }
+
+      Prob EncodeLongest(float prob) const {
+        Prob ret;
+        ret.prob = prob;
+        return ret;
+      }
+
+      template <class Entry> MiddlePointer Middle(unsigned char /*order_minus_2*/, const Entry &entry) const {
+        return MiddlePointer(entry.value);
+      }
+
+      template <class Entry> LongestPointer Longest(const Entry &entry) const {
+        return LongestPointer(entry.value.prob);
+      }
+
+      template <class Entry> bool Valid(const Entry &entry) const { return ValidValue(entry.value); }
+
+    private:
+      static bool ValidValue(const ProbBackoff &value) { return ValidWeights(value); }
+
+      // Longest n-grams never extend left, so the sign bit is always set.
+      static bool ValidValue(const Prob &value) {
+        return std::isfinite(value.prob) && std::signbit(value.prob);
+      }
+  };
+};
+
+/* BackoffValue in probing tables keyed by FingerprintT (uint16_t or uint32_t)
+ * fingerprints instead of whole 64-bit hashes (see util::FingerprintEqual
+ * for the false positive rate).  Middle entries shrink from 16 to 12 or 10
+ * bytes and longest entries from 12 to 8 or 6.
+ */
+template <class FingerprintT> struct FingerprintValue {
+  typedef ProbBackoff Weights;
+  static const ModelType kProbingModelType = (sizeof(FingerprintT) == 2) ? FINGERPRINT16_PROBING : FINGERPRINT32_PROBING;
+
+  typedef BackoffValue::ProbingProxy ProbingProxy;
+
+#pragma pack(push)
+#pragma pack(2)
+  struct ProbingEntry {
+    typedef FingerprintT Key;
+    typedef Weights Value;
+    FingerprintT key;
+    ProbBackoff value;
+    FingerprintT GetKey() const { return key; }
+  };
+
+  struct LongestEntry {
+    typedef FingerprintT Key;
+    typedef Prob Value;
+    FingerprintT key;
+    Prob value;
+    FingerprintT GetKey() const { return key; }
+  };
+#pragma pack(pop)
+
+  typedef ProbingProxy MiddlePointer;
+  typedef detail::LongestPointer LongestPointer;
+
+  typedef util::FingerprintHash<FingerprintT> KeyHash;
+  typedef util::FingerprintEqual<FingerprintT> KeyEqual;
+
+  typedef BackoffValue::Codebooks Codebooks;
 };
 
 } // namespace ngram
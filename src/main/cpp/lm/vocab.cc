@@ -5,6 +5,8 @@
 #include "util/exception.hh"
 #include "util/murmur_hash.hh"
 
+#include <vector>
+
 namespace lm {
 namespace ngram {
 
@@ -44,6 +46,26 @@ uint64_t ProbingVocabulary::Size(uint64_t entries, const Config &config) {
   return Size(entries, config.probing_multiplier);
 }
 
+void ProbingVocabulary::Build(void *start, std::size_t allocated, uint64_t entries, const Config &config, const std::vector<ProbingVocabularyEntry> &words) {
+  UTIL_THROW_IF(allocated != Size(entries, config), util::Exception, "The vocabulary needs " << Size(entries, config) << " bytes, not " << allocated);
+  detail::ProbingVocabularyHeader *header = static_cast<detail::ProbingVocabularyHeader*>(start);
+  header->version = kProbingVocabularyVersion;
+  header->bound = static_cast<WordIndex>(entries);
+  std::vector<uint64_t> keys;
+  std::vector<ProbingVocabularyEntry> inserted;
+  keys.reserve(words.size());
+  inserted.reserve(words.size());
+  for (std::vector<ProbingVocabularyEntry>::const_iterator i = words.begin(); i != words.end(); ++i) {
+    UTIL_THROW_IF(i->value >= entries, util::Exception, "Word id " << i->value << " is not below " << entries);
+    if (!i->value) continue;
+    keys.push_back(i->key);
+    inserted.push_back(*i);
+  }
+  Lookup lookup(static_cast<uint8_t*>(start) + ALIGN8(sizeof(detail::ProbingVocabularyHeader)), allocated - ALIGN8(sizeof(detail::ProbingVocabularyHeader)));
+  // The vocabulary is small next to the n-grams, so one thread will do.
+  lookup.InsertAll(keys.empty() ? NULL : &keys[0], inserted.empty() ? NULL : &inserted[0], inserted.size(), 1);
+}
+
 void ProbingVocabulary::SetupMemory(void *start, std::size_t allocated) {
   detail::ProbingVocabularyHeader *header_ = static_cast<detail::ProbingVocabularyHeader*>(start);
   lookup_ = Lookup(static_cast<uint8_t*>(start) + ALIGN8(sizeof(detail::ProbingVocabularyHeader)), allocated);
@@ -57,5 +79,172 @@ void ProbingVocabulary::SetupMemory(void *start, std::size_t allocated) {
   //lookup_.CheckConsistency(); 
 }
 
+namespace {
+class CheckVocabEntry {
+  public:
+    explicit CheckVocabEntry(WordIndex bound) : bound_(bound) {}
+
+    void operator()(const ProbingVocabularyEntry &entry) const {
+      UTIL_THROW_IF(entry.value >= bound_, FormatLoadException, "Vocabulary maps a word to " << entry.value << " but there are only " << bound_ << " words");
+    }
+
+  private:
+    WordIndex bound_;
+};
+} // namespace
+
+void ProbingVocabulary::CheckConsistency(const void *start, std::size_t allocated, uint64_t entries, unsigned int threads) {
+  try {
+    const detail::ProbingVocabularyHeader *header = static_cast<const detail::ProbingVocabularyHeader*>(start);
+    UTIL_THROW_IF(header->version != kProbingVocabularyVersion, FormatLoadException, "Probing version " << header->version << " is not " << kProbingVocabularyVersion);
+    UTIL_THROW_IF(header->bound != entries, FormatLoadException, "There are " << header->bound << " words but " << entries << " unigrams");
+    // The table is only read; SetupMemory makes the same one.
+    Lookup lookup(const_cast<uint8_t*>(static_cast<const uint8_t*>(start)) + ALIGN8(sizeof(detail::ProbingVocabularyHeader)), allocated);
+    std::size_t found = lookup.CheckConsistency(threads, CheckVocabEntry(header->bound));
+    // <unk> is normally left out, but some builders insert it.
+    UTIL_THROW_IF(found + 1 != entries && found != entries, FormatLoadException, "The vocabulary has " << found << " words but there are " << entries << " unigrams");
+  } catch (util::Exception &e) {
+    e << " in vocabulary";
+    throw;
+  }
+}
+
+namespace {
+const unsigned int kMphVocabularyVersion = 0;
+} // namespace
+
+namespace detail {
+struct MphVocabularyHeader {
+  unsigned int version;
+  // Lowest unused vocab id, as in ProbingVocabularyHeader.
+  WordIndex bound;
+  unsigned int fingerprint_bits;
+};
+} // namespace detail
+
+namespace {
+
+const std::size_t kMphHeaderSize = ALIGN8(sizeof(detail::MphVocabularyHeader));
+
+// Fewer bits would let most unknown words through as known ones.
+const unsigned int kMinFingerprintBits = 8;
+
+void CheckFingerprintBits(unsigned int bits) {
+  UTIL_THROW_IF(bits < kMinFingerprintBits || bits > 64, ConfigException, "Vocabulary fingerprints can have " << kMinFingerprintBits << " to 64 bits, not " << bits);
+}
+
+void CheckStoredFingerprintBits(unsigned int bits) {
+  UTIL_THROW_IF(bits < kMinFingerprintBits || bits > 64, FormatLoadException, "The vocabulary claims " << bits << " fingerprint bits");
+}
+
+uint64_t MphRecordsSize(uint64_t entries, unsigned int fingerprint_bits) {
+  // +sizeof(uint64_t) so that ReadInt57 can read past the last record.
+  return ALIGN8((entries * (util::RequiredBits(entries) + fingerprint_bits) + 7) / 8 + sizeof(uint64_t));
+}
+
+void WriteFingerprint(uint8_t *records, uint64_t bit_off, uint8_t bits, uint64_t fingerprint) {
+  if (bits <= 57) {
+    util::WriteInt57(records, bit_off, bits, fingerprint);
+  } else {
+    util::WriteInt57(records, bit_off, 32, fingerprint & 0xffffffffULL);
+    util::WriteInt57(records, bit_off + 32, bits - 32, fingerprint >> 32);
+  }
+}
+
+} // namespace
+
+uint64_t MphVocabulary::Size(uint64_t entries, const Config &config) {
+  CheckFingerprintBits(config.vocab_fingerprint_bits);
+  return kMphHeaderSize + util::PerfectHash::Size(entries) + MphRecordsSize(entries, config.vocab_fingerprint_bits);
+}
+
+void MphVocabulary::UpdateConfigFromBinary(const void *start, std::size_t available, Config &config) {
+  const detail::MphVocabularyHeader *header = static_cast<const detail::MphVocabularyHeader*>(start);
+  UTIL_THROW_IF(available < sizeof(detail::MphVocabularyHeader), FormatLoadException, "The file ends before the vocabulary header");
+  UTIL_THROW_IF(header->version != kMphVocabularyVersion, FormatLoadException, "The binary file has perfect hash vocabulary version " << header->version << " but the code expects version " << kMphVocabularyVersion);
+  CheckStoredFingerprintBits(header->fingerprint_bits);
+  config.vocab_fingerprint_bits = static_cast<uint8_t>(header->fingerprint_bits);
+}
+
+void MphVocabulary::Attach(void *start, uint64_t entries, uint8_t fingerprint_bits) {
+  uint8_t *base = static_cast<uint8_t*>(start);
+  hash_ = util::PerfectHash(base + kMphHeaderSize, entries);
+  records_ = base + kMphHeaderSize + util::PerfectHash::Size(entries);
+  id_bits_ = util::RequiredBits(entries);
+  id_mask_ = (1ULL << id_bits_) - 1;
+  fingerprint_bits_ = fingerprint_bits;
+  fingerprint_mask_ = (fingerprint_bits == 64) ? ~0ULL : ((1ULL << fingerprint_bits) - 1);
+  total_bits_ = id_bits_ + fingerprint_bits_;
+}
+
+void MphVocabulary::Build(void *start, std::size_t allocated, uint64_t entries, const Config &config, const std::vector<ProbingVocabularyEntry> &words) {
+  UTIL_THROW_IF(allocated != Size(entries, config), util::Exception, "The vocabulary needs " << Size(entries, config) << " bytes, not " << allocated);
+  UTIL_THROW_IF(words.size() > entries, util::Exception, "Asked to build a vocabulary of " << words.size() << " words with " << entries << " entries");
+  detail::MphVocabularyHeader *header = static_cast<detail::MphVocabularyHeader*>(start);
+  header->version = kMphVocabularyVersion;
+  header->bound = static_cast<WordIndex>(entries);
+  header->fingerprint_bits = config.vocab_fingerprint_bits;
+
+  MphVocabulary vocab;
+  vocab.Attach(start, entries, config.vocab_fingerprint_bits);
+  std::vector<uint64_t> keys;
+  keys.reserve(words.size());
+  for (std::vector<ProbingVocabularyEntry>::const_iterator i = words.begin(); i != words.end(); ++i) {
+    UTIL_THROW_IF(i->value >= entries, util::Exception, "Word id " << i->value << " is not below " << entries);
+    keys.push_back(i->key);
+  }
+  vocab.hash_.Build(keys.empty() ? NULL : &keys[0], keys.size());
+  uint8_t *records = const_cast<uint8_t*>(vocab.records_);
+  for (std::vector<ProbingVocabularyEntry>::const_iterator i = words.begin(); i != words.end(); ++i) {
+    uint64_t at = vocab.hash_.Index(i->key) * vocab.total_bits_;
+    util::WriteInt57(records, at, vocab.id_bits_, i->value);
+    WriteFingerprint(records, at + vocab.id_bits_, vocab.fingerprint_bits_, i->key & vocab.fingerprint_mask_);
+  }
+}
+
+void MphVocabulary::SetupMemory(void *start, std::size_t /*allocated*/) {
+  const detail::MphVocabularyHeader *header = static_cast<const detail::MphVocabularyHeader*>(start);
+  UTIL_THROW_IF(header->version != kMphVocabularyVersion, FormatLoadException, "The binary file has perfect hash vocabulary version " << header->version << " but the code expects version " << kMphVocabularyVersion << ".  Please rerun build_binary using the same version of the code.");
+  CheckStoredFingerprintBits(header->fingerprint_bits);
+  Attach(start, header->bound, static_cast<uint8_t>(header->fingerprint_bits));
+  bound_ = header->bound;
+  SetSpecial(Index("<s>"), Index("</s>"), 0);
+}
+
+void MphVocabulary::CheckConsistency(const void *start, std::size_t allocated, uint64_t entries, unsigned int /*threads*/) {
+  try {
+    const detail::MphVocabularyHeader *header = static_cast<const detail::MphVocabularyHeader*>(start);
+    UTIL_THROW_IF(header->version != kMphVocabularyVersion, FormatLoadException, "Perfect hash version " << header->version << " is not " << kMphVocabularyVersion);
+    UTIL_THROW_IF(header->bound != entries, FormatLoadException, "There are " << header->bound << " words but " << entries << " unigrams");
+    CheckStoredFingerprintBits(header->fingerprint_bits);
+    uint64_t expected = kMphHeaderSize + util::PerfectHash::Size(entries) + MphRecordsSize(entries, header->fingerprint_bits);
+    UTIL_THROW_IF(allocated != expected, FormatLoadException, "The vocabulary takes " << allocated << " bytes but should take " << expected);
+    // Only read; SetupMemory makes the same one.
+    MphVocabulary vocab;
+    vocab.Attach(const_cast<void*>(start), entries, static_cast<uint8_t>(header->fingerprint_bits));
+    try {
+      vocab.hash_.CheckConsistency();
+    } catch (const util::Exception &e) {
+      UTIL_THROW(FormatLoadException, e.what());
+    }
+    // Every id but <unk> must appear exactly once.  This is one pass over a
+    // small table, so it does not bother with threads.
+    std::vector<bool> seen(entries, false);
+    uint64_t found = 0;
+    for (uint64_t i = 0; i < entries; ++i) {
+      WordIndex id = static_cast<WordIndex>(util::ReadInt57(vocab.records_, i * vocab.total_bits_, vocab.id_bits_, vocab.id_mask_));
+      if (!id) continue;
+      UTIL_THROW_IF(id >= entries, FormatLoadException, "Vocabulary maps a word to " << id << " but there are only " << entries << " words");
+      UTIL_THROW_IF(seen[id], FormatLoadException, "Vocabulary maps two words to " << id);
+      seen[id] = true;
+      ++found;
+    }
+    UTIL_THROW_IF(found + 1 != entries, FormatLoadException, "The vocabulary has " << found << " words besides <unk> but there are " << entries << " unigrams");
+  } catch (util::Exception &e) {
+    e << " in vocabulary";
+    throw;
+  }
+}
+
 } // namespace ngram
 } // namespace lm
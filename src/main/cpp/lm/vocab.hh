@@ -2,6 +2,8 @@
 #define LM_VOCAB_H
 
 #include "lm/virtual_interface.hh"
+#include "util/bit_packing.hh"
+#include "util/perfect_hash.hh"
 #include "util/probing_hash_table.hh"
 
 #include <limits>
@@ -18,8 +20,12 @@ inline uint64_t HashForVocab(const StringPiece &str) {
   return HashForVocab(str.data(), str.length());
 }
 struct ProbingVocabularyHeader;
+struct MphVocabularyHeader;
 } // namespace detail
 
+// Added to the search's ModelType for models using MphVocabulary.
+const unsigned int kMphVocabularyTypeAdd = 16;
+
 #pragma pack(push)
 #pragma pack(4)
 struct ProbingVocabularyEntry {
@@ -42,6 +48,8 @@ struct ProbingVocabularyEntry {
 // Vocabulary storing a map from uint64_t to WordIndex.
 class ProbingVocabulary : public base::Vocabulary {
   public:
+    static const unsigned int kModelTypeAdd = 0;
+
     ProbingVocabulary() {};
 
     WordIndex Index(const StringPiece &str) const {
@@ -53,12 +61,28 @@ class ProbingVocabulary : public base::Vocabulary {
     // This just unwraps Config to get the probing_multiplier.
     static uint64_t Size(uint64_t entries, const Config &config);
 
+    // Nothing in the image changes the size.
+    static void UpdateConfigFromBinary(const void * /*start*/, std::size_t /*available*/, Config & /*config*/) {}
+
     // Vocab words are [0, Bound()).
     WordIndex Bound() const { return bound_; }
 
+    /* Fill Size(entries, config) zeroed bytes at start with words, as
+     * MphVocabulary::Build does.  <unk> is left out of the table.  Throws
+     * util::Exception for duplicate hashes.
+     */
+    static void Build(void *start, std::size_t allocated, uint64_t entries, const Config &config, const std::vector<ProbingVocabularyEntry> &words);
+
     // Everything else is for populating.  I'm too lazy to hide and friend these, but you'll only get a const reference anyway.
     void SetupMemory(void *start, std::size_t allocated); // + LoadedBinary
 
+    // Check the image SetupMemory would get using threads threads.  Throws
+    // FormatLoadException.
+    static void CheckConsistency(const void *start, std::size_t allocated, uint64_t entries, unsigned int threads);
+
+    // Bound lookups by what the table holds; see Config::probe_threads.
+    void LimitProbes(unsigned int threads) { lookup_.LimitProbes(threads); }
+
   private:
     typedef util::ProbingHashTable<ProbingVocabularyEntry, util::IdentityHash> Lookup;
 
@@ -69,6 +93,79 @@ class ProbingVocabulary : public base::Vocabulary {
     bool saw_unk_;
 };
 
+/* Vocabulary on a minimal perfect hash (see util/perfect_hash.hh) of the same
+ * 64-bit word hashes ProbingVocabulary uses.  Each word gets one bit-packed
+ * record holding its id and a fingerprint: the low
+ * Config::vocab_fingerprint_bits of its hash.  The perfect hash sends unknown
+ * words to an arbitrary record, so the fingerprint is what rejects them.  With
+ * 64 bits, Index() returns exactly what ProbingVocabulary does; with fewer, an
+ * unknown word is mistaken for a known one with probability
+ * 2^-fingerprint_bits.
+ *
+ * Records take fingerprint_bits + log2(words) bits, plus about 4 bits of
+ * perfect hash, against 12 bytes times probing_multiplier for
+ * ProbingVocabulary, and a lookup reads two cache lines instead of probing.
+ */
+class MphVocabulary : public base::Vocabulary {
+  public:
+    static const unsigned int kModelTypeAdd = kMphVocabularyTypeAdd;
+
+    MphVocabulary() {}
+
+    WordIndex Index(const StringPiece &str) const {
+      uint64_t hash = detail::HashForVocab(str);
+      uint64_t at = hash_.Index(hash) * total_bits_;
+      if (Fingerprint(at + id_bits_) != (hash & fingerprint_mask_)) return 0;
+      return static_cast<WordIndex>(util::ReadInt57(records_, at, id_bits_, id_mask_));
+    }
+
+    // Uses config.vocab_fingerprint_bits.
+    static uint64_t Size(uint64_t entries, const Config &config);
+
+    // Read the fingerprint size from the start of the vocabulary image.
+    static void UpdateConfigFromBinary(const void *start, std::size_t available, Config &config);
+
+    // Vocab words are [0, Bound()).
+    WordIndex Bound() const { return bound_; }
+
+    /* Fill Size(entries, config) zeroed bytes at start with words, each the
+     * HashForVocab of a word and its id.  entries is the number of unigrams,
+     * <unk> included; <unk> itself need not be in words.  Throws
+     * util::Exception for duplicate hashes and ConfigException for a bad
+     * fingerprint size.
+     */
+    static void Build(void *start, std::size_t allocated, uint64_t entries, const Config &config, const std::vector<ProbingVocabularyEntry> &words);
+
+    void SetupMemory(void *start, std::size_t allocated);
+
+    // Check the image SetupMemory would get: the perfect hash and every id.
+    // Throws FormatLoadException.
+    static void CheckConsistency(const void *start, std::size_t allocated, uint64_t entries, unsigned int threads);
+
+    // A lookup reads one record whatever the table holds.
+    void LimitProbes(unsigned int) {}
+
+  private:
+    // Fingerprints up to 64 bits, which ReadInt57 cannot do in one go.
+    uint64_t Fingerprint(uint64_t bit_off) const {
+      if (fingerprint_bits_ <= 57) return util::ReadInt57(records_, bit_off, fingerprint_bits_, fingerprint_mask_);
+      return util::ReadInt57(records_, bit_off, 32, 0xffffffffULL) |
+        (util::ReadInt57(records_, bit_off + 32, fingerprint_bits_ - 32, fingerprint_mask_ >> 32) << 32);
+    }
+
+    // Point the members at an image without checking its header.
+    void Attach(void *start, uint64_t entries, uint8_t fingerprint_bits);
+
+    util::PerfectHash hash_;
+
+    const uint8_t *records_;
+
+    uint8_t id_bits_, fingerprint_bits_, total_bits_;
+    uint64_t id_mask_, fingerprint_mask_;
+
+    WordIndex bound_;
+};
+
 } // namespace ngram
 } // namespace lm
 
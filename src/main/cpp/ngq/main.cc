@@ -16,6 +16,9 @@ kenlm_misc();
 FIMPORT void *
 kenlm_init(size_t size, void *data, size_t ex_msg_size, char *ex_msg);
 
+FIMPORT void *
+kenlm_init_file(const char *path, int flags, size_t ex_msg_size, char *ex_msg);
+
 FIMPORT void
 kenlm_clean(void *pHandle);
 
@@ -27,21 +30,11 @@ kenlm_query(void *pHandle, const char *pTag);
 int
 main(void) {
     char file_name [] = "tag.lm.bin"; // "tag.lm.bin" "build.gradle"
-    FILE *f = fopen(file_name, "rb");
-
-    fseek(f, 0, SEEK_END);
-    size_t size = ftell(f);
-    fseek(f, 0, SEEK_SET);  //same as rewind(f);
-
-    void *data = malloc((size + 1)*sizeof(char));
-    fread(data, size, 1, f);
-    fclose(f);
 
     size_t ex_msg_size = 2048;
     char *ex_msg = reinterpret_cast<char *>(malloc((ex_msg_size)*sizeof(char)));
 
-    void *pHandle = kenlm_init(size, data, ex_msg_size, ex_msg);
-    free(data);
+    void *pHandle = kenlm_init_file(file_name, 0, ex_msg_size, ex_msg);
 
     if (!pHandle) {
         std::cout << "kenlm_init exception found." << std::endl;
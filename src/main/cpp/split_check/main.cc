@@ -0,0 +1,138 @@
+// Check util::SplitTokens against the find_first_of loop it replaced.
+//
+// usage: split_check [strings] [seed]
+//
+// Splits random strings (200000 by default) with random delimiter sets, with
+// and without skip_empty, at every alignment, and compares the tokens with
+// the old splitter's (empty tokens dropped for skip_empty).  Strings run to a
+// few blocks so the block boundaries and the bytes after the last full block
+// are covered.  The splitter is compiled into this program, so build it with
+// -mavx2 for the AVX2 path, plainly for SSE2 and with -U__SSE2__ (GCC or
+// Clang) for the scalar one.  Stops after five mismatches and exits 1 on any.
+
+#include "util/split_tokens.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+
+namespace {
+
+// Bytes strings are made of: every default delimiter, a NUL, bytes above
+// 127 and a few letters so tokens are not all empty.
+const char kAlphabet[] = " \t\n\v\f\rabcxyz\x80\xfe\xff";
+const std::size_t kAlphabetSize = sizeof(kAlphabet) - 1 + 1; // and NUL
+
+char RandomByte() {
+    std::size_t i = rand() % kAlphabetSize;
+    return i < sizeof(kAlphabet) - 1 ? kAlphabet[i] : '\0';
+}
+
+class Collect {
+  public:
+    explicit Collect(std::vector<std::string> &out) : out_(out) {}
+
+    void operator()(StringPiece token) {
+        out_.push_back(std::string(token.data(), token.size()));
+    }
+
+  private:
+    std::vector<std::string> &out_;
+};
+
+// The splitting QueryModel did before SplitTokens, with any delimiters.
+void
+Reference(StringPiece piece, StringPiece delimiters, bool skip_empty, std::vector<std::string> &out) {
+    StringPiece::size_type prev_pos = 0;
+    StringPiece::size_type pos;
+    do {
+        pos = piece.find_first_of(delimiters, prev_pos);
+        StringPiece word(piece.substr(prev_pos, pos - prev_pos));
+        prev_pos = pos + 1;
+        if (!skip_empty || !word.empty()) {
+            out.push_back(std::string(word.data(), word.size()));
+        }
+    }
+    while (pos != StringPiece::npos);
+}
+
+std::string
+Printable(const std::string &str) {
+    std::string ret;
+    const char kHex[] = "0123456789abcdef";
+    for (std::size_t i = 0; i < str.size(); ++i) {
+        unsigned char c = static_cast<unsigned char>(str[i]);
+        if (c >= 0x20 && c < 0x7f && c != '\\') {
+            ret += c;
+        } else {
+            ret += "\\x";
+            ret += kHex[c >> 4];
+            ret += kHex[c & 15];
+        }
+    }
+    return ret;
+}
+
+} // namespace
+
+int
+main(int argc, char *argv[]) {
+    const long strings = argc > 1 ? atol(argv[1]) : 200000;
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+    const std::size_t block = util::Delimiters::kBlock;
+    // Room to place a string at every offset within a block.
+    std::vector<char> buffer(8 * block + block);
+
+    long splits = 0;
+    int bad = 0;
+    for (long s = 0; s < strings && bad < 5; ++s) {
+        std::string text;
+        for (std::size_t length = rand() % (4 * block + 4); text.size() < length; ) {
+            text += RandomByte();
+        }
+        if (rand() % 4 == 0) {
+            // Long runs of one delimiter across block boundaries.
+            std::string run(rand() % (2 * block), ' ');
+            text = run + text + run;
+        }
+        text.resize(std::min(text.size(), 8 * block));
+
+        std::string delimiters;
+        switch (rand() % 3) {
+            case 0:
+                delimiters = " ";
+                break;
+            case 1:
+                delimiters = " \t\n\v\f\r";
+                break;
+            default:
+                for (std::size_t count = 1 + rand() % util::Delimiters::kMaxBytes; delimiters.size() < count; ) {
+                    delimiters += RandomByte();
+                }
+        }
+
+        const std::size_t offset = s % block;
+        std::copy(text.begin(), text.end(), buffer.begin() + offset);
+        const StringPiece piece(&buffer[offset], text.size());
+
+        for (int skip_empty = 0; skip_empty < 2; ++skip_empty) {
+            std::vector<std::string> got, want;
+            Collect collect(got);
+            util::SplitTokens(piece, util::Delimiters(delimiters, skip_empty), collect);
+            Reference(piece, delimiters, skip_empty, want);
+            ++splits;
+            if (got != want) {
+                std::cerr << "mismatch: \"" << Printable(text) << "\" delimiters \"" << Printable(delimiters)
+                    << "\" skip_empty " << skip_empty << " offset " << offset << ": "
+                    << got.size() << " tokens, expected " << want.size() << std::endl;
+                ++bad;
+            }
+        }
+    }
+
+    std::cout << splits << " splits in blocks of " << block << " bytes, " << bad << " mismatched" << std::endl;
+    return bad ? 1 : 0;
+}
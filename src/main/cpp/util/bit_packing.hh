@@ -0,0 +1,137 @@
+#ifndef UTIL_BIT_PACKING_H
+#define UTIL_BIT_PACKING_H
+
+/* Bit-level packing routines
+ *
+ * WARNING WARNING WARNING:
+ * The write functions assume that memory is zero initially.  This makes them
+ * faster and is the appropriate case for mmapped language model construction.
+ * These routines assume that unaligned access to uint64_t is fast.  This is
+ * the case on x86_64.  I'm not sure how fast unaligned 64-bit access is on
+ * x86 but my target audience is large language models for which 64-bit is
+ * necessary.
+ *
+ * Call the BitPackingSanity function to sanity check.  Calling once suffices,
+ * but it may be called multiple times when that's inconvenient.
+ */
+
+#include <cstddef>
+#include <cstring>
+
+#include <stdint.h>
+
+namespace util {
+
+// Fields are stored least significant bit first.  On big endian machines the
+// bits of a uint64_t read from an arbitrary byte run the other way.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+inline uint8_t BitPackShift(uint8_t bit, uint8_t length) {
+  return 64 - length - bit;
+}
+#else
+inline uint8_t BitPackShift(uint8_t bit, uint8_t /*length*/) {
+  return bit;
+}
+#endif
+
+inline uint64_t ReadOff(const void *base, uint64_t bit_off) {
+  uint64_t value64;
+  std::memcpy(&value64, static_cast<const uint8_t*>(base) + (bit_off >> 3), sizeof(value64));
+  return value64;
+}
+
+/* Pack integers up to 57 bits using their least significant digits.
+ * The length is specified using mask:
+ * Assumes mask == (1 << length) - 1 where length <= 57.
+ */
+inline uint64_t ReadInt57(const void *base, uint64_t bit_off, uint8_t length, uint64_t mask) {
+  return (ReadOff(base, bit_off) >> BitPackShift(bit_off & 7, length)) & mask;
+}
+/* Assumes value < (1 << length) and length <= 57.
+ * Assumes the memory is zero initially.
+ */
+inline void WriteInt57(void *base, uint64_t bit_off, uint8_t length, uint64_t value) {
+  uint8_t *at = static_cast<uint8_t*>(base) + (bit_off >> 3);
+  uint64_t value64;
+  std::memcpy(&value64, at, sizeof(value64));
+  value64 |= (value << BitPackShift(bit_off & 7, length));
+  std::memcpy(at, &value64, sizeof(value64));
+}
+
+/* Same caveats as above, but for a 25 bit limit. */
+inline uint32_t ReadInt25(const void *base, uint64_t bit_off, uint8_t length, uint32_t mask) {
+  uint32_t value32;
+  std::memcpy(&value32, static_cast<const uint8_t*>(base) + (bit_off >> 3), sizeof(value32));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return (value32 >> (32 - length - (bit_off & 7))) & mask;
+#else
+  return (value32 >> (bit_off & 7)) & mask;
+#endif
+}
+
+typedef union { float f; uint32_t i; } FloatEnc;
+
+inline float ReadFloat32(const void *base, uint64_t bit_off) {
+  FloatEnc encoded;
+  encoded.i = static_cast<uint32_t>(ReadInt57(base, bit_off, 32, 0xffffffffULL));
+  return encoded.f;
+}
+inline void WriteFloat32(void *base, uint64_t bit_off, float value) {
+  FloatEnc encoded;
+  encoded.f = value;
+  WriteInt57(base, bit_off, 32, encoded.i);
+}
+
+const uint32_t kSignBit = 0x80000000;
+
+// Log probabilities are never positive, so their sign need not be stored.
+inline float ReadNonPositiveFloat31(const void *base, uint64_t bit_off) {
+  FloatEnc encoded;
+  encoded.i = static_cast<uint32_t>(ReadInt57(base, bit_off, 31, 0x7fffffffULL));
+  // Sign bit set means negative.
+  encoded.i |= kSignBit;
+  return encoded.f;
+}
+inline void WriteNonPositiveFloat31(void *base, uint64_t bit_off, float value) {
+  FloatEnc encoded;
+  encoded.f = value;
+  encoded.i &= ~kSignBit;
+  WriteInt57(base, bit_off, 31, encoded.i);
+}
+
+void BitPackingSanity();
+
+// Return bits required to store integers upto max_value.  Not the most
+// efficient implementation, but this is only called a few times to size tries.
+uint8_t RequiredBits(uint64_t max_value);
+
+struct BitsMask {
+  static BitsMask ByMax(uint64_t max_value) {
+    BitsMask ret;
+    ret.FromMax(max_value);
+    return ret;
+  }
+  static BitsMask ByBits(uint8_t bits) {
+    BitsMask ret;
+    ret.bits = bits;
+    ret.mask = (1ULL << bits) - 1;
+    return ret;
+  }
+  void FromMax(uint64_t max_value) {
+    bits = RequiredBits(max_value);
+    mask = (1ULL << bits) - 1;
+  }
+  uint8_t bits;
+  uint64_t mask;
+};
+
+struct BitAddress {
+  BitAddress(void *in_base, uint64_t in_offset) : base(in_base), offset(in_offset) {}
+
+  void *base;
+  uint64_t offset;
+};
+
+} // namespace util
+
+#endif // UTIL_BIT_PACKING_H
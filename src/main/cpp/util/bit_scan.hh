@@ -0,0 +1,25 @@
+#ifndef UTIL_BIT_SCAN_H
+#define UTIL_BIT_SCAN_H
+
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace util {
+
+// Index of the lowest set bit of a non-zero mask.
+inline unsigned int LowestBit(uint32_t mask) {
+#ifdef _MSC_VER
+  unsigned long ret;
+  _BitScanForward(&ret, mask);
+  return ret;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+} // namespace util
+
+#endif // UTIL_BIT_SCAN_H
@@ -0,0 +1,380 @@
+#ifndef UTIL_BLOCKED_PROBING_HASH_TABLE_H
+#define UTIL_BLOCKED_PROBING_HASH_TABLE_H
+
+#include "util/bit_scan.hh"
+#include "util/exception.hh"
+#include "util/parallel.hh"
+#include "util/prefetch.hh"
+#include "util/probing_hash_table.hh"
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <numeric>
+#include <vector>
+
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define UTIL_BLOCKED_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UTIL_BLOCKED_SSE2
+#endif
+
+namespace util {
+namespace detail {
+
+/* Compare the 32 bytes of keys at keys with want and with empty at once.
+ * Bit i of each mask is set if byte i belongs to a key equal to it; every
+ * byte of the key is set with SIMD, only its first without.
+ */
+template <class Key> struct CompareKeys;
+
+#if defined(UTIL_BLOCKED_AVX2)
+template <class Key> struct CompareKeys {
+  static void Run(const Key *keys, Key want, Key empty, uint32_t &match, uint32_t &empties) {
+    __m256i got = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys));
+    match = static_cast<uint32_t>(_mm256_movemask_epi8(Equal(got, Broadcast(want))));
+    empties = static_cast<uint32_t>(_mm256_movemask_epi8(Equal(got, Broadcast(empty))));
+  }
+
+  static __m256i Broadcast(uint16_t key) { return _mm256_set1_epi16(static_cast<short>(key)); }
+  static __m256i Broadcast(uint32_t key) { return _mm256_set1_epi32(static_cast<int>(key)); }
+  static __m256i Broadcast(uint64_t key) { return _mm256_set1_epi64x(static_cast<long long>(key)); }
+
+  static __m256i Equal(__m256i a, __m256i b) {
+    switch (sizeof(Key)) {
+      case 2: return _mm256_cmpeq_epi16(a, b);
+      case 4: return _mm256_cmpeq_epi32(a, b);
+      default: return _mm256_cmpeq_epi64(a, b);
+    }
+  }
+};
+#elif defined(UTIL_BLOCKED_SSE2)
+template <class Key> struct CompareKeys {
+  static void Run(const Key *keys, Key want, Key empty, uint32_t &match, uint32_t &empties) {
+    __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys));
+    __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys) + 1);
+    __m128i w = Broadcast(want), e = Broadcast(empty);
+    match = Mask(Equal(low, w), Equal(high, w));
+    empties = Mask(Equal(low, e), Equal(high, e));
+  }
+
+  static uint32_t Mask(__m128i low, __m128i high) {
+    return static_cast<uint32_t>(_mm_movemask_epi8(low)) | (static_cast<uint32_t>(_mm_movemask_epi8(high)) << 16);
+  }
+
+  static __m128i Broadcast(uint16_t key) { return _mm_set1_epi16(static_cast<short>(key)); }
+  static __m128i Broadcast(uint32_t key) { return _mm_set1_epi32(static_cast<int>(key)); }
+  static __m128i Broadcast(uint64_t key) { return _mm_set1_epi64x(static_cast<long long>(key)); }
+
+  // SSE2 has no 64-bit compare: both 32-bit halves must be equal.
+  static __m128i Equal(__m128i a, __m128i b) {
+    switch (sizeof(Key)) {
+      case 2: return _mm_cmpeq_epi16(a, b);
+      case 4: return _mm_cmpeq_epi32(a, b);
+      default: {
+        __m128i halves = _mm_cmpeq_epi32(a, b);
+        return _mm_and_si128(halves, _mm_shuffle_epi32(halves, _MM_SHUFFLE(2, 3, 0, 1)));
+      }
+    }
+  }
+};
+#else
+template <class Key> struct CompareKeys {
+  static void Run(const Key *keys, Key want, Key empty, uint32_t &match, uint32_t &empties) {
+    match = 0;
+    empties = 0;
+    for (std::size_t i = 0; i < 32 / sizeof(Key); ++i) {
+      match |= static_cast<uint32_t>(keys[i] == want) << (i * sizeof(Key));
+      empties |= static_cast<uint32_t>(keys[i] == empty) << (i * sizeof(Key));
+    }
+  }
+};
+#endif
+
+} // namespace detail
+
+/* ProbingHashTable with the keys kept apart from the values, so that one
+ * SIMD compare covers several buckets.  Buckets are grouped in blocks of
+ * kSlots: 32 bytes of keys (4 whole keys or 8 or 16 fingerprints), then
+ * their values.  A lookup compares a whole block's keys with the key and
+ * with the empty key at once and stops at the first bucket that matches
+ * either, starting from the ideal one, so probe chains cost one compare per
+ * block instead of one per bucket and never read values they do not return.
+ *
+ * Buckets are numbered as in a ProbingHashTable with the same number of
+ * buckets and probed in the same order, so the same entries sit in the same
+ * buckets: InsertAll fills one and moves its buckets into blocks.
+ */
+template <class EntryT, class HashT, class EqualT = std::equal_to<typename EntryT::Key> > class BlockedProbingHashTable {
+  public:
+    typedef EntryT Entry;
+    typedef typename Entry::Key Key;
+    typedef typename Entry::Value Value;
+    typedef HashT Hash;
+    typedef EqualT Equal;
+
+    static const std::size_t kSlots = 32 / sizeof(Key);
+
+    struct Block {
+      Key keys[kSlots];
+      Value values[kSlots];
+    };
+
+    // The key and value of the bucket Find stopped at.
+    struct Slot {
+      Slot(const Key &key_in, const Value &value_in) : key(key_in), value(value_in) {}
+      Key GetKey() const { return key; }
+      const Key &key;
+      const Value &value;
+    };
+
+    class ConstIterator {
+      public:
+        ConstIterator() : block_(NULL), slot_(0) {}
+
+        ConstIterator(const Block *block, std::size_t slot) : block_(block), slot_(slot) {}
+
+        Slot operator*() const { return Slot(block_->keys[slot_], block_->values[slot_]); }
+
+      private:
+        const Block *block_;
+        std::size_t slot_;
+    };
+
+    static uint64_t Size(uint64_t entries, float multiplier) {
+      uint64_t buckets = std::max(entries + 1, static_cast<uint64_t>(multiplier * static_cast<float>(entries)));
+      return (buckets + kSlots - 1) / kSlots * sizeof(Block);
+    }
+
+    // Must be assigned to later.
+    BlockedProbingHashTable() : begin_(NULL), end_(NULL), buckets_(0), probes_(0) {}
+
+    BlockedProbingHashTable(void *start, std::size_t allocated, const Key &invalid = Key(), const Hash &hash_func = Hash(), const Equal &equal_func = Equal())
+      : begin_(reinterpret_cast<Block*>(start)),
+        end_(begin_ + allocated / sizeof(Block)),
+        buckets_((allocated / sizeof(Block)) * kSlots),
+        invalid_(invalid),
+        hash_(hash_func),
+        equal_(equal_func),
+        probes_(buckets_) {}
+
+    template <class LookupKey> void Prefetch(const LookupKey key) const {
+      util::Prefetch(begin_ + Ideal(key) / kSlots);
+    }
+
+    template <class LookupKey> bool Find(const LookupKey key, ConstIterator &out) const {
+      std::size_t ideal = Ideal(key);
+      const Block *block = begin_ + ideal / kSlots;
+      // Ignore the buckets of the first block before the ideal one.
+      uint32_t from = ~static_cast<uint32_t>(0) << ((ideal % kSlots) * sizeof(Key));
+      const Key want = StoredKey(equal_, key);
+      // Buckets the lookup may read, counting from the start of block.
+      std::size_t left = probes_ + ideal % kSlots;
+      while (true) {
+        uint32_t match, empty;
+        detail::CompareKeys<Key>::Run(block->keys, want, invalid_, match, empty);
+        uint32_t stop = (match | empty) & from;
+        if (left < kSlots) stop &= ~(~static_cast<uint32_t>(0) << (left * sizeof(Key)));
+        if (stop) {
+          unsigned int bit = LowestBit(stop);
+          if (!(match & (static_cast<uint32_t>(1) << bit))) return false;
+          out = ConstIterator(block, bit / sizeof(Key));
+          return true;
+        }
+        if (left <= kSlots) return false;
+        left -= kSlots;
+        if (++block == end_) block = begin_;
+        from = ~static_cast<uint32_t>(0);
+      }
+    }
+
+    /* Fill the empty (zeroed) table as ProbingHashTable::InsertAll does, with
+     * the same arguments and exceptions, then move the buckets into blocks.
+     * Takes memory for a packed copy of the table while it runs.
+     */
+    template <class LookupKey> void InsertAll(const LookupKey *keys, const Entry *entries, std::size_t count, unsigned int threads) {
+      std::vector<Entry> packed(buckets_);
+      Packed table(packed.empty() ? NULL : &packed[0], buckets_ * sizeof(Entry), invalid_, hash_, equal_);
+      table.InsertAll(keys, entries, count, threads);
+      std::size_t chunks = (buckets_ + kProbingCheckChunk - 1) / kProbingCheckChunk;
+      ParallelFor(chunks, threads, FillChunk(*this, packed));
+      probes_ = table.MaxProbes();
+    }
+
+    /* Bound lookups as ProbingHashTable::LimitProbes does, to the same number
+     * of buckets.  A block is compared whole, so there is no early stop for
+     * runs in order of ideal bucket.
+     */
+    void LimitProbes(unsigned int threads) {
+      std::size_t chunks = (buckets_ + kProbingCheckChunk - 1) / kProbingCheckChunk;
+      std::vector<std::size_t> empty(chunks);
+      probes_ = buckets_;
+      if (!EmptyBefore(threads, empty)) return;
+      std::vector<std::size_t> probes(chunks);
+      ParallelFor(chunks, threads, MeasureChunk(*this, empty, probes));
+      probes_ = *std::max_element(probes.begin(), probes.end());
+    }
+
+    // Call fn with the stored key of every entry, in bucket order.
+    template <class Fn> void ForEachKey(Fn &fn) const {
+      for (const Block *block = begin_; block != end_; ++block) {
+        for (std::size_t i = 0; i < kSlots; ++i) {
+          if (!equal_(block->keys[i], invalid_)) fn(block->keys[i]);
+        }
+      }
+    }
+
+    /* Same as ProbingHashTable::CheckConsistency: every entry must be
+     * reachable from its ideal bucket and some bucket must be empty.
+     * check(entry) is called with a copy of each entry.  Returns the number
+     * of entries.
+     */
+    template <class Check> std::size_t CheckConsistency(unsigned int threads, const Check &check) const {
+      std::size_t chunks = (buckets_ + kProbingCheckChunk - 1) / kProbingCheckChunk;
+      std::vector<std::size_t> empty(chunks);
+      UTIL_THROW_IF(!EmptyBefore(threads, empty), ProbingSizeException, "Completely full");
+      std::vector<std::size_t> entries(chunks);
+      ParallelFor(chunks, threads, CheckChunk<Check>(*this, empty, check, entries));
+      return std::accumulate(entries.begin(), entries.end(), static_cast<std::size_t>(0));
+    }
+
+  private:
+    typedef ProbingHashTable<Entry, Hash, Equal> Packed;
+
+    template <class LookupKey> std::size_t Ideal(const LookupKey key) const {
+      return hash_(key) % buckets_;
+    }
+
+    const Key &KeyAt(std::size_t bucket) const { return begin_[bucket / kSlots].keys[bucket % kSlots]; }
+
+    const Value &ValueAt(std::size_t bucket) const { return begin_[bucket / kSlots].values[bucket % kSlots]; }
+
+    class FillChunk {
+      public:
+        FillChunk(BlockedProbingHashTable &table, const std::vector<Entry> &packed) : table_(table), packed_(packed) {}
+
+        void operator()(std::size_t chunk) const {
+          std::size_t end = std::min(table_.buckets_, (chunk + 1) * kProbingCheckChunk);
+          for (std::size_t i = chunk * kProbingCheckChunk; i < end; ++i) {
+            Block &block = table_.begin_[i / kSlots];
+            block.keys[i % kSlots] = packed_[i].key;
+            block.values[i % kSlots] = packed_[i].value;
+          }
+        }
+
+      private:
+        BlockedProbingHashTable &table_;
+        const std::vector<Entry> &packed_;
+    };
+
+    // Last empty bucket before each chunk, wrapping around, or false if none.
+    bool EmptyBefore(unsigned int threads, std::vector<std::size_t> &empty) const {
+      ParallelFor(empty.size(), threads, FindLastEmpty(*this, empty));
+      std::size_t before = buckets_;
+      for (std::size_t c = empty.size(); c && before == buckets_; --c) before = empty[c - 1];
+      if (before == buckets_) return false;
+      for (std::size_t c = 0; c < empty.size(); ++c) {
+        std::size_t here = empty[c];
+        empty[c] = before;
+        if (here != buckets_) before = here;
+      }
+      return true;
+    }
+
+    class FindLastEmpty {
+      public:
+        FindLastEmpty(const BlockedProbingHashTable &table, std::vector<std::size_t> &out) : table_(table), out_(out) {}
+
+        void operator()(std::size_t chunk) const {
+          std::size_t begin = chunk * kProbingCheckChunk;
+          std::size_t i = std::min(table_.buckets_, begin + kProbingCheckChunk);
+          while (i > begin && !table_.equal_(table_.KeyAt(i - 1), table_.invalid_)) --i;
+          out_[chunk] = (i > begin) ? i - 1 : table_.buckets_;
+        }
+
+      private:
+        const BlockedProbingHashTable &table_;
+        std::vector<std::size_t> &out_;
+    };
+
+    template <class Check> class CheckChunk {
+      public:
+        CheckChunk(const BlockedProbingHashTable &table, const std::vector<std::size_t> &empty_before, const Check &check, std::vector<std::size_t> &entries)
+          : table_(table), empty_before_(empty_before), check_(check), entries_(entries) {}
+
+        void operator()(std::size_t chunk) const {
+          const std::size_t buckets = table_.buckets_;
+          std::size_t empty = empty_before_[chunk];
+          std::size_t end = std::min(buckets, (chunk + 1) * kProbingCheckChunk);
+          std::size_t count = 0;
+          for (std::size_t i = chunk * kProbingCheckChunk; i < end; ++i) {
+            Entry entry;
+            entry.key = table_.KeyAt(i);
+            if (table_.equal_(entry.key, table_.invalid_)) {
+              empty = i;
+              continue;
+            }
+            if (StoresWholeKey<Equal>::value) {
+              std::size_t ideal = table_.Ideal(entry.key);
+              UTIL_THROW_IF((i + buckets - ideal) % buckets >= (i + buckets - empty) % buckets, Exception, "Inconsistency at position " << i << " with ideal " << ideal);
+            }
+            entry.value = table_.ValueAt(i);
+            check_(entry);
+            ++count;
+          }
+          entries_[chunk] = count;
+        }
+
+      private:
+        const BlockedProbingHashTable &table_;
+        const std::vector<std::size_t> &empty_before_;
+        const Check &check_;
+        std::vector<std::size_t> &entries_;
+    };
+
+    class MeasureChunk {
+      public:
+        MeasureChunk(const BlockedProbingHashTable &table, const std::vector<std::size_t> &empty_before, std::vector<std::size_t> &probes)
+          : table_(table), empty_before_(empty_before), probes_(probes) {}
+
+        void operator()(std::size_t chunk) const {
+          const std::size_t buckets = table_.buckets_;
+          std::size_t empty = empty_before_[chunk];
+          std::size_t end = std::min(buckets, (chunk + 1) * kProbingCheckChunk);
+          std::size_t probes = 0;
+          for (std::size_t i = chunk * kProbingCheckChunk; i < end; ++i) {
+            const Key &key = table_.KeyAt(i);
+            if (table_.equal_(key, table_.invalid_)) {
+              empty = i;
+            } else if (StoresWholeKey<Equal>::value) {
+              probes = std::max(probes, (i + buckets - table_.Ideal(key)) % buckets + 1);
+            } else {
+              probes = std::max(probes, (i + buckets - empty) % buckets);
+            }
+          }
+          probes_[chunk] = probes;
+        }
+
+      private:
+        const BlockedProbingHashTable &table_;
+        const std::vector<std::size_t> &empty_before_;
+        std::vector<std::size_t> &probes_;
+    };
+
+    Block *begin_;
+    Block *end_;
+    std::size_t buckets_;
+    Key invalid_;
+    Hash hash_;
+    Equal equal_;
+    // Most buckets a lookup reads; see LimitProbes.
+    std::size_t probes_;
+};
+
+} // namespace util
+
+#endif // UTIL_BLOCKED_PROBING_HASH_TABLE_H
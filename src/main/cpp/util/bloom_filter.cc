@@ -0,0 +1,23 @@
+#include "util/bloom_filter.hh"
+
+#include <algorithm>
+
+namespace util {
+
+namespace {
+// Probes are 9 bits each of one 64-bit product.
+const unsigned int kMaxProbes = 7;
+const uint64_t kMaxLines = 1ULL << 32;
+} // namespace
+
+BloomFilter::BloomFilter(uint64_t entries, unsigned int bits_per_key) : offset_(0), lines_(0), probes_(0) {
+  if (!entries || !bits_per_key) return;
+  lines_ = std::min(kMaxLines - 1, (entries * bits_per_key + kLineWords * 64 - 1) / (kLineWords * 64));
+  // ln 2 bits per probe is best for a plain Bloom filter.
+  probes_ = std::max(1U, std::min(kMaxProbes, (bits_per_key * 69 + 50) / 100));
+  words_.resize(lines_ * kLineWords + kLineWords - 1);
+  // Start on a cache line.
+  offset_ = ((64 - reinterpret_cast<uintptr_t>(&words_[0]) % 64) % 64) / sizeof(uint64_t);
+}
+
+} // namespace util
@@ -0,0 +1,113 @@
+#include "util/checksum.hh"
+
+#include "util/murmur_hash.hh"
+#include "util/parallel.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UTIL_CHECKSUM_SSE2
+#endif
+
+namespace util {
+
+namespace {
+
+const std::size_t kBlock = 1 << 20;
+// Bytes consumed per step: four 64-bit lanes.
+const std::size_t kStripe = 32;
+
+// Per-lane keys, advanced by kKeyStep after every stripe so that swapping two
+// stripes changes the result.
+const uint64_t kKeys[4] = {
+  0x9e3779b185ebca87ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0x27d4eb2f165667c5ULL
+};
+const uint64_t kKeyStep = 0x85ebca77c2b2ae63ULL;
+
+/* Each lane adds the product of the low and high halves of (data ^ key) to
+ * itself and the raw data to its neighbour, as in XXH3.  The two loops below
+ * compute exactly the same thing.
+ */
+#ifdef UTIL_CHECKSUM_SSE2
+void Accumulate(const uint8_t *data, std::size_t stripes, uint64_t *acc) {
+  __m128i acc0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc));
+  __m128i acc1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + 2));
+  __m128i key0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(kKeys));
+  __m128i key1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(kKeys + 2));
+  const __m128i step = _mm_set1_epi64x(static_cast<int64_t>(kKeyStep));
+  for (std::size_t s = 0; s < stripes; ++s, data += kStripe) {
+    __m128i x0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+    __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+    __m128i k0 = _mm_xor_si128(x0, key0);
+    __m128i k1 = _mm_xor_si128(x1, key1);
+    acc0 = _mm_add_epi64(acc0, _mm_mul_epu32(k0, _mm_srli_epi64(k0, 32)));
+    acc1 = _mm_add_epi64(acc1, _mm_mul_epu32(k1, _mm_srli_epi64(k1, 32)));
+    acc0 = _mm_add_epi64(acc0, _mm_shuffle_epi32(x0, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc1 = _mm_add_epi64(acc1, _mm_shuffle_epi32(x1, _MM_SHUFFLE(1, 0, 3, 2)));
+    key0 = _mm_add_epi64(key0, step);
+    key1 = _mm_add_epi64(key1, step);
+  }
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(acc), acc0);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(acc + 2), acc1);
+}
+#else
+inline uint64_t Load64(const uint8_t *p) {
+  uint64_t ret;
+  std::memcpy(&ret, p, sizeof(ret));
+  return ret;
+}
+
+void Accumulate(const uint8_t *data, std::size_t stripes, uint64_t *acc) {
+  uint64_t key[4];
+  std::memcpy(key, kKeys, sizeof(key));
+  for (std::size_t s = 0; s < stripes; ++s, data += kStripe) {
+    for (unsigned int l = 0; l < 4; ++l) {
+      uint64_t x = Load64(data + 8 * l);
+      uint64_t k = x ^ key[l];
+      acc[l] += (k & 0xffffffffULL) * (k >> 32);
+      acc[l ^ 1] += x;
+      key[l] += kKeyStep;
+    }
+  }
+}
+#endif
+
+uint64_t HashBlock(const uint8_t *data, std::size_t size) {
+  uint64_t acc[4];
+  std::memcpy(acc, kKeys, sizeof(acc));
+  std::size_t stripes = size / kStripe;
+  Accumulate(data, stripes, acc);
+  // The tail is shorter than a stripe; fold it in with the lanes.
+  return MurmurHash64A(data + stripes * kStripe, size % kStripe, MurmurHash64A(acc, sizeof(acc), size));
+}
+
+class HashBlocks {
+  public:
+    HashBlocks(const uint8_t *data, std::size_t size, uint64_t *out)
+      : data_(data), size_(size), out_(out) {}
+
+    void operator()(std::size_t block) const {
+      std::size_t begin = block * kBlock;
+      out_[block] = HashBlock(data_ + begin, std::min(kBlock, size_ - begin));
+    }
+
+  private:
+    const uint8_t *data_;
+    std::size_t size_;
+    uint64_t *out_;
+};
+
+} // namespace
+
+uint64_t Checksum(const void *data, std::size_t size, unsigned int threads) {
+  std::vector<uint64_t> blocks((size + kBlock - 1) / kBlock);
+  if (!blocks.empty()) {
+    ParallelFor(blocks.size(), threads, HashBlocks(static_cast<const uint8_t*>(data), size, &blocks[0]));
+  }
+  return MurmurHash64A(blocks.empty() ? NULL : &blocks[0], blocks.size() * sizeof(uint64_t), size);
+}
+
+} // namespace util
@@ -0,0 +1,21 @@
+#ifndef UTIL_CHECKSUM_H
+#define UTIL_CHECKSUM_H
+
+#include <cstddef>
+
+#include <stdint.h>
+
+namespace util {
+
+/* Fast 64-bit checksum for catching corrupted or truncated model files.  Not
+ * cryptographic.  The data is cut into fixed 1 MB blocks that are hashed
+ * independently (with SSE2 where available, otherwise portable code giving
+ * the same result) on up to threads threads, then the block hashes are
+ * combined in order.  The result depends only on the bytes, never on threads
+ * or on the instruction set used.
+ */
+uint64_t Checksum(const void *data, std::size_t size, unsigned int threads = 1);
+
+} // namespace util
+
+#endif // UTIL_CHECKSUM_H
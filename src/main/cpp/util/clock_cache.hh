@@ -0,0 +1,203 @@
+#ifndef UTIL_CLOCK_CACHE_H
+#define UTIL_CLOCK_CACHE_H
+
+#include "util/murmur_hash.hh"
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+
+namespace util {
+
+/* Bounded map from 64-bit keys to small Values, safe to share between
+ * threads.  Entries live in kShards shards, each behind its own lock, in sets
+ * of kWays (one cache line for a 16-byte Entry); a full set evicts by CLOCK
+ * (an entry found since the hand last passed gets another round).  Nothing
+ * expires otherwise.
+ *
+ * Keys go through MurmurMix64 to pick their shard and set, so they need not
+ * be hashes.  Any key but kEmptyKey may be stored.
+ */
+template <class Value> class ClockCache {
+  public:
+    struct Stats {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t evictions;
+      // Entries held.
+      uint64_t entries;
+    };
+
+    static const std::size_t kShards = 64;
+    static const std::size_t kWays = 4;
+    static const uint64_t kEmptyKey = ~static_cast<uint64_t>(0);
+
+    struct Entry {
+      uint64_t key;
+      Value value;
+    };
+
+    // The most entries Reset can be given without taking more than bytes.
+    static std::size_t EntriesIn(std::size_t bytes) {
+      return bytes / (sizeof(Set) + 1) / kShards * kShards * kWays;
+    }
+
+    ClockCache() : sets_per_shard_(0) { ResetStats(); }
+
+    // Room for at least entries.
+    explicit ClockCache(std::size_t entries) { Reset(entries); }
+
+    // Forget everything and make room for at least entries, or none for 0.
+    // Not thread safe.
+    void Reset(std::size_t entries);
+
+    bool Empty() const { return sets_.empty(); }
+
+    // Room for this many entries.
+    std::size_t Capacity() const { return sets_.size() * kWays; }
+
+    bool Find(uint64_t key, Value &value) const { return Find(key, value, AcceptAll()); }
+
+    // Find, but only if accept(the stored value) is true: one it turns down
+    // is a miss.  accept is called under the shard's lock.
+    template <class Accept> bool Find(uint64_t key, Value &value, const Accept &accept) const;
+
+    // Remember a value, evicting another from its set if need be.  A key
+    // already present takes the new value.
+    void Insert(uint64_t key, const Value &value);
+
+    Stats GetStats() const;
+
+  private:
+    struct AcceptAll {
+      bool operator()(const Value &) const { return true; }
+    };
+
+    // The referenced bits of a set's entries are the low kWays bits of its
+    // clock byte, the hand the bits above.
+    static const unsigned int kHandShift = kWays;
+    static const unsigned char kReferenced = (1 << kWays) - 1;
+
+    struct Set {
+      Entry entries[kWays];
+    };
+
+    // Padded so neighbouring shards' locks and counters are a cache line
+    // apart wherever the array lands (new ignores alignas before C++17).
+    struct Shard {
+      std::mutex lock;
+      uint64_t hits, misses, evictions, entries;
+      char padding[64];
+    };
+
+    // The shard is in the low bits of the mixed key, the set within it above.
+    std::size_t SetOf(uint64_t mixed) const {
+      return (mixed % kShards) * sets_per_shard_ + (mixed / kShards) % sets_per_shard_;
+    }
+
+    Shard &ShardOf(uint64_t mixed) const { return shards_[mixed % kShards]; }
+
+    void ResetStats() {
+      for (std::size_t i = 0; i < kShards; ++i) {
+        shards_[i].hits = shards_[i].misses = shards_[i].evictions = shards_[i].entries = 0;
+      }
+    }
+
+    std::size_t sets_per_shard_;
+
+    std::vector<Set> sets_;
+    mutable std::vector<unsigned char> clock_;
+
+    mutable Shard shards_[kShards];
+
+    ClockCache(const ClockCache &);
+    ClockCache &operator=(const ClockCache &);
+};
+
+template <class Value> const std::size_t ClockCache<Value>::kShards;
+template <class Value> const std::size_t ClockCache<Value>::kWays;
+template <class Value> const uint64_t ClockCache<Value>::kEmptyKey;
+
+template <class Value> void ClockCache<Value>::Reset(std::size_t entries) {
+  sets_per_shard_ = (entries + kShards * kWays - 1) / (kShards * kWays);
+  Set empty;
+  for (std::size_t i = 0; i < kWays; ++i) {
+    empty.entries[i].key = kEmptyKey;
+    empty.entries[i].value = Value();
+  }
+  std::vector<Set>(sets_per_shard_ * kShards, empty).swap(sets_);
+  std::vector<unsigned char>(sets_.size(), 0).swap(clock_);
+  ResetStats();
+}
+
+template <class Value> template <class Accept> bool ClockCache<Value>::Find(uint64_t key, Value &value, const Accept &accept) const {
+  if (Empty()) return false;
+  const uint64_t mixed = MurmurMix64(key);
+  const std::size_t set = SetOf(mixed);
+  Shard &shard = ShardOf(mixed);
+  std::lock_guard<std::mutex> lock(shard.lock);
+  const Entry *entries = sets_[set].entries;
+  for (std::size_t i = 0; i < kWays; ++i) {
+    if (entries[i].key == key) {
+      if (!accept(entries[i].value)) break;
+      value = entries[i].value;
+      clock_[set] |= 1 << i;
+      ++shard.hits;
+      return true;
+    }
+  }
+  ++shard.misses;
+  return false;
+}
+
+template <class Value> void ClockCache<Value>::Insert(uint64_t key, const Value &value) {
+  if (Empty()) return;
+  const uint64_t mixed = MurmurMix64(key);
+  const std::size_t set = SetOf(mixed);
+  Shard &shard = ShardOf(mixed);
+  std::lock_guard<std::mutex> lock(shard.lock);
+  Entry *entries = sets_[set].entries;
+  unsigned char &clock = clock_[set];
+  std::size_t victim = kWays;
+  for (std::size_t i = 0; i < kWays; ++i) {
+    if (entries[i].key == key) {
+      entries[i].value = value;
+      return;
+    }
+    if (entries[i].key == kEmptyKey && victim == kWays) victim = i;
+  }
+  if (victim == kWays) {
+    // CLOCK: clear referenced bits from the hand until an unreferenced entry.
+    std::size_t hand = clock >> kHandShift;
+    while (clock & (1 << hand)) {
+      clock &= ~(1 << hand);
+      hand = (hand + 1) % kWays;
+    }
+    victim = hand;
+    clock = (clock & kReferenced) | (((hand + 1) % kWays) << kHandShift);
+    ++shard.evictions;
+  } else {
+    ++shard.entries;
+  }
+  entries[victim].key = key;
+  entries[victim].value = value;
+}
+
+template <class Value> typename ClockCache<Value>::Stats ClockCache<Value>::GetStats() const {
+  Stats ret;
+  ret.hits = ret.misses = ret.evictions = ret.entries = 0;
+  for (std::size_t i = 0; i < kShards; ++i) {
+    std::lock_guard<std::mutex> lock(shards_[i].lock);
+    ret.hits += shards_[i].hits;
+    ret.misses += shards_[i].misses;
+    ret.evictions += shards_[i].evictions;
+    ret.entries += shards_[i].entries;
+  }
+  return ret;
+}
+
+} // namespace util
+
+#endif // UTIL_CLOCK_CACHE_H
@@ -4,6 +4,9 @@
 #include <typeinfo>
 #endif
 
+#include <cerrno>
+#include <cstring>
+
 namespace util {
 
 Exception::Exception() throw() {}
@@ -35,6 +38,42 @@ void Exception::SetLocation(const char *file, unsigned int line, const char *fun
   what_ << old_text;
 }
 
+#if !defined(sun) && !defined(_WIN32) && !defined(_WIN64)
+namespace {
+
+// Only the strerror_r that <cstring> declared, so the other is not unused.
+#if defined(__GLIBC__) && defined(__USE_GNU)
+// The GNU version.
+const char *HandleStrerror(const char *ret, const char * /*buf*/) {
+  return ret;
+}
+#else
+// The XOPEN version.
+const char *HandleStrerror(int ret, const char *buf) {
+  if (!ret) return buf;
+  return NULL;
+}
+#endif
+
+} // namespace
+#endif
+
+ErrnoException::ErrnoException() throw() : errno_(errno) {
+  char buf[200];
+  buf[0] = 0;
+#if defined(sun) || defined(_WIN32) || defined(_WIN64)
+  const char *add = strerror(errno);
+#else
+  const char *add = HandleStrerror(strerror_r(errno, buf, 200), buf);
+#endif
+
+  if (add) {
+    *this << add << ' ';
+  }
+}
+
+ErrnoException::~ErrnoException() throw() {}
+
 OverflowException::OverflowException() throw() {}
 OverflowException::~OverflowException() throw() {}
 
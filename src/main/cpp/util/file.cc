@@ -0,0 +1,221 @@
+#include "util/file.hh"
+
+#include "util/exception.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace util {
+
+scoped_fd::~scoped_fd() {
+#if defined(_WIN32) || defined(_WIN64)
+  if (fd_ != -1) _close(fd_);
+#else
+  if (fd_ != -1) close(fd_);
+#endif
+}
+
+EndOfFileException::EndOfFileException() throw() {
+  *this << "End of file";
+}
+EndOfFileException::~EndOfFileException() throw() {}
+
+int OpenReadOrThrow(const char *name) {
+  int ret;
+#if defined(_WIN32) || defined(_WIN64)
+  UTIL_THROW_IF(-1 == (ret = _open(name, _O_BINARY | _O_RDONLY)), ErrnoException, "while opening " << name);
+#else
+  UTIL_THROW_IF(-1 == (ret = open(name, O_RDONLY)), ErrnoException, "while opening " << name);
+#endif
+  return ret;
+}
+
+int CreateOrThrow(const char *name) {
+  int ret;
+#if defined(_WIN32) || defined(_WIN64)
+  UTIL_THROW_IF(-1 == (ret = _open(name, _O_CREAT | _O_TRUNC | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE)), ErrnoException, "while creating " << name);
+#else
+  UTIL_THROW_IF(-1 == (ret = open(name, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)), ErrnoException, "while creating " << name);
+#endif
+  return ret;
+}
+
+int MakeTempOrThrow(std::string &base) {
+  base += "XXXXXX";
+  std::vector<char> name(base.c_str(), base.c_str() + base.size() + 1);
+  int ret;
+#if defined(_WIN32) || defined(_WIN64)
+  UTIL_THROW_IF(_mktemp_s(&name[0], name.size()), ErrnoException, "while making a temporary name from " << base);
+  UTIL_THROW_IF(-1 == (ret = _open(&name[0], _O_CREAT | _O_EXCL | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE)), ErrnoException, "while creating " << &name[0]);
+#else
+  UTIL_THROW_IF(-1 == (ret = mkstemp(&name[0])), ErrnoException, "while creating a temporary file from " << base);
+  // mkstemp makes it private; match CreateOrThrow.
+  fchmod(ret, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+#endif
+  base.assign(&name[0]);
+  return ret;
+}
+
+void RenameOrThrow(const char *from, const char *to) {
+#if defined(_WIN32) || defined(_WIN64)
+  UTIL_THROW_IF(!MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING), Exception, "Windows error " << GetLastError() << " while renaming " << from << " to " << to);
+#else
+  UTIL_THROW_IF(rename(from, to), ErrnoException, "while renaming " << from << " to " << to);
+#endif
+}
+
+uint64_t SizeFile(int fd) {
+#if defined(_WIN32) || defined(_WIN64)
+  __int64 ret = _filelengthi64(fd);
+  return (ret == -1) ? kBadSize : ret;
+#else
+  struct stat sb;
+  // Does not set errno.
+  if (fstat(fd, &sb) == -1 || (!sb.st_size && !S_ISREG(sb.st_mode))) return kBadSize;
+  return sb.st_size;
+#endif
+}
+
+uint64_t SizeOrThrow(int fd) {
+  uint64_t ret = SizeFile(fd);
+  UTIL_THROW_IF(ret == kBadSize, Exception, "Failed to size fd " << fd);
+  return ret;
+}
+
+void ReadOrThrow(int fd, void *to_void, std::size_t amount) {
+  uint8_t *to = static_cast<uint8_t*>(to_void);
+  while (amount) {
+    // Some platforms refuse reads over 2 GB in one call.
+    std::size_t chunk = std::min<std::size_t>(amount, INT_MAX);
+#if defined(_WIN32) || defined(_WIN64)
+    int ret = _read(fd, to, static_cast<unsigned int>(chunk));
+#else
+    ssize_t ret = read(fd, to, chunk);
+    if (ret == -1 && errno == EINTR) continue;
+#endif
+    UTIL_THROW_IF(ret == -1, ErrnoException, "Reading " << amount << " from fd " << fd << " failed.");
+    UTIL_THROW_IF(ret == 0, EndOfFileException, " in fd " << fd << " but there should be " << amount << " more bytes to read.");
+    amount -= ret;
+    to += ret;
+  }
+}
+
+std::size_t ReadOrEOF(int fd, void *to_void, std::size_t amount) {
+  uint8_t *to = static_cast<uint8_t*>(to_void);
+  std::size_t got = 0;
+  while (got < amount) {
+    std::size_t chunk = std::min<std::size_t>(amount - got, INT_MAX);
+#if defined(_WIN32) || defined(_WIN64)
+    int ret = _read(fd, to + got, static_cast<unsigned int>(chunk));
+#else
+    ssize_t ret = read(fd, to + got, chunk);
+    if (ret == -1 && errno == EINTR) continue;
+#endif
+    UTIL_THROW_IF(ret == -1, ErrnoException, "Reading " << (amount - got) << " from fd " << fd << " failed.");
+    if (ret == 0) break;
+    got += ret;
+  }
+  return got;
+}
+
+void WriteOrThrow(int fd, const void *data_void, std::size_t size) {
+  const uint8_t *data = static_cast<const uint8_t*>(data_void);
+  while (size) {
+    std::size_t chunk = std::min<std::size_t>(size, INT_MAX);
+#if defined(_WIN32) || defined(_WIN64)
+    int ret = _write(fd, data, static_cast<unsigned int>(chunk));
+#else
+    ssize_t ret = write(fd, data, chunk);
+    if (ret == -1 && errno == EINTR) continue;
+#endif
+    UTIL_THROW_IF(ret < 1, ErrnoException, "Write failed with " << size << " bytes left to fd " << fd);
+    data += ret;
+    size -= ret;
+  }
+}
+
+void SeekOrThrow(int fd, uint64_t off) {
+#if defined(_WIN32) || defined(_WIN64)
+  __int64 ret = _lseeki64(fd, off, SEEK_SET);
+#else
+  off_t ret = lseek(fd, off, SEEK_SET);
+#endif
+  UTIL_THROW_IF(ret == -1, ErrnoException, "Seek to " << off << " in fd " << fd << " failed");
+}
+
+void ResizeOrThrow(int fd, uint64_t to) {
+#if defined(_WIN32) || defined(_WIN64)
+  errno_t ret = _chsize_s(fd, to);
+#else
+  int ret = ftruncate(fd, to);
+#endif
+  UTIL_THROW_IF(ret, ErrnoException, "while resizing fd " << fd << " to " << to);
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+
+void LockOrThrow(int, bool) {
+  UTIL_THROW(Exception, "File locking is not implemented on Windows.");
+}
+
+void UnlockOrThrow(int) {}
+
+int CreateSegment(const char *name) {
+  UTIL_THROW(Exception, "Shared memory segments are not implemented on Windows.  Segment: " << name);
+}
+
+int OpenSegmentReadOnly(const char *name) {
+  UTIL_THROW(Exception, "Shared memory segments are not implemented on Windows.  Segment: " << name);
+}
+
+bool UnlinkSegment(const char *) { return false; }
+
+#else
+
+void LockOrThrow(int fd, bool exclusive) {
+  int ret;
+  while ((ret = flock(fd, exclusive ? LOCK_EX : LOCK_SH)) == -1 && errno == EINTR) {}
+  UTIL_THROW_IF(ret, ErrnoException, "while locking fd " << fd);
+}
+
+void UnlockOrThrow(int fd) {
+  UTIL_THROW_IF(flock(fd, LOCK_UN), ErrnoException, "while unlocking fd " << fd);
+}
+
+int CreateSegment(const char *name) {
+  int ret = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  UTIL_THROW_IF(ret == -1 && errno != EEXIST, ErrnoException, "while creating shared memory segment " << name);
+  return ret;
+}
+
+int OpenSegmentReadOnly(const char *name) {
+  int ret = shm_open(name, O_RDONLY, 0);
+  UTIL_THROW_IF(ret == -1 && errno != ENOENT, ErrnoException, "while opening shared memory segment " << name);
+  return ret;
+}
+
+bool UnlinkSegment(const char *name) {
+  if (!shm_unlink(name)) return true;
+  UTIL_THROW_IF(errno != ENOENT, ErrnoException, "while unlinking shared memory segment " << name);
+  return false;
+}
+
+#endif
+
+} // namespace util
@@ -0,0 +1,94 @@
+#ifndef UTIL_FILE_H
+#define UTIL_FILE_H
+
+#include "util/exception.hh"
+
+#include <cstddef>
+#include <string>
+
+#include <stdint.h>
+
+namespace util {
+
+class scoped_fd {
+  public:
+    scoped_fd() : fd_(-1) {}
+
+    explicit scoped_fd(int fd) : fd_(fd) {}
+
+    ~scoped_fd();
+
+    void reset(int to = -1) {
+      scoped_fd other(fd_);
+      fd_ = to;
+    }
+
+    int get() const { return fd_; }
+
+    int operator*() const { return fd_; }
+
+    int release() {
+      int ret = fd_;
+      fd_ = -1;
+      return ret;
+    }
+
+  private:
+    int fd_;
+
+    scoped_fd(const scoped_fd &);
+    scoped_fd &operator=(const scoped_fd &);
+};
+
+class EndOfFileException : public Exception {
+  public:
+    EndOfFileException() throw();
+    ~EndOfFileException() throw();
+};
+
+// Open for read only.
+int OpenReadOrThrow(const char *name);
+
+// Create or truncate for writing.
+int CreateOrThrow(const char *name);
+
+// Create a new file for writing whose name is base followed by a unique
+// suffix.  Sets base to the whole name.
+int MakeTempOrThrow(std::string &base);
+
+// Atomically replace to, if it exists, with from.
+void RenameOrThrow(const char *from, const char *to);
+
+// Return value for SizeFile when it can't size properly.
+const uint64_t kBadSize = (uint64_t)-1;
+uint64_t SizeFile(int fd);
+uint64_t SizeOrThrow(int fd);
+
+// Read exactly size bytes from the current position or throw.
+void ReadOrThrow(int fd, void *to, std::size_t size);
+// Same but stop early at the end of the file.  Returns the bytes read.
+std::size_t ReadOrEOF(int fd, void *to, std::size_t size);
+
+void WriteOrThrow(int fd, const void *data, std::size_t size);
+
+// Seek to an absolute offset.
+void SeekOrThrow(int fd, uint64_t off);
+
+void ResizeOrThrow(int fd, uint64_t to);
+
+// Advisory lock on the whole file (flock).  Closing the fd releases it.
+void LockOrThrow(int fd, bool exclusive);
+void UnlockOrThrow(int fd);
+
+/* POSIX shared memory segments, named like shm_open(3) names e.g. "/tag.lm".
+ * These return -1 instead of throwing when the segment already exists or
+ * does not exist, respectively.
+ */
+int CreateSegment(const char *name);
+int OpenSegmentReadOnly(const char *name);
+// Returns false if there was no such segment.
+bool UnlinkSegment(const char *name);
+
+} // namespace util
+
+#endif // UTIL_FILE_H
@@ -0,0 +1,289 @@
+/* Memory mapping wrappers.
+ * ARM and MinGW ports contributed by Hideo Okuma and Tomoyuki Yoshimura at
+ * NICT.
+ */
+#include "util/mmap.hh"
+
+#include "util/exception.hh"
+#include "util/file.hh"
+#include "util/scoped.hh"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace util {
+
+namespace {
+
+void UnmapOrThrow(void *start, size_t length) {
+#if defined(_WIN32) || defined(_WIN64)
+  UTIL_THROW_IF(!::UnmapViewOfFile(start), ErrnoException, "Failed to unmap a file");
+#else
+  UTIL_THROW_IF(munmap(start, length), ErrnoException, "munmap failed with " << start << " for length " << length);
+#endif
+}
+
+void ReadAt(int fd, uint64_t offset, std::size_t size, scoped_memory &out) {
+  out.reset(MallocOrThrow(size), size, scoped_memory::MALLOC_ALLOCATED);
+#if defined(_WIN32) || defined(_WIN64)
+  UTIL_THROW_IF(_lseeki64(fd, offset, SEEK_SET) == -1, ErrnoException, "Seek failed");
+#else
+  UTIL_THROW_IF(lseek(fd, offset, SEEK_SET) == -1, ErrnoException, "Seek failed");
+#endif
+  ReadOrThrow(fd, out.get(), size);
+}
+
+} // namespace
+
+void *MapOrThrow(std::size_t size, bool for_write, bool prefault, int fd, uint64_t offset) {
+#if defined(_WIN32) || defined(_WIN64)
+  int protectC = for_write ? PAGE_READWRITE : PAGE_READONLY;
+  int protectM = for_write ? FILE_MAP_WRITE : FILE_MAP_READ;
+  HANDLE hMapping = CreateFileMapping((HANDLE)_get_osfhandle(fd), NULL, protectC, 0, 0, NULL);
+  UTIL_THROW_IF(!hMapping, ErrnoException, "CreateFileMapping failed");
+  LARGE_INTEGER l;
+  l.QuadPart = offset;
+  void *ret = MapViewOfFile(hMapping, protectM, l.HighPart, l.LowPart, size);
+  CloseHandle(hMapping);
+  UTIL_THROW_IF(!ret, ErrnoException, "MapViewOfFile failed");
+#else
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE // Linux specific
+  if (prefault) {
+    flags |= MAP_POPULATE;
+  }
+#endif
+  int protect = for_write ? (PROT_READ | PROT_WRITE) : PROT_READ;
+  void *ret;
+  UTIL_THROW_IF((ret = mmap(NULL, size, protect, flags, fd, offset)) == MAP_FAILED, ErrnoException, "mmap failed for size " << size << " at offset " << offset);
+#endif
+  return ret;
+}
+
+namespace {
+const std::size_t kHugePageSize = 2 << 20;
+
+std::size_t RoundUp(std::size_t value, std::size_t multiple) {
+  return ((value + multiple - 1) / multiple) * multiple;
+}
+} // namespace
+
+void scoped_memory::reset(void *data, std::size_t size, Alloc source) {
+  switch(source_) {
+    case MMAP_ROUND_2M_ALLOCATED:
+      try {
+        UnmapOrThrow(data_, RoundUp(size_, kHugePageSize));
+      } catch (const Exception &e) {
+        std::cerr << e.what() << std::endl;
+        abort();
+      }
+      break;
+    case MMAP_ALLOCATED:
+      try {
+        UnmapOrThrow(data_, size_);
+      } catch (const Exception &e) {
+        std::cerr << e.what() << std::endl;
+        abort();
+      }
+      break;
+    case MALLOC_ALLOCATED:
+      std::free(data_);
+      break;
+    case NONE_ALLOCATED:
+      break;
+  }
+  data_ = data;
+  size_ = size;
+  source_ = source;
+}
+
+const char *AllocatePolicyName(AllocatePolicy policy) {
+  switch (policy) {
+    case ALLOCATE_MALLOC: return "malloc";
+    case ALLOCATE_ALIGNED: return "aligned";
+    case ALLOCATE_TRANSPARENT_HUGE: return "transparent huge pages";
+    case ALLOCATE_HUGETLB: return "hugetlb";
+  }
+  return "unknown";
+}
+
+namespace {
+
+#if !defined(_WIN32) && !defined(_WIN64)
+// Anonymous private memory, or NULL if the kernel refuses.
+void *AnonymousMap(std::size_t size, int extra_flags) {
+  void *ret = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+  return ret == MAP_FAILED ? NULL : ret;
+}
+
+// Map enough to find a 2 MB aligned range of size bytes, then give back the
+// ends.  Transparent huge pages only back aligned 2 MB ranges.
+void *HugeAlignedMap(std::size_t size) {
+  std::size_t rounded = RoundUp(size, kHugePageSize);
+  uint8_t *wide = static_cast<uint8_t*>(AnonymousMap(rounded + kHugePageSize, 0));
+  if (!wide) return NULL;
+  uint8_t *aligned = reinterpret_cast<uint8_t*>(RoundUp(reinterpret_cast<uintptr_t>(wide), kHugePageSize));
+  if (aligned != wide) UnmapOrThrow(wide, aligned - wide);
+  if (aligned + rounded != wide + rounded + kHugePageSize) {
+    UnmapOrThrow(aligned + rounded, (wide + rounded + kHugePageSize) - (aligned + rounded));
+  }
+  return aligned;
+}
+#endif
+
+} // namespace
+
+AllocatePolicy AllocateImage(std::size_t size, AllocatePolicy policy, scoped_memory &to) {
+#if !defined(_WIN32) && !defined(_WIN64)
+  void *got;
+  switch (policy) {
+    case ALLOCATE_HUGETLB:
+#ifdef MAP_HUGETLB
+      if ((got = AnonymousMap(RoundUp(size, kHugePageSize), MAP_HUGETLB))) {
+        to.reset(got, size, scoped_memory::MMAP_ROUND_2M_ALLOCATED);
+        return ALLOCATE_HUGETLB;
+      }
+#endif
+      // Fall through.
+    case ALLOCATE_TRANSPARENT_HUGE:
+      if ((got = HugeAlignedMap(size))) {
+        to.reset(got, size, scoped_memory::MMAP_ROUND_2M_ALLOCATED);
+#ifdef MADV_HUGEPAGE
+        if (!madvise(got, RoundUp(size, kHugePageSize), MADV_HUGEPAGE)) return ALLOCATE_TRANSPARENT_HUGE;
+#endif
+        return ALLOCATE_ALIGNED;
+      }
+      // Fall through.
+    case ALLOCATE_ALIGNED:
+      if ((got = AnonymousMap(size, 0))) {
+        to.reset(got, size, scoped_memory::MMAP_ALLOCATED);
+        return ALLOCATE_ALIGNED;
+      }
+      // Fall through.
+    case ALLOCATE_MALLOC:
+      break;
+  }
+#endif
+  to.reset(MallocOrThrow(size), size, scoped_memory::MALLOC_ALLOCATED);
+  return ALLOCATE_MALLOC;
+}
+
+uint8_t TouchPages(const void *begin, std::size_t size) {
+  // Pages are at least this big everywhere we run.
+  const std::size_t kStride = 4096;
+  const volatile uint8_t *i = static_cast<const volatile uint8_t*>(begin);
+  const volatile uint8_t *end = i + size;
+  uint8_t ret = 0;
+  for (; i < end; i += kStride) ret ^= *i;
+  if (size) ret ^= *(end - 1);
+  return ret;
+}
+
+void MapRead(LoadMethod method, int fd, uint64_t offset, std::size_t size, scoped_memory &out) {
+  switch (method) {
+    case LAZY:
+      out.reset(MapOrThrow(size, false, false, fd, offset), size, scoped_memory::MMAP_ALLOCATED);
+      break;
+    case POPULATE_OR_LAZY:
+#ifdef MAP_POPULATE
+    case POPULATE_OR_READ:
+#endif
+      out.reset(MapOrThrow(size, false, true, fd, offset), size, scoped_memory::MMAP_ALLOCATED);
+      break;
+#ifndef MAP_POPULATE
+    case POPULATE_OR_READ:
+#endif
+    case READ:
+      ReadAt(fd, offset, size, out);
+      break;
+  }
+}
+
+void AdviseMapping(const scoped_memory &mem, unsigned int advice) {
+#if !defined(_WIN32) && !defined(_WIN64)
+  if (mem.source() != scoped_memory::MMAP_ALLOCATED) return;
+  // Advice is only a hint, so failure is not worth an exception.
+  if (advice & ADVISE_RANDOM) madvise(mem.get(), mem.size(), MADV_RANDOM);
+  if (advice & ADVISE_WILLNEED) madvise(mem.get(), mem.size(), MADV_WILLNEED);
+#endif
+}
+
+namespace {
+
+// The creator locks the segment right after creating it, so an attacher can
+// only find it empty for a moment.  Wait for up to about ten seconds.
+const unsigned int kAttachAttempts = 10000;
+
+void SleepBriefly() {
+#if defined(_WIN32) || defined(_WIN64)
+  Sleep(1);
+#else
+  usleep(1000);
+#endif
+}
+
+void FillSegment(int fd, const void *data, std::size_t size, std::size_t header_size) {
+  ResizeOrThrow(fd, size);
+  scoped_memory writable(MapOrThrow(size, true, false, fd), size, scoped_memory::MMAP_ALLOCATED);
+  const char *from = static_cast<const char*>(data);
+  char *to = static_cast<char*>(writable.get());
+  std::memcpy(to + header_size, from + header_size, size - header_size);
+  std::memcpy(to, from, header_size);
+}
+
+} // namespace
+
+bool PublishOrAttachSegment(const char *name, const void *data, std::size_t size, std::size_t header_size, scoped_memory &out) {
+  for (unsigned int attempt = 0; attempt < kAttachAttempts; ++attempt) {
+    if (data) {
+      scoped_fd created(CreateSegment(name));
+      if (created.get() != -1) {
+        try {
+          LockOrThrow(created.get(), true);
+          FillSegment(created.get(), data, size, header_size);
+          MapRead(LAZY, created.get(), 0, size, out);
+          UnlockOrThrow(created.get());
+        } catch (...) {
+          UnlinkSegment(name);
+          throw;
+        }
+        return true;
+      }
+    }
+    scoped_fd attached(OpenSegmentReadOnly(name));
+    if (attached.get() == -1) {
+      UTIL_THROW_IF(!data, Exception, "Shared memory segment " << name << " does not exist and there is no data to publish");
+      // The creator gave up and unlinked it.  Try to create it ourselves.
+      continue;
+    }
+    LockOrThrow(attached.get(), false);
+    uint64_t got = SizeOrThrow(attached.get());
+    if (!got) {
+      // Created but not locked yet.
+      UnlockOrThrow(attached.get());
+      SleepBriefly();
+      continue;
+    }
+    UTIL_THROW_IF(data && got != size, Exception, "Shared memory segment " << name << " holds " << got << " bytes but the model to publish has " << size << ".  Is it left over from another model?  Unlink it or use a different name.");
+    MapRead(LAZY, attached.get(), 0, got, out);
+    const char *header = out.begin();
+    UTIL_THROW_IF(got < header_size || std::count(header, header + header_size, 0) == static_cast<std::ptrdiff_t>(header_size), Exception, "Shared memory segment " << name << " was never completed.  Its creator probably died.  Unlink it and load again.");
+    return false;
+  }
+  UTIL_THROW(Exception, "Timed out waiting for shared memory segment " << name);
+}
+
+} // namespace util
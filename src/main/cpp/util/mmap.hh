@@ -0,0 +1,124 @@
+#ifndef UTIL_MMAP_H
+#define UTIL_MMAP_H
+// Utilities for mmaped files and for owning model memory regardless of where
+// it came from.
+
+#include <cstddef>
+
+#include <stdint.h>
+
+namespace util {
+
+/* A region of memory together with the knowledge of how to release it.  The
+ * model image can be a private copy, memory the caller still owns, or a
+ * mapping, so the owner records the source rather than assuming malloc.
+ */
+class scoped_memory {
+  public:
+    typedef enum {
+      MMAP_ROUND_2M_ALLOCATED, // The size was rounded up to a multiple of 2 MB.  Do the same before munmap.
+      MMAP_ALLOCATED, // munmap
+      MALLOC_ALLOCATED, // free
+      NONE_ALLOCATED // nothing here, or borrowed from the caller!
+    } Alloc;
+
+    scoped_memory(void *data, std::size_t size, Alloc source)
+      : data_(data), size_(size), source_(source) {}
+
+    scoped_memory() : data_(NULL), size_(0), source_(NONE_ALLOCATED) {}
+
+    ~scoped_memory() { reset(); }
+
+    void *get() const { return data_; }
+    const char *begin() const { return reinterpret_cast<char*>(data_); }
+    const char *end() const { return reinterpret_cast<char*>(data_) + size_; }
+    std::size_t size() const { return size_; }
+
+    Alloc source() const { return source_; }
+
+    void reset() { reset(NULL, 0, NONE_ALLOCATED); }
+
+    void reset(void *data, std::size_t size, Alloc from);
+
+  private:
+    void *data_;
+    std::size_t size_;
+
+    Alloc source_;
+
+    scoped_memory(const scoped_memory &);
+    scoped_memory &operator=(const scoped_memory &);
+};
+
+typedef enum {
+  // mmap with no prepopulate.  Pages are faulted in on first use.
+  LAZY,
+  // On linux, pass MAP_POPULATE to mmap.
+  POPULATE_OR_LAZY,
+  // Populate on Linux.  malloc and read on non-Linux.
+  POPULATE_OR_READ,
+  // malloc and read.
+  READ
+} LoadMethod;
+
+// Hints for the kernel about a mapping, combined with |.
+typedef enum {
+  ADVISE_NORMAL = 0,
+  // Lookups hash to random pages, so read-ahead on a fault is wasted I/O.
+  ADVISE_RANDOM = 1,
+  // Start reading the whole mapping in the background now.
+  ADVISE_WILLNEED = 2
+} MapAdvice;
+
+// How to allocate memory for a private copy of a model, from least to most
+// TLB friendly.  Each policy falls back to the one before it.
+typedef enum {
+  // Plain malloc.
+  ALLOCATE_MALLOC,
+  // Page aligned anonymous memory.
+  ALLOCATE_ALIGNED,
+  // 2 MB aligned anonymous memory with madvise(MADV_HUGEPAGE), for kernels
+  // whose transparent huge pages are set to madvise.
+  ALLOCATE_TRANSPARENT_HUGE,
+  // MAP_HUGETLB from the huge page pool reserved in vm.nr_hugepages.
+  ALLOCATE_HUGETLB
+} AllocatePolicy;
+
+const char *AllocatePolicyName(AllocatePolicy policy);
+
+// Allocate size bytes under policy.  Returns the policy that was actually
+// used, which is weaker than the one requested if the system refused.
+AllocatePolicy AllocateImage(std::size_t size, AllocatePolicy policy, scoped_memory &to);
+
+// Read one byte from every page in [begin, begin + size) so the range is
+// resident and in the TLB's page tables.  The return value only exists so the
+// reads cannot be optimized away.
+uint8_t TouchPages(const void *begin, std::size_t size);
+
+// Map size bytes of fd at offset, shared with other processes.
+void *MapOrThrow(std::size_t size, bool for_write, bool prefault, int fd, uint64_t offset = 0);
+
+// Map or read size bytes of fd starting at offset, read-only and shared with
+// other processes mapping the same file.
+void MapRead(LoadMethod method, int fd, uint64_t offset, std::size_t size, scoped_memory &out);
+
+// Apply MapAdvice flags to memory that came from MapRead.  Does nothing for
+// memory that was read or if the platform has no madvise.
+void AdviseMapping(const scoped_memory &mem, unsigned int advice);
+
+/* Publish size bytes from data as the shared memory segment name, or attach to
+ * the segment if another process already published it.  Either way out ends
+ * up as a read-only shared mapping of the segment.  Returns true if this call
+ * created the segment.
+ *
+ * The creator holds an exclusive lock on the segment while filling it and
+ * writes the first header_size bytes last, so an attacher never sees a
+ * partial image behind a valid header.  If the creator dies part way, the
+ * header stays zero and attachers fail until the segment is unlinked.
+ * Attachers may pass data = NULL; if they pass data, size must match.
+ */
+bool PublishOrAttachSegment(const char *name, const void *data, std::size_t size, std::size_t header_size, scoped_memory &out);
+
+} // namespace util
+
+#endif // UTIL_MMAP_H
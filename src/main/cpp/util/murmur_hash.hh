@@ -8,6 +8,16 @@ namespace util {
 // 64-bit machine version
 uint64_t MurmurHash64A(const void * key, std::size_t len, uint64_t seed = 0);
 
+// MurmurHash3's 64-bit finalizer: a bijection that spreads every bit of key
+// over the result, for picking buckets with keys that are not hashes.
+inline uint64_t MurmurMix64(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  return key ^ (key >> 33);
+}
+
 } // namespace util
 
 #endif // UTIL_MURMUR_HASH_H
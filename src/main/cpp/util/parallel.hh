@@ -0,0 +1,59 @@
+#ifndef UTIL_PARALLEL_H
+#define UTIL_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace util {
+
+/* Call fn(i) for every i in [0, count) using up to threads threads, the
+ * calling thread included.  Items are handed out one at a time, so uneven
+ * items balance out.  If fn throws, remaining items are skipped and the first
+ * exception is rethrown here once every thread has stopped.
+ */
+template <class Fn> void ParallelFor(std::size_t count, unsigned int threads, const Fn &fn) {
+  std::atomic<std::size_t> next(0);
+  std::atomic<bool> failed(false);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  struct Worker {
+    static void Run(const Fn &fn, std::size_t count, std::atomic<std::size_t> &next, std::atomic<bool> &failed, std::exception_ptr &error, std::mutex &error_mutex) {
+      try {
+        for (std::size_t i; !failed.load(std::memory_order_relaxed) && (i = next.fetch_add(1)) < count; ) {
+          fn(i);
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) error = std::current_exception();
+        failed = true;
+      }
+    }
+  };
+
+  std::size_t extra = std::min<std::size_t>(threads ? threads - 1 : 0, count ? count - 1 : 0);
+  std::vector<std::thread> workers;
+  workers.reserve(extra);
+  try {
+    for (std::size_t t = 0; t < extra; ++t) {
+      workers.push_back(std::thread(&Worker::Run, std::cref(fn), count, std::ref(next), std::ref(failed), std::ref(error), std::ref(error_mutex)));
+    }
+  } catch (const std::system_error &) {
+    // Out of threads: make do with the ones we have.
+  }
+  Worker::Run(fn, count, next, failed, error, error_mutex);
+  for (std::vector<std::thread>::iterator i = workers.begin(); i != workers.end(); ++i) {
+    i->join();
+  }
+  if (error) std::rethrow_exception(error);
+}
+
+} // namespace util
+
+#endif // UTIL_PARALLEL_H
@@ -0,0 +1,147 @@
+#include "util/perfect_hash.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace util {
+
+namespace {
+
+// Buckets are about kBucketScale * n / log2(n).  Fewer buckets save pilot
+// space but need larger pilots, and 16 bits must suffice.
+const double kBucketScale = 5.0;
+
+// Seeds tried before giving up.
+const uint64_t kMaxSeeds = 16;
+
+const uint64_t kMaxPilots = 1 << 16;
+
+struct Layout {
+  explicit Layout(uint64_t entries) {
+    table = entries + entries / 64 + 1;
+    double log_entries = std::log(static_cast<double>(std::max<uint64_t>(entries, 2))) / std::log(2.0);
+    buckets = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(kBucketScale * static_cast<double>(entries) / log_entries)));
+    dense_buckets = buckets * 3 / 10;
+    pilots_size = ((buckets * sizeof(uint16_t) + 7) / 8) * 8;
+    remap_size = (((table - entries) * sizeof(uint32_t) + 7) / 8) * 8;
+  }
+
+  uint64_t table, buckets, dense_buckets, pilots_size, remap_size;
+};
+
+} // namespace
+
+uint64_t PerfectHash::Size(uint64_t entries) {
+  Layout layout(entries);
+  return sizeof(uint64_t) + layout.pilots_size + layout.remap_size;
+}
+
+PerfectHash::PerfectHash(void *start, uint64_t entries) : entries_(entries) {
+  UTIL_THROW_IF(entries >= (1ULL << 32), Exception, "A perfect hash of " << entries << " entries is too big for 32-bit indices");
+  Layout layout(entries);
+  table_ = layout.table;
+  buckets_ = layout.buckets;
+  dense_buckets_ = layout.dense_buckets;
+  uint8_t *base = static_cast<uint8_t*>(start);
+  seed_ = reinterpret_cast<uint64_t*>(base);
+  seed_mix_ = MurmurMix64(*seed_);
+  pilots_ = reinterpret_cast<uint16_t*>(base + sizeof(uint64_t));
+  remap_ = reinterpret_cast<uint32_t*>(base + sizeof(uint64_t) + layout.pilots_size);
+}
+
+void PerfectHash::SetSeed(uint64_t seed) {
+  *seed_ = seed;
+  seed_mix_ = MurmurMix64(seed);
+}
+
+void PerfectHash::Build(const uint64_t *keys, std::size_t count) {
+  UTIL_THROW_IF(count > entries_, Exception, "Asked to hash " << count << " keys into " << entries_ << " entries");
+  std::vector<uint64_t> sorted(keys, keys + count);
+  std::sort(sorted.begin(), sorted.end());
+  UTIL_THROW_IF(std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end(), Exception, "Duplicate key " << *std::adjacent_find(sorted.begin(), sorted.end()) << " in perfect hash");
+  for (uint64_t seed = 0; seed < kMaxSeeds; ++seed) {
+    SetSeed(seed);
+    if (TryBuild(keys, count)) return;
+  }
+  UTIL_THROW(Exception, "No pilots found for a perfect hash of " << count << " keys after " << kMaxSeeds << " seeds");
+}
+
+namespace {
+
+class BySizeDescending {
+  public:
+    explicit BySizeDescending(const std::vector<uint64_t> &starts) : starts_(starts) {}
+
+    bool operator()(uint64_t left, uint64_t right) const {
+      uint64_t left_size = starts_[left + 1] - starts_[left], right_size = starts_[right + 1] - starts_[right];
+      return left_size > right_size || (left_size == right_size && left < right);
+    }
+
+  private:
+    const std::vector<uint64_t> &starts_;
+};
+
+} // namespace
+
+bool PerfectHash::TryBuild(const uint64_t *keys, std::size_t count) {
+  // Group the hashes by bucket.
+  std::vector<uint64_t> mixed(count), starts(buckets_ + 1, 0);
+  for (std::size_t i = 0; i < count; ++i) {
+    mixed[i] = MurmurMix64(keys[i] + seed_mix_);
+    ++starts[Bucket(mixed[i]) + 1];
+  }
+  for (uint64_t b = 0; b < buckets_; ++b) starts[b + 1] += starts[b];
+  std::vector<uint64_t> hashes(count), fill(starts.begin(), starts.end() - 1);
+  for (std::size_t i = 0; i < count; ++i) {
+    hashes[fill[Bucket(mixed[i])]++] = mixed[i];
+  }
+
+  std::vector<uint64_t> order(buckets_);
+  for (uint64_t b = 0; b < buckets_; ++b) order[b] = b;
+  std::sort(order.begin(), order.end(), BySizeDescending(starts));
+
+  std::fill(pilots_, pilots_ + buckets_, 0);
+  std::vector<bool> taken(table_, false);
+  std::vector<uint64_t> positions;
+  for (std::vector<uint64_t>::const_iterator b = order.begin(); b != order.end() && starts[*b + 1] != starts[*b]; ++b) {
+    uint64_t pilot;
+    for (pilot = 0; pilot < kMaxPilots; ++pilot) {
+      positions.clear();
+      uint64_t k;
+      for (k = starts[*b]; k < starts[*b + 1]; ++k) {
+        uint64_t position = Position(hashes[k], static_cast<uint16_t>(pilot));
+        if (taken[position] || std::find(positions.begin(), positions.end(), position) != positions.end()) break;
+        positions.push_back(position);
+      }
+      if (k == starts[*b + 1]) break;
+    }
+    if (pilot == kMaxPilots) return false;
+    pilots_[*b] = static_cast<uint16_t>(pilot);
+    for (std::vector<uint64_t>::const_iterator p = positions.begin(); p != positions.end(); ++p) {
+      taken[*p] = true;
+    }
+  }
+
+  // Send taken positions past the end to the holes below it.  Untaken ones
+  // only matter for keys that were not built in, so any index will do.
+  uint64_t hole = 0;
+  for (uint64_t position = entries_; position < table_; ++position) {
+    if (taken[position]) {
+      while (taken[hole]) ++hole;
+      remap_[position - entries_] = static_cast<uint32_t>(hole++);
+    } else {
+      remap_[position - entries_] = 0;
+    }
+  }
+  return true;
+}
+
+void PerfectHash::CheckConsistency() const {
+  for (uint64_t i = 0; i < table_ - entries_; ++i) {
+    UTIL_THROW_IF(remap_[i] >= std::max<uint64_t>(entries_, 1), Exception, "Perfect hash remaps position " << (entries_ + i) << " to " << remap_[i] << " past the end " << entries_);
+  }
+}
+
+} // namespace util
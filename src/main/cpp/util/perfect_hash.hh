@@ -0,0 +1,85 @@
+#ifndef UTIL_PERFECT_HASH_H
+#define UTIL_PERFECT_HASH_H
+
+#include "util/exception.hh"
+#include "util/murmur_hash.hh"
+
+#include <cstddef>
+
+#include <stdint.h>
+
+namespace util {
+
+/* Minimal perfect hash of distinct 64-bit keys, in the style of PTHash.  Keys
+ * are split into buckets, skewed so that 60% of keys share 30% of the
+ * buckets.  Building picks a 16-bit pilot per bucket, largest bucket first,
+ * that sends every key of the bucket to a free position in a table 1/64
+ * larger than the key count.  Positions past the end are remapped onto the
+ * holes below it, so n keys get exactly the indices [0, n).  That costs about
+ * 4 bits per key and no keys are stored: a key that was not built in gets an
+ * arbitrary index, so callers must check what they find there.
+ *
+ * The size depends only on the number of entries.  Memory holds the seed,
+ * the pilots, then the remap.
+ */
+class PerfectHash {
+  public:
+    static uint64_t Size(uint64_t entries);
+
+    PerfectHash() : entries_(0) {}
+
+    // Use Size(entries) bytes at start, either built or zeroed for Build.
+    // entries must be below 2^32.
+    PerfectHash(void *start, uint64_t entries);
+
+    // In [0, entries) for any key.
+    uint64_t Index(uint64_t key) const {
+      uint64_t hash = MurmurMix64(key + seed_mix_);
+      uint64_t position = Position(hash, pilots_[Bucket(hash)]);
+      return position < entries_ ? position : remap_[position - entries_];
+    }
+
+    /* Assign indices to count <= entries distinct keys.  With fewer keys than
+     * entries, some indices are unused.  Throws util::Exception for duplicate
+     * keys or if no seed works, which should not happen.
+     */
+    void Build(const uint64_t *keys, std::size_t count);
+
+    // Checks that every remapped index is in range.  Any seed and pilots are
+    // fine.  Throws util::Exception.
+    void CheckConsistency() const;
+
+  private:
+    // x * range / 2^32 without division.
+    static uint64_t Range(uint32_t x, uint64_t range) {
+      return (static_cast<uint64_t>(x) * range) >> 32;
+    }
+
+    uint64_t Bucket(uint64_t hash) const {
+      return (static_cast<uint32_t>(hash) < kDenseThreshold)
+        ? Range(static_cast<uint32_t>(hash >> 32), dense_buckets_)
+        : dense_buckets_ + Range(static_cast<uint32_t>(hash >> 32), buckets_ - dense_buckets_);
+    }
+
+    uint64_t Position(uint64_t hash, uint16_t pilot) const {
+      return Range(static_cast<uint32_t>((MurmurMix64(hash) ^ ((pilot + 1ULL) * 0x9e3779b97f4a7c15ULL)) >> 32), table_);
+    }
+
+    bool TryBuild(const uint64_t *keys, std::size_t count);
+
+    void SetSeed(uint64_t seed);
+
+    // 60% of 2^32.
+    static const uint32_t kDenseThreshold = 2576980377U;
+
+    uint64_t entries_, table_, buckets_, dense_buckets_;
+
+    uint64_t *seed_;
+    uint64_t seed_mix_;
+    uint16_t *pilots_;
+    uint32_t *remap_;
+};
+
+} // namespace util
+
+#endif // UTIL_PERFECT_HASH_H
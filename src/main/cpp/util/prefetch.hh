@@ -0,0 +1,24 @@
+#ifndef UTIL_PREFETCH_H
+#define UTIL_PREFETCH_H
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <xmmintrin.h>
+#endif
+
+namespace util {
+
+// Start loading the cache line holding address, to be read soon.  Only a
+// hint: address need not be valid, and compilers without one do nothing.
+inline void Prefetch(const void *address) {
+#if defined(__GNUC__)
+  __builtin_prefetch(address, 0, 3);
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+  _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+  (void)address;
+#endif
+}
+
+} // namespace util
+
+#endif // UTIL_PREFETCH_H
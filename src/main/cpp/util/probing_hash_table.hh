@@ -2,12 +2,15 @@
 #define UTIL_PROBING_HASH_TABLE_H
 
 #include "util/exception.hh"
+#include "util/parallel.hh"
+#include "util/prefetch.hh"
 
 #include <algorithm>
 #include <cstddef>
 #include <functional>
 #include <vector>
 #include <memory>
+#include <numeric>
 
 #include <cassert>
 #include <stdint.h>
@@ -29,6 +32,57 @@ struct IdentityHash {
   template <class T> T operator()(T arg) const { return arg; }
 };
 
+/* Keys for tables that store only a fingerprint of each 64-bit hash: its top
+ * 8 * sizeof(Fingerprint) bits.  FingerprintHash gives DivMod the bits below,
+ * so the bucket and the fingerprint are independent.  Look up with the full
+ * hash; FingerprintEqual compares it with what is stored.  A fingerprint is
+ * never 0 (the empty bucket).
+ *
+ * A lookup compares the fingerprint with every entry from the ideal bucket to
+ * the next empty one.  With linear probing at load 1/m (m the probing
+ * multiplier), a missing key passes (1 + (m / (m - 1))^2) / 2 entries on
+ * average, so it is mistaken for a present one with probability about that
+ * times 2^-bits: 1e-9 for 32 bits and 8e-5 for 16 bits at m = 1.5.  A present
+ * key is shadowed the same way by an entry earlier in its run with the same
+ * fingerprint.
+ */
+template <class FingerprintT> struct FingerprintHash {
+  uint64_t operator()(uint64_t hash) const {
+    return hash & (~0ULL >> (8 * sizeof(FingerprintT)));
+  }
+};
+
+template <class FingerprintT> struct FingerprintEqual {
+  static FingerprintT Of(uint64_t hash) {
+    FingerprintT ret = static_cast<FingerprintT>(hash >> (64 - 8 * sizeof(FingerprintT)));
+    return ret ? ret : 1;
+  }
+
+  // Stored against stored, e.g. the empty fingerprint.
+  bool operator()(FingerprintT stored, FingerprintT other) const { return stored == other; }
+
+  // Stored against the full hash being looked up.
+  bool operator()(FingerprintT stored, uint64_t hash) const { return stored == Of(hash); }
+};
+
+// Whether the stored key is enough to compute an entry's ideal bucket.  It is
+// not for fingerprints, so CheckConsistency cannot check where their entries
+// sit, only that every lookup stops.
+template <class Equal> struct StoresWholeKey {
+  static const bool value = true;
+};
+
+template <class FingerprintT> struct StoresWholeKey<FingerprintEqual<FingerprintT> > {
+  static const bool value = false;
+};
+
+// What a table compared with equal stores for the lookup key key.
+inline uint64_t StoredKey(const std::equal_to<uint64_t> &, uint64_t key) { return key; }
+
+template <class FingerprintT> FingerprintT StoredKey(const FingerprintEqual<FingerprintT> &, uint64_t key) {
+  return FingerprintEqual<FingerprintT>::Of(key);
+}
+
 class DivMod {
   public:
     explicit DivMod(std::size_t buckets)
@@ -55,6 +109,9 @@ class DivMod {
     std::size_t buckets_;
 };
 
+// Buckets per work item when checking a table in parallel.
+const std::size_t kProbingCheckChunk = 1 << 16;
+
 /* Non-standard hash table
  * Buckets must be set at the beginning and must be greater than maximum number
  * of elements, else it throws ProbingSizeException.
@@ -85,7 +142,9 @@ template <class EntryT, class HashT, class EqualT = std::equal_to<typename Entry
     :
         buckets_(0),
         mod_(1),
-        entries_(0)
+        entries_(0),
+        probes_(0),
+        ordered_(false)
 #ifdef DEBUG
       , initialized_(false)
 #endif
@@ -102,26 +161,30 @@ template <class EntryT, class HashT, class EqualT = std::equal_to<typename Entry
         invalid_(invalid),
         hash_(hash_func),
         equal_(equal_func),
-        entries_(0)
+        entries_(0),
+        probes_(allocated / sizeof(Entry)),
+        ordered_(false)
 #ifdef DEBUG
         , initialized_(true)
 #endif
     {
     }
 
-    MutableIterator Ideal(const Key key) {
+    // The lookup key may differ from the stored Key, e.g. a full hash
+    // against fingerprints.
+    template <class LookupKey> MutableIterator Ideal(const LookupKey key) {
       return mod_.Ideal(begin_, hash_(key));
     }
-    ConstIterator Ideal(const Key key) const {
+    template <class LookupKey> ConstIterator Ideal(const LookupKey key) const {
       return mod_.Ideal(begin_, hash_(key));
     }
 
-    // Iterator is both input and output.
-    template <class Key> bool FindFromIdeal(const Key key, ConstIterator &i) const {
+    // Iterator is both input and output.  Reads at most MaxProbes() buckets.
+    template <class LookupKey> bool FindFromIdeal(const LookupKey key, ConstIterator &i) const {
 #ifdef DEBUG
       assert(initialized_);
 #endif
-      for (;; mod_.Next(begin_, end_, i)) {
+      for (std::size_t walked = 0; walked < probes_; ++walked, mod_.Next(begin_, end_, i)) {
         Key got(i->GetKey());
         //std::cout << "pht.FindFromIdeal got: " << std::hex << got << " begin: " << begin_ << " end: " << end_ << " i: " << i << std::endl;
         if (equal_(got, key)) {
@@ -132,10 +195,23 @@ template <class EntryT, class HashT, class EqualT = std::equal_to<typename Entry
             //std::cout << "not found." << std::endl;
             return false;
         }
+        // got is closer to its ideal bucket than key would be, so in a run
+        // ordered by ideal bucket key would have come before it.  Most walks
+        // end within two buckets anyway, cheaper than the division to tell.
+        if (ordered_ && walked >= 2 && Displacement(i - begin_, got) < walked) return false;
       }
+      return false;
     }
 
-    template <class Key> bool Find(const Key key, ConstIterator &out) const {
+    // The most buckets a lookup reads.
+    std::size_t MaxProbes() const { return probes_; }
+
+    // Start loading the bucket a Find for key begins at.
+    template <class LookupKey> void Prefetch(const LookupKey key) const {
+      util::Prefetch(Ideal(key));
+    }
+
+    template <class LookupKey> bool Find(const LookupKey key, ConstIterator &out) const {
       out = Ideal(key);
       //std::cout << "pht.Find key: " << std::hex << key << " begin: " << begin_ << " end: " << end_ << " out: " << out
       //    << " out.key: " << out->key << " begin_.key: " << begin_->key << std::endl;
@@ -145,6 +221,13 @@ template <class EntryT, class HashT, class EqualT = std::equal_to<typename Entry
       return result;
     }
 
+    // Call fn with the stored key of every entry, in bucket order.
+    template <class Fn> void ForEachKey(Fn &fn) const {
+      for (ConstIterator i = begin_; i != end_; ++i) {
+        if (!equal_(i->GetKey(), invalid_)) fn(i->GetKey());
+      }
+    }
+
     // Mostly for tests, check consistency of every entry.
     void CheckConsistency() {
       MutableIterator last;
@@ -167,7 +250,334 @@ template <class EntryT, class HashT, class EqualT = std::equal_to<typename Entry
       }
     }
 
+    /* Parallel, read-only check for tables loaded from files we do not trust.
+     * Every entry must be reachable from its ideal bucket without crossing an
+     * empty bucket, and some bucket must be empty or looking up a missing key
+     * never terminates.  check(entry) is called on every entry to validate
+     * the value.  Returns the number of entries.
+     */
+    template <class Check> std::size_t CheckConsistency(unsigned int threads, const Check &check) const {
+      std::size_t chunks = (buckets_ + kProbingCheckChunk - 1) / kProbingCheckChunk;
+      std::vector<std::size_t> empty(chunks);
+      UTIL_THROW_IF(!EmptyBefore(threads, empty), ProbingSizeException, "Completely full");
+      std::vector<std::size_t> entries(chunks);
+      ParallelFor(chunks, threads, CheckChunk<Check>(*this, empty, check, entries));
+      return std::accumulate(entries.begin(), entries.end(), static_cast<std::size_t>(0));
+    }
+
+    /* Bound lookups by what the table holds, reading it on threads threads.
+     * A lookup then reads at most one bucket more than the farthest any entry
+     * sits from its ideal bucket or, for fingerprints, the longest run of full
+     * buckets.  If every run is in order of ideal bucket, as InsertAll leaves
+     * it, a lookup of a missing whole key also stops at the first entry that
+     * sits closer to its own ideal bucket than the key would.  Until then a
+     * lookup reads at most the whole table, so even one with no empty bucket
+     * ends.
+     */
+    void LimitProbes(unsigned int threads) {
+      std::size_t chunks = (buckets_ + kProbingCheckChunk - 1) / kProbingCheckChunk;
+      std::vector<std::size_t> empty(chunks);
+      probes_ = buckets_;
+      ordered_ = false;
+      if (!EmptyBefore(threads, empty)) return;
+      std::vector<std::size_t> probes(chunks);
+      std::vector<unsigned char> ordered(chunks);
+      ParallelFor(chunks, threads, MeasureChunk(*this, empty, probes, ordered));
+      probes_ = *std::max_element(probes.begin(), probes.end());
+      ordered_ = std::find(ordered.begin(), ordered.end(), 0) == ordered.end();
+    }
+
+    /* Fill the empty (zeroed) table with count entries at once on threads
+     * threads.  keys[i] is what entries[i] will be looked up by: the stored
+     * key, or for fingerprints the full hash.  Entries are split by ranges of
+     * ideal bucket and each range is sorted and placed on its own thread.
+     * The table comes out as if the entries were inserted one at a time in
+     * order of ideal bucket, ties broken by key, so the bytes do not depend on
+     * the number of threads.  Throws ProbingSizeException if no bucket would
+     * be left empty and Exception for duplicate keys.
+     */
+    template <class LookupKey> void InsertAll(const LookupKey *keys, const Entry *entries, std::size_t count, unsigned int threads) {
+      UTIL_THROW_IF(count >= buckets_, ProbingSizeException, "Inserting " << count << " entries into " << buckets_ << " buckets would leave none empty");
+      const std::size_t parts = std::min<std::size_t>(buckets_, std::max(1U, threads) * kProbingInsertPartsPerThread);
+      const std::size_t chunks = (count + kProbingCheckChunk - 1) / kProbingCheckChunk;
+      std::vector<Placement<LookupKey> > unsorted(count), sorted(count);
+      // counts[chunk * parts + part] entries of each chunk go to each part.
+      std::vector<std::size_t> counts(chunks * parts, 0);
+      ParallelFor(chunks, threads, IdealChunk<LookupKey>(*this, keys, count, parts, unsorted, counts));
+      // Turn counts into where each chunk starts writing each part.
+      std::vector<std::size_t> part_begin(parts + 1);
+      std::size_t offset = 0;
+      for (std::size_t p = 0; p < parts; ++p) {
+        part_begin[p] = offset;
+        for (std::size_t c = 0; c < chunks; ++c) {
+          std::size_t here = counts[c * parts + p];
+          counts[c * parts + p] = offset;
+          offset += here;
+        }
+      }
+      part_begin[parts] = offset;
+      ParallelFor(chunks, threads, ScatterChunk<LookupKey>(*this, count, parts, unsorted, counts, sorted));
+      std::vector<Placement<LookupKey> >().swap(unsorted);
+
+      // Where each part would end if it started before its first ideal.
+      std::vector<std::size_t> part_end(parts);
+      ParallelFor(parts, threads, SortPart<LookupKey>(part_begin, sorted, part_end));
+
+      /* Chain the parts: one starts where the one before ended, or later.
+       * Whatever runs past the last bucket wraps around to the first ones,
+       * pushing the start of part 0 along, which can push more past the end.
+       * That converges since the table has an empty bucket.
+       */
+      std::vector<std::size_t> part_start(parts);
+      std::size_t wrapped = 0;
+      while (true) {
+        std::size_t end = wrapped;
+        for (std::size_t p = 0; p < parts; ++p) {
+          part_start[p] = end;
+          end = std::max(end + (part_begin[p + 1] - part_begin[p]), part_end[p]);
+        }
+        std::size_t overflow = (end > buckets_) ? (end - buckets_) : 0;
+        if (overflow <= wrapped) break;
+        wrapped = overflow;
+      }
+      std::vector<std::size_t> probes(parts);
+      ParallelFor(parts, threads, PlacePart<LookupKey>(*this, entries, part_begin, part_start, sorted, probes));
+      entries_ = count;
+      probes_ = *std::max_element(probes.begin(), probes.end());
+      ordered_ = StoresWholeKey<Equal>::value;
+    }
+
   private:
+    // Parts per thread in InsertAll, so that uneven parts balance out.
+    static const std::size_t kProbingInsertPartsPerThread = 8;
+
+    template <class LookupKey> struct Placement {
+      std::size_t ideal;
+      LookupKey key;
+      std::size_t index;
+
+      bool operator<(const Placement &other) const {
+        return ideal < other.ideal || (ideal == other.ideal && key < other.key);
+      }
+    };
+
+    template <class LookupKey> class IdealChunk {
+      public:
+        IdealChunk(const ProbingHashTable &table, const LookupKey *keys, std::size_t count, std::size_t parts, std::vector<Placement<LookupKey> > &out, std::vector<std::size_t> &counts)
+          : table_(table), keys_(keys), count_(count), parts_(parts), out_(out), counts_(counts) {}
+
+        void operator()(std::size_t chunk) const {
+          std::size_t end = std::min(count_, (chunk + 1) * kProbingCheckChunk);
+          std::size_t *counts = &counts_[chunk * parts_];
+          for (std::size_t i = chunk * kProbingCheckChunk; i < end; ++i) {
+            Placement<LookupKey> &place = out_[i];
+            place.ideal = table_.Ideal(keys_[i]) - table_.begin_;
+            place.key = keys_[i];
+            place.index = i;
+            ++counts[table_.Part(place.ideal, parts_)];
+          }
+        }
+
+      private:
+        const ProbingHashTable &table_;
+        const LookupKey *keys_;
+        std::size_t count_, parts_;
+        std::vector<Placement<LookupKey> > &out_;
+        std::vector<std::size_t> &counts_;
+    };
+
+    template <class LookupKey> class ScatterChunk {
+      public:
+        ScatterChunk(const ProbingHashTable &table, std::size_t count, std::size_t parts, const std::vector<Placement<LookupKey> > &from, std::vector<std::size_t> &offsets, std::vector<Placement<LookupKey> > &to)
+          : table_(table), count_(count), parts_(parts), from_(from), offsets_(offsets), to_(to) {}
+
+        void operator()(std::size_t chunk) const {
+          std::size_t end = std::min(count_, (chunk + 1) * kProbingCheckChunk);
+          std::size_t *offsets = &offsets_[chunk * parts_];
+          for (std::size_t i = chunk * kProbingCheckChunk; i < end; ++i) {
+            to_[offsets[table_.Part(from_[i].ideal, parts_)]++] = from_[i];
+          }
+        }
+
+      private:
+        const ProbingHashTable &table_;
+        std::size_t count_, parts_;
+        const std::vector<Placement<LookupKey> > &from_;
+        std::vector<std::size_t> &offsets_;
+        std::vector<Placement<LookupKey> > &to_;
+    };
+
+    template <class LookupKey> class SortPart {
+      public:
+        SortPart(const std::vector<std::size_t> &begin, std::vector<Placement<LookupKey> > &sorted, std::vector<std::size_t> &end)
+          : begin_(begin), sorted_(sorted), end_(end) {}
+
+        // Inserted in order, entry i of n ends up no earlier than ideal, and
+        // the part ends no earlier than ideal + n - i.
+        void operator()(std::size_t part) const {
+          typename std::vector<Placement<LookupKey> >::iterator first = sorted_.begin() + begin_[part], last = sorted_.begin() + begin_[part + 1];
+          std::sort(first, last);
+          std::size_t n = last - first, end = 0;
+          for (std::size_t i = 0; i < n; ++i) {
+            UTIL_THROW_IF(i && first[i].key == first[i - 1].key, Exception, "Duplicate key " << first[i].key << " in probing hash table");
+            end = std::max(end, first[i].ideal + n - i);
+          }
+          end_[part] = end;
+        }
+
+      private:
+        const std::vector<std::size_t> &begin_;
+        std::vector<Placement<LookupKey> > &sorted_;
+        std::vector<std::size_t> &end_;
+    };
+
+    template <class LookupKey> class PlacePart {
+      public:
+        PlacePart(ProbingHashTable &table, const Entry *entries, const std::vector<std::size_t> &begin, const std::vector<std::size_t> &start, const std::vector<Placement<LookupKey> > &sorted, std::vector<std::size_t> &probes)
+          : table_(table), entries_(entries), begin_(begin), start_(start), sorted_(sorted), probes_(probes) {}
+
+        // Also records the most buckets a lookup of the part's entries reads.
+        void operator()(std::size_t part) const {
+          std::size_t at = start_[part];
+          std::size_t probes = 0;
+          for (std::size_t i = begin_[part]; i < begin_[part + 1]; ++i, ++at) {
+            at = std::max(at, sorted_[i].ideal);
+            table_.begin_[(at >= table_.buckets_) ? (at - table_.buckets_) : at] = entries_[sorted_[i].index];
+            probes = std::max(probes, at - sorted_[i].ideal + 1);
+          }
+          probes_[part] = probes;
+        }
+
+      private:
+        ProbingHashTable &table_;
+        const Entry *entries_;
+        const std::vector<std::size_t> &begin_, &start_;
+        const std::vector<Placement<LookupKey> > &sorted_;
+        std::vector<std::size_t> &probes_;
+    };
+
+    // Which of parts equal ranges of buckets bucket is in.
+    std::size_t Part(std::size_t bucket, std::size_t parts) const {
+      return static_cast<std::size_t>((static_cast<uint64_t>(bucket) * parts) / buckets_);
+    }
+
+    // How many buckets past its ideal one the entry with key in bucket is.
+    std::size_t Displacement(std::size_t bucket, const Key &key) const {
+      std::size_t ideal = Ideal(key) - begin_;
+      return (bucket >= ideal) ? (bucket - ideal) : (bucket + buckets_ - ideal);
+    }
+
+    // Fills empty with the last empty bucket before each chunk, wrapping
+    // around.  Returns false if there is none.
+    bool EmptyBefore(unsigned int threads, std::vector<std::size_t> &empty) const {
+      // Last empty bucket in each chunk, or buckets_ if there is none.
+      ParallelFor(empty.size(), threads, FindLastEmpty(*this, empty));
+      std::size_t before = buckets_;
+      for (std::size_t c = empty.size(); c && before == buckets_; --c) before = empty[c - 1];
+      if (before == buckets_) return false;
+      for (std::size_t c = 0; c < empty.size(); ++c) {
+        std::size_t here = empty[c];
+        empty[c] = before;
+        if (here != buckets_) before = here;
+      }
+      return true;
+    }
+
+    class FindLastEmpty {
+      public:
+        FindLastEmpty(const ProbingHashTable &table, std::vector<std::size_t> &out) : table_(table), out_(out) {}
+
+        void operator()(std::size_t chunk) const {
+          std::size_t begin = chunk * kProbingCheckChunk;
+          std::size_t i = std::min(table_.buckets_, begin + kProbingCheckChunk);
+          while (i > begin && !table_.equal_(table_.begin_[i - 1].GetKey(), table_.invalid_)) --i;
+          out_[chunk] = (i > begin) ? i - 1 : table_.buckets_;
+        }
+
+      private:
+        const ProbingHashTable &table_;
+        std::vector<std::size_t> &out_;
+    };
+
+    template <class Check> class CheckChunk {
+      public:
+        CheckChunk(const ProbingHashTable &table, const std::vector<std::size_t> &empty_before, const Check &check, std::vector<std::size_t> &entries)
+          : table_(table), empty_before_(empty_before), check_(check), entries_(entries) {}
+
+        void operator()(std::size_t chunk) const {
+          const std::size_t buckets = table_.buckets_;
+          std::size_t empty = empty_before_[chunk];
+          std::size_t end = std::min(buckets, (chunk + 1) * kProbingCheckChunk);
+          std::size_t count = 0;
+          for (std::size_t i = chunk * kProbingCheckChunk; i < end; ++i) {
+            const Entry &entry = table_.begin_[i];
+            if (table_.equal_(entry.GetKey(), table_.invalid_)) {
+              empty = i;
+              continue;
+            }
+            if (StoresWholeKey<Equal>::value) {
+              std::size_t ideal = table_.Ideal(entry.GetKey()) - table_.begin_;
+              // Compare how far back the ideal bucket and the last gap are.
+              UTIL_THROW_IF((i + buckets - ideal) % buckets >= (i + buckets - empty) % buckets, Exception, "Inconsistency at position " << i << " with ideal " << ideal);
+            }
+            check_(entry);
+            ++count;
+          }
+          entries_[chunk] = count;
+        }
+
+      private:
+        const ProbingHashTable &table_;
+        const std::vector<std::size_t> &empty_before_;
+        const Check &check_;
+        std::vector<std::size_t> &entries_;
+    };
+
+    class MeasureChunk {
+      public:
+        MeasureChunk(const ProbingHashTable &table, const std::vector<std::size_t> &empty_before, std::vector<std::size_t> &probes, std::vector<unsigned char> &ordered)
+          : table_(table), empty_before_(empty_before), probes_(probes), ordered_(ordered) {}
+
+        void operator()(std::size_t chunk) const {
+          const std::size_t buckets = table_.buckets_;
+          const std::size_t begin = chunk * kProbingCheckChunk;
+          const std::size_t end = std::min(buckets, begin + kProbingCheckChunk);
+          std::size_t empty = empty_before_[chunk];
+          std::size_t probes = 0;
+          bool ordered = StoresWholeKey<Equal>::value;
+          // In order of ideal bucket, an entry is at most one bucket further
+          // from its ideal one than the entry before, and at its ideal one
+          // after an empty bucket.
+          std::size_t allowed = 0;
+          const std::size_t before = (begin ? begin : buckets) - 1;
+          if (ordered && empty != before) allowed = table_.Displacement(before, table_.begin_[before].GetKey()) + 1;
+          for (std::size_t i = begin; i < end; ++i) {
+            const Key key(table_.begin_[i].GetKey());
+            if (table_.equal_(key, table_.invalid_)) {
+              empty = i;
+              allowed = 0;
+              continue;
+            }
+            if (StoresWholeKey<Equal>::value) {
+              std::size_t displacement = table_.Displacement(i, key);
+              probes = std::max(probes, displacement + 1);
+              if (displacement > allowed) ordered = false;
+              allowed = displacement + 1;
+            } else {
+              probes = std::max(probes, (i + buckets - empty) % buckets);
+            }
+          }
+          probes_[chunk] = probes;
+          ordered_[chunk] = ordered;
+        }
+
+      private:
+        const ProbingHashTable &table_;
+        const std::vector<std::size_t> &empty_before_;
+        std::vector<std::size_t> &probes_;
+        std::vector<unsigned char> &ordered_;
+    };
+
     MutableIterator begin_;
     MutableIterator end_;
     std::size_t buckets_;
@@ -177,6 +587,10 @@ template <class EntryT, class HashT, class EqualT = std::equal_to<typename Entry
     Mod mod_;
 
     std::size_t entries_;
+    // Most buckets a lookup reads, and whether runs are in order of ideal
+    // bucket; see LimitProbes.
+    std::size_t probes_;
+    bool ordered_;
 #ifdef DEBUG
     bool initialized_;
 #endif
@@ -0,0 +1,74 @@
+#ifndef UTIL_RESULT_CACHE_H
+#define UTIL_RESULT_CACHE_H
+
+#include "util/clock_cache.hh"
+
+#include <algorithm>
+#include <cstddef>
+
+#include <stdint.h>
+
+namespace util {
+
+/* Bounded map from well mixed 64-bit keys, such as hashes of whole inputs,
+ * to the float computed for them, in a ClockCache.  A key is checked against
+ * a 32-bit check value, such as the input's length, too; two inputs that
+ * agree on both share an entry, so keys must come from a hash wide enough
+ * that this does not happen in practice.  Safe to share between threads.
+ */
+class ResultCache {
+  private:
+    struct Result {
+      uint32_t check;
+      float value;
+    };
+
+    typedef ClockCache<Result> Table;
+
+    class CheckIs {
+      public:
+        explicit CheckIs(uint32_t check) : check_(check) {}
+
+        bool operator()(const Result &result) const { return result.check == check_; }
+
+      private:
+        uint32_t check_;
+    };
+
+  public:
+    typedef Table::Stats Stats;
+
+    // Room for at least entries results, and at least one set per shard.
+    explicit ResultCache(std::size_t entries) : table_(std::max<std::size_t>(entries, 1)) {}
+
+    // A key stored with another check is a miss.
+    bool Find(uint64_t key, uint32_t check, float &value) const {
+      Result result;
+      if (!table_.Find(Stored(key), result, CheckIs(check))) return false;
+      value = result.value;
+      return true;
+    }
+
+    // Remember a result, evicting another from its set if need be.  This
+    // replaces one stored for key with another check.
+    void Insert(uint64_t key, uint32_t check, float value) {
+      Result result;
+      result.check = check;
+      result.value = value;
+      table_.Insert(Stored(key), result);
+    }
+
+    // Room for this many results.
+    std::size_t Capacity() const { return table_.Capacity(); }
+
+    Stats GetStats() const { return table_.GetStats(); }
+
+  private:
+    static uint64_t Stored(uint64_t key) { return key == Table::kEmptyKey ? key - 1 : key; }
+
+    Table table_;
+};
+
+} // namespace util
+
+#endif // UTIL_RESULT_CACHE_H
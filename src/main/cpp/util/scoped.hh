@@ -0,0 +1,23 @@
+#ifndef UTIL_SCOPED_H
+#define UTIL_SCOPED_H
+/* Other scoped objects in the style of scoped_ptr. */
+
+#include "util/exception.hh"
+
+#include <cstddef>
+
+namespace util {
+
+class MallocException : public Exception {
+  public:
+    explicit MallocException(std::size_t requested) throw();
+    ~MallocException() throw();
+};
+
+void *MallocOrThrow(std::size_t requested);
+// Zeroed.  Large requests get fresh pages, so untouched ones cost nothing.
+void *CallocOrThrow(std::size_t requested);
+
+} // namespace util
+
+#endif // UTIL_SCOPED_H
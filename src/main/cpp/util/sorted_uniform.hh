@@ -0,0 +1,52 @@
+#ifndef UTIL_SORTED_UNIFORM_H
+#define UTIL_SORTED_UNIFORM_H
+
+#include <cstddef>
+
+#include <stdint.h>
+
+namespace util {
+
+/* Interpolation search for key among positions (before_it, after_it) of a
+ * sorted sequence whose keys are spread roughly evenly between before_v and
+ * after_v.  accessor(i) returns the key at position i.  Requires before_v <=
+ * key < after_v; positions are unsigned, so before_it may be one before 0.
+ *
+ * Uniform keys take O(log log n) probes.  Skewed keys could take O(n), so
+ * every other probe bisects instead, which bounds the cost at twice that of
+ * binary search.
+ */
+template <class Accessor> bool BoundedSortedUniformFind(
+    const Accessor &accessor,
+    uint64_t before_it, uint64_t before_v,
+    uint64_t after_it, uint64_t after_v,
+    const uint64_t key, uint64_t &out) {
+  for (bool bisect = false; after_it - before_it > 1; bisect = !bisect) {
+    uint64_t width = after_it - before_it - 1;
+    uint64_t offset;
+    if (bisect) {
+      offset = (width - 1) / 2;
+    } else {
+      offset = static_cast<uint64_t>(static_cast<double>(key - before_v) / static_cast<double>(after_v - before_v) * static_cast<double>(width));
+      // Cap for floating point rounding.
+      if (offset >= width) offset = width - 1;
+    }
+    uint64_t pivot = before_it + 1 + offset;
+    uint64_t mid = accessor(pivot);
+    if (mid < key) {
+      before_it = pivot;
+      before_v = mid;
+    } else if (mid > key) {
+      after_it = pivot;
+      after_v = mid;
+    } else {
+      out = pivot;
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace util
+
+#endif // UTIL_SORTED_UNIFORM_H
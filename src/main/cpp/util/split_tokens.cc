@@ -0,0 +1,34 @@
+#include "util/split_tokens.hh"
+
+#include "util/exception.hh"
+
+#include <algorithm>
+
+namespace util {
+
+const std::size_t Delimiters::kMaxBytes;
+const std::size_t Delimiters::kBlock;
+
+Delimiters::Delimiters() : count_(1), skip_empty_(false) {
+  std::fill(bytes_, bytes_ + kMaxBytes, ' ');
+  std::fill(is_, is_ + 256, false);
+  is_[static_cast<unsigned char>(' ')] = true;
+}
+
+Delimiters::Delimiters(StringPiece bytes, bool skip_empty) : count_(0), skip_empty_(skip_empty) {
+  UTIL_THROW_IF(bytes.empty() || bytes.size() > kMaxBytes, Exception, "Between 1 and " << kMaxBytes << " delimiter bytes, not " << bytes.size());
+  std::fill(is_, is_ + 256, false);
+  for (StringPiece::const_iterator i = bytes.begin(); i != bytes.end(); ++i) {
+    if (is_[static_cast<unsigned char>(*i)]) continue;
+    is_[static_cast<unsigned char>(*i)] = true;
+    bytes_[count_++] = *i;
+  }
+  // Unused bytes repeat the first, in case Mask compares them.
+  std::fill(bytes_ + count_, bytes_ + kMaxBytes, bytes_[0]);
+}
+
+Delimiters Delimiters::Whitespace(bool skip_empty) {
+  return Delimiters(" \t\n\v\f\r", skip_empty);
+}
+
+} // namespace util
@@ -0,0 +1,114 @@
+#ifndef UTIL_SPLIT_TOKENS_H
+#define UTIL_SPLIT_TOKENS_H
+
+#include "util/bit_scan.hh"
+#include "util/string_piece.hh"
+
+#include <cstddef>
+
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define UTIL_SPLIT_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UTIL_SPLIT_SSE2
+#endif
+
+namespace util {
+
+/* The bytes that separate tokens, up to kMaxBytes of them, and what a run
+ * of them means.  By default each one ends a token, so two in a row or one
+ * at either end make an empty token, as splitting with find_first_of does;
+ * with skip_empty a run separates once and leading and trailing ones
+ * separate nothing.
+ */
+class Delimiters {
+  public:
+    static const std::size_t kMaxBytes = 8;
+
+    // Split at every space, keeping empty tokens.
+    Delimiters();
+
+    // Throws if bytes is empty or longer than kMaxBytes.
+    Delimiters(StringPiece bytes, bool skip_empty);
+
+    // Space, tab, newline, vertical tab, form feed and carriage return.
+    static Delimiters Whitespace(bool skip_empty);
+
+    bool SkipEmpty() const { return skip_empty_; }
+
+    bool Is(char c) const { return is_[static_cast<unsigned char>(c)]; }
+
+#if defined(UTIL_SPLIT_AVX2)
+    static const std::size_t kBlock = 32;
+
+    // Bit i is set if text[i] is a delimiter, for i < kBlock.
+    uint32_t Mask(const char *text) const {
+      const __m256i got = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text));
+      __m256i hit = _mm256_cmpeq_epi8(got, _mm256_set1_epi8(bytes_[0]));
+      for (std::size_t i = 1; i < count_; ++i) {
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(got, _mm256_set1_epi8(bytes_[i])));
+      }
+      return static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+    }
+#elif defined(UTIL_SPLIT_SSE2)
+    static const std::size_t kBlock = 16;
+
+    uint32_t Mask(const char *text) const {
+      const __m128i got = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text));
+      __m128i hit = _mm_cmpeq_epi8(got, _mm_set1_epi8(bytes_[0]));
+      for (std::size_t i = 1; i < count_; ++i) {
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(got, _mm_set1_epi8(bytes_[i])));
+      }
+      return static_cast<uint32_t>(_mm_movemask_epi8(hit));
+    }
+#else
+    static const std::size_t kBlock = 8;
+
+    uint32_t Mask(const char *text) const {
+      uint32_t ret = 0;
+      for (std::size_t i = 0; i < kBlock; ++i) {
+        ret |= static_cast<uint32_t>(Is(text[i])) << i;
+      }
+      return ret;
+    }
+#endif
+
+  private:
+    char bytes_[kMaxBytes];
+    std::size_t count_;
+    bool skip_empty_;
+    bool is_[256];
+};
+
+/* Call out(token) with each token of text in order, as a StringPiece into
+ * text.  Finds the delimiters kBlock bytes at a time, so a token costs one
+ * iteration however long it is.
+ */
+template <class Out> void SplitTokens(StringPiece text, const Delimiters &delimiters, Out &out) {
+  const char *const begin = text.data();
+  const std::size_t length = text.size();
+  const bool skip_empty = delimiters.SkipEmpty();
+  // Where the token being read started.
+  std::size_t start = 0;
+  std::size_t block = 0;
+  for (; block + Delimiters::kBlock <= length; block += Delimiters::kBlock) {
+    for (uint32_t mask = delimiters.Mask(begin + block); mask; mask &= mask - 1) {
+      const std::size_t at = block + LowestBit(mask);
+      if (!skip_empty || at != start) out(StringPiece(begin + start, at - start));
+      start = at + 1;
+    }
+  }
+  for (std::size_t at = block; at < length; ++at) {
+    if (!delimiters.Is(begin[at])) continue;
+    if (!skip_empty || at != start) out(StringPiece(begin + start, at - start));
+    start = at + 1;
+  }
+  if (!skip_empty || length != start) out(StringPiece(begin + start, length - start));
+}
+
+} // namespace util
+
+#endif // UTIL_SPLIT_TOKENS_H
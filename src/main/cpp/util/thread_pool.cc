@@ -0,0 +1,139 @@
+#include "util/thread_pool.hh"
+
+#include <algorithm>
+#include <system_error>
+
+namespace util {
+
+namespace {
+
+uint64_t Pack(uint32_t begin, uint32_t end) {
+  return static_cast<uint64_t>(begin) | (static_cast<uint64_t>(end) << 32);
+}
+
+uint32_t Begin(uint64_t range) { return static_cast<uint32_t>(range); }
+uint32_t End(uint64_t range) { return static_cast<uint32_t>(range >> 32); }
+
+} // namespace
+
+ThreadPool::Job::Job(std::size_t offset_in, std::size_t count, unsigned int participants, void (*call_in)(const void *, std::size_t), const void *fn_in)
+  : offset(offset_in), call(call_in), fn(fn_in), ranges(participants), next_slot(1), active(0), failed(false) {
+  for (unsigned int p = 0; p < participants; ++p) {
+    ranges[p] = Pack(static_cast<uint32_t>(count * p / participants), static_cast<uint32_t>(count * (p + 1) / participants));
+  }
+}
+
+ThreadPool::ThreadPool(unsigned int workers) : stop_(false) {
+  threads_.reserve(workers);
+  try {
+    for (unsigned int i = 0; i < workers; ++i) {
+      threads_.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+    }
+  } catch (const std::system_error &) {
+    // Out of threads: make do with the ones we have.
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_.notify_all();
+  for (std::vector<std::thread>::iterator i = threads_.begin(); i != threads_.end(); ++i) {
+    i->join();
+  }
+}
+
+unsigned int ThreadPool::Participants(std::size_t count, unsigned int threads) const {
+  std::size_t ret = std::min<std::size_t>(std::max(threads, 1u), Workers() + 1);
+  return static_cast<unsigned int>(std::max<std::size_t>(1, std::min(ret, count)));
+}
+
+void ThreadPool::Run(Job &job) {
+  if (job.ranges.size() > 1) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(&job);
+    }
+    for (std::size_t i = 1; i < job.ranges.size(); ++i) work_.notify_one();
+  }
+  Participate(job, 0);
+  if (job.ranges.size() > 1) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Workers that have not joined yet are no longer needed.
+    std::deque<Job*>::iterator queued = std::find(jobs_.begin(), jobs_.end(), &job);
+    if (queued != jobs_.end()) jobs_.erase(queued);
+    while (job.active) done_.wait(lock);
+  }
+  if (job.error) std::rethrow_exception(job.error);
+}
+
+bool ThreadPool::Take(std::atomic<uint64_t> &range, uint32_t &item) {
+  uint64_t current = range.load();
+  while (Begin(current) < End(current)) {
+    if (range.compare_exchange_weak(current, Pack(Begin(current) + 1, End(current)))) {
+      item = Begin(current);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ThreadPool::Steal(Job &job, unsigned int thief) {
+  while (true) {
+    // The range that looks fullest.
+    unsigned int victim = thief;
+    uint64_t victim_range = 0;
+    uint32_t most = 0;
+    for (unsigned int p = 0; p < job.ranges.size(); ++p) {
+      if (p == thief) continue;
+      uint64_t range = job.ranges[p].load();
+      if (End(range) > Begin(range) && End(range) - Begin(range) > most) {
+        victim = p;
+        victim_range = range;
+        most = End(range) - Begin(range);
+      }
+    }
+    if (victim == thief) return false;
+    uint32_t middle = Begin(victim_range) + most / 2;
+    if (job.ranges[victim].compare_exchange_strong(victim_range, Pack(Begin(victim_range), middle))) {
+      // The thief's range is empty, and only its owner makes ranges bigger.
+      job.ranges[thief] = Pack(middle, End(victim_range));
+      return true;
+    }
+  }
+}
+
+void ThreadPool::Participate(Job &job, unsigned int slot) {
+  try {
+    do {
+      uint32_t item;
+      while (!job.failed.load(std::memory_order_relaxed) && Take(job.ranges[slot], item)) {
+        job.call(job.fn, job.offset + item);
+      }
+    } while (!job.failed.load(std::memory_order_relaxed) && Steal(job, slot));
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(job.error_mutex);
+    if (!job.error) job.error = std::current_exception();
+    job.failed = true;
+  }
+}
+
+void ThreadPool::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    while (!stop_ && jobs_.empty()) work_.wait(lock);
+    if (jobs_.empty()) return;
+    Job &job = *jobs_.front();
+    unsigned int slot = job.next_slot++;
+    if (job.next_slot == job.ranges.size()) jobs_.pop_front();
+    ++job.active;
+    lock.unlock();
+    Participate(job, slot);
+    lock.lock();
+    if (!--job.active) done_.notify_all();
+  }
+}
+
+} // namespace util
@@ -0,0 +1,102 @@
+#ifndef UTIL_THREAD_POOL_H
+#define UTIL_THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+namespace util {
+
+/* Threads that stay up between calls, for work too short to pay for starting
+ * threads as ParallelFor does.  Any number of callers may use one pool at
+ * once; each call gets the workers that are free.
+ *
+ * Each call splits its items into one contiguous range per participating
+ * thread.  A thread takes items from the front of its own range and, once
+ * that is empty, steals the back half of the fullest looking range of
+ * another thread, so uneven items balance out without a shared counter.
+ */
+class ThreadPool {
+  public:
+    // Start workers threads.  0 is allowed: calls then run on the caller.
+    explicit ThreadPool(unsigned int workers);
+
+    // Waits for running calls, then stops the workers.
+    ~ThreadPool();
+
+    unsigned int Workers() const { return static_cast<unsigned int>(threads_.size()); }
+
+    /* Call fn(i) for every i in [0, count) on the calling thread and up to
+     * threads - 1 workers.  If fn throws, remaining items are skipped and the
+     * first exception is rethrown here once every thread has stopped.
+     */
+    template <class Fn> void ParallelFor(std::size_t count, unsigned int threads, const Fn &fn) {
+      // Ranges pack begin and end into 32 bits each.
+      const std::size_t kMaxJob = 0xffffffffULL;
+      for (std::size_t begin = 0; begin < count; ) {
+        std::size_t size = std::min(count - begin, kMaxJob);
+        Job job(begin, size, Participants(size, threads), &CallFn<Fn>, &fn);
+        Run(job);
+        begin += size;
+      }
+    }
+
+  private:
+    struct Job {
+      Job(std::size_t offset, std::size_t count, unsigned int participants, void (*call)(const void *, std::size_t), const void *fn);
+
+      std::size_t offset;
+      void (*call)(const void *fn, std::size_t i);
+      const void *fn;
+
+      // One per participant: begin in the low 32 bits, end in the high.
+      std::vector<std::atomic<uint64_t> > ranges;
+
+      // Participant slots handed out so far and workers still running, both
+      // under the pool's mutex.
+      unsigned int next_slot;
+      unsigned int active;
+
+      std::atomic<bool> failed;
+      std::exception_ptr error;
+      std::mutex error_mutex;
+    };
+
+    template <class Fn> static void CallFn(const void *fn, std::size_t i) {
+      (*static_cast<const Fn*>(fn))(i);
+    }
+
+    unsigned int Participants(std::size_t count, unsigned int threads) const;
+
+    // Offer job to the workers, work on it, and wait for it to finish.
+    void Run(Job &job);
+
+    // Work on job as participant slot until nothing is left.
+    static void Participate(Job &job, unsigned int slot);
+
+    static bool Take(std::atomic<uint64_t> &range, uint32_t &item);
+
+    static bool Steal(Job &job, unsigned int thief);
+
+    void WorkerLoop();
+
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable work_, done_;
+    // Jobs with slots left for workers.
+    std::deque<Job*> jobs_;
+    bool stop_;
+};
+
+} // namespace util
+
+#endif // UTIL_THREAD_POOL_H
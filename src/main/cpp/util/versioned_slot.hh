@@ -0,0 +1,141 @@
+#ifndef UTIL_VERSIONED_SLOT_H
+#define UTIL_VERSIONED_SLOT_H
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+
+#include <stdint.h>
+
+namespace util {
+
+/* Holds the current version of a read-mostly object, e.g. a loaded model,
+ * and lets a writer replace it while readers keep going.
+ *
+ * Readers never lock: a Reader bumps a counter for the current epoch, reads
+ * the pointer and drops the counter when it goes out of scope.  Publish swaps
+ * the pointer, then waits out a grace period (two epoch flips, each waiting
+ * for the previous epoch's readers to leave) before deleting the old object,
+ * so in-flight readers finish on the version they started with.  Counters are
+ * striped across cache lines to keep readers on different cores apart.
+ *
+ * Writers are serialized and block for the grace period.  Readers must not
+ * publish.
+ */
+template <class T> class VersionedSlot {
+  private:
+    struct Record {
+      T *value;
+      uint64_t version;
+    };
+
+  public:
+    class Reader {
+      public:
+        explicit Reader(const VersionedSlot<T> &slot) {
+          unsigned int stripe = Stripe();
+          counter_ = &slot.stripes_[stripe].readers[slot.epoch_.load() & 1];
+          counter_->fetch_add(1);
+          record_ = slot.current_.load();
+        }
+
+        ~Reader() {
+          counter_->fetch_sub(1);
+        }
+
+        // NULL if nothing was published.
+        T *Get() const { return record_ ? record_->value : NULL; }
+
+        uint64_t Version() const { return record_ ? record_->version : 0; }
+
+      private:
+        std::atomic<uint64_t> *counter_;
+        const Record *record_;
+
+        Reader(const Reader &);
+        Reader &operator=(const Reader &);
+    };
+
+    VersionedSlot() : current_(NULL), epoch_(0), version_(0) {
+      for (unsigned int i = 0; i < kStripes; ++i) {
+        stripes_[i].readers[0].store(0);
+        stripes_[i].readers[1].store(0);
+      }
+    }
+
+    // No reader may be active.
+    ~VersionedSlot() {
+      Record *last = current_.load();
+      if (last) {
+        delete last->value;
+        delete last;
+      }
+    }
+
+    /* Make to (which may be NULL) the current object and take ownership of
+     * it.  Returns its version number, which starts at 1 and increases with
+     * every publish.  The previous object is deleted once no reader can be
+     * using it.
+     */
+    uint64_t Publish(T *to) {
+      std::lock_guard<std::mutex> lock(writer_);
+      Record *record = new Record;
+      record->value = to;
+      record->version = ++version_;
+      Record *old = current_.exchange(record);
+      WaitForReaders();
+      WaitForReaders();
+      if (old) {
+        delete old->value;
+        delete old;
+      }
+      return record->version;
+    }
+
+    uint64_t Version() const {
+      const Record *record = current_.load();
+      return record ? record->version : 0;
+    }
+
+  private:
+    static const unsigned int kStripes = 16;
+
+    static unsigned int Stripe() {
+      static std::atomic<unsigned int> next(0);
+      static thread_local unsigned int mine = next.fetch_add(1) % kStripes;
+      return mine;
+    }
+
+    // Flip the epoch and wait for everybody who entered under the old one.
+    void WaitForReaders() {
+      unsigned int old = epoch_.fetch_add(1) & 1;
+      for (unsigned int i = 0; i < kStripes; ++i) {
+        while (stripes_[i].readers[old].load()) {
+          std::this_thread::yield();
+        }
+      }
+    }
+
+    struct ReaderCounts {
+      std::atomic<uint64_t> readers[2];
+      char padding[64 - 2 * sizeof(std::atomic<uint64_t>)];
+    };
+
+    mutable ReaderCounts stripes_[kStripes];
+
+    std::atomic<Record*> current_;
+
+    std::atomic<unsigned int> epoch_;
+
+    // Only touched under writer_.
+    uint64_t version_;
+    std::mutex writer_;
+
+    VersionedSlot(const VersionedSlot &);
+    VersionedSlot &operator=(const VersionedSlot &);
+};
+
+} // namespace util
+
+#endif // UTIL_VERSIONED_SLOT_H